@@ -0,0 +1,155 @@
+// Copyright 2023 Evan Williams
+#ifndef ADDRESS_INTERNER_H
+#define ADDRESS_INTERNER_H
+
+/**
+ * An interning table for IP addresses (and subnet prefixes) keyed by
+ * their binary form rather than their text. Like KeyInterner, it hands
+ * out dense IDs from 0 for per-address state kept in plain vectors, but
+ * each slot holds the 128-bit address next to its ID, so a lookup is
+ * one probe into one array with no string hashing or comparison. That
+ * matters for per-IP tracking, where there are far more distinct keys
+ * than users and most lookups miss the cache.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+#include "IpPrefixSet.h"
+#include "KeyInterner.h"
+
+class AddressInterner {
+public:
+    /** The ID type handed out for addresses */
+    using Id = KeyInterner::Id;
+
+    /** An address as a 128-bit number (see IpPrefixSet) */
+    using Key = IpPrefixSet::Key;
+
+    /** Create an empty table */
+    AddressInterner() : slots(16) {}
+
+    /**
+     * Convert an address in text form to the key it is interned under.
+     * Text that is not a valid address (which a malformed log line can
+     * put in the IP field) is hashed into the IPv6 discard-only prefix
+     * 100::/64, which never appears as a login source.
+     *
+     * @param text The address, e.g., "10.1.2.3".
+     */
+    static Key toKey(std::string_view text) {
+        Key key;
+        int maxLen;
+        if (IpPrefixSet::parse(text, key, maxLen)) {
+            return key;
+        }
+        return Key(0x0100) << 112 | std::hash<std::string_view>()(text);
+    }
+
+    /**
+     * Check if a key is one that toKey made for text that is not an
+     * address.
+     */
+    static bool isTextKey(const Key key) {
+        return key >> 64 == Key(0x0100) << 48;
+    }
+
+    /**
+     * Return the ID of an address, adding it with the next ID if it is
+     * not yet in the table.
+     *
+     * @param key The address (see toKey).
+     */
+    Id intern(const Key key) {
+        const std::uint64_t hi = static_cast<std::uint64_t>(key >> 64),
+                            lo = static_cast<std::uint64_t>(key);
+        size_t i = slotOf(hi, lo);
+        for (; slots[i].id != KeyInterner::NotFound; i = (i + 1) & mask()) {
+            if (slots[i].lo == lo && slots[i].hi == hi) {
+                return slots[i].id;
+            }
+        }
+        const Id id = static_cast<Id>(count++);
+        slots[i] = {hi, lo, id};
+        // Keep the load factor at or below 1/2 so probe runs stay short
+        if (count * 2 > slots.size()) {
+            rehash();
+        }
+        return id;
+    }
+
+    /**
+     * Start loading the slot where an address would be found, so that a
+     * later intern of it does not wait on memory.
+     */
+    void prefetch(const Key key) const {
+        __builtin_prefetch(&slots[slotOf(static_cast<std::uint64_t>(
+            key >> 64), static_cast<std::uint64_t>(key))]);
+    }
+
+    /** Return the ID of an address in text form (see toKey) */
+    Id intern(std::string_view address) { return intern(toKey(address)); }
+
+    /** Obtain the number of distinct addresses in the table */
+    size_t size() const { return count; }
+
+    /**
+     * Write or restore the table with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the slots being restored are not
+     * a valid table.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        ar.value(count);
+        ar.array(slots);
+        bool valid = !slots.empty() && (slots.size() & mask()) == 0 &&
+                     count < slots.size();
+        for (size_t i = 0; valid && i < slots.size(); i++) {
+            valid = slots[i].id == KeyInterner::NotFound ||
+                    slots[i].id < count;
+        }
+        ar.check(valid, "address table");
+    }
+
+private:
+    /** An address (as two halves) and its ID, or NotFound if unused */
+    struct Slot {
+        std::uint64_t hi = 0, lo = 0;
+        Id id = KeyInterner::NotFound;
+    };
+
+    /** The mask applied to a hash to obtain a slot index */
+    size_t mask() const { return slots.size() - 1; }
+
+    /** Return the starting slot for an address */
+    size_t slotOf(const std::uint64_t hi, const std::uint64_t lo) const {
+        const std::uint64_t mix = hi * 0x9e3779b97f4a7c15ULL ^ lo;
+        return (mix * 0xff51afd7ed558ccdULL >> 32) & mask();
+    }
+
+    /** Double the number of slots and reinsert every address */
+    void rehash() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.id != KeyInterner::NotFound) {
+                size_t i = slotOf(slot.hi, slot.lo);
+                while (slots[i].id != KeyInterner::NotFound) {
+                    i = (i + 1) & mask();
+                }
+                slots[i] = slot;
+            }
+        }
+    }
+
+    /** The open-addressed table (a power of 2 in size) */
+    std::vector<Slot> slots;
+
+    /** The number of addresses in the table */
+    size_t count = 0;
+};
+
+#endif  // ADDRESS_INTERNER_H
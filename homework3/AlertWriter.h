@@ -0,0 +1,497 @@
+// Copyright 2023 Evan Williams
+#ifndef ALERT_WRITER_H
+#define ALERT_WRITER_H
+
+/**
+ * Buffered output of LoginSentry's detections. Alerts are formatted
+ * into one large buffer that is written out with a single write call
+ * once it reaches a size threshold, or once the oldest pending alert
+ * has waited for a time threshold, so alerts in quiet periods are not
+ * held back indefinitely.
+ *
+ * Alerts can be written as the original human-readable text, or in a
+ * machine-readable JSON Lines or TSV form with the rule, user, IP,
+ * and timestamp of each detection.
+ *
+ * Optionally, the IPs and users of the alerts are also counted as they
+ * pass through (see HeavyHitters.h), and the top ones are reported
+ * before the totals at the end of a run.
+ *
+ * Also optionally, full buffers are handed to a writer thread through
+ * an SPSC ring (see SpscRing.h) instead of being written inline, so a
+ * slow consumer of the output holds up detection only once that ring
+ * is full.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "HeavyHitters.h"
+#include "SpscRing.h"
+
+/** The kind of detection being reported */
+struct AlertKind {
+    /** The rule's name in the machine-readable formats */
+    const char* name;
+    /** The rule's description in the text format */
+    const char* description;
+};
+
+/** A login from a banned IP address or range */
+constexpr AlertKind BANNED_IP_ALERT = {"banned_ip", "banned IP"};
+
+/** Too many logins by one user in the frequency rule's window */
+constexpr AlertKind FREQUENCY_ALERT = {"frequency", "frequency"};
+
+/** The output formats for alerts */
+enum class AlertFormat { TEXT, JSON, TSV };
+
+class AlertWriter {
+public:
+    /**
+     * Create a writer.
+     *
+     * @param fd The file descriptor to write to (not closed).
+     *
+     * @param format The output format.
+     *
+     * @param flushBytes Pending output is written once it reaches this
+     * many bytes.
+     *
+     * @param flushInterval Pending output is written once it has waited
+     * this long. Zero disables the time threshold (and its thread).
+     */
+    explicit AlertWriter(const int fd = STDOUT_FILENO,
+        const AlertFormat format = AlertFormat::TEXT,
+        const size_t flushBytes = 1 << 16,
+        const std::chrono::milliseconds flushInterval =
+            std::chrono::milliseconds(100))
+        : fd(fd), format(format), flushBytes(flushBytes),
+          flushInterval(flushInterval) {
+        buffer.reserve(flushBytes + 4096);
+        if (flushInterval.count() > 0) {
+            timer = std::thread([this] { timerLoop(); });
+        }
+    }
+
+    /** Write out anything pending and stop the timer and writer threads */
+    ~AlertWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (timer.joinable()) {
+            timer.join();
+        }
+        stopBackground();
+    }
+
+    AlertWriter(const AlertWriter&) = delete;
+    AlertWriter& operator=(const AlertWriter&) = delete;
+
+    /**
+     * Report a possible hacking attempt.
+     *
+     * @param kind The rule that flagged the line.
+     *
+     * @param user The user ID from the line.
+     *
+     * @param ip The IP address from the line.
+     *
+     * @param seconds The time of the line in seconds since Epoch.
+     *
+     * @param line The full log line.
+     */
+    void alert(const AlertKind& kind, std::string_view user,
+               std::string_view ip, const long seconds,
+               std::string_view line) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const bool wasEmpty = buffer.empty();
+        if (top) {
+            top->record(user, ip);
+        }
+        switch (format) {
+        case AlertFormat::TEXT:
+            buffer.append("Hacking due to ").append(kind.description)
+                  .append(". Line: ").append(line) += '\n';
+            break;
+        case AlertFormat::JSON:
+            buffer.append("{\"rule\":\"").append(kind.name)
+                  .append("\",\"user\":\"");
+            appendJson(user);
+            buffer.append("\",\"ip\":\"");
+            appendJson(ip);
+            buffer.append("\",\"time\":");
+            appendNumber(seconds);
+            buffer.append("}\n");
+            break;
+        case AlertFormat::TSV:
+            buffer.append(kind.name) += '\t';
+            appendTsv(user);
+            buffer += '\t';
+            appendTsv(ip);
+            buffer += '\t';
+            appendNumber(seconds);
+            buffer += '\n';
+            break;
+        }
+        pendingAfterAppend(wasEmpty, lock);
+    }
+
+    /**
+     * Count the IPs and users of the alerts from now on, and report the
+     * top ones with the totals.
+     *
+     * @param k The number of IPs and users to report.
+     */
+    void trackTop(const size_t k) {
+        std::lock_guard<std::mutex> lock(mutex);
+        top = std::make_unique<TopAttackers>(k);
+    }
+
+    /**
+     * Report the number of logins that arrived too late to be put in
+     * order (see ReorderBuffer.h) with the totals.
+     *
+     * @param lateness The lateness bound of the run in seconds.
+     */
+    void trackLate(const long lateness) {
+        std::lock_guard<std::mutex> lock(mutex);
+        lateBound = lateness;
+    }
+
+    /**
+     * Report the totals at the end of a run, preceded by the top IPs
+     * and users if they are being tracked.
+     *
+     * @param lineCount The number of lines processed.
+     *
+     * @param hackCount The number of possible hacking attempts found.
+     *
+     * @param lateCount The number of logins that arrived too late to be
+     * put in order, reported if trackLate was called.
+     */
+    void summary(const size_t lineCount, const size_t hackCount,
+                 const size_t lateCount = 0) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const bool wasEmpty = buffer.empty();
+        if (top) {
+            appendTop();
+        }
+        const std::string lines = std::to_string(lineCount),
+                          hacks = std::to_string(hackCount),
+                          late = std::to_string(lateCount);
+        switch (format) {
+        case AlertFormat::TEXT:
+            if (lateBound > 0) {
+                buffer.append(late).append(" logins arrived more than ")
+                      .append(std::to_string(lateBound))
+                      .append(" seconds out of order.\n");
+            }
+            buffer.append("Processed ").append(lines).append(" lines. Found ")
+                  .append(hacks).append(" possible hacking attempts.\n");
+            break;
+        case AlertFormat::JSON:
+            buffer.append("{\"summary\":{\"lines\":").append(lines)
+                  .append(",\"hacks\":").append(hacks);
+            if (lateBound > 0) {
+                buffer.append(",\"late\":").append(late);
+            }
+            buffer.append("}}\n");
+            break;
+        case AlertFormat::TSV:
+            if (lateBound > 0) {
+                buffer.append("late\t").append(late) += '\n';
+            }
+            buffer.append("summary\t").append(lines).append("\t")
+                  .append(hacks) += '\n';
+            break;
+        }
+        pendingAfterAppend(wasEmpty, lock);
+    }
+
+    /**
+     * Write out all pending output now, or hand it to the writer thread
+     * if there is one.
+     */
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        writeBuffer();
+    }
+
+    /**
+     * Write the output on a writer thread from now on. Full buffers are
+     * queued for it in a ring, and the output waits only if the ring is
+     * full (backpressure). An idle writer thread polls the ring, so this
+     * is meant for runs over a whole log rather than for follow mode.
+     *
+     * @param buffers The most buffers queued for the writer.
+     */
+    void writeInBackground(const size_t buffers = 4) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!background) {
+            background = std::make_unique<Background>(buffers);
+            background->thread = std::thread(writerLoop, fd,
+                                             std::ref(*background));
+        }
+    }
+
+    /**
+     * Write out all pending output and stop the writer thread (if any),
+     * so later output is written inline again.
+     */
+    void stopBackground() {
+        std::unique_ptr<Background> stopped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writeBuffer();
+            stopped = std::move(background);
+        }
+        if (stopped) {
+            stopped->full.close();
+            stopped->thread.join();
+            backgroundStats = stopped->full.stats();
+        }
+    }
+
+    /**
+     * Obtain the counters of the ring to the writer thread, once it was
+     * stopped, e.g., to see whether the output held up detection.
+     */
+    RingStats outputStats() const { return backgroundStats; }
+
+    /** Parse the name of an output format ("text", "json", or "tsv") */
+    static AlertFormat parseFormat(const std::string& name) {
+        return name == "json" ? AlertFormat::JSON :
+               name == "tsv"  ? AlertFormat::TSV : AlertFormat::TEXT;
+    }
+
+private:
+    /** Flush or arm the timer after output was added to the buffer */
+    void pendingAfterAppend(const bool wasEmpty,
+                            std::unique_lock<std::mutex>& lock) {
+        if (buffer.size() >= flushBytes) {
+            writeBuffer();
+        } else if (wasEmpty) {
+            oldest = std::chrono::steady_clock::now();
+            lock.unlock();
+            wakeup.notify_one();
+        }
+    }
+
+    /**
+     * Write the whole buffer, or queue it for the writer thread and
+     * continue in a buffer the writer is done with.
+     */
+    void writeBuffer() {
+        if (!background) {
+            writeAll(fd, buffer);
+            buffer.clear();
+        } else if (!buffer.empty()) {
+            std::string next;
+            if (!background->spare.tryPop(next)) {
+                next.reserve(flushBytes + 4096);
+            }
+            buffer.swap(next);
+            background->full.push(std::move(next));
+        }
+    }
+
+    /** Write a block with as few write calls as possible */
+    static void writeAll(const int fd, std::string_view block) {
+        for (size_t done = 0; done < block.size();) {
+            const ssize_t n = ::write(fd, block.data() + done,
+                                      block.size() - done);
+            if (n < 0 && errno != EINTR) {
+                break;  // Nowhere left to report this; drop the output
+            }
+            done += (n > 0 ? n : 0);
+        }
+    }
+
+    /** The queued buffers and the thread that writes them */
+    struct Background {
+        explicit Background(const size_t buffers)
+            : full(buffers), spare(buffers) {}
+        /** Buffers to be written, and written ones to be reused */
+        SpscRing<std::string> full, spare;
+        std::thread thread;
+    };
+
+    /** The writer thread: write the queued buffers until stopped */
+    static void writerLoop(const int fd, Background& background) {
+        std::string block;
+        while (background.full.pop(block)) {
+            writeAll(fd, block);
+            block.clear();
+            background.spare.tryPush(block);
+        }
+    }
+
+    /** The timer thread: flush output that has waited flushInterval */
+    void timerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (buffer.empty()) {
+                wakeup.wait(lock);
+            } else if (wakeup.wait_until(lock, oldest + flushInterval) ==
+                       std::cv_status::timeout && !buffer.empty() &&
+                       std::chrono::steady_clock::now() >=
+                       oldest + flushInterval) {
+                writeBuffer();
+            }
+        }
+    }
+
+    /** Append the top IPs and users report */
+    void appendTop() {
+        struct List {
+            const char *name, *title;
+            const SpaceSaving* summary;
+        };
+        const List lists[] = {{"ip", "IPs", &top->ips},
+                              {"user", "users", &top->users}};
+        if (format == AlertFormat::JSON) {
+            buffer.append("{\"top\":{");
+        }
+        for (const auto& [name, title, summary] : lists) {
+            const std::vector<SpaceSaving::Counter> counters =
+                summary->top(top->k);
+            switch (format) {
+            case AlertFormat::TEXT:
+                buffer.append("Top ").append(title) += ':';
+                for (size_t i = 0; i < counters.size(); i++) {
+                    buffer.append(i == 0 ? " " : ", ")
+                          .append(counters[i].key).append(" (");
+                    if (counters[i].error > 0) {
+                        appendNumber(counters[i].count - counters[i].error);
+                        buffer += '-';
+                    }
+                    appendNumber(counters[i].count);
+                    buffer += ')';
+                }
+                buffer += '\n';
+                break;
+            case AlertFormat::JSON:
+                buffer.append(summary == lists[0].summary ? "\"" : ",\"")
+                      .append(name).append("s\":[");
+                for (size_t i = 0; i < counters.size(); i++) {
+                    buffer.append(i == 0 ? "{\"key\":\"" : ",{\"key\":\"");
+                    appendJson(counters[i].key);
+                    buffer.append("\",\"count\":");
+                    appendNumber(counters[i].count);
+                    buffer.append(",\"error\":");
+                    appendNumber(counters[i].error);
+                    buffer += '}';
+                }
+                buffer += ']';
+                break;
+            case AlertFormat::TSV:
+                for (const SpaceSaving::Counter& counter : counters) {
+                    buffer.append("top\t").append(name) += '\t';
+                    appendTsv(counter.key);
+                    buffer += '\t';
+                    appendNumber(counter.count);
+                    buffer += '\t';
+                    appendNumber(counter.error);
+                    buffer += '\n';
+                }
+                break;
+            }
+        }
+        if (format == AlertFormat::JSON) {
+            buffer.append("}}\n");
+        }
+    }
+
+    /** Append a number without any temporary strings */
+    void appendNumber(const long value) {
+        char digits[24];
+        buffer.append(digits, std::to_chars(digits, digits + sizeof(digits),
+                                            value).ptr - digits);
+    }
+
+    /** Append a string with JSON escapes for quotes and control bytes */
+    void appendJson(std::string_view text) {
+        // Most user names and addresses need no escapes at all
+        if (std::none_of(text.begin(), text.end(), [](const char c) {
+                return c == '"' || c == '\\' ||
+                       static_cast<unsigned char>(c) < 0x20; })) {
+            buffer.append(text);
+            return;
+        }
+        for (const char c : text) {
+            if (c == '"' || c == '\\') {
+                buffer += '\\';
+                buffer += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                buffer += esc;
+            } else {
+                buffer += c;
+            }
+        }
+    }
+
+    /** Append a string with TSV escapes for tabs, newlines, and '\' */
+    void appendTsv(std::string_view text) {
+        for (const char c : text) {
+            switch (c) {
+            case '\t': buffer += "\\t"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\\': buffer += "\\\\"; break;
+            default: buffer += c;
+            }
+        }
+    }
+
+    /** The file descriptor that output is written to */
+    const int fd;
+
+    /** The output format */
+    const AlertFormat format;
+
+    /** The size and age thresholds at which output is written */
+    const size_t flushBytes;
+    const std::chrono::milliseconds flushInterval;
+
+    /** The formatted output not yet written */
+    std::string buffer;
+
+    /** The top IPs and users of the alerts, if they are being tracked */
+    std::unique_ptr<TopAttackers> top;
+
+    /** The lateness bound whose late logins are reported, or 0 */
+    long lateBound = 0;
+
+    /** The time at which the oldest pending output was added */
+    std::chrono::steady_clock::time_point oldest;
+
+    /** Guards the buffer, since the timer thread also flushes it */
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread timer;
+
+    /** The writer thread's state, if output is written in background */
+    std::unique_ptr<Background> background;
+
+    /** The counters of the last writer thread's ring */
+    RingStats backgroundStats;
+};
+
+#endif  // ALERT_WRITER_H
@@ -0,0 +1,335 @@
+// Copyright 2023 Evan Williams
+#ifndef DECOMPRESSOR_H
+#define DECOMPRESSOR_H
+
+/**
+ * Streaming decompression of rotated logs (auth.log.N.gz and
+ * auth.log.N.zst) between the input source and the line scanner. The
+ * codec is detected from the magic bytes at the start of the data, so
+ * plain, gzip, and zstd input can all be handed to the same stream.
+ *
+ * Decompression runs on its own thread, which reads the source in
+ * large blocks and queues decompressed blocks for the parsing thread,
+ * so the two overlap.
+ *
+ * gzip support needs zlib (link with -lz). zstd support is compiled
+ * in when <zstd.h> is available (link with -lzstd).
+ */
+
+#include <zlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define LOGIN_SENTRY_HAS_ZSTD 1
+#endif
+
+/**
+ * A stream buffer that yields the decompressed contents of a source
+ * stream. A background thread reads and decompresses the source, and
+ * underflow hands out the decompressed blocks in order.
+ */
+class DecompressingBuf : public std::streambuf {
+public:
+    /** The compression formats recognized from their magic bytes */
+    enum Codec { PLAIN, GZIP, ZSTD };
+
+    /**
+     * Start decompressing a source stream.
+     *
+     * @param source The compressed stream. It must outlive this buffer.
+     *
+     * @param blockSize The size of the blocks read and produced.
+     *
+     * @param maxQueued The number of decompressed blocks that may wait
+     * for the parser before the decompressor thread blocks.
+     */
+    explicit DecompressingBuf(std::istream& source,
+                              const size_t blockSize = 1 << 20,
+                              const size_t maxQueued = 4)
+        : source(source), blockSize(blockSize), maxQueued(maxQueued) {
+        worker = std::thread([this] { decompressAll(); });
+    }
+
+    /** Stop the decompressor thread, even if data remains unread */
+    ~DecompressingBuf() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    /**
+     * Obtain the error that ended decompression early, if any. This is
+     * set once the stream has reached its end.
+     */
+    std::string error() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return errorMessage;
+    }
+
+    /**
+     * Return the codec of a source whose first bytes are given.
+     */
+    static Codec detect(const unsigned char* magic, const size_t len) {
+        if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            return GZIP;
+        }
+        if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+            magic[2] == 0x2f && magic[3] == 0xfd) {
+            return ZSTD;
+        }
+        return PLAIN;
+    }
+
+protected:
+    /** Move on to the next decompressed block once the current is used */
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !queue.empty() || finished; });
+        if (queue.empty()) {
+            return traits_type::eof();
+        }
+        current = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        changed.notify_all();
+        setg(&current[0], &current[0], &current[0] + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    /**
+     * Hand a decompressed block to the parser, waiting while the queue
+     * is full.
+     *
+     * @return False if the buffer is being destroyed.
+     */
+    bool push(std::string& block) {
+        if (block.empty()) {
+            return !stopping;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] {
+            return queue.size() < maxQueued || stopping;
+        });
+        queue.push_back(std::move(block));
+        lock.unlock();
+        changed.notify_all();
+        block = std::string();
+        return !stopping;
+    }
+
+    /** Read the next block of compressed input into in */
+    bool readInput(std::vector<char>& in, size_t& len) {
+        source.read(in.data(), in.size());
+        len = source.gcount();
+        return len > 0;
+    }
+
+    /** The body of the decompressor thread */
+    void decompressAll() {
+        std::vector<char> in(blockSize);
+        size_t len = 0;
+        readInput(in, len);
+        std::string error;
+        switch (detect(reinterpret_cast<unsigned char*>(in.data()), len)) {
+        case GZIP: error = inflateGzip(in, len); break;
+        case ZSTD: error = decompressZstd(in, len); break;
+        default:
+            do {
+                std::string block(in.data(), len);
+                if (!push(block)) {
+                    break;
+                }
+            } while (readInput(in, len));
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        errorMessage = error;
+        finished = true;
+        changed.notify_all();
+    }
+
+    /**
+     * Decompress gzip data (possibly several concatenated members, as
+     * produced by logrotate with delaycompress) with zlib.
+     *
+     * @return An error message, or an empty string on success.
+     */
+    std::string inflateGzip(std::vector<char>& in, size_t len) {
+        z_stream zs = {};
+        // 15 + 32: maximum window, and detect the gzip/zlib header
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+            return "Error initializing zlib";
+        }
+        std::string out(blockSize, '\0'), error;
+        size_t used = 0;
+        int rc = Z_OK;
+        do {
+            zs.next_in = reinterpret_cast<Bytef*>(in.data());
+            zs.avail_in = static_cast<uInt>(len);
+            while (zs.avail_in > 0) {
+                zs.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                zs.avail_out = static_cast<uInt>(out.size() - used);
+                rc = inflate(&zs, Z_NO_FLUSH);
+                used = out.size() - zs.avail_out;
+                if (rc == Z_STREAM_END) {
+                    inflateReset(&zs);
+                } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                    error = std::string("Error decompressing gzip data: ") +
+                            (zs.msg ? zs.msg : "corrupt input");
+                    break;
+                }
+                if (used == out.size()) {
+                    if (!push(out)) {
+                        break;
+                    }
+                    out.assign(blockSize, '\0');
+                    used = 0;
+                } else if (rc == Z_BUF_ERROR) {
+                    break;  // No progress possible without more input
+                }
+            }
+        } while (error.empty() && !stopping && readInput(in, len));
+        if (error.empty() && rc != Z_STREAM_END && zs.total_in != 0 &&
+            !stopping) {
+            error = "Truncated gzip data";
+        }
+        out.resize(used);
+        push(out);
+        inflateEnd(&zs);
+        return error;
+    }
+
+    /**
+     * Decompress zstd data (possibly several concatenated frames).
+     *
+     * @return An error message, or an empty string on success.
+     */
+    std::string decompressZstd(std::vector<char>& in, size_t len) {
+#ifdef LOGIN_SENTRY_HAS_ZSTD
+        ZSTD_DStream* zs = ZSTD_createDStream();
+        ZSTD_initDStream(zs);
+        std::string out(blockSize, '\0'), error;
+        size_t used = 0, rc = 0;
+        do {
+            ZSTD_inBuffer input = {in.data(), len, 0};
+            while (input.pos < input.size) {
+                ZSTD_outBuffer output = {&out[0], out.size(), used};
+                rc = ZSTD_decompressStream(zs, &output, &input);
+                used = output.pos;
+                if (ZSTD_isError(rc)) {
+                    error = std::string("Error decompressing zstd data: ") +
+                            ZSTD_getErrorName(rc);
+                    break;
+                }
+                if (used == out.size()) {
+                    if (!push(out)) {
+                        break;
+                    }
+                    out.assign(blockSize, '\0');
+                    used = 0;
+                }
+            }
+        } while (error.empty() && !stopping && readInput(in, len));
+        if (error.empty() && rc != 0 && !stopping) {
+            error = "Truncated zstd data";
+        }
+        out.resize(used);
+        push(out);
+        ZSTD_freeDStream(zs);
+        return error;
+#else
+        (void) in, (void) len;
+        return "zstd-compressed input, but zstd support is not compiled in";
+#endif
+    }
+
+    /** The compressed source */
+    std::istream& source;
+
+    /** The size of the blocks read from source and handed out */
+    const size_t blockSize;
+
+    /** The maximum number of decompressed blocks waiting in queue */
+    const size_t maxQueued;
+
+    /** The decompressed blocks waiting for the parser */
+    std::deque<std::string> queue;
+
+    /** The block currently being read by the parser */
+    std::string current;
+
+    /** The error, if any, that ended decompression */
+    std::string errorMessage;
+
+    /** Set when the decompressor thread is done */
+    bool finished = false;
+
+    /** Set when the buffer is being destroyed */
+    std::atomic<bool> stopping{false};
+
+    /** Guards queue, errorMessage, finished, and stopping */
+    mutable std::mutex mutex;
+
+    /** Signalled whenever the queue or the flags change */
+    std::condition_variable changed;
+
+    /** The decompressor thread */
+    std::thread worker;
+};
+
+/**
+ * The log input handed to the line scanner. If the source starts with
+ * the magic bytes of a supported compression format, reads go through
+ * a DecompressingBuf; otherwise the source is used directly, so plain
+ * logs pay nothing for this stage.
+ */
+class LogInput {
+public:
+    /**
+     * Wrap a source stream.
+     *
+     * @param source The (possibly compressed) log data. It must outlive
+     * this object.
+     */
+    explicit LogInput(std::istream& source) : in(&source) {
+        // Plain syslog text starts with a month name, so the first byte
+        // is enough to rule out compression without consuming input.
+        const auto first = source.rdbuf()->sgetc();
+        if (first == 0x1f || first == 0x28) {
+            buf = std::make_unique<DecompressingBuf>(source);
+            decoded = std::make_unique<std::istream>(buf.get());
+            in = decoded.get();
+        }
+    }
+
+    /** Obtain the stream of decompressed log text */
+    std::istream& stream() { return *in; }
+
+    /**
+     * Obtain the error, if any, that ended decompression early. Only
+     * meaningful once the stream has been read to its end.
+     */
+    std::string error() const { return buf ? buf->error() : ""; }
+
+private:
+    std::unique_ptr<DecompressingBuf> buf;
+    std::unique_ptr<std::istream> decoded;
+    std::istream* in;
+};
+
+#endif  // DECOMPRESSOR_H
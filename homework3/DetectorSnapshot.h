@@ -0,0 +1,217 @@
+// Copyright 2023 Evan Williams
+#ifndef DETECTOR_SNAPSHOT_H
+#define DETECTOR_SNAPSHOT_H
+
+/**
+ * Binary snapshots of detector state, so that a restart does not forget
+ * the recent logins of every user. The state classes (KeyInterner,
+ * FrequencyTracker, FrequencyDetector, RuleEngine, Sentry) each have a
+ *
+ *     template <class Archive> void snapshot(Archive& ar)
+ *
+ * method that lists their members once; it is used both to write a
+ * snapshot (with SnapshotWriter) and to restore one (SnapshotReader).
+ * After reading its members, a snapshot method passes the invariants
+ * the rest of its class relies on (such as IDs in range) to ar.check,
+ * so that a corrupt snapshot is rejected with an exception instead of
+ * being indexed out of bounds later.
+ *
+ * A snapshot is a versioned header followed by the raw contents of the
+ * state's arrays, each 8-byte aligned. Loading maps the file and copies
+ * each array into place in one go, so nothing is parsed or rehashed
+ * and millions of tracked users load in milliseconds. Snapshots are
+ * written to a temporary file that is renamed over the old one, so a
+ * crash never leaves a torn snapshot behind.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "MappedFile.h"
+
+/** The first bytes of every snapshot, including the format version */
+constexpr char SNAPSHOT_MAGIC[8] = {'L', 'S', 'S', 'N', 'A', 'P', 0, 6};
+
+/**
+ * The archive that writes state into a snapshot.
+ */
+class SnapshotWriter {
+public:
+    /** Start a snapshot with its header */
+    SnapshotWriter() { out.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)); }
+
+    /** Write a scalar (of at most 8 bytes) */
+    template <class T>
+    void value(const T& v) {
+        static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= 8);
+        char slot[8] = {};
+        std::memcpy(slot, &v, sizeof(T));
+        out.append(slot, sizeof(slot));
+    }
+
+    /** Write an array of trivially copyable elements */
+    template <class T>
+    void array(const std::vector<T>& v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        raw(v.data(), v.size(), sizeof(T));
+    }
+
+    /** Write an array of flags, one byte each */
+    void array(const std::vector<bool>& v) {
+        const std::vector<char> bytes(v.begin(), v.end());
+        array(bytes);
+    }
+
+    /** Write a string */
+    void array(const std::string& s) { raw(s.data(), s.size(), 1); }
+
+    /** Check an invariant of restored state; state being written has it */
+    void check(bool, const char*) {}
+
+    /** Obtain the snapshot written so far */
+    const std::string& data() const { return out; }
+
+private:
+    /** Write an element count and the elements, padded to 8 bytes */
+    void raw(const void* data, const size_t count, const size_t size) {
+        value(static_cast<uint64_t>(count));
+        out.append(static_cast<const char*>(data), count * size);
+        out.resize((out.size() + 7) & ~size_t(7), '\0');
+    }
+
+    std::string out;
+};
+
+/**
+ * The archive that restores state from a snapshot in memory.
+ */
+class SnapshotReader {
+public:
+    /**
+     * Start reading a snapshot.
+     *
+     * @param data The snapshot, e.g., a MappedFile's data.
+     *
+     * @exception std::runtime_error If the data is not a snapshot of
+     * this version.
+     */
+    explicit SnapshotReader(std::string_view data) : in(data) {
+        if (in.size() < sizeof(SNAPSHOT_MAGIC) ||
+            std::memcmp(in.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) {
+            throw std::runtime_error("Not a snapshot, or an old version");
+        }
+        pos = sizeof(SNAPSHOT_MAGIC);
+    }
+
+    /** Read a scalar (of at most 8 bytes) */
+    template <class T>
+    void value(T& v) {
+        std::memcpy(&v, take(8), sizeof(T));
+    }
+
+    /** Read an array of trivially copyable elements */
+    template <class T>
+    void array(std::vector<T>& v) {
+        uint64_t count;
+        value(count);
+        if (count > in.size() / sizeof(T)) {
+            throw std::runtime_error("Truncated snapshot");
+        }
+        // The data is only 8-byte aligned, so it is copied as bytes
+        const char* data = take(count * sizeof(T));
+        v.resize(count);
+        std::memcpy(v.data(), data, count * sizeof(T));
+    }
+
+    /** Read an array of flags, one byte each */
+    void array(std::vector<bool>& v) {
+        std::vector<char> bytes;
+        array(bytes);
+        v.assign(bytes.begin(), bytes.end());
+    }
+
+    /** Read a string */
+    void array(std::string& s) {
+        std::vector<char> bytes;
+        array(bytes);
+        s.assign(bytes.begin(), bytes.end());
+    }
+
+    /**
+     * Check an invariant of the state read so far.
+     *
+     * @param valid Whether the invariant holds.
+     *
+     * @param what The state it is about, for the error message.
+     *
+     * @exception std::runtime_error If it does not hold.
+     */
+    void check(const bool valid, const char* what) {
+        if (!valid) {
+            throw std::runtime_error(std::string("Corrupt snapshot: bad ") +
+                                     what);
+        }
+    }
+
+private:
+    /** Consume the next bytes, and the padding after them */
+    const char* take(const size_t size) {
+        if (size > in.size() - pos) {
+            throw std::runtime_error("Truncated snapshot");
+        }
+        const char* data = in.data() + pos;
+        pos = std::min(in.size(), (pos + size + 7) & ~size_t(7));
+        return data;
+    }
+
+    std::string_view in;
+    size_t pos;
+};
+
+/**
+ * Helper method to write a snapshot of some state atomically.
+ *
+ * @param path The snapshot file.
+ *
+ * @param state An object with a snapshot method.
+ *
+ * @exception std::runtime_error If the file cannot be written.
+ */
+template <class State>
+void saveSnapshot(const std::string& path, State& state) {
+    SnapshotWriter writer;
+    state.snapshot(writer);
+    writeFileAtomically(path, writer.data());
+}
+
+/**
+ * Helper method to restore some state from a snapshot, if there is one.
+ *
+ * @param path The snapshot file.
+ *
+ * @param state An object with a snapshot method. If an exception is
+ * thrown, it may have been partly restored.
+ *
+ * @return False if there is no snapshot file.
+ *
+ * @exception std::runtime_error If the snapshot is truncated, fails a
+ * check of its invariants, or was taken with different rules.
+ */
+template <class State>
+bool loadSnapshot(const std::string& path, State& state) {
+    if (access(path.c_str(), F_OK) != 0) {
+        return false;
+    }
+    const MappedFile file(path);
+    SnapshotReader reader(file.data());
+    state.snapshot(reader);
+    return true;
+}
+
+#endif  // DETECTOR_SNAPSHOT_H
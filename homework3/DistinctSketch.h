@@ -0,0 +1,339 @@
+// Copyright 2023 Evan Williams
+#ifndef DISTINCT_SKETCH_H
+#define DISTINCT_SKETCH_H
+
+/**
+ * Approximate counting of the distinct users seen per key (IP address
+ * or subnet) within a sliding window, for detecting password spraying
+ * with thresholds too large to track exactly. Each key gets a
+ * HyperLogLog sketch split into time slices, so memory per key is
+ * fixed (about 2.6 KB) however many users are tried, and recording a
+ * login is a hash and a byte compare, plus a merge of the slices when
+ * the key moves on to a new one.
+ *
+ * Small counts are exact: each key also remembers its EXACT_USERS most
+ * recent users and when each was last seen, like DistinctTracker, and
+ * as long as none of the users it had to forget is still within the
+ * window, the count of those within the window is the answer. So a
+ * rule with a threshold below EXACT_USERS never alerts early or late,
+ * and the sketch only answers for keys with more users than that.
+ *
+ * Error bounds: with 256 registers the standard error of an estimate
+ * is 1.04 / sqrt(256), about 6.5%, and estimates within 15% of the
+ * true count about 98% of the time. Below about 640 distinct users the
+ * estimate comes from linear counting of the empty registers, which is
+ * somewhat tighter (see the "sketch" benchmark). A key whose true
+ * count is near a rule's threshold may therefore alert slightly early
+ * or late. The window is covered by 8 slices and one more for the
+ * slice in progress, so users are remembered for the window plus at
+ * most 1/8 of it (exact counts use the window itself).
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "FrequencyWindow.h"
+#include "KeyInterner.h"
+
+class DistinctSketchTracker {
+public:
+    /** The number of index bits of a hash; there are 2^PRECISION registers */
+    static constexpr int PRECISION = 8;
+    static constexpr size_t REGISTERS = size_t(1) << PRECISION;
+
+    /** The number of time slices per sketch (the window is SLICES - 1) */
+    static constexpr long SLICES = 9;
+
+    /** The number of recent users per key that are counted exactly */
+    static constexpr size_t EXACT_USERS = 32;
+
+    /**
+     * Create a tracker for the given rule.
+     *
+     * @param rule The maximum number of distinct users and the window.
+     */
+    explicit DistinctSketchTracker(const FrequencyRule& rule)
+        : rule(rule),
+          sliceWidth((std::max(rule.window, 1L) + SLICES - 2) /
+                     (SLICES - 1)) {}
+
+    /**
+     * Record a login by a user for a key and report whether the key's
+     * estimated number of distinct users now violates the rule.
+     * Timestamps are assumed to arrive in order for each key; an older
+     * one is counted in the key's current slice.
+     *
+     * @param keyID The interned ID of the key (e.g., the IP address).
+     *
+     * @param userID The interned ID of the user who attempted to login.
+     *
+     * @param seconds The time of the attempt in seconds since Epoch.
+     *
+     * @return True if the count (exact or estimated, see above) is
+     * more than maxAttempts distinct users for this key within the
+     * rule's window.
+     */
+    bool record(const KeyInterner::Id keyID, const KeyInterner::Id userID,
+                const long seconds) {
+        if (keyID >= states.size()) {
+            states.resize(keyID + 1);
+            registers.resize(states.size() * STRIDE, 0);
+        }
+        State& state = states[keyID];
+        std::uint8_t *slices = &registers[keyID * STRIDE],
+                     *merged = slices + SLICES * REGISTERS;
+        const long slice = seconds / sliceWidth;
+        if (slice > state.slice) {
+            advance(state, slices, merged, slice);
+        }
+        // The top bits pick the register, and the rest give the rank:
+        // the position of their first set bit (a guard bit caps it)
+        const std::uint64_t hash = mix(userID);
+        const size_t index = hash >> (64 - PRECISION);
+        const std::uint8_t rank = static_cast<std::uint8_t>(__builtin_clzll(
+            hash << PRECISION | std::uint64_t(1) << (PRECISION - 1)) + 1);
+        std::uint8_t& current = slices[(state.slice % SLICES) * REGISTERS +
+                                       index];
+        current = std::max(current, rank);
+        if (rank > merged[index]) {
+            state.sum += inversePower(rank) - inversePower(merged[index]);
+            state.zeros -= (merged[index] == 0);
+            merged[index] = rank;
+            state.estimate = estimate(state);
+        }
+        state.exact = countExact(state, userID, seconds);
+        return (state.exact >= 0 ? state.exact : state.estimate) >
+               rule.maxAttempts;
+    }
+
+    /**
+     * Obtain the number of distinct users of a key within the window
+     * that ended at its most recent login: exact for small counts, and
+     * otherwise the sketch's estimate.
+     *
+     * @param keyID The interned ID of the key.
+     */
+    double estimate(const KeyInterner::Id keyID) const {
+        if (keyID >= states.size()) {
+            return 0;
+        }
+        const State& state = states[keyID];
+        return state.exact >= 0 ? state.exact : state.estimate;
+    }
+
+    /**
+     * Start loading a key's summary and merged registers (see
+     * FrequencyTracker::prefetch).
+     */
+    void prefetch(const KeyInterner::Id keyID) const {
+        if (keyID < states.size()) {
+            __builtin_prefetch(&states[keyID], 1);
+            __builtin_prefetch(&registers[keyID * STRIDE +
+                                          SLICES * REGISTERS], 1);
+        }
+    }
+
+    /** Obtain the memory used per key, in bytes */
+    static constexpr size_t bytesPerKey() { return STRIDE + sizeof(State); }
+
+    /**
+     * Write or restore the sketches with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the snapshot being restored was
+     * taken with a different rule.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        size_t stride = STRIDE;
+        long width = sliceWidth;
+        ar.value(stride);
+        ar.value(width);
+        if (stride != STRIDE || width != sliceWidth) {
+            throw std::runtime_error("Snapshot has a different distinct-"
+                                     "users sketch");
+        }
+        ar.array(states);
+        ar.array(registers);
+        bool valid = registers.size() == states.size() * STRIDE;
+        for (const State& state : states) {
+            // The slice picks the registers to update, so it must not be
+            // negative (LONG_MIN is a key not seen yet)
+            valid = valid && (state.slice >= 0 || state.slice == LONG_MIN) &&
+                    state.exact >= -1 &&
+                    state.exact <= static_cast<long>(EXACT_USERS);
+        }
+        ar.check(valid, "distinct-users sketches");
+    }
+
+private:
+    /** The registers kept per key: one set per slice, then their max */
+    static constexpr size_t STRIDE = (SLICES + 1) * REGISTERS;
+
+    /** The fraction bits of the fixed-point sum (see inversePower) */
+    static constexpr int SUM_BITS = 63 - PRECISION;
+
+    /** The summary of a key's merged registers */
+    struct State {
+        /** The slice (time / sliceWidth) of the key's latest login */
+        long slice = LONG_MIN;
+        /** The slice each set of registers was started for */
+        long started[SLICES] = {LONG_MIN, LONG_MIN, LONG_MIN, LONG_MIN,
+                                LONG_MIN, LONG_MIN, LONG_MIN, LONG_MIN,
+                                LONG_MIN};
+        /** The sum of 2^-register over the merged registers (fixed point) */
+        std::uint64_t sum = std::uint64_t(1) << 63;
+        /** The number of merged registers that are still 0 */
+        long zeros = REGISTERS;
+        /** The estimated number of distinct users */
+        double estimate = 0;
+        /** The most recent users and when each was last seen */
+        KeyInterner::Id recentUsers[EXACT_USERS];
+        long recentTimes[EXACT_USERS];
+        /** When the most recent user that was replaced was last seen */
+        long forgotten = LONG_MIN;
+        /** The exact number of distinct users, or -1 if too many */
+        long exact = 0;
+
+        /** Start with every recent user slot unused */
+        State() {
+            std::fill(recentUsers, recentUsers + EXACT_USERS,
+                      KeyInterner::NotFound);
+            std::fill(recentTimes, recentTimes + EXACT_USERS, LONG_MIN);
+        }
+    };
+
+    /**
+     * Add a login to a key's recent users, replacing the least recent
+     * one if the user is new (see DistinctTracker::record).
+     *
+     * @return The number of recent users within the window, or -1 if
+     * a user that was replaced is still within it, so that the count
+     * may be short.
+     */
+    long countExact(State& state, const KeyInterner::Id userID,
+                    const long seconds) const {
+        const long since = seconds - rule.window;
+        size_t slot = 0;
+        long inWindow = 1;
+        bool found = false;
+        for (size_t i = 0; i < EXACT_USERS; i++) {
+            if (state.recentUsers[i] == userID) {
+                slot = i;
+                found = true;
+            } else {
+                inWindow += (state.recentTimes[i] >= since);
+                if (!found &&
+                    state.recentTimes[i] < state.recentTimes[slot]) {
+                    slot = i;
+                }
+            }
+        }
+        if (!found) {
+            inWindow -= (state.recentTimes[slot] >= since);
+            state.forgotten = std::max(state.forgotten,
+                                       state.recentTimes[slot]);
+        }
+        state.recentUsers[slot] = userID;
+        state.recentTimes[slot] = seconds;
+        return state.forgotten >= since ? -1 : inWindow;
+    }
+
+    /** Spread the bits of a (dense) user ID over a 64-bit hash */
+    static std::uint64_t mix(std::uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /**
+     * Obtain 2^-rank as a fixed-point number with SUM_BITS fraction
+     * bits. A whole sketch of zeros sums to 2^63, so the sum fits in 64
+     * bits; ranks above SUM_BITS (probability 2^-55) count as 0.
+     */
+    static std::uint64_t inversePower(const std::uint8_t rank) {
+        return rank > SUM_BITS ? 0 : std::uint64_t(1) << (SUM_BITS - rank);
+    }
+
+    /** The HyperLogLog estimate, with linear counting for small counts */
+    static double estimate(const State& state) {
+        const double m = REGISTERS;
+        const double raw = 0.7213 / (1 + 1.079 / m) * m * m /
+                           std::ldexp(double(state.sum), -SUM_BITS);
+        if (raw <= 2.5 * m && state.zeros > 0) {
+            return m * std::log(m / state.zeros);
+        }
+        return raw;
+    }
+
+    /**
+     * Move a key on to a later slice: start the slice afresh and
+     * rebuild the merged registers from the slices still in the window.
+     * Slices that fell out of the window are not touched, so a key that
+     * is seen less often than once per window costs one slice to clear.
+     */
+    void advance(State& state, std::uint8_t* slices, std::uint8_t* merged,
+                 const long slice) {
+        state.slice = slice;
+        std::uint8_t* current = slices + (slice % SLICES) * REGISTERS;
+        std::fill(current, current + REGISTERS, 0);
+        state.started[slice % SLICES] = slice;
+        // Into a local array a slice at a time, so the compiler can
+        // vectorize the max
+        std::uint8_t ranks[REGISTERS] = {};
+        bool live = false;
+        for (long s = 0; s < SLICES; s++) {
+            const long started = state.started[s];
+            if (started > slice - SLICES && started < slice) {
+                const std::uint8_t* other = slices + s * REGISTERS;
+                for (size_t i = 0; i < REGISTERS; i++) {
+                    const std::uint8_t rank = other[i];
+                    ranks[i] = (rank > ranks[i] ? rank : ranks[i]);
+                }
+                live = true;
+            }
+        }
+        if (!live) {
+            // The common case for a key seen less often than once per
+            // window: nothing is left, so start over
+            std::fill(merged, merged + REGISTERS, 0);
+            const State empty;
+            state.sum = empty.sum;
+            state.zeros = empty.zeros;
+            state.estimate = empty.estimate;
+            return;
+        }
+        // Usually only a few registers drop, so the sum is adjusted for
+        // those, 8 registers at a time
+        for (size_t i = 0; i < REGISTERS; i += 8) {
+            std::uint64_t before, after;
+            std::memcpy(&before, merged + i, 8);
+            std::memcpy(&after, ranks + i, 8);
+            for (size_t j = i; before != after && j < i + 8; j++) {
+                state.sum += inversePower(ranks[j]) - inversePower(merged[j]);
+                state.zeros += (ranks[j] == 0) - (merged[j] == 0);
+            }
+        }
+        std::copy(ranks, ranks + REGISTERS, merged);
+        state.estimate = estimate(state);
+    }
+
+    /** The rule being checked */
+    const FrequencyRule rule;
+
+    /** The length of a slice in seconds (the window / (SLICES - 1)) */
+    const long sliceWidth;
+
+    /** The summary of each key (indexed by ID) */
+    std::vector<State> states;
+
+    /** The registers of each key, STRIDE bytes per key */
+    std::vector<std::uint8_t> registers;
+};
+
+#endif  // DISTINCT_SKETCH_H
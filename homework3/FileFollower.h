@@ -0,0 +1,209 @@
+// Copyright 2023 Evan Williams
+#ifndef FILE_FOLLOWER_H
+#define FILE_FOLLOWER_H
+
+/**
+ * Follow mode ("tail -F") for a local log file such as /var/log/auth.log.
+ * The file is read from the last byte offset whenever inotify reports
+ * a change, and complete lines are handed to a callback. Rotation is
+ * handled both when the file is renamed and replaced (the inode at the
+ * path changes) and when it is truncated in place (copytruncate).
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+class FileFollower {
+public:
+    /** The callback that receives each complete line (without '\n') */
+    using LineHandler = std::function<void(std::string_view)>;
+
+    /**
+     * Start following a file.
+     *
+     * @param path The path of the file to follow.
+     *
+     * @param fromEnd If true, lines already in the file are skipped and
+     * only lines appended from now on are reported.
+     *
+     * @exception std::runtime_error If inotify cannot be set up.
+     */
+    explicit FileFollower(const std::string& path, const bool fromEnd = false)
+        : path(path), notifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+        if (notifyFd == -1) {
+            throw std::runtime_error(std::string("Error setting up "
+                                     "inotify: ") + std::strerror(errno));
+        }
+        // Watch the directory for a new file appearing at the path
+        const size_t slash = path.rfind('/');
+        const std::string dir = (slash == std::string::npos ? "." :
+                                 slash == 0 ? "/" : path.substr(0, slash));
+        inotify_add_watch(notifyFd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+        reopen();
+        if (fromEnd && fd != -1) {
+            struct stat info;
+            fstat(fd, &info);
+            offset = info.st_size;
+        }
+    }
+
+    /** Close the file and the inotify descriptor */
+    ~FileFollower() {
+        if (fd != -1) {
+            close(fd);
+        }
+        close(notifyFd);
+    }
+
+    FileFollower(const FileFollower&) = delete;
+    FileFollower& operator=(const FileFollower&) = delete;
+
+    /**
+     * Report every complete line in the file, then keep waiting for and
+     * reporting new lines until stop is set.
+     *
+     * @param onLine The callback for each line.
+     *
+     * @param afterRead Called after each batch of lines (e.g., to flush
+     * alerts), so output is not delayed waiting for more input.
+     *
+     * @param stop Checked at least every pollMillis milliseconds.
+     *
+     * @param pollMillis The longest time to wait for an inotify event
+     * before checking the file (and stop) anyway.
+     */
+    void run(const LineHandler& onLine, const std::function<void()>& afterRead,
+             const std::atomic<bool>& stop, const int pollMillis = 1000) {
+        while (!stop) {
+            readNewLines(onLine);
+            afterRead();
+            checkRotation(onLine);
+            struct pollfd pfd = {notifyFd, POLLIN, 0};
+            if (poll(&pfd, 1, pollMillis) > 0) {
+                // The events only serve as a wakeup; drain and discard
+                char events[4096];
+                while (read(notifyFd, events, sizeof(events)) > 0) {}
+            }
+        }
+    }
+
+    /**
+     * Continue from a position saved by an earlier run (see position
+     * and fileInode). If the file at the path is no longer the same
+     * file, or is now shorter, it is read from its start instead.
+     *
+     * @return True if reading continues from the saved position.
+     */
+    bool resume(const ino_t savedInode, const off_t savedOffset) {
+        struct stat info;
+        if (fd == -1 || savedInode != inode || fstat(fd, &info) != 0 ||
+            info.st_size < savedOffset) {
+            return false;
+        }
+        offset = savedOffset;
+        partial.clear();
+        return true;
+    }
+
+    /** Obtain the offset of the first byte not yet passed to onLine */
+    off_t position() const { return offset - partial.size(); }
+
+    /** Obtain the inode of the file currently being followed */
+    ino_t fileInode() const { return inode; }
+
+private:
+    /**
+     * Read from the last offset to the end of the current file and
+     * report each complete line. A trailing partial line is kept until
+     * its newline arrives.
+     */
+    void readNewLines(const LineHandler& onLine) {
+        if (fd == -1) {
+            return;
+        }
+        char buf[1 << 16];
+        for (ssize_t n; (n = pread(fd, buf, sizeof(buf), offset)) > 0;) {
+            offset += n;
+            std::string_view data(buf, n);
+            for (size_t nl; (nl = data.find('\n')) != std::string_view::npos;
+                 data.remove_prefix(nl + 1)) {
+                if (partial.empty()) {
+                    onLine(data.substr(0, nl));
+                } else {
+                    partial.append(data.substr(0, nl));
+                    onLine(partial);
+                    partial.clear();
+                }
+            }
+            partial.append(data);
+        }
+    }
+
+    /**
+     * Detect rotation. If the file was truncated, start again from its
+     * beginning. If a different file now exists at the path, finish
+     * reading the old one and switch to the new one.
+     */
+    void checkRotation(const LineHandler& onLine) {
+        struct stat info;
+        if (fd != -1 && fstat(fd, &info) == 0 && info.st_size < offset) {
+            offset = 0;
+            partial.clear();
+        }
+        if (stat(path.c_str(), &info) == 0 &&
+            (fd == -1 || info.st_ino != inode || info.st_dev != device)) {
+            readNewLines(onLine);
+            if (!partial.empty()) {
+                onLine(partial);
+                partial.clear();
+            }
+            reopen();
+            readNewLines(onLine);
+        }
+    }
+
+    /** Open the file currently at the path and watch it */
+    void reopen() {
+        if (fd != -1) {
+            close(fd);
+            inotify_rm_watch(notifyFd, fileWatch);
+        }
+        offset = 0;
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd != -1 && fstat(fd, &info) == 0) {
+            inode = info.st_ino;
+            device = info.st_dev;
+            fileWatch = inotify_add_watch(notifyFd, path.c_str(), IN_MODIFY |
+                IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+        }
+    }
+
+    /** The path of the file being followed */
+    const std::string path;
+
+    /** The inotify instance and the watch on the current file */
+    const int notifyFd;
+    int fileWatch = -1;
+
+    /** The current file, its identity, and how far it has been read */
+    int fd = -1;
+    ino_t inode = 0;
+    dev_t device = 0;
+    off_t offset = 0;
+
+    /** The start of a line whose newline has not been written yet */
+    std::string partial;
+};
+
+#endif  // FILE_FOLLOWER_H
@@ -0,0 +1,242 @@
+// Copyright 2023 Evan Williams
+#ifndef FREQUENCY_WINDOW_H
+#define FREQUENCY_WINDOW_H
+
+/**
+ * Bounded tracking of recent login times for the frequency rule. A
+ * rule of the form "more than N attempts within W seconds" only ever
+ * needs the last N + 1 timestamps of each user, so each user gets a
+ * fixed-size ring instead of a list that grows for the whole run.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "KeyInterner.h"
+
+/**
+ * The parameters of a frequency rule: it is violated when there are
+ * more than maxAttempts logins within window seconds.
+ */
+struct FrequencyRule {
+    size_t maxAttempts = 3;
+    long window = 20;
+};
+
+/** Synonym for an interned key set that is used to track authorized
+ * users. Lookups take a string_view and never allocate.
+ */
+using LookupMap = KeyInterner;
+
+/**
+ * Fixed-size rings of the most recent login times, one ring per user.
+ * Users are identified by their dense KeyInterner ID and all rings
+ * live back-to-back in one vector indexed by that ID, each preceded by
+ * the index of its oldest entry, so memory use is (maxAttempts + 2)
+ * words per distinct user regardless of how many log lines are
+ * processed, and a record touches one cache line or two with no
+ * division.
+ */
+class FrequencyTracker {
+public:
+    /**
+     * Create a tracker for the given rule.
+     *
+     * @param rule The frequency rule whose window the rings cover.
+     */
+    explicit FrequencyTracker(const FrequencyRule& rule = FrequencyRule())
+        : rule(rule), ringSize(rule.maxAttempts + 1) {}
+
+    /**
+     * Record a login time for a user and report whether the user's
+     * most recent logins now violate the rule. Timestamps are assumed
+     * to arrive in order for each user.
+     *
+     * @param userID The interned ID of the user who attempted to login.
+     *
+     * @param seconds The time of the attempt in seconds since Epoch.
+     *
+     * @return True if there are more than maxAttempts logins by this
+     * user within the rule's window.
+     */
+    bool record(const KeyInterner::Id userID, const long seconds) {
+        if (userID >= users) {
+            // Unused entries hold LONG_MIN, which is never in a window
+            rings.resize((userID + 1) * (ringSize + 1), LONG_MIN);
+            for (; users <= userID; users++) {
+                rings[users * (ringSize + 1)] = 0;
+            }
+        }
+        long *entry = &rings[userID * (ringSize + 1)], *ring = entry + 1;
+        const size_t slot = entry[0];
+        const size_t next = (slot + 1 == ringSize ? 0 : slot + 1);
+        ring[slot] = seconds;
+        entry[0] = next;
+        // The next slot holds the oldest of the last ringSize entries,
+        // which is the one to compare against.
+        return ring[next] >= seconds - rule.window;
+    }
+
+    /**
+     * Start loading a user's ring, so that a later record for the user
+     * does not wait on memory.
+     */
+    void prefetch(const KeyInterner::Id userID) const {
+        if (userID < users) {
+            __builtin_prefetch(&rings[userID * (ringSize + 1)], 1);
+        }
+    }
+
+    /**
+     * Obtain the number of distinct users being tracked.
+     */
+    size_t size() const { return users; }
+
+    /**
+     * Write or restore the rings with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the snapshot being restored was
+     * taken with a different rule, or its rings do not match its users.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        size_t size = ringSize;
+        long window = rule.window;
+        ar.value(size);
+        ar.value(window);
+        if (size != ringSize || window != rule.window) {
+            throw std::runtime_error("Snapshot has a different frequency "
+                                     "rule");
+        }
+        ar.value(users);
+        ar.array(rings);
+        bool valid = rings.size() / (ringSize + 1) == users &&
+                     rings.size() % (ringSize + 1) == 0;
+        for (size_t i = 0; valid && i < rings.size(); i += ringSize + 1) {
+            valid = static_cast<size_t>(rings[i]) < ringSize;
+        }
+        ar.check(valid, "frequency rings");
+    }
+
+private:
+    /** The rule being checked */
+    const FrequencyRule rule;
+
+    /** The number of timestamps kept per user (maxAttempts + 1) */
+    const size_t ringSize;
+
+    /** The number of users (IDs) with a ring */
+    size_t users = 0;
+
+    /**
+     * For each user, the slot of the oldest entry followed by the ring
+     * of recent login times (ringSize entries)
+     */
+    std::vector<long> rings;
+};
+
+/**
+ * Helper method to detect hacking due to a login time violation.
+ * Specifically if there are over 3 login attempts by a single 
+ * user ID within a 20 second period. Only the last few login times of
+ * each unauthorized user are kept in the tracker.
+ *
+ * @param loginTimes - Tracker with the recent login times for each user.
+ * @param authorized - Flags indicating which interned user IDs are
+ *                     authorized users.
+ * @param userID - Interned user ID to be checked for a violation.
+ * @param seconds - The time of this login in seconds since Epoch.
+ *
+ * @return True if there is a violation. False if not.
+ */
+inline bool frequencyHacking(FrequencyTracker& loginTimes,
+    const std::vector<bool>& authorized, const KeyInterner::Id userID,
+    const long seconds) {
+    return !authorized[userID] && loginTimes.record(userID, seconds);
+}
+
+/**
+ * The frequency rule's state for a set of users: every user seen gets
+ * a dense ID, and the user's authorized flag and recent login times
+ * are indexed by it. Each instance is independent, so users can be
+ * sharded across several detectors as long as a given user always goes
+ * to the same one.
+ */
+class FrequencyDetector {
+public:
+    /**
+     * Create a detector.
+     *
+     * @param authorizedUsers The users that are exempt from the rule.
+     * The set must outlive this detector.
+     *
+     * @param rule The frequency rule to be checked.
+     */
+    explicit FrequencyDetector(const LookupMap& authorizedUsers,
+                               const FrequencyRule& rule = FrequencyRule())
+        : authorizedUsers(&authorizedUsers), loginTimes(rule) {}
+
+    /**
+     * Record a login by a user and check it with frequencyHacking.
+     *
+     * @param user The user ID from the log line.
+     *
+     * @param seconds The time of the login in seconds since Epoch.
+     *
+     * @return True if the login violates the frequency rule.
+     */
+    bool check(std::string_view user, const long seconds) {
+        const KeyInterner::Id userID = users.intern(user);
+        if (userID == authorized.size()) {
+            authorized.push_back(authorizedUsers->contains(user));
+        }
+        return frequencyHacking(loginTimes, authorized, userID, seconds);
+    }
+
+    /**
+     * Switch to a new set of authorized users, e.g., after the list was
+     * reloaded. The flags of every tracked user are recomputed, and
+     * their recent login times are kept.
+     *
+     * @param users The users that are now exempt from the rule. The set
+     * must outlive this detector or the next switch.
+     */
+    void setAuthorizedUsers(const LookupMap& users) {
+        authorizedUsers = &users;
+        for (KeyInterner::Id id = 0; id < authorized.size(); id++) {
+            authorized[id] = users.contains(this->users.key(id));
+        }
+    }
+
+    /**
+     * Write or restore the detector with a snapshot archive (see
+     * DetectorSnapshot.h).
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        users.snapshot(ar);
+        ar.array(authorized);
+        loginTimes.snapshot(ar);
+        ar.check(authorized.size() == users.size() &&
+                 loginTimes.size() <= users.size(), "user flags");
+    }
+
+private:
+    /** The users that are exempt from the frequency rule */
+    const LookupMap* authorizedUsers;
+
+    /** The dense IDs of every user seen so far */
+    KeyInterner users;
+
+    /** Whether each user (indexed by ID) is an authorized user */
+    std::vector<bool> authorized;
+
+    /** The recent login times of each user (indexed by ID) */
+    FrequencyTracker loginTimes;
+};
+
+#endif  // FREQUENCY_WINDOW_H
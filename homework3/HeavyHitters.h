@@ -0,0 +1,337 @@
+// Copyright 2023 Evan Williams
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+/**
+ * Bounded-memory top-K summaries of the IPs and users behind the
+ * hacking attempts, built in the same pass as detection. Each summary
+ * uses the Space-Saving algorithm: it keeps a fixed number of
+ * counters, and a key that is not tracked takes over the counter with
+ * the smallest count (inheriting that count as its possible error).
+ * With c counters over n attempts:
+ *
+ *   - every key with more than n / c attempts is tracked,
+ *   - a tracked key's count is at most its error above the true count.
+ *
+ * Summaries are mergeable (e.g., one per thread or per host, combined
+ * at the end) with the same guarantees over the combined attempts, and
+ * can be saved and restored with a snapshot archive.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class SpaceSaving {
+public:
+    /** A tracked key; its true count is in [count - error, count] */
+    struct Counter {
+        std::string key;
+        std::uint64_t count, error;
+    };
+
+    /**
+     * Create an empty summary.
+     *
+     * @param capacity The number of counters kept.
+     */
+    explicit SpaceSaving(const size_t capacity = 256)
+        : capacity(std::max<size_t>(capacity, 1)) {
+        size_t size = 16;
+        while (size < this->capacity * 2) {
+            size *= 2;
+        }
+        slots.assign(size, EMPTY);
+    }
+
+    /**
+     * Count an occurrence of a key.
+     *
+     * @param key The key, e.g., an IP address or a user ID.
+     *
+     * @param weight The number of occurrences.
+     */
+    void offer(std::string_view key, const std::uint64_t weight = 1) {
+        total += weight;
+        const size_t hash = std::hash<std::string_view>()(key);
+        size_t i = hash & mask();
+        for (; slots[i] != EMPTY; i = (i + 1) & mask()) {
+            const std::uint32_t c = slots[i];
+            if (hashes[c] == hash && counters[c].key == key) {
+                counters[c].count += weight;
+                siftDown(heapPos[c]);
+                return;
+            }
+        }
+        if (counters.size() < capacity) {
+            const std::uint32_t c = static_cast<std::uint32_t>(
+                counters.size());
+            counters.push_back({std::string(key), weight, 0});
+            hashes.push_back(hash);
+            heapPos.push_back(c);
+            heap.push_back(c);
+            slots[i] = c;
+            siftUp(c);
+            return;
+        }
+        // Replace the key with the smallest count
+        const std::uint32_t c = heap[0];
+        unlink(c);
+        Counter& counter = counters[c];
+        counter.key.assign(key);
+        counter.error = counter.count;
+        counter.count += weight;
+        hashes[c] = hash;
+        link(c);
+        siftDown(0);
+    }
+
+    /**
+     * Add another summary's counts to this one. Keys that only one of
+     * the summaries tracks are assumed to have had up to the smallest
+     * count of the other (if it is full), which keeps the guarantees.
+     *
+     * @param other The summary to merge in. Its capacity may differ.
+     */
+    void merge(const SpaceSaving& other) {
+        const std::uint64_t ownMin = floorCount(), otherMin =
+            other.floorCount();
+        std::unordered_map<std::string_view, Counter> combined;
+        for (const Counter& counter : counters) {
+            combined.emplace(counter.key, Counter{counter.key,
+                counter.count + otherMin, counter.error + otherMin});
+        }
+        for (const Counter& counter : other.counters) {
+            auto [it, added] = combined.emplace(counter.key, Counter{
+                counter.key, counter.count + ownMin,
+                counter.error + ownMin});
+            if (!added) {
+                it->second.count += counter.count - otherMin;
+                it->second.error += counter.error - otherMin;
+            }
+        }
+        std::vector<Counter> kept;
+        for (auto& entry : combined) {
+            kept.push_back(std::move(entry.second));
+        }
+        sortByCount(kept);
+        kept.resize(std::min(kept.size(), capacity));
+        rebuild(std::move(kept));
+        total += other.total;
+    }
+
+    /**
+     * Obtain the k keys with the highest counts, highest first (ties in
+     * key order).
+     */
+    std::vector<Counter> top(const size_t k) const {
+        std::vector<Counter> result = counters;
+        sortByCount(result);
+        result.resize(std::min(k, result.size()));
+        return result;
+    }
+
+    /** Obtain the total of all occurrences offered (and merged) */
+    std::uint64_t size() const { return total; }
+
+    /**
+     * Write or restore the summary with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the snapshot being restored has
+     * more counters than this summary keeps.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        std::uint64_t count = counters.size();
+        ar.value(total);
+        ar.value(count);
+        if (count > capacity) {
+            throw std::runtime_error("Snapshot has a larger top-K summary");
+        }
+        std::vector<Counter> list = counters;
+        list.resize(count);
+        for (Counter& counter : list) {
+            ar.array(counter.key);
+            ar.value(counter.count);
+            ar.value(counter.error);
+        }
+        rebuild(std::move(list));
+    }
+
+private:
+    /** An unused slot of the hash table */
+    static constexpr std::uint32_t EMPTY = UINT32_MAX;
+
+    /** The mask applied to a hash to obtain a slot index */
+    size_t mask() const { return slots.size() - 1; }
+
+    /** The count any untracked key may have had (0 if not yet full) */
+    std::uint64_t floorCount() const {
+        return counters.size() < capacity ? 0 : counters[heap[0]].count;
+    }
+
+    /** Sort counters by count, highest first, then by key */
+    static void sortByCount(std::vector<Counter>& list) {
+        std::sort(list.begin(), list.end(), [](const Counter& a,
+                                               const Counter& b) {
+            return a.count != b.count ? a.count > b.count : a.key < b.key;
+        });
+    }
+
+    /** Replace every counter (the total is kept) */
+    void rebuild(std::vector<Counter> list) {
+        counters.clear();
+        hashes.clear();
+        heap.clear();
+        heapPos.clear();
+        std::fill(slots.begin(), slots.end(), EMPTY);
+        for (Counter& counter : list) {
+            const std::uint32_t c = static_cast<std::uint32_t>(
+                counters.size());
+            counters.push_back(std::move(counter));
+            hashes.push_back(std::hash<std::string_view>()(
+                counters[c].key));
+            heapPos.push_back(c);
+            heap.push_back(c);
+            link(c);
+            siftUp(c);
+        }
+    }
+
+    /** Add a counter to the hash table */
+    void link(const std::uint32_t c) {
+        size_t i = hashes[c] & mask();
+        while (slots[i] != EMPTY) {
+            i = (i + 1) & mask();
+        }
+        slots[i] = c;
+    }
+
+    /**
+     * Remove a counter from the hash table, shifting later entries of
+     * its probe run back so that no tombstones are needed.
+     */
+    void unlink(const std::uint32_t c) {
+        size_t i = hashes[c] & mask();
+        while (slots[i] != c) {
+            i = (i + 1) & mask();
+        }
+        for (size_t j = (i + 1) & mask(); slots[j] != EMPTY;
+             j = (j + 1) & mask()) {
+            // Move the entry at j into the hole at i unless its home
+            // slot lies cyclically in (i, j]
+            const size_t home = hashes[slots[j]] & mask();
+            if (((j - home) & mask()) >= ((j - i) & mask())) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = EMPTY;
+    }
+
+    /** Move a heap entry up to its place, e.g., after it was added */
+    void siftUp(size_t pos) {
+        while (pos > 0) {
+            const size_t parent = (pos - 1) / 2;
+            if (!less(heap[pos], heap[parent])) {
+                break;
+            }
+            swapHeap(pos, parent);
+            pos = parent;
+        }
+    }
+
+    /** Restore the min-heap order after a counter's count increased */
+    void siftDown(size_t pos) {
+        for (;;) {
+            size_t least = pos;
+            for (const size_t child : {2 * pos + 1, 2 * pos + 2}) {
+                if (child < heap.size() && less(heap[child], heap[least])) {
+                    least = child;
+                }
+            }
+            if (least == pos) {
+                return;
+            }
+            swapHeap(pos, least);
+            pos = least;
+        }
+    }
+
+    /** Compare two counters by count */
+    bool less(const std::uint32_t a, const std::uint32_t b) const {
+        return counters[a].count < counters[b].count;
+    }
+
+    /** Swap two heap entries and update their positions */
+    void swapHeap(const size_t a, const size_t b) {
+        std::swap(heap[a], heap[b]);
+        heapPos[heap[a]] = a;
+        heapPos[heap[b]] = b;
+    }
+
+    /** The number of counters kept */
+    const size_t capacity;
+
+    /** The counters, and the hash of each one's key */
+    std::vector<Counter> counters;
+    std::vector<size_t> hashes;
+
+    /** The counters as a min-heap by count, and each one's position */
+    std::vector<std::uint32_t> heap;
+    std::vector<size_t> heapPos;
+
+    /** The open-addressed index of the counters by key */
+    std::vector<std::uint32_t> slots;
+
+    /** The total of all occurrences */
+    std::uint64_t total = 0;
+};
+
+/**
+ * The top attacking IPs and users of a run: one summary of each over
+ * the lines reported as possible hacking attempts.
+ */
+struct TopAttackers {
+    /**
+     * Create empty summaries for a top-k report.
+     *
+     * @param k The number of IPs and users to report. Each summary keeps
+     * 10k counters (at least 100), so that the top k are reliable.
+     */
+    explicit TopAttackers(const size_t k)
+        : k(k), ips(std::max<size_t>(k * 10, 100)),
+          users(std::max<size_t>(k * 10, 100)) {}
+
+    /** Count a hacking attempt */
+    void record(std::string_view user, std::string_view ip) {
+        ips.offer(ip);
+        users.offer(user);
+    }
+
+    /** Add the attempts counted by another instance */
+    void merge(const TopAttackers& other) {
+        ips.merge(other.ips);
+        users.merge(other.users);
+    }
+
+    /** Write or restore the summaries with a snapshot archive */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        ips.snapshot(ar);
+        users.snapshot(ar);
+    }
+
+    /** The number of IPs and users reported */
+    size_t k;
+
+    SpaceSaving ips, users;
+};
+
+#endif  // HEAVY_HITTERS_H
@@ -0,0 +1,751 @@
+// Copyright 2023 Evan Williams
+#ifndef HTTP_FETCH_H
+#define HTTP_FETCH_H
+
+/**
+ * Download of logs over HTTP/1.1. All downloads are driven by
+ * asynchronous operations on an io_context, so the logs of hundreds
+ * of slow hosts can be fetched at once from one thread. The body of
+ * each response is handed to a callback as it arrives, so parsing
+ * overlaps with the transfers.
+ *
+ * Responses may be identity or chunked encoded. Several paths on one
+ * host are fetched one after another over a single keep-alive
+ * connection. If a connection drops part way through a body, the
+ * download reconnects and asks for the rest with a Range request, so
+ * nothing is downloaded twice.
+ */
+
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <cctype>
+#include <charconv>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Helper method to break down a URL into hostname, port and path.
+ * @param url A string with the given URL.
+ * @return a tuple with 3 strings.
+ * The 3 strings in the tuple are: hostname, port, and path.
+ */
+inline std::tuple<std::string,
+            std::string, std::string> breakDownURL(const std::string& url) {
+    // The values to be returned.
+    std::string hostName, port = "80", path = "/";
+    std::size_t start = url.find("//") + 2;
+    std::size_t end;
+    hostName = url.substr(start);
+    if (hostName.find(':') != std::string::npos) {
+        end = hostName.find(':');
+        port = hostName.substr(end + 1);
+        port = port.substr(0, port.find('/'));
+    } else {
+        end = hostName.find('/');
+    }
+    path = hostName.substr(hostName.find('/'));
+    hostName = hostName.substr(0, end);
+    return { hostName, port, path };
+}
+
+/**
+ * Helper method to build a GET request.
+ *
+ * @param host The host name.
+ *
+ * @param port The port, which is part of the Host header unless 80.
+ *
+ * @param path The path of the file.
+ *
+ * @param offset The body offset to resume from (0 for all of it).
+ *
+ * @param etag The ETag of the log that offset refers to, or "". If the
+ * log has changed since, the server sends all of the new log instead.
+ *
+ * @param keepAlive Whether the connection will be used for another
+ * request afterwards.
+ */
+inline std::string httpRequest(const std::string& host,
+                               const std::string& port,
+                               const std::string& path, const size_t offset,
+                               const std::string& etag, const bool keepAlive) {
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+                          (port == "80" ? "" : ":" + port) + "\r\n";
+    if (offset > 0) {
+        request += "Range: bytes=" + std::to_string(offset) + "-\r\n";
+        // Weak validators are not allowed in If-Range
+        if (!etag.empty() && etag.compare(0, 2, "W/") != 0) {
+            request += "If-Range: " + etag + "\r\n";
+        }
+    }
+    return request + (keepAlive ? "Connection: keep-alive\r\n\r\n" :
+                                  "Connection: close\r\n\r\n");
+}
+
+/** The callback that receives the pieces of a response body */
+using BodyHandler = std::function<void(std::string_view)>;
+
+/**
+ * An incremental reader of one HTTP response. Bytes are fed in as they
+ * are received, the status line and headers are parsed once complete,
+ * and the decoded body bytes are passed on. A body is delimited by its
+ * Content-Length, by chunked encoding, or by the end of the connection.
+ */
+class HttpResponseParser {
+public:
+    /**
+     * Create a parser for the response to a request.
+     *
+     * @param resumeFrom The body offset the request asked to resume
+     * from. If the server ignores the Range header and sends the whole
+     * body, the bytes before this offset are dropped.
+     *
+     * @param validator The ETag sent with the request, if any. A whole
+     * body with a different ETag (or shorter than resumeFrom) is a new
+     * log, which is passed on from its start; see bodyStart. So is a
+     * log whose 416 response gives a size below resumeFrom; see restart.
+     */
+    explicit HttpResponseParser(const size_t resumeFrom = 0,
+                                const std::string& validator = "")
+        : resumeFrom(resumeFrom), validator(validator) {}
+
+    /**
+     * Process the next bytes received from the server.
+     *
+     * @param data The bytes received.
+     *
+     * @param onBody The callback for the body bytes among them.
+     *
+     * @return False if the response is not a usable log (see error).
+     */
+    bool feed(std::string_view data, const BodyHandler& onBody) {
+        std::string rest;  // The bytes after the headers
+        while (!data.empty() && state != DONE) {
+            switch (state) {
+            case HEADER: {
+                const size_t before = line.size();
+                line.append(data);
+                // The blank line may straddle the previous and this piece
+                size_t end = line.find("\n\r\n", before > 2 ? before - 2 : 0);
+                size_t skip = 3;
+                const size_t bare = line.find("\n\n", before > 1 ?
+                                              before - 1 : 0);
+                if (bare < end) {
+                    end = bare, skip = 2;
+                }
+                if (end == std::string::npos) {
+                    return true;
+                }
+                rest = line.substr(end + skip);
+                data = rest;
+                if (!parseHeader(std::string_view(line).substr(0, end + 1))) {
+                    return false;
+                }
+                line.clear();
+                break;
+            }
+            case BODY: case CHUNK_DATA: {
+                const size_t take = (remaining < 0 ? data.size() :
+                    std::min<size_t>(remaining, data.size()));
+                deliver(data.substr(0, take), onBody);
+                data.remove_prefix(take);
+                if (remaining >= 0 && (remaining -= take) == 0) {
+                    state = (state == BODY ? DONE : CHUNK_END);
+                }
+                break;
+            }
+            default: {
+                // The chunk framing is line based
+                const size_t nl = data.find('\n');
+                line.append(data.substr(0, nl));
+                if (nl == std::string_view::npos) {
+                    return line.size() < 4096 || fail("Bad chunk framing");
+                }
+                data.remove_prefix(nl + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (!chunkLine(line)) {
+                    return false;
+                }
+                line.clear();
+            }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Check the response once the server has closed the connection.
+     *
+     * @return False if the response was cut short (see error).
+     */
+    bool finish() {
+        if (state == BODY && remaining < 0) {
+            state = DONE;  // The body was delimited by the close
+        }
+        return state == DONE || fail(state == HEADER ?
+            "Connection closed before the response headers" :
+            "Connection closed before the end of the response");
+    }
+
+    /** Determine whether the whole response has been received */
+    bool complete() const { return state == DONE; }
+
+    /**
+     * Determine whether the server will accept another request on the
+     * same connection once this response is complete.
+     */
+    bool keepAlive() const { return persistent; }
+
+    /** Obtain the reason the response was rejected, if it was */
+    const std::string& error() const { return errorMessage; }
+
+    /**
+     * Obtain the offset in the log of the first body byte passed on:
+     * resumeFrom, or 0 if the log was replaced. Valid once the headers
+     * have been parsed.
+     */
+    size_t bodyStart() const { return start; }
+
+    /** Obtain the ETag of the response, or "" if it had none */
+    const std::string& etag() const { return tag; }
+
+    /**
+     * Determine whether the server refused the range because the log
+     * was replaced by a shorter one since resumeFrom was recorded. The
+     * log must then be requested again from its start.
+     */
+    bool restart() const { return replaced; }
+
+private:
+    /** Where the parser is in the response */
+    enum State { HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER,
+                 DONE };
+
+    /** Record an error message and return false */
+    bool fail(const std::string& message) {
+        errorMessage = message;
+        return false;
+    }
+
+    /** Pass on body bytes, except for any already received earlier */
+    void deliver(std::string_view data, const BodyHandler& onBody) {
+        const size_t drop = std::min(skip, data.size());
+        skip -= drop;
+        data.remove_prefix(drop);
+        if (!data.empty()) {
+            onBody(data);
+        }
+    }
+
+    /** Handle one line of chunk framing (without its line ending) */
+    bool chunkLine(const std::string& text) {
+        switch (state) {
+        case CHUNK_SIZE: {
+            // The size is in hex and may be followed by ";extensions"
+            size_t size = 0, digits = 0;
+            for (; digits < text.size() && std::isxdigit(
+                     static_cast<unsigned char>(text[digits])); digits++) {
+                const char c = std::tolower(text[digits]);
+                size = size * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+            }
+            if (digits == 0 || digits > 15) {
+                return fail("Bad chunk size: " + text);
+            }
+            remaining = size;
+            state = (size == 0 ? TRAILER : CHUNK_DATA);
+            return true;
+        }
+        case CHUNK_END:
+            state = CHUNK_SIZE;
+            return text.empty() || fail("Missing end of chunk");
+        default:  // TRAILER: header fields until a blank line
+            state = (text.empty() ? DONE : TRAILER);
+            return true;
+        }
+    }
+
+    /**
+     * Parse the decimal number at the start of a header value.
+     *
+     * @param text The header value.
+     *
+     * @param number Set to the number, if there is one.
+     *
+     * @return The number of digits parsed, or 0 if the value does not
+     * start with a digit or the number is too large.
+     */
+    static size_t parseNumber(std::string_view text, long long& number) {
+        if (text.empty() || !std::isdigit(static_cast<unsigned char>(
+                                text[0]))) {
+            return 0;
+        }
+        const auto [end, error] = std::from_chars(text.data(),
+            text.data() + text.size(), number);
+        return error == std::errc() ? end - text.data() : 0;
+    }
+
+    /** Parse the status line and the headers that matter here */
+    bool parseHeader(std::string_view text) {
+        const size_t space = text.find(' ');
+        if (text.substr(0, 5) != "HTTP/" || space == std::string_view::npos) {
+            return fail("Not an HTTP response");
+        }
+        const std::string_view status = text.substr(space + 1, 3);
+        start = resumeFrom;
+        if (status != "200" && status != "206" &&
+            (status != "416" || resumeFrom == 0)) {
+            const size_t eol = text.find_first_of("\r\n");
+            return fail("HTTP error: " +
+                std::string(text.substr(space + 1, eol - space - 1)));
+        }
+        persistent = (text.substr(0, 8) != "HTTP/1.0");
+        bool chunked = false;
+        long long length = -1, rangeStart = -1, size = -1;
+        for (size_t pos = text.find('\n'); pos < text.size();) {
+            const size_t eol = std::min(text.find('\n', pos + 1), text.size());
+            std::string_view field = text.substr(pos + 1, eol - pos - 1);
+            pos = eol;
+            const size_t colon = field.find(':');
+            if (colon == std::string_view::npos) {
+                continue;
+            }
+            std::string name(field.substr(0, colon));
+            for (char& c : name) {
+                c = std::tolower(static_cast<unsigned char>(c));
+            }
+            field.remove_prefix(std::min(field.find_first_not_of(" \t",
+                                                 colon + 1), field.size()));
+            const std::string raw(field.substr(0,
+                                  field.find_last_not_of(" \t\r") + 1));
+            std::string value = raw;
+            for (char& c : value) {
+                c = std::tolower(static_cast<unsigned char>(c));
+            }
+            if (name == "content-length") {
+                const size_t digits = parseNumber(value, length);
+                if (digits == 0 || digits != value.size()) {
+                    return fail("Bad Content-Length: " + raw);
+                }
+            } else if (name == "transfer-encoding") {
+                chunked = (value == "chunked");
+                if (!chunked && value != "identity") {
+                    return fail("Unsupported transfer encoding: " + value);
+                }
+            } else if (name == "connection") {
+                persistent = (value == "keep-alive" ||
+                              (persistent && value != "close"));
+            } else if (name == "etag") {
+                tag = raw;
+            } else if (name == "content-range" &&
+                       value.compare(0, 8, "bytes */") == 0) {
+                // The form sent with a 416: the current size of the log
+                if (parseNumber(value.substr(8), size) == 0) {
+                    return fail("Bad Content-Range: " + raw);
+                }
+            } else if (name == "content-range" &&
+                       value.compare(0, 6, "bytes ") == 0) {
+                const size_t digits = parseNumber(value.substr(6),
+                                                  rangeStart);
+                if (digits == 0 || value.compare(6 + digits, 1, "-") != 0) {
+                    return fail("Bad Content-Range: " + raw);
+                }
+            }
+        }
+        if (status == "416") {
+            // Nothing after resumeFrom yet, unless the log is now shorter
+            // than that (or has a new ETag): then it was replaced, and is
+            // fetched again from its start. Skip any body by not reusing
+            // the connection.
+            replaced = ((size >= 0 && size_t(size) < resumeFrom) ||
+                        (!tag.empty() && !validator.empty() &&
+                         tag != validator));
+            persistent = false;
+            state = DONE;
+            return true;
+        }
+        if (status == "206" && rangeStart != long(resumeFrom)) {
+            return fail("Unexpected Content-Range in partial response");
+        }
+        if (status == "200" && resumeFrom > 0 &&
+            ((!tag.empty() && !validator.empty() && tag != validator) ||
+             (!chunked && length >= 0 && size_t(length) < resumeFrom))) {
+            start = 0;
+        }
+        skip = (status == "200" ? start : 0);
+        if (chunked) {
+            state = CHUNK_SIZE;
+        } else {
+            state = (length == 0 ? DONE : BODY);
+            remaining = length;
+            persistent = persistent && length >= 0;
+        }
+        return true;
+    }
+
+    /** The body offset that the request asked for, and its ETag */
+    size_t resumeFrom;
+    std::string validator;
+
+    /** The offset of the first body byte passed on, and the new ETag */
+    size_t start = 0;
+    std::string tag;
+
+    /** The number of body bytes still to be dropped */
+    size_t skip = 0;
+
+    /** Where the parser is in the response */
+    State state = HEADER;
+
+    /** The headers, or the chunk framing line, received so far */
+    std::string line;
+
+    /** The bytes left in the body or chunk, or -1 if read until closed */
+    long long remaining = -1;
+
+    /** Whether the connection may be reused after this response */
+    bool persistent = false;
+
+    /** Whether a 416 showed that the log was replaced */
+    bool replaced = false;
+
+    /** The reason the response was rejected, if it was */
+    std::string errorMessage;
+};
+
+/** Where to start downloading a URL, and the outcome of doing so */
+struct FetchState {
+    /** The body offset to start from; reset to 0 if the log changed */
+    size_t offset = 0;
+    /** The ETag of the log that offset refers to, or "" */
+    std::string etag;
+    /** The error that ended the download, or "" on success */
+    std::string error;
+};
+
+/**
+ * The downloads from one host. The paths are fetched in order over one
+ * connection, which is kept alive between them when the server allows.
+ * A connection that fails part way through a body is reopened and the
+ * body resumed from where it stopped, up to a number of retries.
+ */
+class HttpDownload {
+public:
+    /** The callback for the body pieces of the path with the given ID */
+    using TargetHandler = std::function<void(size_t, std::string_view)>;
+
+    /** The callback for the end of the download of the path with an ID */
+    using DoneHandler = std::function<void(size_t)>;
+
+    /** One path to be fetched */
+    struct Target {
+        /** The caller's ID for the path, passed to the body callback */
+        size_t id;
+        std::string path;
+        /** Where to start; kept up to date as the body arrives */
+        FetchState state = {};
+    };
+
+    /**
+     * Start downloading. Nothing happens until the io_context runs.
+     *
+     * @param io The io_context that drives the download.
+     *
+     * @param host The host to fetch from.
+     *
+     * @param port The port to connect to.
+     *
+     * @param paths The paths to fetch, in order.
+     *
+     * @param onBody The callback for the pieces of the bodies.
+     *
+     * @param onDone Called once a path has been fetched or given up
+     * on, if not null.
+     *
+     * @param maxRetries The number of times a path is retried (resuming
+     * where it stopped) after a connection fails.
+     */
+    HttpDownload(boost::asio::io_context& io, const std::string& host,
+                 const std::string& port,
+                 std::vector<Target> paths, TargetHandler onBody,
+                 DoneHandler onDone = nullptr, const int maxRetries = 3)
+        : host(host), port(port), resolver(io), socket(io),
+          onBody(std::move(onBody)), onDone(std::move(onDone)),
+          maxRetries(maxRetries),
+          targets(std::move(paths)) {
+        if (!targets.empty()) {
+            connect();
+        }
+    }
+
+    HttpDownload(const HttpDownload&) = delete;
+    HttpDownload& operator=(const HttpDownload&) = delete;
+
+    /** Obtain the paths and their results */
+    const std::vector<Target>& results() const { return targets; }
+
+private:
+    /** Open a new connection and send the current request on it */
+    void connect() {
+        resolver.async_resolve(host, port, [this](const auto& ec,
+                                                  const auto& endpoints) {
+            if (ec) {
+                return retry("Error resolving host: " + ec.message());
+            }
+            boost::asio::async_connect(socket, endpoints,
+                                       [this](const auto& ec, const auto&) {
+                ec ? retry("Error connecting: " + ec.message())
+                   : sendRequest();
+            });
+        });
+    }
+
+    /** Ask for the current path, from where a previous attempt stopped */
+    void sendRequest() {
+        Target& target = targets[current];
+        parser = HttpResponseParser(target.state.offset, target.state.etag);
+        started = false;
+        request = httpRequest(host, port, target.path, target.state.offset,
+                              target.state.etag,
+                              current + 1 < targets.size());
+        boost::asio::async_write(socket, boost::asio::buffer(request),
+                                 [this](const auto& ec, size_t) {
+            ec ? retry("Error sending request: " + ec.message())
+               : readMore();
+        });
+    }
+
+    /** Read the next piece of the current response */
+    void readMore() {
+        socket.async_read_some(boost::asio::buffer(buffer),
+                               [this](const auto& ec, const size_t n) {
+            Target& target = targets[current];
+            if (n > 0 && !parser.feed(std::string_view(buffer.data(), n),
+                    [this, &target](std::string_view body) {
+                        syncStart(target);
+                        target.state.offset += body.size();
+                        onBody(target.id, body);
+                    })) {
+                target.state.error = parser.error();
+                return nextTarget(false);
+            }
+            if (parser.complete() && parser.restart()) {
+                restart(target);
+            } else if (parser.complete()) {
+                syncStart(target);
+                nextTarget(parser.keepAlive());
+            } else if (ec == boost::asio::error::eof && parser.finish()) {
+                syncStart(target);
+                nextTarget(false);
+            } else if (ec) {
+                retry(ec == boost::asio::error::eof ? parser.error() :
+                      "Error reading response: " + ec.message());
+            } else {
+                readMore();
+            }
+        });
+    }
+
+    /**
+     * Take note of the log the response is for: start over at 0 if it
+     * turned out to be a new log, and remember its ETag.
+     */
+    void syncStart(Target& target) {
+        if (!started) {
+            started = true;
+            target.state.offset = parser.bodyStart();
+            if (!parser.etag().empty()) {
+                target.state.etag = parser.etag();
+            }
+        }
+    }
+
+    /** Fetch the current path again from its start, as a new log */
+    void restart(Target& target) {
+        target.state.offset = 0;
+        target.state.etag.clear();
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        connect();
+    }
+
+    /** Move on to the next path, on the same connection if possible */
+    void nextTarget(const bool reuse) {
+        retries = 0;
+        if (onDone) {
+            onDone(targets[current].id);
+        }
+        if (++current < targets.size() && reuse) {
+            return sendRequest();
+        }
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        if (current < targets.size()) {
+            connect();
+        }
+    }
+
+    /** Reconnect after a failure, or give up on the current path */
+    void retry(const std::string& message) {
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        if (retries++ < maxRetries) {
+            connect();
+        } else {
+            targets[current].state.error = message;
+            nextTarget(false);
+        }
+    }
+
+    const std::string host, port;
+    boost::asio::ip::tcp::resolver resolver;
+    boost::asio::ip::tcp::socket socket;
+    const TargetHandler onBody;
+    const DoneHandler onDone;
+    const int maxRetries;
+
+    /** The paths, the one being fetched, and its failed attempts */
+    std::vector<Target> targets;
+    size_t current = 0;
+    int retries = 0;
+
+    std::string request;
+    std::array<char, 1 << 16> buffer;
+    HttpResponseParser parser;
+
+    /** Set once syncStart has seen the current response */
+    bool started = false;
+};
+
+/**
+ * Download several URLs concurrently on one thread. URLs on the same
+ * host and port share one connection and are fetched in order.
+ *
+ * @param urls The URLs to fetch.
+ *
+ * @param states Where to start each URL (all from 0 if empty). On
+ * return, the offset and ETag at which each download ended, and its
+ * error, if any.
+ *
+ * @param onBody Called with the index of the URL and the next piece of
+ * its body, in order for each URL but interleaved across URLs.
+ *
+ * @param onDone Called with the index of each URL once its download
+ * has ended, successfully or not, if not null. Its state is only
+ * filled in on return.
+ */
+inline void fetchAll(const std::vector<std::string>& urls,
+    std::vector<FetchState>& states,
+    const std::function<void(size_t, std::string_view)>& onBody,
+    const std::function<void(size_t)>& onDone = nullptr) {
+    states.resize(urls.size());
+    // The paths to fetch from each host, in the order first seen
+    std::map<std::pair<std::string, std::string>, size_t> hostIndex;
+    std::vector<std::pair<std::string, std::string>> hosts;
+    std::vector<std::vector<HttpDownload::Target>> paths;
+    for (size_t i = 0; i < urls.size(); i++) {
+        std::string host, port, path;
+        std::tie(host, port, path) = breakDownURL(urls[i]);
+        const auto [it, added] = hostIndex.insert({{host, port},
+                                                   hosts.size()});
+        if (added) {
+            hosts.push_back({host, port});
+            paths.emplace_back();
+        }
+        paths[it->second].push_back({i, path, states[i]});
+    }
+    boost::asio::io_context io;
+    std::vector<std::unique_ptr<HttpDownload>> downloads;
+    for (size_t h = 0; h < hosts.size(); h++) {
+        downloads.push_back(std::make_unique<HttpDownload>(io,
+            hosts[h].first, hosts[h].second, paths[h], onBody, onDone));
+    }
+    io.run();
+    for (const auto& download : downloads) {
+        for (const auto& target : download->results()) {
+            states[target.id] = target.state;
+        }
+    }
+}
+
+/**
+ * Download several URLs concurrently from their start. See above.
+ *
+ * @return The error for each URL, or "" for each that succeeded.
+ */
+inline std::vector<std::string> fetchAll(const std::vector<std::string>& urls,
+    const std::function<void(size_t, std::string_view)>& onBody,
+    const std::function<void(size_t)>& onDone = nullptr) {
+    std::vector<FetchState> states;
+    fetchAll(urls, states, onBody, onDone);
+    std::vector<std::string> errors;
+    for (const FetchState& state : states) {
+        errors.push_back(state.error);
+    }
+    return errors;
+}
+
+/**
+ * A stream buffer that yields the body of one URL, so a download can
+ * be read through an std::istream. The download runs on a private
+ * io_context that is advanced whenever more data is needed, so it has
+ * the chunked decoding and resume of HttpDownload without a thread.
+ */
+class HttpStreamBuf : public std::streambuf {
+public:
+    /**
+     * Start downloading a URL.
+     *
+     * @param url The URL, e.g., http://host:8080/auth.log.
+     */
+    explicit HttpStreamBuf(const std::string& url) {
+        std::string host, port, path;
+        std::tie(host, port, path) = breakDownURL(url);
+        download = std::make_unique<HttpDownload>(io, host, port,
+            std::vector<HttpDownload::Target>{{0, path}},
+            [this](size_t, std::string_view body) { pending.append(body); });
+    }
+
+    /**
+     * Obtain the error that ended the download, or "" on success. Only
+     * meaningful once the stream has been read to its end.
+     */
+    std::string error() const {
+        return download->results()[0].state.error;
+    }
+
+protected:
+    /** Run the download until the next piece of the body is in */
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        pending.clear();
+        while (pending.empty() && io.run_one() > 0) {}
+        if (pending.empty()) {
+            return traits_type::eof();
+        }
+        current.swap(pending);
+        setg(&current[0], &current[0], &current[0] + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    boost::asio::io_context io;
+    std::unique_ptr<HttpDownload> download;
+
+    /** The body bytes received but not handed out, and those being read */
+    std::string pending, current;
+};
+
+#endif  // HTTP_FETCH_H
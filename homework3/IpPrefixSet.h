@@ -0,0 +1,318 @@
+// Copyright 2023 Evan Williams
+#ifndef IP_PREFIX_SET_H
+#define IP_PREFIX_SET_H
+
+/**
+ * A set of IPv4/IPv6 addresses and CIDR ranges (e.g. "10.1.2.0/24" or
+ * "2001:db8::/32") stored in binary form in a compressed binary radix
+ * (Patricia) trie. IPv4 addresses are stored as IPv4-mapped IPv6
+ * addresses (::ffff:a.b.c.d), so one trie holds both families and an
+ * IPv4 range also matches the mapped form of its addresses.
+ *
+ * Single addresses, which make up most of a ban feed, are kept in a
+ * flat open-addressed hash table so they cost one probe. Ranges go in
+ * the trie, where a node only exists where two stored prefixes
+ * diverge and each node is 32 bytes (two per cache line). Since the
+ * trie holds only the ranges, it stays small and cache resident.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+
+class IpPrefixSet {
+public:
+    /** An address as a 128-bit number, most significant bit first */
+    using Key = unsigned __int128;
+
+    /** Create an empty set */
+    IpPrefixSet() : nodes(1), hosts(16, Empty) {}
+
+    /**
+     * Add an address or CIDR range to the set.
+     *
+     * @param entry An address, optionally followed by "/prefixLength".
+     *
+     * @exception std::runtime_error If the entry is not a valid address
+     * or range.
+     */
+    void insert(std::string_view entry) {
+        const size_t slash = entry.find('/');
+        Key key;
+        int maxLen;
+        if (!parse(entry.substr(0, slash), key, maxLen)) {
+            throw std::runtime_error("Invalid IP address " +
+                                     std::string(entry));
+        }
+        int len = 128;
+        if (slash != std::string_view::npos) {
+            const std::string_view bits = entry.substr(slash + 1);
+            len = 0;
+            for (const char c : bits) {
+                len = (c >= '0' && c <= '9' && len <= 128) ?
+                      len * 10 + c - '0' : 999;
+            }
+            if (bits.empty() || len > maxLen) {
+                throw std::runtime_error("Invalid IP range " +
+                                         std::string(entry));
+            }
+            len += 128 - maxLen;
+        }
+        if (len == 128) {
+            insertHost(key);
+        } else {
+            insert(key & mask(len), len);
+        }
+        count++;
+    }
+
+    /**
+     * Check if an address is in the set, i.e. if it falls within any
+     * of the stored ranges.
+     *
+     * @param address The address in text form, e.g. "10.1.2.3".
+     *
+     * @return True if the address is covered by the set. Strings that
+     * are not valid addresses are never in the set.
+     */
+    bool contains(std::string_view address) const {
+        Key key;
+        int maxLen;
+        return parse(address, key, maxLen) && contains(key);
+    }
+
+    /**
+     * Check if a binary address is in the set.
+     *
+     * @param key The address as a 128-bit (IPv4-mapped if IPv4) number.
+     */
+    bool contains(const Key key) const {
+        if (key == Empty ? hasEmptyKey : findHost(key)) {
+            return true;
+        }
+        for (std::uint32_t n = 0;;) {
+            const Node& node = nodes[n];
+            if (node.stored) {
+                return true;
+            }
+            if (node.len == 128 ||
+                (n = node.child[bit(key, node.len)]) == 0 ||
+                (key & mask(nodes[n].len)) != nodes[n].prefix) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Obtain the number of entries added to the set.
+     */
+    size_t size() const { return count; }
+
+    /**
+     * Convert an address in text form to a 128-bit number. Dotted-quad
+     * IPv4 addresses are converted directly; anything else is handed
+     * to boost::asio::ip::make_address.
+     *
+     * @param text The address to be converted.
+     *
+     * @param key The converted address.
+     *
+     * @param maxLen Set to 32 for an IPv4 address and 128 for IPv6.
+     *
+     * @return True if the text was a valid address.
+     */
+    static bool parse(std::string_view text, Key& key, int& maxLen) {
+        if (parseIPv4(text, key)) {
+            maxLen = 32;
+            return true;
+        }
+        if (text.find(':') == std::string_view::npos) {
+            return false;
+        }
+        boost::system::error_code ec;
+        const auto addr = boost::asio::ip::make_address(
+            boost::asio::string_view(text.data(), text.size()), ec);
+        if (ec || !addr.is_v6()) {
+            return false;
+        }
+        key = 0;
+        for (const unsigned char byte : addr.to_v6().to_bytes()) {
+            key = key << 8 | byte;
+        }
+        maxLen = 128;
+        return true;
+    }
+
+private:
+    /** A node of the trie covering the first len bits of prefix */
+    struct Node {
+        Key prefix = 0;
+        std::uint32_t child[2] = {0, 0};
+        std::uint8_t len = 0;
+        bool stored = false;
+    };
+
+    /** The marker for an unused slot in hosts */
+    static constexpr Key Empty = ~Key(0);
+
+    /** Return the starting slot in hosts for a key */
+    size_t hostSlot(const Key key) const {
+        const std::uint64_t mix = static_cast<std::uint64_t>(key >> 64) *
+            0x9e3779b97f4a7c15ULL ^ static_cast<std::uint64_t>(key);
+        return (mix * 0xff51afd7ed558ccdULL >> 32) & (hosts.size() - 1);
+    }
+
+    /** Check if a single address is in the hosts table */
+    bool findHost(const Key key) const {
+        for (size_t i = hostSlot(key);; i = (i + 1) & (hosts.size() - 1)) {
+            if (hosts[i] == key) {
+                return true;
+            } else if (hosts[i] == Empty) {
+                return false;
+            }
+        }
+    }
+
+    /** Add a single address to the hosts table */
+    void insertHost(const Key key) {
+        if (key == Empty) {
+            hasEmptyKey = true;
+            return;
+        }
+        if (findHost(key)) {
+            return;
+        }
+        // Keep the load factor at or below 1/2 so probe runs stay short
+        if (++hostCount * 2 > hosts.size()) {
+            std::vector<Key> old(hosts.size() * 2, Empty);
+            old.swap(hosts);
+            for (const Key k : old) {
+                if (k != Empty) {
+                    size_t i = hostSlot(k);
+                    while (hosts[i] != Empty) {
+                        i = (i + 1) & (hosts.size() - 1);
+                    }
+                    hosts[i] = k;
+                }
+            }
+        }
+        size_t i = hostSlot(key);
+        while (hosts[i] != Empty) {
+            i = (i + 1) & (hosts.size() - 1);
+        }
+        hosts[i] = key;
+    }
+
+    /** Return a mask with the first len (0-128) bits set */
+    static Key mask(const int len) {
+        return len == 0 ? Key(0) : ~Key(0) << (128 - len);
+    }
+
+    /** Return bit i (0 is the most significant) of key */
+    static int bit(const Key key, const int i) {
+        return static_cast<int>(key >> (127 - i)) & 1;
+    }
+
+    /** Return the number of leading bits that two keys share */
+    static int commonBits(const Key a, const Key b) {
+        const Key diff = a ^ b;
+        const std::uint64_t hi = static_cast<std::uint64_t>(diff >> 64);
+        const std::uint64_t lo = static_cast<std::uint64_t>(diff);
+        return hi ? __builtin_clzll(hi) : lo ? 64 + __builtin_clzll(lo) : 128;
+    }
+
+    /**
+     * Convert a dotted-quad IPv4 address to its IPv4-mapped IPv6 form
+     * without any allocation.
+     */
+    static bool parseIPv4(std::string_view text, Key& key) {
+        std::uint32_t addr = 0;
+        int octets = 0, digits = 0, value = 0;
+        for (const char c : text) {
+            if (c >= '0' && c <= '9' && digits < 3) {
+                value = value * 10 + c - '0';
+                digits++;
+            } else if (c == '.' && digits > 0 && octets < 3) {
+                addr = addr << 8 | value;
+                octets++;
+                digits = value = 0;
+            } else {
+                return false;
+            }
+            if (value > 255) {
+                return false;
+            }
+        }
+        if (octets != 3 || digits == 0) {
+            return false;
+        }
+        key = Key(0xffff) << 32 | (addr << 8 | value);
+        return true;
+    }
+
+    /**
+     * Add a prefix (whose bits past len are zero) to the trie.
+     */
+    void insert(const Key prefix, const int len) {
+        for (std::uint32_t n = 0;;) {
+            if (nodes[n].len == len) {
+                nodes[n].stored = true;
+                return;
+            }
+            const int side = bit(prefix, nodes[n].len);
+            const std::uint32_t c = nodes[n].child[side];
+            if (c == 0) {
+                nodes[n].child[side] = addNode(prefix, len, true);
+                return;
+            }
+            const int common = std::min({commonBits(prefix, nodes[c].prefix),
+                                         int(nodes[c].len), len});
+            if (common == nodes[c].len) {
+                n = c;
+                continue;
+            }
+            // The new prefix diverges partway along the edge to c, so
+            // split the edge with a node at the point of divergence.
+            const std::uint32_t mid = addNode(prefix & mask(common), common,
+                                              common == len);
+            nodes[mid].child[bit(nodes[c].prefix, common)] = c;
+            if (common != len) {
+                nodes[mid].child[bit(prefix, common)] =
+                    addNode(prefix, len, true);
+            }
+            nodes[n].child[side] = mid;
+            return;
+        }
+    }
+
+    /** Append a node to the trie and return its index */
+    std::uint32_t addNode(const Key prefix, const int len, const bool stored) {
+        Node node;
+        node.prefix = prefix;
+        node.len = static_cast<std::uint8_t>(len);
+        node.stored = stored;
+        nodes.push_back(node);
+        return static_cast<std::uint32_t>(nodes.size() - 1);
+    }
+
+    /** The nodes of the trie; node 0 is the root (the empty prefix) */
+    std::vector<Node> nodes;
+
+    /** Open-addressed table of single addresses (a power of 2 in size) */
+    std::vector<Key> hosts;
+
+    /** The number of addresses in hosts */
+    size_t hostCount = 0;
+
+    /** True if the all-ones address (used as the Empty marker) is set */
+    bool hasEmptyKey = false;
+
+    /** The number of entries added to the set */
+    size_t count = 0;
+};
+
+#endif  // IP_PREFIX_SET_H
@@ -0,0 +1,186 @@
+// Copyright 2023 Evan Williams
+#ifndef KEY_INTERNER_H
+#define KEY_INTERNER_H
+
+/**
+ * A string interning table that maps each distinct key (a user ID or
+ * an IP address) to a dense integer ID, starting at 0. Per-key state
+ * can then be kept in plain vectors indexed by ID rather than in maps
+ * keyed by heap-allocated strings.
+ *
+ * The table uses open addressing with linear probing over a flat array
+ * of IDs, and the key text is stored back-to-back in one buffer, so a
+ * lookup touches a few contiguous cache lines and never allocates.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class KeyInterner {
+public:
+    /** The ID type handed out for keys */
+    using Id = std::uint32_t;
+
+    /** The value returned by find for a key that is not in the table */
+    static constexpr Id NotFound = UINT32_MAX;
+
+    /**
+     * Create an empty table.
+     *
+     * @param capacity The number of keys to size the table for.
+     */
+    explicit KeyInterner(const size_t capacity = 64) {
+        size_t size = 16;
+        while (size < capacity * 2) {
+            size *= 2;
+        }
+        slots.assign(size, NotFound);
+    }
+
+    /**
+     * Look up a key without adding it.
+     *
+     * @param key The key to look up.
+     *
+     * @return The ID of the key, or NotFound.
+     */
+    Id find(std::string_view key) const {
+        const size_t hash = std::hash<std::string_view>()(key);
+        for (size_t i = hash & mask();; i = (i + 1) & mask()) {
+            const Id id = slots[i];
+            if (id == NotFound ||
+                (hashes[id] == hash && this->key(id) == key)) {
+                return id;
+            }
+        }
+    }
+
+    /**
+     * Return the ID of a key, adding the key with the next ID if it is
+     * not yet in the table.
+     *
+     * @param key The key to be interned.
+     *
+     * @return The ID of the key.
+     */
+    Id intern(std::string_view key) {
+        const size_t hash = std::hash<std::string_view>()(key);
+        size_t i = hash & mask();
+        for (; slots[i] != NotFound; i = (i + 1) & mask()) {
+            const Id id = slots[i];
+            if (hashes[id] == hash && this->key(id) == key) {
+                return id;
+            }
+        }
+        const Id id = static_cast<Id>(hashes.size());
+        slots[i] = id;
+        hashes.push_back(hash);
+        offsets.push_back(static_cast<std::uint32_t>(text.size()));
+        text.append(key);
+        offsets.push_back(static_cast<std::uint32_t>(text.size()));
+        // Keep the load factor at or below 1/2 so probe runs stay short
+        if (hashes.size() * 2 > slots.size()) {
+            rehash();
+        }
+        return id;
+    }
+
+    /**
+     * Obtain the text of an interned key. The view is invalidated by
+     * the next call to intern.
+     *
+     * @param id The ID of the key.
+     */
+    std::string_view key(const Id id) const {
+        const std::uint32_t start = offsets[id * 2];
+        return std::string_view(text.data() + start, offsets[id * 2 + 1] -
+                                start);
+    }
+
+    /**
+     * Check if a key is in the table.
+     */
+    bool contains(std::string_view key) const {
+        return find(key) != NotFound;
+    }
+
+    /**
+     * Obtain the number of distinct keys in the table. IDs are always
+     * in the range [0, size()).
+     */
+    size_t size() const { return hashes.size(); }
+
+    /**
+     * Write or restore the table with a snapshot archive (see
+     * DetectorSnapshot.h). The arrays are stored as they are, so a
+     * restored table needs no rehashing.
+     *
+     * @exception std::runtime_error If the arrays being restored are
+     * not a valid table.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        ar.array(slots);
+        ar.array(hashes);
+        ar.array(offsets);
+        ar.array(text);
+        ar.check(valid(), "key table");
+    }
+
+private:
+    /** The mask applied to a hash to obtain a slot index */
+    size_t mask() const { return slots.size() - 1; }
+
+    /**
+     * Check that the table is usable: a power of 2 of slots, with some
+     * left empty so a probe ends, IDs in range, and each key's text
+     * within the text buffer.
+     */
+    bool valid() const {
+        if (slots.empty() || (slots.size() & mask()) != 0 ||
+            hashes.size() >= slots.size() ||
+            offsets.size() != hashes.size() * 2) {
+            return false;
+        }
+        for (const Id id : slots) {
+            if (id != NotFound && id >= hashes.size()) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < offsets.size(); i += 2) {
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > text.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** Double the number of slots and reinsert every ID */
+    void rehash() {
+        slots.assign(slots.size() * 2, NotFound);
+        for (Id id = 0; id < hashes.size(); id++) {
+            size_t i = hashes[id] & mask();
+            while (slots[i] != NotFound) {
+                i = (i + 1) & mask();
+            }
+            slots[i] = id;
+        }
+    }
+
+    /** The open-addressed table of IDs (a power of 2 in size) */
+    std::vector<Id> slots;
+
+    /** The full hash of each key, indexed by ID */
+    std::vector<size_t> hashes;
+
+    /** The start and end of each key in text, two entries per ID */
+    std::vector<std::uint32_t> offsets;
+
+    /** The text of all keys, back-to-back */
+    std::string text;
+};
+
+#endif  // KEY_INTERNER_H
@@ -0,0 +1,242 @@
+// Copyright 2023 Evan Williams
+#ifndef LINE_SPLITTER_H
+#define LINE_SPLITTER_H
+
+/**
+ * Splitting log text into lines and the first words of each line in
+ * one pass, 64 bytes at a time. Each 64-byte block is turned into two
+ * bit masks, one of newlines and one of whitespace, with SIMD compares
+ * (AVX2 if the compiler targets it, e.g., with -mavx2 or
+ * -march=native, otherwise SSE2, or a plain loop on other CPUs). The
+ * word boundaries of the block are then the bits where the whitespace
+ * mask changes, so a line's words are found with a count-trailing-
+ * zeros per boundary instead of a test per byte, and the rest of a
+ * line after the words a format needs costs nothing beyond its block's
+ * masks.
+ *
+ * Whitespace is the same set of characters as isLogSpace. The last
+ * partial block of the text is copied into a buffer padded with
+ * spaces, so nothing past the text is ever read.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/** The instruction set scanBlock was compiled for */
+#if defined(__AVX2__)
+constexpr const char* BLOCK_SCAN_ISA = "AVX2";
+#elif defined(__SSE2__)
+constexpr const char* BLOCK_SCAN_ISA = "SSE2";
+#else
+constexpr const char* BLOCK_SCAN_ISA = "scalar";
+#endif
+
+/** The newline and whitespace bits of a 64-byte block (bit i = byte i) */
+struct BlockMasks {
+    std::uint64_t newlines, spaces;
+};
+
+/**
+ * Helper method to compute the masks of the 64 bytes at p, all of
+ * which must be readable.
+ */
+inline BlockMasks scanBlock(const char* p) {
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n'),
+        space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'),
+        four = _mm256_set1_epi8(4);
+    BlockMasks masks = {0, 0};
+    for (int half = 0; half < 2; half++) {
+        const __m256i bytes = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(p + 32 * half));
+        // \t, \n, \v, \f, and \r are 9 to 13
+        const __m256i control = _mm256_sub_epi8(bytes, tab);
+        const __m256i isSpace = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control),
+            _mm256_cmpeq_epi8(bytes, space));
+        masks.newlines |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, newline)))) << (32 * half);
+        masks.spaces |= std::uint64_t(std::uint32_t(
+            _mm256_movemask_epi8(isSpace))) << (32 * half);
+    }
+    return masks;
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' '),
+        tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    BlockMasks masks = {0, 0};
+    for (int quarter = 0; quarter < 4; quarter++) {
+        const __m128i bytes = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(p + 16 * quarter));
+        // \t, \n, \v, \f, and \r are 9 to 13
+        const __m128i control = _mm_sub_epi8(bytes, tab);
+        const __m128i isSpace = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(control, four), control),
+            _mm_cmpeq_epi8(bytes, space));
+        masks.newlines |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(
+            _mm_cmpeq_epi8(bytes, newline)))) << (16 * quarter);
+        masks.spaces |= std::uint64_t(std::uint16_t(
+            _mm_movemask_epi8(isSpace))) << (16 * quarter);
+    }
+    return masks;
+#else
+    BlockMasks masks = {0, 0};
+    for (int i = 0; i < 64; i++) {
+        const unsigned char c = p[i];
+        masks.newlines |= std::uint64_t(c == '\n') << i;
+        masks.spaces |= std::uint64_t(c == ' ' || (c >= 9 && c <= 13)) << i;
+    }
+    return masks;
+#endif
+}
+
+/**
+ * The first whitespace-separated words of a line, as offsets from the
+ * start of the line: word i is [bounds[2i], bounds[2i + 1]).
+ */
+struct LineWords {
+    /** The most words a line is split into */
+    static constexpr size_t MAX = 11;
+
+    std::uint32_t bounds[2 * MAX];
+    /** The number of bounds found (twice the number of words) */
+    std::uint32_t boundCount = 0;
+
+    /** Obtain the number of words found */
+    size_t size() const { return boundCount / 2; }
+
+    /** Obtain the start of word i */
+    size_t start(const size_t i) const { return bounds[2 * i]; }
+
+    /** Obtain word i of the line the words were found in */
+    std::string_view word(std::string_view line, const size_t i) const {
+        return line.substr(bounds[2 * i], bounds[2 * i + 1] - bounds[2 * i]);
+    }
+};
+
+/**
+ * Splits text into lines, and each line into its first Words words.
+ *
+ * @tparam Words The number of words wanted per line, at most
+ * LineWords::MAX. With 0, the text is only split into lines.
+ */
+template <size_t Words>
+class LineSplitter {
+    static_assert(Words <= LineWords::MAX, "Too many words per line");
+
+public:
+    /**
+     * Start splitting the text at the given position, which must be
+     * the start of a line.
+     */
+    LineSplitter(std::string_view text, const size_t pos)
+        : text(text), pos(pos) {
+        if (pos < text.size()) {
+            load(pos, 1);
+        }
+    }
+
+    /**
+     * Find the next line and its words.
+     *
+     * @param line Set to the line, without its newline. A final line
+     * without a newline is a line too.
+     *
+     * @param words Set to the first words of the line.
+     *
+     * @return False at the end of the text.
+     */
+    bool next(std::string_view& line, LineWords& words) {
+        if (pos >= text.size()) {
+            return false;
+        }
+        const size_t start = pos;
+        std::uint32_t n = 0;
+        for (;;) {
+            const std::uint64_t live = ~std::uint64_t(0) << (pos - base);
+            const std::uint64_t newline = masks.newlines & live;
+            // The bits up to and including the newline, which ends a word
+            const std::uint64_t upTo = newline ?
+                ((newline & -newline) << 1) - 1 : ~std::uint64_t(0);
+            // Each change of the whitespace mask starts or ends a word
+            for (std::uint64_t edges = changes & live & upTo;
+                 edges != 0 && n < 2 * Words; edges &= edges - 1) {
+                words.bounds[n++] = static_cast<std::uint32_t>(
+                    base + __builtin_ctzll(edges) - start);
+            }
+            if (newline != 0) {
+                const size_t end = base + __builtin_ctzll(newline);
+                line = text.substr(start, end - start);
+                pos = end + 1;
+                if (pos - base == 64 && pos < text.size()) {
+                    load(pos, 1);
+                }
+                break;
+            }
+            if (base + 64 >= text.size()) {
+                // The padding (if any) ended the last word
+                if (n % 2 != 0) {
+                    words.bounds[n++] = static_cast<std::uint32_t>(
+                        text.size() - start);
+                }
+                line = text.substr(start);
+                pos = text.size();
+                break;
+            }
+            load(base + 64, masks.spaces >> 63);
+            pos = base;
+        }
+        words.boundCount = n;
+        return true;
+    }
+
+    /** Obtain the position after the last line found */
+    size_t position() const { return pos; }
+
+private:
+    /**
+     * Compute the masks of the block at the given position.
+     *
+     * @param spaceBefore 1 if the byte before the block is whitespace
+     * (or the block starts a line).
+     */
+    void load(const size_t at, const std::uint64_t spaceBefore) {
+        base = at;
+        if (text.size() - at >= 64) {
+            masks = scanBlock(text.data() + at);
+        } else {
+            char padded[64];
+            std::memset(padded, ' ', sizeof(padded));
+            std::memcpy(padded, text.data() + at, text.size() - at);
+            masks = scanBlock(padded);
+        }
+        changes = masks.spaces ^ ((masks.spaces << 1) | spaceBefore);
+    }
+
+    /** The text, and where the next line starts */
+    std::string_view text;
+    size_t pos;
+
+    /** The position of the current block, and its masks */
+    size_t base = 0;
+    BlockMasks masks = {0, 0};
+    std::uint64_t changes = 0;
+};
+
+/**
+ * Helper method to split a single line into its first Words words.
+ *
+ * @param line The line, without its newline.
+ */
+template <size_t Words>
+void splitWords(std::string_view line, LineWords& words) {
+    LineSplitter<Words> splitter(line, 0);
+    if (!splitter.next(line, words)) {
+        words.boundCount = 0;
+    }
+}
+
+#endif  // LINE_SPLITTER_H
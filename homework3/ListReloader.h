@@ -0,0 +1,301 @@
+// Copyright 2023 Evan Williams
+#ifndef LIST_RELOADER_H
+#define LIST_RELOADER_H
+
+/**
+ * The banned-IP and authorized-user lists, and hot reloading of them
+ * for long-running (follow) deployments. A background thread watches
+ * both files with inotify and builds a complete new set of lists
+ * whenever one of them is rewritten. The new set is published with a
+ * single atomic pointer store (RCU style): detection threads pick it up
+ * with one atomic load and never take a lock, and an old set is freed
+ * only after every detection thread has moved on from it.
+ */
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrequencyWindow.h"
+#include "IpPrefixSet.h"
+
+/**
+ * Helper method to load data from a given file into an unordered map.
+ *
+ * @param fileName The file name from words are are to be read by this
+ * method. The parameter value is typically "authorized_users.txt" or
+ * "banned_ips.txt".
+ *
+ * @return Return an interned key set with the entries in the file.
+ */
+inline LookupMap loadLookup(const std::string& fileName) {
+    // Open the file and check to ensure that the stream is valid
+    std::ifstream is(fileName);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + fileName);
+    }
+    // The look up map to be populated by this method.
+    LookupMap lookup;
+    // Load the entries into the unordered map
+    for (std::string entry; is >> entry;) {
+        lookup.intern(entry);
+    }
+    // Return the loaded unordered map back to the caller.
+    return lookup;
+}
+
+/**
+ * Helper method to load banned IP addresses and CIDR ranges from a
+ * given file into a binary prefix set.
+ *
+ * @param fileName The file name from which addresses are to be read,
+ * typically "banned_ips.txt". Entries are whitespace-separated and
+ * are either a single IPv4/IPv6 address or a range such as
+ * "10.1.0.0/16".
+ *
+ * @return Return a prefix set with the addresses in the file.
+ */
+inline IpPrefixSet loadBannedIPs(const std::string& fileName) {
+    std::ifstream is(fileName);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + fileName);
+    }
+    IpPrefixSet banned;
+    for (std::string entry; is >> entry;) {
+        banned.insert(entry);
+    }
+    return banned;
+}
+
+/**
+ * One immutable version of both lists. Generations are numbered from 1
+ * and each reload that succeeds gets the next number.
+ */
+struct LookupLists {
+    IpPrefixSet bannedIPs;
+    LookupMap authorizedUsers;
+    uint64_t generation;
+};
+
+/** A file descriptor that is closed when its owner goes away */
+class OwnedFd {
+public:
+    explicit OwnedFd(const int fd) : fd(fd) {}
+    ~OwnedFd() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    OwnedFd(const OwnedFd&) = delete;
+    OwnedFd& operator=(const OwnedFd&) = delete;
+
+    /** Obtain the descriptor, or -1 if it failed to open */
+    int get() const { return fd; }
+
+private:
+    const int fd;
+};
+
+class ListReloader {
+public:
+    /**
+     * Load the lists and start watching their files.
+     *
+     * @param bannedFile The banned IPs file, e.g., "banned_ips.txt".
+     *
+     * @param authorizedFile The authorized users file.
+     *
+     * @param readers The number of detection threads that will call
+     * acquire, each with its own index.
+     *
+     * @exception std::runtime_error If either file cannot be loaded
+     * now, or inotify cannot be set up or cannot watch the directory of
+     * either file (so reloading would silently never happen).
+     */
+    ListReloader(const std::string& bannedFile,
+                 const std::string& authorizedFile, const size_t readers = 1)
+        : bannedFile(bannedFile), authorizedFile(authorizedFile),
+          notifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+          readerCount(readers),
+          readerGenerations(new std::atomic<uint64_t>[readers]) {
+        if (notifyFd.get() == -1) {
+            throw std::runtime_error(std::string("Error setting up "
+                                     "inotify: ") + std::strerror(errno));
+        }
+        for (size_t r = 0; r < readerCount; r++) {
+            readerGenerations[r] = 0;
+        }
+        // Editors and deploy tools often replace a file by renaming a
+        // new one over it, so the directories are watched, not the files
+        for (const std::string* file : {&bannedFile, &authorizedFile}) {
+            if (inotify_add_watch(notifyFd.get(), directory(*file).c_str(),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+                throw std::runtime_error("Error watching " +
+                    directory(*file) + ": " + std::strerror(errno));
+            }
+        }
+        published = load(1).release();
+        watcher = std::thread([this] { watch(); });
+    }
+
+    /** Stop watching and free every version of the lists */
+    ~ListReloader() {
+        stop = true;
+        watcher.join();
+        for (const LookupLists* lists : retired) {
+            delete lists;
+        }
+        delete published.load();
+    }
+
+    ListReloader(const ListReloader&) = delete;
+    ListReloader& operator=(const ListReloader&) = delete;
+
+    /**
+     * Obtain the lists a detection thread should use from now on. This
+     * is one atomic load (plus a store when the lists have changed), so
+     * it can be called for every line. The returned lists stay valid
+     * until the same reader calls acquire again.
+     *
+     * @param reader The index of the calling detection thread.
+     */
+    const LookupLists& acquire(const size_t reader = 0) {
+        const LookupLists* lists = published.load(std::memory_order_acquire);
+        std::atomic<uint64_t>& seen = readerGenerations[reader];
+        if (seen.load(std::memory_order_relaxed) != lists->generation) {
+            // Tells the watcher that older versions are no longer used
+            seen.store(lists->generation, std::memory_order_release);
+        }
+        return *lists;
+    }
+
+    /** Obtain the generation of the lists currently published */
+    uint64_t generation() const {
+        return published.load(std::memory_order_acquire)->generation;
+    }
+
+private:
+    /** The directory of a file, for watching it */
+    static std::string directory(const std::string& file) {
+        const size_t slash = file.rfind('/');
+        return slash == std::string::npos ? "." :
+               slash == 0 ? "/" : file.substr(0, slash);
+    }
+
+    /** The name of a file within its directory */
+    static std::string baseName(const std::string& file) {
+        return file.substr(file.rfind('/') + 1);
+    }
+
+    /** Build a new version of the lists from the files */
+    std::unique_ptr<LookupLists> load(const uint64_t generation) const {
+        return std::unique_ptr<LookupLists>(new LookupLists{
+            loadBannedIPs(bannedFile), loadLookup(authorizedFile),
+            generation});
+    }
+
+    /**
+     * The watcher thread: reload when either file is rewritten, and free
+     * old versions once no reader uses them.
+     */
+    void watch() {
+        while (!stop) {
+            struct pollfd pfd = {notifyFd.get(), POLLIN, 0};
+            if (poll(&pfd, 1, 200) > 0 && listsChanged()) {
+                // Let a burst of writes (e.g., both files) settle first
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                listsChanged();
+                reload();
+            }
+            reclaim();
+        }
+    }
+
+    /** Drain the inotify events and report whether one was for a list */
+    bool listsChanged() {
+        const std::string names[] = {baseName(bannedFile),
+                                     baseName(authorizedFile)};
+        bool changed = false;
+        alignas(inotify_event) char events[4096];
+        for (ssize_t n; (n = read(notifyFd.get(), events,
+                                  sizeof(events))) > 0;) {
+            for (ssize_t pos = 0; pos < n;) {
+                const auto* event =
+                    reinterpret_cast<const inotify_event*>(events + pos);
+                if (event->len > 0 && (event->name == names[0] ||
+                                       event->name == names[1])) {
+                    changed = true;
+                }
+                pos += sizeof(inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+
+    /** Publish a new version, or keep the current one if loading fails */
+    void reload() {
+        const LookupLists* current = published.load();
+        try {
+            std::unique_ptr<LookupLists> lists = load(current->generation + 1);
+            retired.push_back(published.exchange(lists.release(),
+                                                 std::memory_order_acq_rel));
+            std::cerr << "Reloaded " << bannedFile << " and " << authorizedFile
+                      << " (generation " << current->generation + 1 << ")\n";
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Keeping generation " << current->generation
+                      << " of the lists: " << e.what() << '\n';
+        }
+    }
+
+    /** Free the retired versions that every reader has moved past */
+    void reclaim() {
+        uint64_t oldestInUse = UINT64_MAX;
+        for (size_t r = 0; r < readerCount; r++) {
+            oldestInUse = std::min(oldestInUse,
+                readerGenerations[r].load(std::memory_order_acquire));
+        }
+        std::vector<const LookupLists*> kept;
+        for (const LookupLists* lists : retired) {
+            if (lists->generation < oldestInUse) {
+                delete lists;
+            } else {
+                kept.push_back(lists);
+            }
+        }
+        retired.swap(kept);
+    }
+
+    /** The files the lists are loaded from */
+    const std::string bannedFile, authorizedFile;
+
+    /** The inotify instance watching the files' directories */
+    const OwnedFd notifyFd;
+
+    /** The current version of the lists */
+    std::atomic<const LookupLists*> published;
+
+    /** The generation each reader last acquired (0 before the first) */
+    const size_t readerCount;
+    std::unique_ptr<std::atomic<uint64_t>[]> readerGenerations;
+
+    /** Replaced versions that a reader may still be using */
+    std::vector<const LookupLists*> retired;
+
+    std::atomic<bool> stop = false;
+    std::thread watcher;
+};
+
+#endif  // LIST_RELOADER_H
@@ -0,0 +1,333 @@
+// Copyright 2023 Evan Williams
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+/**
+ * The log formats LoginSentry can read. Each format is a scanner type
+ * with the same members, and the detectors (BasicSentry,
+ * BasicSourceParser, processChunksParallel) take the scanner as a
+ * template parameter, so each format gets its own copy of the hot loop
+ * with the scanner inlined and no per-line test of the format. The
+ * format is picked once, by name, with withLogFormat.
+ *
+ * A scanner has:
+ *
+ *   NAME         The name given to --log-format.
+ *   SPANS_LINES  True if a login depends on earlier lines (such as
+ *                the other fields of a journal record), so the log
+ *                cannot be split into chunks for several threads.
+ *   WORDS        How many leading words of each line the scanner
+ *                uses; the LineSplitter finds them along with the
+ *                line (see LineSplitter.h).
+ *   scan         Fill in the user and IP (and timestamp fields) of a
+ *                line from the line and its words, and return true if
+ *                the line is a login.
+ *   time         Convert the timestamp of the line just scanned.
+ *   snapshot     Write or restore any state kept between lines.
+ *
+ * The formats:
+ *
+ *   sshd    Syslog lines (classic or RFC 3339 timestamps) whose
+ *           message is one of sshd's authentication results (see
+ *           scanSshdMessage). Other lines are counted but not checked.
+ *   fields  The original fixed layout: any line with at least 11
+ *           words is a login, with the user in word 8 and the IP in
+ *           word 10 (see LogTokenizer.h).
+ *   export  The output of "journalctl -o export": records of
+ *           KEY=value lines separated by a blank line. The MESSAGE
+ *           line is checked, with the record's __REALTIME_TIMESTAMP.
+ *   json    The output of "journalctl -o json": a JSON object per
+ *           line with the MESSAGE and __REALTIME_TIMESTAMP keys.
+ *
+ * Journal fields stored in binary form (e.g., a MESSAGE that is not
+ * valid UTF-8) are skipped, and the user and IP of a JSON message are
+ * taken as they appear, without undoing escapes.
+ */
+
+#include <string>
+#include <string_view>
+#include "LineSplitter.h"
+#include "LogTokenizer.h"
+#include "SyslogTime.h"
+
+/** Helper method to test if a view starts with a prefix */
+inline bool startsWith(std::string_view text, std::string_view prefix) {
+    return text.size() >= prefix.size() &&
+           text.compare(0, prefix.size(), prefix) == 0;
+}
+
+/**
+ * Find the user and IP in an sshd message that reports the result of
+ * an authentication attempt:
+ *
+ *   Failed <method> for [invalid user ]<user> from <ip> port <n> ssh2
+ *   Accepted <method> for <user> from <ip> port <n> ssh2[: <key>]
+ *
+ * The method may be password, publickey, keyboard-interactive/pam,
+ * none, and so on. A user name may contain spaces, so the IP follows
+ * the last " from ". A message folded by rsyslog into "message repeated
+ * N times: [ ... ]" is one login. Other sshd messages ("Invalid user",
+ * "Connection closed by", pam_unix's "authentication failure", ...)
+ * repeat an attempt that is logged by one of the lines above, or
+ * precede any attempt, so they are not logins.
+ *
+ * @param message The message, after the syslog tag.
+ *
+ * @param fields The structure whose user and ip are set.
+ *
+ * @return True if the message is an authentication result.
+ */
+inline bool scanSshdMessage(std::string_view message, LogFields& fields) {
+    if (startsWith(message, "message repeated ")) {
+        const size_t open = message.find("[ ");
+        if (open == std::string_view::npos) {
+            return false;
+        }
+        message.remove_prefix(open + 2);
+    }
+    if (startsWith(message, "Failed ")) {
+        message.remove_prefix(7);
+    } else if (startsWith(message, "Accepted ")) {
+        message.remove_prefix(9);
+    } else {
+        return false;
+    }
+    const size_t method = message.find(' ');
+    if (method == std::string_view::npos ||
+        message.compare(method, 5, " for ") != 0) {
+        return false;
+    }
+    message.remove_prefix(method + 5);
+    if (startsWith(message, "invalid user ")) {
+        message.remove_prefix(13);
+    }
+    const size_t from = message.rfind(" from ");
+    if (from == std::string_view::npos) {
+        return false;
+    }
+    fields.user = message.substr(0, from);
+    message.remove_prefix(from + 6);
+    fields.ip = message.substr(0, message.find(' '));
+    return !fields.ip.empty();
+}
+
+/**
+ * Helper method to convert a journal timestamp (microseconds since
+ * Epoch, in decimal) to a time.
+ *
+ * @return False if the text is not a number.
+ */
+inline bool parseMicroseconds(std::string_view digits, LogTime& time) {
+    if (digits.empty() || digits.size() > 18) {
+        return false;
+    }
+    long micros = 0;
+    for (const char c : digits) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        micros = micros * 10 + (c - '0');
+    }
+    time = {micros / 1000000, micros % 1000000 * 1000};
+    return true;
+}
+
+/** Syslog lines whose message is an sshd authentication result */
+struct SshdFormat {
+    static constexpr const char* NAME = "sshd";
+    static constexpr bool SPANS_LINES = false;
+    static constexpr size_t WORDS = LineWords::MAX;
+
+    bool scan(std::string_view line, const LineWords& words,
+              LogFields& fields) {
+        fields = LogFields{};
+        if (words.size() == 0) {
+            return false;
+        }
+        // The timestamp, the host, the tag (e.g., "sshd[123]:"), and
+        // the first word of the message
+        size_t message = 3;
+        fields.time = words.word(line, 0);
+        if (!isRfc3339(fields.time)) {
+            fields.month = fields.time;
+            fields.day = (words.size() > 1 ? words.word(line, 1) : "");
+            fields.time = (words.size() > 2 ? words.word(line, 2) : "");
+            message = 5;
+        }
+        if (words.size() <= message) {
+            return false;
+        }
+        // Most messages are "Failed|Accepted <method> for <user> from
+        // <ip> ...", which the words already give
+        const std::string_view result = words.word(line, message);
+        if (words.size() > message + 5 &&
+            (result == "Failed" || result == "Accepted") &&
+            words.word(line, message + 2) == "for" &&
+            words.word(line, message + 4) == "from") {
+            fields.user = words.word(line, message + 3);
+            fields.ip = words.word(line, message + 5);
+            return true;
+        }
+        return scanSshdMessage(line.substr(words.start(message)), fields);
+    }
+
+    LogTime time(TimestampParser& parser, const LogFields& fields) const {
+        return parser.toTime(fields.month, fields.day, fields.time);
+    }
+
+    template <class Archive>
+    void snapshot(Archive&) {}
+};
+
+/** The original fixed layout of whitespace-separated words */
+struct FieldsFormat {
+    static constexpr const char* NAME = "fields";
+    static constexpr bool SPANS_LINES = false;
+    static constexpr size_t WORDS = IP + 1;
+
+    /** The same fields as tokenizeLine, from the words */
+    bool scan(std::string_view line, const LineWords& words,
+              LogFields& fields) {
+        fields = LogFields{};
+        if (words.size() == 0) {
+            return false;
+        }
+        // An RFC 3339 timestamp is one word for three
+        size_t shift = 0;
+        fields.time = words.word(line, 0);
+        if (isRfc3339(fields.time)) {
+            shift = TIME;
+        } else if (words.size() > TIME) {
+            fields.month = fields.time;
+            fields.day = words.word(line, DAY);
+            fields.time = words.word(line, TIME);
+        }
+        if (words.size() <= IP - shift) {
+            return false;
+        }
+        fields.user = words.word(line, USER - shift);
+        fields.ip = words.word(line, IP - shift);
+        return true;
+    }
+
+    LogTime time(TimestampParser& parser, const LogFields& fields) const {
+        return parser.toTime(fields.month, fields.day, fields.time);
+    }
+
+    template <class Archive>
+    void snapshot(Archive&) {}
+};
+
+/**
+ * The records of "journalctl -o export". The timestamp of the record
+ * being read is kept until the blank line that ends it.
+ */
+struct JournalExportFormat {
+    static constexpr const char* NAME = "export";
+    static constexpr bool SPANS_LINES = true;
+    static constexpr size_t WORDS = 0;
+
+    bool scan(std::string_view line, const LineWords&, LogFields& fields) {
+        fields = LogFields{};
+        if (line.empty()) {
+            recordTime = {-1, 0};
+        } else if (startsWith(line, "MESSAGE=")) {
+            return recordTime.seconds >= 0 &&
+                   scanSshdMessage(line.substr(8), fields);
+        } else if (startsWith(line, "__REALTIME_TIMESTAMP=") &&
+                   !parseMicroseconds(line.substr(21), recordTime)) {
+            recordTime = {-1, 0};
+        }
+        return false;
+    }
+
+    LogTime time(TimestampParser&, const LogFields&) const {
+        return recordTime;
+    }
+
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        ar.value(recordTime.seconds);
+        ar.value(recordTime.nanos);
+    }
+
+private:
+    /** The timestamp of the current record, or -1 seconds if none */
+    LogTime recordTime = {-1, 0};
+};
+
+/** The objects of "journalctl -o json", one per line */
+struct JournalJsonFormat {
+    static constexpr const char* NAME = "json";
+    static constexpr bool SPANS_LINES = false;
+    static constexpr size_t WORDS = 0;
+
+    bool scan(std::string_view line, const LineWords&, LogFields& fields) {
+        fields = LogFields{};
+        const std::string_view message = value(line, "\"MESSAGE\":\"");
+        if (message.empty() || !scanSshdMessage(message, fields)) {
+            return false;
+        }
+        fields.time = value(line, "\"__REALTIME_TIMESTAMP\":\"");
+        return !fields.time.empty();
+    }
+
+    LogTime time(TimestampParser&, const LogFields& fields) const {
+        LogTime time = {0, 0};
+        parseMicroseconds(fields.time, time);
+        return time;
+    }
+
+    template <class Archive>
+    void snapshot(Archive&) {}
+
+private:
+    /**
+     * Find the string value after a key (given with its quotes and the
+     * colon) and return it without its quotes, or an empty view.
+     */
+    static std::string_view value(std::string_view line,
+                                  std::string_view key) {
+        const size_t start = line.find(key);
+        if (start == std::string_view::npos) {
+            return {};
+        }
+        for (size_t i = start + key.size(); i < line.size(); i++) {
+            if (line[i] == '\\') {
+                i++;
+            } else if (line[i] == '"') {
+                return line.substr(start + key.size(),
+                                   i - start - key.size());
+            }
+        }
+        return {};
+    }
+};
+
+/**
+ * Call an action with a default-constructed scanner of the named
+ * format, e.g., to run the detector compiled for that format.
+ *
+ * @param name The name of the format (see above).
+ *
+ * @param action A generic callable taking the scanner.
+ *
+ * @return False if there is no format with that name.
+ */
+template <class Action>
+bool withLogFormat(const std::string& name, Action&& action) {
+    if (name == SshdFormat::NAME) {
+        action(SshdFormat());
+    } else if (name == FieldsFormat::NAME) {
+        action(FieldsFormat());
+    } else if (name == JournalExportFormat::NAME) {
+        action(JournalExportFormat());
+    } else if (name == JournalJsonFormat::NAME) {
+        action(JournalJsonFormat());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#endif  // LOG_FORMAT_H
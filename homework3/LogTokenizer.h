@@ -0,0 +1,99 @@
+// Copyright 2023 Evan Williams
+#ifndef LOG_TOKENIZER_H
+#define LOG_TOKENIZER_H
+
+/**
+ * A small, allocation-free tokenizer for sshd log lines. Rather than
+ * building an std::istringstream per line and copying every word into
+ * an std::string, the tokenizer walks the line once and records
+ * std::string_view slices into the caller's line buffer for the only
+ * fields LoginSentry actually uses.
+ */
+
+#include <string_view>
+
+/** The whitespace-separated field positions of a typical sshd line:
+ *
+ *   Aug 29 11:01:01 host sshd[123]: Failed password for bob from 1.2.3.4
+ *   0   1  2        3    4          5      6        7   8   9    10
+ *
+ * An RFC 3339 timestamp (e.g., from rsyslog's high-precision format)
+ * is a single word that stands for fields 0 to 2.
+ */
+enum LogField { MONTH = 0, DAY = 1, TIME = 2, USER = 8, IP = 10 };
+
+/**
+ * The fields extracted from a single log line. The views point into
+ * the buffer passed to tokenizeLine and are only valid while that
+ * buffer is alive and unchanged. For an RFC 3339 timestamp, month and
+ * day are empty and time is the whole timestamp (see SyslogTime.h).
+ */
+struct LogFields {
+    std::string_view month, day, time, user, ip;
+};
+
+/**
+ * Helper method to test for the same whitespace characters that
+ * operator>> skips over (in the "C" locale).
+ */
+inline bool isLogSpace(const char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+           c == '\v' || c == '\f';
+}
+
+/**
+ * Helper method to tell an RFC 3339 timestamp, such as
+ * "2021-06-10T03:32:36.123456+02:00", from a month name.
+ */
+inline bool isRfc3339(std::string_view word) {
+    return word.size() >= 20 && word[4] == '-' && (word[10] | 0x20) == 't';
+}
+
+/**
+ * Split a log line on runs of whitespace and extract the month, day,
+ * time, user, and IP fields as views into the line. Scanning stops
+ * as soon as the IP field (the last one needed) has been found.
+ *
+ * @param line The log line to be tokenized.
+ *
+ * @param fields The structure to be filled in. Fields not present in
+ * a short line are set to empty views.
+ *
+ * @return True if the line had all fields through the IP address.
+ */
+inline bool tokenizeLine(std::string_view line, LogFields& fields) {
+    fields = LogFields{};
+    const char *pos = line.data(), *const end = pos + line.size();
+    for (int field = 0; field <= IP; field++) {
+        while (pos != end && isLogSpace(*pos)) {
+            pos++;
+        }
+        if (pos == end) {
+            return false;
+        }
+        const char *start = pos;
+        while (pos != end && !isLogSpace(*pos)) {
+            pos++;
+        }
+        const std::string_view word(start, pos - start);
+        switch (field) {
+        case MONTH:
+            if (isRfc3339(word)) {
+                // One word for the whole timestamp
+                fields.time = word;
+                field = TIME;
+            } else {
+                fields.month = word;
+            }
+            break;
+        case DAY:   fields.day   = word; break;
+        case TIME:  fields.time  = word; break;
+        case USER:  fields.user  = word; break;
+        case IP:    fields.ip    = word; break;
+        default: break;
+        }
+    }
+    return true;
+}
+
+#endif  // LOG_TOKENIZER_H
@@ -12,212 +12,223 @@
 
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <map>
+#include <memory>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <boost/asio.hpp>
+#include "AlertWriter.h"
+#include "Decompressor.h"
+#include "DetectorSnapshot.h"
+#include "FileFollower.h"
+#include "HttpFetch.h"
+#include "IpPrefixSet.h"
+#include "ListReloader.h"
+#include "LogFormat.h"
+#include "MappedFile.h"
+#include "MergedSentry.h"
+#include "ParallelSentry.h"
+#include "PipelinedSentry.h"
+#include "PollState.h"
+#include "RuleEngine.h"
+#include "Sentry.h"
 
 // Convenience namespace declarations to streamline the code below
 using namespace boost::asio;
 using namespace boost::asio::ip;
 using namespace std;
 
-/** Synonym for an unordered map that is used to track banned IPs and 
- * authorized users. For example, the key in this map would be IP addresses
- * and the value is just a place holder (is always set to true).
- */
-using LookupMap = std::unordered_map<std::string, bool>;
-
 /**
- * An unordered map to track the seconds for each log entry associated
- * with each user. The user ID is the key into this unordered map.
- * The values is a list of timestamps of log entries associated with
- * an user. For example, if a user "bob" has 3 login at "Aug 29 11:01:01",
- * "Aug 29 11:01:02", and "Aug 29 11:01:03" (one second apart each), then
- * logins["bill"] will be a vector with values {1630249261, 1630249262, 
- * 1630249263}. 
- */
-using LoginTimes = std::unordered_map<std::string, std::vector<long>>;
-
-/**
- * Helper method to load data from a given file into an unordered map.
- * 
- * @param fileName The file name from words are are to be read by this 
- * method. The parameter value is typically "authorized_users.txt" or
- * "banned_ips.txt".
- * 
- * @return Return an unordered map with the 
+ * Process login logs from a stream that may be gzip or zstd compressed
+ * and detect possible hacking attempts due to login by a banned IP
+ * address or by excessive login frequency from a single unauthorized
+ * user (or whichever threshold rules are given). Decompression (if
+ * needed) runs on its own thread alongside parsing. With one thread
+ * for detection, reading, parsing, and detection are still separate
+ * pipeline stages (see PipelinedSentry.h).
+ *
+ * @param source The stream with the (possibly compressed) log data.
+ * @param bannedIPs The banned IP addresses and ranges.
+ * @param authorizedUsers The users exempt from the frequency rule.
+ * @param rules The threshold rules. Only the default rules can be
+ * checked with several threads.
+ * @param threads The number of threads to use for parsing/detection.
+ * @param alerts The writer to which detections are reported.
+ * @param lateness How many seconds a login may arrive out of order and
+ * still be checked in order, or 0.
+ * @param stats Set to the counters of the pipeline, if not null.
  */
-LookupMap loadLookup(const std::string& fileName) {
-    // Open the file and check to ensure that the stream is valid
-    std::ifstream is(fileName);
-    if (!is.good()) {
-        throw std::runtime_error("Error opening file " + fileName);
+template <class Format>
+void processStream(std::istream& source, const IpPrefixSet& bannedIPs,
+    const LookupMap& authorizedUsers, const RuleSet& rules,
+    const size_t threads, AlertWriter& alerts, const long lateness = 0,
+    PipelineStats* stats = nullptr) {
+    LogInput input(source);
+    if (threads > 1) {
+        processLogsParallel<Format>(input.stream(), bannedIPs,
+            authorizedUsers, threads, alerts, lateness);
+    } else {
+        const PipelineStats counters = processLogsPipelined<Format>(
+            input.stream(), bannedIPs, authorizedUsers, rules, alerts,
+            lateness);
+        if (stats) {
+            *stats = counters;
+        }
     }
-    // The look up map to be populated by this method.
-    LookupMap lookup;
-    // Load the entries into the unordered map
-    for (std::string entry; is >> entry;) {
-        lookup[entry] = true;
+    if (!input.error().empty()) {
+        std::cerr << input.error() << '\n';
     }
-    // Return the loaded unordered map back to the caller.
-    return lookup;
 }
 
 /**
- * This method is used to convert a timestamp of the form "Jun 10
- * 03:32:36" to seconds since Epoch (i.e., 1970-01-01 00:00:00). This
- * method assumes by default, the year is 2021.
- *
- * \param[in] timestamp The timestamp to be converted to seconds.  The
- * timestamp must be in the format "Month day Hour:Minutes:Seconds",
- * e.g. "Jun 10 03:32:36".
+ * Process the login logs in a local file, which is memory-mapped and
+ * scanned in place rather than read through a stream. Compressed
+ * files are decompressed from the mapping as they are scanned.
  *
- * \param[in] year An optional year associated with the date. By
- * default this value is assumed to be 2021.
- *
- * \return This method returns the seconds elapsed since Epoch.
+ * @param path The path to the log file.
+ * @param bannedIPs The banned IP addresses and ranges.
+ * @param authorizedUsers The users exempt from the frequency rule.
+ * @param rules The threshold rules (see processStream).
+ * @param threads The number of threads to use.
+ * @param alerts The writer to which detections are reported.
+ * @param lateness The lateness bound for reordering (see processStream).
+ * @param stats Set to the counters of the pipeline of a compressed
+ * file, if not null (see processStream).
  */
-long toSeconds(const std::string& timestamp, const int year = 2021) {
-    // Initialize the time structure with specified year.
-    struct tm tstamp = { .tm_year = year - 1900 };
-    // Now parse out the values from the supplied timestamp
-    strptime(timestamp.c_str(), "%B %d %H:%M:%S", &tstamp);
-    // Use helper method to return seconds since Epoch
-    return mktime(&tstamp);
+template <class Format>
+void processFile(const std::string& path, const IpPrefixSet& bannedIPs,
+    const LookupMap& authorizedUsers, const RuleSet& rules,
+    const size_t threads, AlertWriter& alerts, const long lateness = 0,
+    PipelineStats* stats = nullptr) {
+    const MappedFile file(path);
+    const auto codec = DecompressingBuf::detect(
+        reinterpret_cast<const unsigned char*>(file.data().data()),
+        file.data().size());
+    if (codec != DecompressingBuf::PLAIN) {
+        ViewBuf buf(file.data());
+        std::istream is(&buf);
+        processStream<Format>(is, bannedIPs, authorizedUsers, rules, threads,
+                              alerts, lateness, stats);
+    } else if (threads > 1) {
+        processLogsParallel<Format>(file.data(), bannedIPs, authorizedUsers,
+                                    threads, alerts, lateness);
+    } else {
+        BasicSentry<Format> sentry(bannedIPs, authorizedUsers, alerts, rules,
+                                   lateness);
+        sentry.checkLines(file.data());
+        sentry.finish();
+        sentry.printSummary();
+    }
 }
 
+/** Set by SIGINT or SIGTERM to end follow mode */
+std::atomic<bool> stopFollowing(false);
+
 /**
- * Helper method to setup a TCP stream for downloading data from an
- * web-server.
- * 
- * @param host The host name of the web-server. Host names can be of
- * the from "www.miamioh.edu" or "ceclnx01.cec.miamioh.edu".  This
- * information is typically extracted from a given URL.
- *
- * @param path The path to the file being download.  An example of
- * this value is ""
- *
- * @param socket The TCP stream (aka socket) to be setup by this
- * method.  After a successful call to this method, this stream will
- * contain the response from the web-server to be processed.
- *
- * @param port An optional port number. The default port number is "80"
- *
+ * The state kept in follow mode's snapshots: the detector and how far
+ * the log file has been checked.
  */
-void setupDownload(const std::string& hostName, const std::string& path,
-                   tcp::iostream& data, const std::string& port = "80") {
-    // Create a boost socket and request the log file from the server.
-    data.connect(hostName, port);
-    data << "GET "   << path     << " HTTP/1.1\r\n"
-         << "Host: " << hostName << "\r\n"
-         << "Connection: Close\r\n\r\n";
-}
+template <class Format>
+struct FollowState {
+    BasicSentry<Format>& sentry;
+    ino_t inode;
+    off_t offset;
+
+    /** Write or restore the state with a snapshot archive */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        sentry.snapshot(ar);
+        ar.value(inode);
+        ar.value(offset);
+    }
+};
 
 /**
- * Helper method to detect hacking due to a login time violation.
- * Specifically if there are over 3 login attempts by a single 
- * user ID within a 20 second period.
+ * Watch a local log file and check lines as they are appended, until
+ * interrupted. One Sentry is used throughout, so the frequency rule
+ * catches bursts that span several reads or a log rotation. Alerts
+ * are flushed after every read, so they appear within milliseconds.
+ *
+ * With a snapshot file, the detector state and the position in the
+ * log are restored at startup and saved every snapshotInterval and at
+ * exit, so a burst that spans a restart is still caught and no line
+ * is checked twice.
  *
- * @param loginTimes - Unordered map containing login time records for each user.
- * @param authorizedUsers - Unordered map containing authorizedUser IDs to be
- *                          referenced.
- * @param userID - User ID to be checked for a login time violation.
+ * The banned-IP and authorized-user lists come from a ListReloader,
+ * so edits to either file take effect from the next line checked.
  *
- * @return True if there is a violation. False if not.
+ * With a lateness bound, a login is checked once a login that many
+ * seconds newer has been appended. Held logins are kept in the
+ * snapshot, or checked at exit if there is none.
+ *
+ * @param path The path to the log file, e.g., /var/log/auth.log.
+ * @param lists The reloadable banned-IP and authorized-user lists.
+ * @param rules The threshold rules to be checked.
+ * @param alerts The writer to which detections are reported.
+ * @param lateness The lateness bound for reordering, or 0.
+ * @param snapshotFile The snapshot file, or "" for none.
+ * @param snapshotInterval The time between snapshots.
  */
-bool frequencyHacking(LoginTimes& loginTimes,
-    const LookupMap& authorizedUsers, const std::string& userID) {
-    bool isViolation = false;
-    if (authorizedUsers.find(userID) == authorizedUsers.end()) {
-        if (loginTimes[userID].size() > 3) {
-            size_t i = loginTimes[userID].size() - 1;
-            if (loginTimes[userID][i] - loginTimes[userID][i - 3] <= 20) {
-                isViolation = true;
+template <class Format>
+void followFile(const std::string& path, ListReloader& lists,
+    const RuleSet& rules, AlertWriter& alerts, const long lateness = 0,
+    const std::string& snapshotFile = "",
+    const std::chrono::seconds snapshotInterval = std::chrono::seconds(10)) {
+    std::signal(SIGINT, [](int) { stopFollowing = true; });
+    std::signal(SIGTERM, [](int) { stopFollowing = true; });
+    const LookupLists* active = &lists.acquire();
+    auto sentry = std::make_unique<BasicSentry<Format>>(active->bannedIPs,
+        active->authorizedUsers, alerts, rules, lateness,
+        TimestampParser::CLOCK_YEAR);
+    FileFollower follower(path);
+    if (!snapshotFile.empty()) {
+        FollowState<Format> saved = {*sentry, 0, 0};
+        try {
+            if (loadSnapshot(snapshotFile, saved)) {
+                follower.resume(saved.inode, saved.offset);
             }
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Ignoring " << snapshotFile << ": " << e.what()
+                      << '\n';
+            sentry = std::make_unique<BasicSentry<Format>>(
+                active->bannedIPs, active->authorizedUsers, alerts, rules,
+                lateness, TimestampParser::CLOCK_YEAR);
         }
+        // The authorized flags in the snapshot may predate the list
+        sentry->useLists(active->bannedIPs, active->authorizedUsers);
     }
-    return isViolation;
-}
-
-/**
- * Helper method to fill out an unordered map with the login time
- * records for each user ID.
- * 
- * @param month - Strings containing the month
- * @param day - Strings containing the day
- * @param time - Strings containing the time
- * @param userID - Strings containing the userID
- */
-void loginTime(const std::string& month, const std::string& day,
-    const std::string& time, const std::string& userID,
-    LoginTimes& loginTimes) {
-    std::string timeStamp = month + " " + day + " " + time;
-    long seconds = toSeconds(timeStamp);
-    if (loginTimes.find(userID) == loginTimes.end()) {
-        std::vector<long> vec = {seconds};
-        loginTimes[userID] = vec;
-    } else {
-        loginTimes[userID].push_back(seconds);
-    }
-}
-/**
- * Process login logs and detects possible hacking attempts due to 
- * login by a banned IP address or by excessive login frequency from
- * a single unauthorized user.
- * 
- * Print the results of the hack detection
- */
-void processLogs(std::istream& is, const LookupMap& bannedIPs,
-    const LookupMap& authorizedUsers) {
-    std::string line, month, day, time, userID, ip, dummy;
-    int lineCount = 0, hackCount = 0;
-    LoginTimes loginTimes;
-    while (std::getline(is, line)) {
-        std::istringstream(line) >> month >> day >> time >> dummy >> dummy
-            >> dummy >> dummy >> dummy >> userID >> dummy >> ip;
-        if (bannedIPs.find(ip) != bannedIPs.end()) {
-            hackCount++;
-            std::cout << "Hacking due to banned IP. Line: " << line << '\n';
-        } else {
-            loginTime(month, day, time, userID, loginTimes);
-            if (frequencyHacking(loginTimes, authorizedUsers, userID)) {
-                hackCount++;
-                std::cout << "Hacking due to frequency. Line: " << line << '\n';
-            }
+    const auto save = [&] {
+        FollowState<Format> state = {*sentry, follower.fileInode(),
+                                     follower.position()};
+        saveSnapshot(snapshotFile, state);
+    };
+    auto lastSnapshot = std::chrono::steady_clock::now();
+    follower.run([&](std::string_view line) {
+        const LookupLists& current = lists.acquire();
+        if (&current != active) {
+            active = &current;
+            sentry->useLists(current.bannedIPs, current.authorizedUsers);
         }
-        lineCount++;
-    }
-    std::cout << "Processed " << lineCount << " lines. Found " << hackCount
-        << " possible hacking attempts." << '\n';
-}
-
-/**
- * Helper method to break down a URL into hostname, port and path.
- * @param url A string with the given URL.
- * @return a tuple with 3 strings. 
- * The 3 strings in the tuple are: hostname, port, and path.
- */
-std::tuple<std::string, 
-            std::string, std::string> breakDownURL(const std::string& url) {
-    // The values to be returned.
-    std::string hostName, port = "80", path = "/";
-    std::size_t start = url.find("//") + 2;
-    std::size_t end;
-    hostName = url.substr(start);
-    if (hostName.find(':') != std::string::npos) {
-        end = hostName.find(':');
-        port = hostName.substr(end + 1);
-        port = port.substr(0, port.find('/'));
+        sentry->checkLine(line);
+    }, [&] {
+        alerts.flush();
+        const auto now = std::chrono::steady_clock::now();
+        if (!snapshotFile.empty() && now - lastSnapshot >= snapshotInterval) {
+            save();
+            lastSnapshot = now;
+        }
+    }, stopFollowing);
+    if (!snapshotFile.empty()) {
+        save();
     } else {
-        end = hostName.find('/');
+        sentry->finish();
     }
-    path = hostName.substr(hostName.find('/'));
-    hostName = hostName.substr(0, end);
-    return { hostName, port, path };
+    sentry->printSummary();
 }
 
 /**
@@ -225,27 +236,136 @@ std::tuple<std::string,
  * log entries from the given URL and detect potential hacking attempts.
  *
  * \param[in] argc The number of command-line arguments.  This program
- * requires exactly one command-line argument.
+ * requires one command-line argument (the URL) plus optional flags.
  *
- * \param[in] argv The actual command-line argument. This should be an URL.
+ * \param[in] argv The actual command-line arguments. This should be an
+ * URL, optionally preceded by "--threads N" to process the logs with
+ * N worker threads. A local file can be given instead of the URL with
+ * "--file path" or a "file://" URL. "--format json" or "--format tsv"
+ * selects a machine-readable output format. "--rules file" replaces
+ * the frequency rule with the threshold rules in a config file.
+ * "--top K" reports the K IPs and users with the most possible hacking
+ * attempts before the totals. "--lateness S" checks logins in timestamp
+ * order even if they arrive up to S seconds out of order, and reports
+ * how many arrived later than that. "--log-format name" reads logs in
+ * another format than sshd's syslog lines: "fields", "export", or
+ * "json" (see LogFormat.h). "--stats" prints the queue depths and
+ * waits of the pipeline stages to cerr at the end (see
+ * PipelinedSentry.h).
  */
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    std::string file, format = "text", stateFile, snapshotFile, rulesFile,
+        logFormat = SshdFormat::NAME;
+    std::vector<std::string> urls;
+    size_t threads = 1, topCount = 0;
+    long lateness = 0;
+    bool follow = false, showStats = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (arg == "--follow") {
+            follow = true;
+        } else if (arg == "--stats") {
+            showStats = true;
+        } else if (arg == "--file" && i + 1 < argc) {
+            file = argv[++i];
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshotFile = argv[++i];
+        } else if (arg == "--top" && i + 1 < argc) {
+            topCount = std::stoul(argv[++i]);
+        } else if (arg == "--lateness" && i + 1 < argc) {
+            lateness = std::stol(argv[++i]);
+        } else if (arg == "--log-format" && i + 1 < argc) {
+            logFormat = argv[++i];
+        } else if (arg == "--rules" && i + 1 < argc) {
+            rulesFile = argv[++i];
+        } else if (arg == "--state" && i + 1 < argc) {
+            stateFile = argv[++i];
+        } else if (arg == "--urls" && i + 1 < argc) {
+            std::ifstream list(argv[++i]);
+            for (std::string url; list >> url;) {
+                urls.push_back(url);
+            }
+        } else if (arg.rfind("file://", 0) == 0) {
+            file = arg.substr(7);
+        } else {
+            urls.push_back(arg);
+        }
+    }
+    if (urls.empty() && file.empty()) {
         std::cout << "Specify URL from where logs are to be obtained.\n";
         return 1;
     }
-    const std::string url = argv[1];
-    tcp::iostream is;  // stream to read ssh logs
-    std::string host, port, path;
-    std::tie(host, port, path) = breakDownURL(url);
-    setupDownload(host, path, is);
-    // Skips over html lines
-    for (std::string hdr; std::getline(is, hdr) && !hdr.empty()
-            && hdr != "\r";) {
+    const RuleSet rules = (rulesFile.empty() ? defaultRules() :
+                           loadRules(rulesFile));
+    if (!rulesFile.empty() && threads > 1) {
+        // The worker threads shard users, so per-IP rules cannot be split
+        std::cerr << "--rules is checked on one thread; ignoring --threads\n";
+        threads = 1;
+    }
+    AlertWriter alerts(STDOUT_FILENO, AlertWriter::parseFormat(format));
+    if (topCount > 0) {
+        alerts.trackTop(topCount);
+    }
+    if (lateness > 0) {
+        alerts.trackLate(lateness);
+    }
+    if (follow && file.empty()) {
+        std::cout << "--follow needs a local file (--file path).\n";
+        return 1;
+    }
+    if (!follow) {
+        // Output is the last stage of the pipeline (see AlertWriter.h)
+        alerts.writeInBackground();
+    }
+    PipelineStats stats;
+    // The rest is compiled once per log format
+    const bool known = withLogFormat(logFormat, [&](auto scanner) {
+        using Format = decltype(scanner);
+        if (Format::SPANS_LINES && threads > 1) {
+            std::cerr << "--log-format " << logFormat << " is checked on one "
+                      << "thread; ignoring --threads\n";
+            threads = 1;
+        }
+        if (follow) {
+            ListReloader lists("banned_ips.txt", "authorized_users.txt");
+            followFile<Format>(file, lists, rules, alerts, lateness,
+                               snapshotFile);
+            return;
+        }
+        IpPrefixSet bannedIPs = loadBannedIPs("banned_ips.txt");
+        LookupMap authorizedUsers = loadLookup("authorized_users.txt");
+        if (!file.empty()) {
+            processFile<Format>(file, bannedIPs, authorizedUsers, rules,
+                                threads, alerts, lateness, &stats);
+        } else if (!stateFile.empty()) {
+            pollUrls<Format>(urls, stateFile, bannedIPs, authorizedUsers,
+                             rules, alerts, lateness);
+        } else if (urls.size() > 1) {
+            processUrls<Format>(urls, bannedIPs, authorizedUsers, rules,
+                                alerts, lateness);
+        } else {
+            HttpStreamBuf download(urls[0]);
+            std::istream is(&download);
+            processStream<Format>(is, bannedIPs, authorizedUsers, rules,
+                                  threads, alerts, lateness, &stats);
+            if (!download.error().empty()) {
+                std::cerr << urls[0] << ": " << download.error() << '\n';
+            }
+        }
+    });
+    if (!known) {
+        std::cout << "Unknown log format " << logFormat << ".\n";
+        return 1;
+    }
+    if (showStats) {
+        alerts.stopBackground();
+        stats.output = alerts.outputStats();
+        stats.print(std::cerr);
     }
-    LookupMap bannedIPs = loadLookup("banned_ips.txt");
-    LookupMap authorizedUsers = loadLookup("authorized_users.txt");
-    processLogs(is, bannedIPs, authorizedUsers);
     return 0;
 }
 
@@ -0,0 +1,1633 @@
+// Copyright 2023 Evan Williams
+/**
+ * Micro-benchmarks for the helpers used by LoginSentry. Each benchmark
+ * runs over a synthetic sshd log generated in memory so that results
+ * are not skewed by disk or network I/O.
+ *
+ * Usage: ./LoginSentryBench [benchmark] [lineCount]
+ *
+ * With no benchmark name, all benchmarks are run.
+ */
+
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "AlertWriter.h"
+#include "Decompressor.h"
+#include "DistinctSketch.h"
+#include "DetectorSnapshot.h"
+#include "FileFollower.h"
+#include "FrequencyWindow.h"
+#include "HttpFetch.h"
+#include "IpPrefixSet.h"
+#include "KeyInterner.h"
+#include "LineSplitter.h"
+#include "ListReloader.h"
+#include "LogFormat.h"
+#include "LogTokenizer.h"
+#include "MappedFile.h"
+#include "MergedSentry.h"
+#include "ParallelSentry.h"
+#include "PipelinedSentry.h"
+#include "RuleEngine.h"
+#include "Sentry.h"
+#include "SyntheticLog.h"
+#include "SyslogTime.h"
+#include "TestLogServer.h"
+
+using namespace std;
+
+/** The clock used to time the benchmarks */
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Helper method to run an operation in a child process and return how
+ * far the child's resident set size peaked above what it started
+ * with, so that each measurement starts from a clean heap and does not
+ * include the memory the benchmarks before it left in this process.
+ *
+ * @param op The operation to run in the child.
+ *
+ * @return The growth of the child's peak RSS in megabytes.
+ */
+double peakRssMB(const std::function<void()>& op) {
+    // The resident set of this process in kB, current or peak
+    const auto residentKB = [](const std::string& field) {
+        std::ifstream status("/proc/self/status");
+        long kb = 0;
+        for (std::string name; status >> name;) {
+            if (name == field) {
+                status >> kb;
+            }
+        }
+        return kb;
+    };
+    std::cout.flush();
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // Reset the peak the child inherited, which is this process's
+        std::ofstream("/proc/self/clear_refs") << "5";
+        const long startKB = residentKB("VmRSS:");
+        op();
+        std::cout.flush();
+        const long growthKB = residentKB("VmHWM:") - startKB;
+        _exit(write(fds[1], &growthKB, sizeof(growthKB)) < 0);
+    }
+    long growthKB = 0;
+    if (read(fds[0], &growthKB, sizeof(growthKB)) < 0) {
+        growthKB = 0;
+    }
+    waitpid(pid, nullptr, 0);
+    close(fds[0]);
+    close(fds[1]);
+    return growthKB / 1024.0;
+}
+
+/**
+ * Helper method to time a callable and print its throughput in lines
+ * per second and MB per second.
+ *
+ * @param name The label to print for this run.
+ *
+ * @param lines The number of lines processed by one call to op.
+ *
+ * @param bytes The number of bytes processed by one call to op.
+ *
+ * @param op The operation to be timed.
+ *
+ * @return The elapsed time in seconds.
+ */
+double timeIt(const std::string& name, const size_t lines, const size_t bytes,
+              const std::function<void()>& op) {
+    const auto start = Clock::now();
+    op();
+    const double secs =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "  " << name << ": " << secs << " s, "
+              << static_cast<long>(lines / secs) << " lines/s, "
+              << bytes / secs / 1e6 << " MB/s\n";
+    return secs;
+}
+
+/** A file descriptor for discarding benchmark output */
+const int devNull = open("/dev/null", O_WRONLY);
+
+/** A sink for benchmark results to keep the optimizer honest */
+volatile size_t sink = 0;
+
+/**
+ * Helper method to tokenize every line of a log up front, so that
+ * benchmarks of later stages do not include the tokenizer.
+ */
+std::vector<LogFields> tokenizeAll(const std::string& log) {
+    std::vector<LogFields> lines;
+    for (size_t pos = 0, end; pos < log.size(); pos = end + 1) {
+        end = log.find('\n', pos);
+        tokenizeLine(std::string_view(log).substr(pos, end - pos),
+                     lines.emplace_back());
+    }
+    return lines;
+}
+
+/**
+ * Compare the original per-line istringstream field extraction with
+ * the string_view based tokenizeLine.
+ */
+void benchTokenizer(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount);
+    std::cout << "tokenizer (" << lineCount << " lines)\n";
+    const double oldSecs = timeIt("istringstream", lineCount, log.size(),
+                                  [&] {
+        std::istringstream is(log);
+        std::string line, month, day, time, userID, ip, dummy;
+        size_t total = 0;
+        while (std::getline(is, line)) {
+            std::istringstream(line) >> month >> day >> time >> dummy
+                >> dummy >> dummy >> dummy >> dummy >> userID >> dummy >> ip;
+            total += month.size() + day.size() + time.size() +
+                     userID.size() + ip.size();
+        }
+        sink = total;
+    });
+    const double newSecs = timeIt("tokenizeLine", lineCount, log.size(), [&] {
+        std::istringstream is(log);
+        std::string line;
+        LogFields fields;
+        size_t total = 0;
+        while (std::getline(is, line)) {
+            tokenizeLine(line, fields);
+            total += fields.month.size() + fields.day.size() +
+                     fields.time.size() + fields.user.size() +
+                     fields.ip.size();
+        }
+        sink = total;
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+}
+
+/**
+ * Compare the raw scan throughput of splitting a log into lines and
+ * their first 11 words: by line with getline or find and then byte by
+ * byte with tokenizeLine, against a LineSplitter's 64-byte masks. The
+ * sums of the word lengths must agree.
+ */
+void benchScan(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount);
+    std::cout << "scan (" << lineCount << " lines, " << BLOCK_SCAN_ISA
+              << ")\n";
+    const auto report = [&](const std::string& name, const auto& op) {
+        size_t total = 0;
+        const double secs = timeIt(name, lineCount, log.size(), [&] {
+            total = op();
+        });
+        std::cout << "    sum " << total << '\n';
+        return secs;
+    };
+    const auto sum = [](const LogFields& f) {
+        return f.month.size() + f.day.size() + f.time.size() +
+               f.user.size() + f.ip.size();
+    };
+    const double oldSecs = report("getline+tokenizeLine", [&] {
+        std::istringstream is(log);
+        std::string line;
+        LogFields fields;
+        size_t total = 0;
+        while (std::getline(is, line)) {
+            tokenizeLine(line, fields);
+            total += sum(fields);
+        }
+        return total;
+    });
+    const double findSecs = report("find+tokenizeLine", [&] {
+        LogFields fields;
+        size_t total = 0;
+        for (size_t pos = 0; pos < log.size();) {
+            const size_t end = log.find('\n', pos);
+            tokenizeLine(std::string_view(&log[pos], end - pos), fields);
+            total += sum(fields);
+            pos = end + 1;
+        }
+        return total;
+    });
+    const double newSecs = report("LineSplitter", [&] {
+        LineSplitter<LineWords::MAX> lines(log, 0);
+        std::string_view line;
+        LineWords words;
+        size_t total = 0;
+        while (lines.next(line, words)) {
+            for (const size_t i : {MONTH, DAY, TIME, USER, IP}) {
+                total += words.word(line, i).size();
+            }
+        }
+        return total;
+    });
+    report("LineSplitter, lines only", [&] {
+        LineSplitter<0> lines(log, 0);
+        std::string_view line;
+        LineWords words;
+        size_t total = 0;
+        while (lines.next(line, words)) {
+            total += line.size();
+        }
+        return total;
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x over getline, "
+              << findSecs / newSecs << "x over find\n";
+}
+
+/**
+ * Check that TimestampParser agrees with toSeconds for a timestamp in
+ * every minute of the year (including both DST transitions in a US
+ * timezone), then compare the throughput of the two conversions.
+ */
+void benchTimestamp(const size_t lineCount) {
+    static const char *Months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    std::cout << "timestamp (" << lineCount << " lines)\n";
+    for (const char *tz : {"UTC", "America/New_York"}) {
+        setenv("TZ", tz, 1);
+        tzset();
+        TimestampParser parser;
+        size_t mismatches = 0;
+        char buf[32];
+        for (int mon = 0; mon < 12; mon++) {
+            for (int day = 1; day <= 31; day++) {
+                for (int min = 0; min < 24 * 60; min++) {
+                    snprintf(buf, sizeof(buf), "%s %d %02d:%02d:%02d",
+                             Months[mon], day, min / 60, min % 60, min % 61);
+                    std::string_view ts(buf);
+                    const auto sp1 = ts.find(' '), sp2 = ts.rfind(' ');
+                    mismatches += parser.toSeconds(ts.substr(0, sp1),
+                        ts.substr(sp1 + 1, sp2 - sp1 - 1),
+                        ts.substr(sp2 + 1)) != toSeconds(buf);
+                }
+            }
+        }
+        std::cout << "  TZ=" << tz << ": " << mismatches << " mismatches\n";
+    }
+    const std::string log = makeSyntheticLog(lineCount);
+    const std::vector<LogFields> lines = tokenizeAll(log);
+    const double oldSecs = timeIt("strptime+mktime", lineCount, log.size(),
+                                  [&] {
+        long total = 0;
+        for (const auto& f : lines) {
+            std::string timeStamp(f.month);
+            timeStamp.append(" ").append(f.day).append(" ").append(f.time);
+            total += toSeconds(timeStamp);
+        }
+        sink = total;
+    });
+    const double newSecs = timeIt("TimestampParser", lineCount, log.size(),
+                                  [&] {
+        TimestampParser parser;
+        long total = 0;
+        for (const auto& f : lines) {
+            total += parser.toSeconds(f.month, f.day, f.time);
+        }
+        sink = total;
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+    // The same instants as RFC 3339 timestamps with a fraction and an
+    // offset, which must convert to the same seconds
+    std::vector<std::string> stamps;
+    std::vector<long> expected;
+    {
+        TimestampParser parser;
+        char buf[48];
+        for (const auto& f : lines) {
+            const long seconds = parser.toSeconds(f.month, f.day, f.time);
+            const time_t shifted = seconds + 5 * 3600 + 30 * 60;
+            tm utc;
+            gmtime_r(&shifted, &utc);
+            const size_t len = strftime(buf, sizeof(buf),
+                                        "%Y-%m-%dT%H:%M:%S", &utc);
+            snprintf(buf + len, sizeof(buf) - len, ".%06ld+05:30",
+                     seconds % 1000000);
+            stamps.push_back(buf);
+            expected.push_back(seconds);
+        }
+    }
+    size_t rfcMismatches = 0;
+    const double rfcSecs = timeIt("TimestampParser (RFC 3339)", lineCount,
+                                  log.size(), [&] {
+        TimestampParser parser;
+        long total = 0;
+        for (size_t i = 0; i < stamps.size(); i++) {
+            const LogTime time = parser.toTime({}, {}, stamps[i]);
+            rfcMismatches += time.seconds != expected[i] ||
+                             time.nanos != expected[i] % 1000000 * 1000;
+            total += time.seconds;
+        }
+        sink = total;
+    });
+    std::cout << "  RFC 3339: " << rfcMismatches << " mismatches, "
+              << oldSecs / rfcSecs << "x\n";
+}
+
+/**
+ * Replay a long synthetic log through the original grow-forever
+ * map of login time vectors and through FrequencyTracker, and report
+ * the peak RSS and hit count of each. Lines are generated on the fly,
+ * so the log itself takes no memory. With few users, each one logs in
+ * every few seconds, so the frequency rule fires.
+ */
+void benchWindow(const size_t lineCount) {
+    std::cout << "window (" << lineCount << " lines, 20 users)\n";
+    const auto replay = [&](const auto& check) {
+        LogGenerator gen(20);
+        TimestampParser timestamps;
+        std::string line, user;
+        LogFields fields;
+        size_t hits = 0;
+        for (size_t i = 0; i < lineCount; i++) {
+            line.clear();
+            gen.next(line);
+            tokenizeLine(line, fields);
+            user.assign(fields.user);
+            hits += check(user, timestamps.toSeconds(fields.month,
+                                                     fields.day, fields.time));
+        }
+        std::cout << "    hits: " << hits << '\n';
+    };
+    const double oldMB = peakRssMB([&] {
+        std::unordered_map<std::string, std::vector<long>> loginTimes;
+        replay([&](const std::string& user, const long seconds) {
+            auto& times = loginTimes[user];
+            times.push_back(seconds);
+            const size_t i = times.size() - 1;
+            return times.size() > 3 && times[i] - times[i - 3] <= 20;
+        });
+    });
+    std::cout << "  vector per user: peak RSS " << oldMB << " MB\n";
+    const double newMB = peakRssMB([&] {
+        KeyInterner users;
+        FrequencyTracker loginTimes;
+        replay([&](const std::string& user, const long seconds) {
+            return loginTimes.record(users.intern(user), seconds);
+        });
+    });
+    std::cout << "  FrequencyTracker: peak RSS " << newMB << " MB\n";
+}
+
+/**
+ * Compare the per-line key lookups of the original string-keyed
+ * unordered maps (one banned-IP lookup plus the four loginTimes[userID]
+ * lookups in frequencyHacking) with one KeyInterner lookup for each.
+ */
+void benchLookup(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount, 100000, 100000);
+    const std::vector<LogFields> lines = tokenizeAll(log);
+    std::cout << "lookup (" << lineCount << " lines, 100000 users/IPs)\n";
+    std::unordered_map<std::string, bool> bannedMap;
+    KeyInterner bannedSet;
+    for (size_t i = 0; i < lines.size(); i += 50) {
+        bannedMap[std::string(lines[i].ip)] = true;
+        bannedSet.intern(lines[i].ip);
+    }
+    const double oldSecs = timeIt("unordered_map<string>", lineCount,
+                                  log.size(), [&] {
+        std::unordered_map<std::string, std::vector<long>> loginTimes;
+        std::string user, ip;
+        size_t total = 0;
+        for (const auto& f : lines) {
+            ip.assign(f.ip);
+            user.assign(f.user);
+            total += bannedMap.find(ip) != bannedMap.end();
+            loginTimes[user];
+            total += loginTimes[user].size() + loginTimes[user].size() +
+                     loginTimes[user].size();
+        }
+        sink = total;
+    });
+    const double newSecs = timeIt("KeyInterner", lineCount, log.size(), [&] {
+        KeyInterner users;
+        std::vector<size_t> perUser;
+        size_t total = 0;
+        for (const auto& f : lines) {
+            total += bannedSet.contains(f.ip);
+            const KeyInterner::Id id = users.intern(f.user);
+            if (id == perUser.size()) {
+                perUser.push_back(0);
+            }
+            total += perUser[id]++;
+        }
+        sink = total;
+    });
+    std::cout << "  lookups/s: " << static_cast<long>(5 * lineCount / oldSecs)
+              << " vs " << static_cast<long>(2 * lineCount / newSecs)
+              << " (lines/s speedup " << oldSecs / newSecs << "x)\n";
+}
+
+/**
+ * Build a ban list of single addresses plus /24 and /16 ranges, check
+ * IpPrefixSet against a brute-force range scan, and compare lookup
+ * throughput with the original exact-match string map.
+ */
+void benchIpSet(const size_t lineCount) {
+    std::cout << "ipset (" << lineCount << " lookups)\n";
+    std::mt19937 rng(381);
+    const auto dotted = [](const std::uint32_t a) {
+        return std::to_string(a >> 24) + '.' + std::to_string(a >> 16 & 255) +
+               '.' + std::to_string(a >> 8 & 255) + '.' +
+               std::to_string(a & 255);
+    };
+    // Bans within 10.0.0.0/8 so that random probes hit some of them
+    std::vector<std::pair<std::uint32_t, int>> bans;
+    IpPrefixSet prefixSet;
+    std::unordered_map<std::string, bool> exactMap;
+    for (int i = 0; i < 200000; i++) {
+        const int len = (i % 10000 == 0 ? 16 : i % 100 == 0 ? 24 : 32);
+        const std::uint32_t addr = (10u << 24 | (rng() & 0xffffff)) &
+                                   (~0u << (32 - len));
+        bans.emplace_back(addr, len);
+        prefixSet.insert(dotted(addr) + '/' + std::to_string(len));
+        exactMap[dotted(addr)] = true;
+    }
+    std::vector<std::string> probes;
+    for (size_t i = 0; i < lineCount; i++) {
+        probes.push_back(dotted(10u << 24 | (rng() & 0xffffff)));
+    }
+    size_t mismatches = 0, hits = 0;
+    for (size_t i = 0; i < std::min<size_t>(probes.size(), 2000); i++) {
+        IpPrefixSet::Key key;
+        int maxLen;
+        IpPrefixSet::parse(probes[i], key, maxLen);
+        const std::uint32_t addr = static_cast<std::uint32_t>(key);
+        bool banned = false;
+        for (const auto& [net, len] : bans) {
+            banned |= (addr & (~0u << (32 - len))) == net;
+        }
+        mismatches += banned != prefixSet.contains(probes[i]);
+        hits += banned;
+    }
+    IpPrefixSet v6;
+    v6.insert("2001:db8::/32");
+    v6.insert("10.9.0.0/16");
+    mismatches += !v6.contains("2001:db8:1::5") + v6.contains("2001:db9::1") +
+                  !v6.contains("::ffff:10.9.3.4") + !v6.contains("10.9.3.4");
+    std::cout << "  " << bans.size() << " bans, " << mismatches
+              << " mismatches against brute force (" << hits
+              << " of 2000 probes banned)\n";
+    size_t bytes = 0;
+    for (const auto& p : probes) {
+        bytes += p.size();
+    }
+    const double oldSecs = timeIt("unordered_map exact", probes.size(), bytes,
+                                  [&] {
+        std::string ip;
+        size_t hits = 0;
+        for (const auto& p : probes) {
+            ip.assign(p);
+            hits += exactMap.find(ip) != exactMap.end();
+        }
+        sink = hits;
+    });
+    const double newSecs = timeIt("IpPrefixSet", probes.size(), bytes, [&] {
+        size_t hits = 0;
+        for (const auto& p : probes) {
+            hits += prefixSet.contains(std::string_view(p));
+        }
+        sink = hits;
+    });
+    std::cout << "  ratio: " << oldSecs / newSecs << "x\n";
+}
+
+/**
+ * Run processLogsParallel with 1 to N threads (N is the number of
+ * hardware threads, at least 4) and check that every run, including
+ * one with tiny chunks, prints exactly the same output. The second log
+ * starts 20 minutes before New Year, so most chunks are all January
+ * and their year must be inferred in log order whatever the number of
+ * threads.
+ */
+void benchScaling(const size_t lineCount) {
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const size_t maxThreads =
+        std::max<size_t>(std::thread::hardware_concurrency(), 4);
+    for (const long start : {0L, LogGenerator::NEW_YEAR - 1200}) {
+        const std::string log = makeSyntheticLog(lineCount, 50, 5000,
+                                                 start);
+        std::cout << "scaling (" << lineCount << " lines, up to "
+                  << maxThreads << " threads" << (start > 0 ?
+                  ", across New Year" : "") << ")\n";
+        std::string expected;
+        for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+            std::string out;
+            timeIt(std::to_string(threads) + " threads", lineCount,
+                   log.size(), [&] {
+                out = captureAlerts([&](AlertWriter& alerts) {
+                    std::istringstream is(log);
+                    processLogsParallel(is, bannedIPs, authorizedUsers,
+                                        threads, alerts);
+                });
+            });
+            if (threads == 1) {
+                expected = out;
+                std::cout << "  "
+                          << expected.substr(expected.rfind("Processed"));
+            } else if (out != expected) {
+                std::cout << "  OUTPUT MISMATCH with " << threads
+                          << " threads\n";
+            }
+        }
+        const std::string out = captureAlerts([&](AlertWriter& alerts) {
+            std::istringstream is(log);
+            processLogsParallel(is, bannedIPs, authorizedUsers, 3, alerts, 0,
+                                4096);
+        });
+        std::cout << "  4 KB chunks: " << (out == expected ? "same" :
+                                           "MISMATCHED") << " output\n";
+    }
+}
+
+/**
+ * Write a synthetic log to a temporary file and compare checking it
+ * through an ifstream with getline against scanning a MappedFile in
+ * place. Detections go to a null stream.
+ */
+void benchMapped(const size_t lineCount) {
+    const std::string path = "/tmp/LoginSentryBench.log";
+    const std::string log = makeSyntheticLog(lineCount);
+    std::ofstream(path) << log;
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    std::cout << "mapped (" << lineCount << " lines, warm page cache)\n";
+    const double oldSecs = timeIt("ifstream+getline", lineCount, log.size(),
+                                  [&] {
+        std::ifstream is(path);
+        Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+        for (std::string line; std::getline(is, line);) {
+            sentry.checkLine(line);
+        }
+    });
+    const double newSecs = timeIt("MappedFile", lineCount, log.size(), [&] {
+        const MappedFile file(path);
+        Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+        sentry.checkLines(file.data());
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+    std::remove(path.c_str());
+}
+
+/**
+ * Compare checking a gzip-compressed log by first inflating it fully
+ * and then scanning, with streaming it through LogInput, where the
+ * decompressor thread overlaps with the scan.
+ */
+void benchDecompress(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount);
+    const std::string gz = gzipCompress(log);
+    IpPrefixSet bannedIPs;
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    std::cout << "decompress (" << lineCount << " lines, " << gz.size()
+              << " bytes gzipped)\n";
+    const double oldSecs = timeIt("inflate then scan", lineCount, log.size(),
+                                  [&] {
+        std::istringstream is(gz);
+        LogInput input(is);
+        std::ostringstream text;
+        text << input.stream().rdbuf();
+        Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+        sentry.checkLines(text.str());
+    });
+    const double newSecs = timeIt("streaming LogInput", lineCount, log.size(),
+                                  [&] {
+        std::istringstream is(gz);
+        LogInput input(is);
+        Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+        for (std::string line; std::getline(input.stream(), line);) {
+            sentry.checkLine(line);
+        }
+        if (!input.error().empty()) {
+            std::cout << "  ERROR: " << input.error() << '\n';
+        }
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+}
+
+/**
+ * Compare writing every detection of an attack burst (every line is a
+ * hit) with std::cout while it is synced with stdio, as processLogs
+ * originally did, against AlertWriter in text and JSON form. Output
+ * goes to /dev/null.
+ */
+void benchAlerts(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount);
+    const std::vector<LogFields> fields = tokenizeAll(log);
+    std::vector<std::string_view> lines;
+    for (size_t pos = 0, end; pos < log.size(); pos = end + 1) {
+        end = log.find('\n', pos);
+        lines.push_back(std::string_view(log).substr(pos, end - pos));
+    }
+    std::cout << "alerts (" << lineCount << " hits)\n";
+    std::cout.flush();
+    const int savedStdout = dup(STDOUT_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+    const auto oldStart = Clock::now();
+    for (const auto& line : lines) {
+        std::cout << "Hacking due to banned IP. Line: " << line << '\n';
+    }
+    std::cout.flush();
+    const double oldSecs =
+        std::chrono::duration<double>(Clock::now() - oldStart).count();
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    std::cout << "  synced std::cout: " << oldSecs << " s, "
+              << static_cast<long>(lineCount / oldSecs) << " alerts/s\n";
+    for (const auto format : {AlertFormat::TEXT, AlertFormat::JSON}) {
+        const double newSecs = timeIt(format == AlertFormat::TEXT ?
+            "AlertWriter text" : "AlertWriter json", lineCount, log.size(),
+            [&] {
+            AlertWriter alerts(devNull, format);
+            for (size_t i = 0; i < lines.size(); i++) {
+                alerts.alert(BANNED_IP_ALERT, fields[i].user, fields[i].ip,
+                             1630249261, lines[i]);
+            }
+        });
+        std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+    }
+}
+
+/**
+ * Measure the detection latency of follow mode: lines that are all
+ * hits are appended one at a time to a file that a FileFollower is
+ * watching, and the time from each write until its alert can be read
+ * from a pipe is recorded.
+ */
+void benchFollow(const size_t lineCount) {
+    const std::string path = "/tmp/LoginSentryBench.follow.log";
+    std::remove(path.c_str());
+    const int logFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                           0644);
+    int alertPipe[2];
+    if (logFd == -1 || pipe(alertPipe) == -1) {
+        std::cout << "follow: cannot create test file or pipe\n";
+        return;
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("0.0.0.0/0");
+    LookupMap authorizedUsers;
+    std::atomic<bool> stop(false);
+    std::thread watcher([&] {
+        AlertWriter alerts(alertPipe[1]);
+        Sentry sentry(bannedIPs, authorizedUsers, alerts);
+        FileFollower follower(path);
+        follower.run([&](std::string_view line) { sentry.checkLine(line); },
+                     [&] { alerts.flush(); }, stop);
+    });
+    const size_t samples = std::min<size_t>(lineCount, 1000);
+    std::cout << "follow (" << samples << " appends)\n";
+    LogGenerator gen;
+    std::vector<double> latencies;
+    std::string line;
+    char alert[4096];
+    for (size_t i = 0; i < samples; i++) {
+        line.clear();
+        gen.next(line);
+        const auto start = Clock::now();
+        if (write(logFd, line.data(), line.size()) < 0) {
+            break;
+        }
+        // Each alert is one line; wait until all of it has arrived
+        for (ssize_t n = 0; n <= 0 || alert[n - 1] != '\n';) {
+            const ssize_t got = read(alertPipe[0], alert + n,
+                                     sizeof(alert) - n);
+            n += (got > 0 ? got : 0);
+        }
+        latencies.push_back(std::chrono::duration<double, std::milli>(
+            Clock::now() - start).count());
+    }
+    stop = true;
+    watcher.join();
+    close(logFd);
+    close(alertPipe[0]);
+    close(alertPipe[1]);
+    std::remove(path.c_str());
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        std::cout << "  append-to-alert latency: median "
+                  << latencies[latencies.size() / 2] << " ms, p99 "
+                  << latencies[latencies.size() * 99 / 100] << " ms, max "
+                  << latencies.back() << " ms\n";
+    }
+}
+
+/**
+ * Compare fetching the logs of many hosts one after another with a
+ * blocking tcp::iostream (as one LoginSentry run per host did) against
+ * fetching them all at once with fetchAll and checking them in one
+ * merged detection phase. The hosts are simulated by TestLogServer
+ * with 100 ms latency and 50 MB/s per connection.
+ */
+void benchFetch(const size_t lineCount) {
+    const size_t hosts = 20;
+    const std::string log = makeSyntheticLog(lineCount / hosts);
+    // One server per host, since fetchAll shares a connection per host
+    std::vector<std::unique_ptr<TestLogServer>> servers;
+    std::vector<std::string> urls;
+    for (size_t i = 0; i < hosts; i++) {
+        servers.push_back(std::make_unique<TestLogServer>(log,
+            std::chrono::milliseconds(100), 50000000));
+        urls.push_back("http://127.0.0.1:" +
+                       std::to_string(servers[i]->port()) + "/auth.log");
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    const size_t lines = (lineCount / hosts) * hosts;
+    std::cout << "fetch (" << hosts << " hosts, " << lines << " lines)\n";
+    const double oldSecs = timeIt("sequential tcp::iostream", lines,
+                                  log.size() * hosts, [&] {
+        for (size_t i = 0; i < hosts; i++) {
+            boost::asio::ip::tcp::iostream is("127.0.0.1",
+                std::to_string(servers[i]->port()));
+            is << "GET /auth.log HTTP/1.1\r\n"
+               << "Host: 127.0.0.1\r\nConnection: Close\r\n\r\n";
+            for (std::string hdr; std::getline(is, hdr) && !hdr.empty()
+                    && hdr != "\r";) {
+            }
+            Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+            for (std::string line; std::getline(is, line);) {
+                sentry.checkLine(line);
+            }
+        }
+    });
+    const double newSecs = timeIt("fetchAll + merged", lines,
+                                  log.size() * hosts, [&] {
+        processUrls(urls, bannedIPs, authorizedUsers, defaultRules(),
+                    nullOut);
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+    // The logins are merged as they arrive, so little of the logs is held
+    const double peakMB = peakRssMB([&] {
+        processUrls(urls, bannedIPs, authorizedUsers, defaultRules(),
+                    nullOut);
+    });
+    std::cout << "  fetchAll + merged: peak RSS " << peakMB << " MB for "
+              << log.size() * hosts / 1e6 << " MB of logs\n";
+}
+
+/**
+ * Compare rescanning a whole remote log on every poll with polling it
+ * incrementally, as LoginSentry --state does: each poll fetches only
+ * the new bytes with a Range request and restores the frequency
+ * windows from a checkpoint. The log grows by 1% between polls.
+ */
+void benchPoll(const size_t lineCount) {
+    std::string log = makeSyntheticLog(lineCount);
+    const std::string appended = makeSyntheticLog(lineCount / 100);
+    const TestLogServer server(log, std::chrono::milliseconds(0),
+                               1000000000);
+    const std::vector<std::string> urls = {"http://127.0.0.1:" +
+        std::to_string(server.port()) + "/auth.log"};
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    std::cout << "poll (" << lineCount << " lines + " << lineCount / 100
+              << " new)\n";
+    // Fetch the log from where states say and check it with loginTimes
+    const auto poll = [&](std::vector<FetchState>& states,
+                          RuleEngine& loginTimes) {
+        std::vector<SourceParser> sources(1, SourceParser(bannedIPs));
+        MergedDetector<> merged(sources, loginTimes, nullOut);
+        fetchAll(urls, states, [&](size_t, std::string_view body) {
+            sources[0].feed(body);
+            merged.advance();
+        }, [&](size_t) {
+            sources[0].finish(false);
+            merged.advance();
+        });
+        merged.finish();
+    };
+    // The state left by a previous poll of the log as it is now
+    std::vector<FetchState> states;
+    std::string windows;
+    {
+        RuleEngine loginTimes(authorizedUsers);
+        poll(states, loginTimes);
+        SnapshotWriter writer;
+        loginTimes.snapshot(writer);
+        windows = writer.data();
+    }
+    log += appended;
+    const double oldSecs = timeIt("full rescan", lineCount / 100,
+                                  appended.size(), [&] {
+        processUrls(urls, bannedIPs, authorizedUsers, defaultRules(),
+                    nullOut);
+    });
+    const double newSecs = timeIt("incremental", lineCount / 100,
+                                  appended.size(), [&] {
+        RuleEngine loginTimes(authorizedUsers);
+        SnapshotReader checkpoint(windows);
+        loginTimes.snapshot(checkpoint);
+        poll(states, loginTimes);
+        SnapshotWriter writer;
+        loginTimes.snapshot(writer);
+    });
+    std::cout << "  speedup: " << oldSecs / newSecs << "x\n";
+}
+
+/**
+ * Compare checkpointing the frequency state of lineCount users as text
+ * (each user's recent login times on a line, replayed on load, as
+ * --state checkpoints were first written) with a binary snapshot
+ * written by saveSnapshot and restored by loadSnapshot from a memory
+ * mapping.
+ */
+void benchSnapshot(const size_t lineCount) {
+    const std::string path = "/tmp/LoginSentryBench.snapshot";
+    LookupMap authorizedUsers;
+    FrequencyDetector detector(authorizedUsers);
+    std::string text;
+    char user[32];
+    for (size_t i = 0; i < lineCount; i++) {
+        snprintf(user, sizeof(user), "user%zu", i);
+        text += user;
+        for (long t = 0; t < 4; t++) {
+            const long seconds = 1630000000 + long(i % 1000) + t;
+            detector.check(user, seconds);
+            text += ' ' + std::to_string(seconds);
+        }
+        text += '\n';
+    }
+    std::cout << "snapshot (" << lineCount << " users)\n";
+    const auto report = [&](const char* name, const double secs) {
+        std::cout << "  " << name << ": " << secs * 1000 << " ms\n";
+        return secs;
+    };
+    const auto seconds = [](const Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    auto start = Clock::now();
+    writeFileAtomically(path, text);
+    report("text save (write only)", seconds(start));
+    start = Clock::now();
+    {
+        FrequencyDetector restored(authorizedUsers);
+        std::ifstream is(path);
+        std::string name;
+        for (std::string line; std::getline(is, line);) {
+            std::istringstream fields(line);
+            fields >> name;
+            for (long t; fields >> t;) {
+                restored.check(name, t);
+            }
+        }
+    }
+    const double oldSecs = report("text load", seconds(start));
+    start = Clock::now();
+    saveSnapshot(path, detector);
+    report("binary save", seconds(start));
+    start = Clock::now();
+    FrequencyDetector restored(authorizedUsers);
+    loadSnapshot(path, restored);
+    const double newSecs = report("binary load", seconds(start));
+    std::ifstream size(path, std::ios::ate);
+    std::cout << "  sizes: text " << text.size() / 1e6 << " MB, binary "
+              << size.tellg() / 1e6 << " MB\n"
+              << "  load speedup: " << oldSecs / newSecs << "x\n";
+    std::remove(path.c_str());
+}
+
+/**
+ * Measure what hot reloading costs the detection thread: checking a log
+ * with fixed lists against acquiring the lists from a ListReloader for
+ * every line while another thread rewrites the ban list every 20 ms.
+ * Also report how long a rewrite takes to become visible to readers.
+ */
+void benchReload(const size_t lineCount) {
+    const std::string banned = "/tmp/LoginSentryBench.banned",
+        authorized = "/tmp/LoginSentryBench.authorized";
+    const auto writeBanned = [&](const int extra) {
+        std::ostringstream os;
+        os << "10.0.3.0/24\n";
+        for (int i = 0; i < extra; i++) {
+            os << "172.16." << i / 256 << '.' << i % 256 << '\n';
+        }
+        writeFileAtomically(banned, os.str());
+    };
+    writeBanned(1000);
+    writeFileAtomically(authorized, "user7\n");
+    const std::string log = makeSyntheticLog(lineCount);
+    AlertWriter nullOut(devNull);
+    ListReloader lists(banned, authorized);
+    std::cout << "reload (" << lineCount << " lines)\n";
+    const double oldSecs = timeIt("fixed lists", lineCount, log.size(), [&] {
+        const LookupLists& fixed = lists.acquire();
+        Sentry sentry(fixed.bannedIPs, fixed.authorizedUsers, nullOut);
+        sentry.checkLines(log);
+    });
+    std::atomic<bool> done = false;
+    std::thread writer([&] {
+        for (int i = 0; !done; i++) {
+            writeBanned(1000 + i % 2);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+    const uint64_t firstGeneration = lists.generation();
+    const double newSecs = timeIt("acquire per line", lineCount, log.size(),
+                                  [&] {
+        const LookupLists* active = &lists.acquire();
+        Sentry sentry(active->bannedIPs, active->authorizedUsers, nullOut);
+        std::string_view text = log;
+        for (size_t nl; (nl = text.find('\n')) != std::string_view::npos;
+             text.remove_prefix(nl + 1)) {
+            const LookupLists& current = lists.acquire();
+            if (&current != active) {
+                active = &current;
+                sentry.useLists(current.bannedIPs, current.authorizedUsers);
+            }
+            sentry.checkLine(text.substr(0, nl));
+        }
+    });
+    done = true;
+    writer.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    std::cout << "  generations swapped in: "
+              << lists.generation() - firstGeneration
+              << ", overhead: " << (newSecs / oldSecs - 1) * 100 << "%\n";
+    const uint64_t before = lists.generation();
+    const auto start = Clock::now();
+    writeBanned(5);
+    while (lists.generation() == before) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    std::cout << "  rewrite to swap: " << std::chrono::duration<double,
+        std::milli>(Clock::now() - start).count() << " ms\n";
+    std::remove(banned.c_str());
+    std::remove(authorized.c_str());
+}
+
+/**
+ * Measure the per-line cost of the rule engine as the number of rules
+ * grows, with the lines tokenized and timestamped up front. The rules
+ * cycle through the three kinds (attempts per user, attempts per IP,
+ * distinct users per IP) with different thresholds, and the log has
+ * few enough users (20) and IPs (50) that each rule fires. The
+ * hardcoded FrequencyDetector is timed as the baseline for one rule.
+ */
+void benchRules(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount, 20, 50);
+    const std::vector<LogFields> lines = tokenizeAll(log);
+    std::vector<long> seconds;
+    TimestampParser timestamps;
+    for (const LogFields& fields : lines) {
+        seconds.push_back(timestamps.toSeconds(fields.month, fields.day,
+                                               fields.time));
+    }
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    std::cout << "rules (" << lines.size() << " lines)\n";
+    const auto perLine = [&](const std::string& name, const auto& check) {
+        const auto start = Clock::now();
+        size_t hits = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            hits += check(lines[i], seconds[i]);
+        }
+        const double ns = std::chrono::duration<double, std::nano>(
+            Clock::now() - start).count() / lines.size();
+        std::cout << "  " << name << ": " << ns << " ns/line, " << hits
+                  << " hits\n";
+    };
+    {
+        FrequencyDetector detector(authorizedUsers);
+        perLine("FrequencyDetector", [&](const LogFields& f, long t) {
+            return detector.check(f.user, t);
+        });
+    }
+    for (size_t count = 1; count <= 16; count *= 2) {
+        RuleSet rules;
+        for (size_t r = 0; r < count; r++) {
+            const RuleSpec::Measure measure = (r % 3 == 2 ?
+                RuleSpec::USERS : RuleSpec::ATTEMPTS);
+            const RuleSpec::Key key = (r % 3 == 0 ? RuleSpec::USER :
+                                       RuleSpec::IP);
+            // A user logs in about every 20 s, and an IP every 50 s
+            const long window = (key == RuleSpec::USER ? 20 : 60) +
+                                long(r) * 10;
+            rules.push_back({"rule" + std::to_string(r), measure, key,
+                             {3 + r / 3, window}});
+        }
+        RuleEngine engine(authorizedUsers, rules);
+        perLine(std::to_string(count) + " rules", [&](const LogFields& f,
+                                                      long t) {
+            return engine.check(f.user, f.ip, t) != nullptr;
+        });
+    }
+}
+
+/**
+ * Measure the end-to-end cost of tracking frequency per IP and per /24
+ * as well as per user: Sentry::checkLines with the default rule alone,
+ * plus a per-IP rule, plus a per-subnet rule. Logs from 5k IPs (state
+ * that stays in cache) and from 100k IPs (state that does not) are
+ * both measured.
+ */
+void benchDimensions(const size_t lineCount) {
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    RuleSpec perIP = defaultRules()[0];
+    perIP.name = "ip_burst";
+    perIP.key = RuleSpec::IP;
+    perIP.rule = {20, 300};
+    RuleSpec perSubnet = perIP;
+    perSubnet.name = "net_burst";
+    perSubnet.v4Prefix = 24;
+    perSubnet.v6Prefix = 64;
+    perSubnet.rule = {50, 300};
+    for (const int ipCount : {5000, 100000}) {
+        const std::string log = makeSyntheticLog(lineCount, 1000, ipCount);
+        std::cout << "dimensions (" << lineCount << " lines, " << ipCount
+                  << " IPs)\n";
+        RuleSet rules = defaultRules();
+        // The best of three runs, since the differences are small
+        const auto run = [&](const std::string& name) {
+            double best = 1e9;
+            for (int i = 0; i < 3; i++) {
+                const auto start = Clock::now();
+                Sentry sentry(bannedIPs, authorizedUsers, nullOut, rules);
+                sentry.checkLines(log);
+                best = std::min(best, std::chrono::duration<double>(
+                    Clock::now() - start).count());
+            }
+            std::cout << "  " << name << ": " << best << " s, "
+                      << static_cast<long>(lineCount / best) << " lines/s\n";
+            return best;
+        };
+        const double userSecs = run("per user");
+        rules.push_back(perIP);
+        const double ipSecs = run("per user + per IP");
+        rules.push_back(perSubnet);
+        const double subnetSecs = run("per user + per IP + per /24");
+        // The added time per line tells cache misses (tens of ns) from
+        // extra work; the rings of a {20, 300} rule take 176 bytes per IP
+        const auto perLine = [&](const double secs) {
+            return (secs - userSecs) * 1e9 / lineCount;
+        };
+        std::cout << "  overhead: per IP " << (ipSecs / userSecs - 1) * 100
+                  << "% (" << perLine(ipSecs) << " ns/line), per IP and /24 "
+                  << (subnetSecs / userSecs - 1) * 100 << "% ("
+                  << perLine(subnetSecs) << " ns/line)\n";
+    }
+}
+
+/**
+ * Check the distinct-user sketches against exact counts, then time
+ * them against the exact tracker. Accuracy: many keys are each given
+ * n distinct users and the relative error of their estimates is
+ * reported next to the documented standard error; then one key is fed
+ * a sliding population, and every estimate is compared with the exact
+ * number of distinct users in the span the sketch covers. Cost: a
+ * "distinct users per IP" rule over a synthetic log of 100000 users
+ * from 20 IPs (about 180 distinct users per IP an hour), exact and
+ * sketched, at a threshold counted exactly and one that is estimated.
+ */
+void benchSketch(const size_t lineCount) {
+    using Sketch = DistinctSketchTracker;
+    std::cout << "sketch accuracy (standard error "
+              << 104 / std::sqrt(double(Sketch::REGISTERS)) << "%)\n";
+    for (const size_t n : {10, 100, 1000, 10000, 100000}) {
+        const size_t keys = std::max<size_t>(20, 2000000 / n / 4);
+        Sketch sketch({0, 3600});
+        double sumError = 0, maxError = 0;
+        for (size_t k = 0; k < keys; k++) {
+            for (size_t u = 0; u < n; u++) {
+                sketch.record(k, k * n + u, 1000);
+            }
+            const double error = std::abs(sketch.estimate(k) - n) / n;
+            sumError += error;
+            maxError = std::max(maxError, error);
+        }
+        std::cout << "  " << n << " users (" << keys << " keys): mean error "
+                  << sumError / keys * 100 << "%, max " << maxError * 100
+                  << "%\n";
+    }
+    {
+        // 40 new users a minute, each retried for a few minutes
+        const long window = 3600, width = window / (Sketch::SLICES - 1);
+        Sketch sketch({0, window});
+        std::map<long, std::unordered_set<size_t>> usersAt;
+        std::mt19937 random(7);
+        double maxError = 0;
+        for (long t = 0; t < 4 * window; t++) {
+            const size_t user = (t / 60) * 40 + random() % 200;
+            sketch.record(0, user, t);
+            usersAt[t].insert(user);
+            // The sketch covers the current slice and the 8 before it
+            std::unordered_set<size_t> exact;
+            for (auto it = usersAt.lower_bound((t / width - 8) * width);
+                 it != usersAt.end(); ++it) {
+                exact.insert(it->second.begin(), it->second.end());
+            }
+            if (t % 60 == 59) {
+                maxError = std::max(maxError, std::abs(sketch.estimate(0) -
+                    double(exact.size())) / exact.size());
+            }
+        }
+        std::cout << "  sliding window (" << window
+                  << " s, about 2000 users): max error " << maxError * 100
+                  << "%\n";
+    }
+    const std::string log = makeSyntheticLog(lineCount, 100000, 20);
+    const std::vector<LogFields> lines = tokenizeAll(log);
+    KeyInterner users, ips;
+    std::vector<KeyInterner::Id> userIDs, ipIDs;
+    std::vector<long> seconds;
+    TimestampParser timestamps;
+    for (const LogFields& fields : lines) {
+        userIDs.push_back(users.intern(fields.user));
+        ipIDs.push_back(ips.intern(fields.ip));
+        seconds.push_back(timestamps.toSeconds(fields.month, fields.day,
+                                               fields.time));
+    }
+    std::cout << "sketch cost (" << lines.size() << " lines, " << ips.size()
+              << " IPs)\n";
+    for (const size_t max : {20, 150}) {
+        const FrequencyRule rule = {max, 3600};
+        const auto time = [&](const std::string& name, auto tracker,
+                              const size_t bytesPerKey) {
+            const auto start = Clock::now();
+            size_t hits = 0;
+            for (size_t i = 0; i < lines.size(); i++) {
+                hits += tracker.record(ipIDs[i], userIDs[i], seconds[i]);
+            }
+            const double ns = std::chrono::duration<double, std::nano>(
+                Clock::now() - start).count() / lines.size();
+            std::cout << "  " << name << " (max " << max << "): " << ns
+                      << " ns/line, " << hits << " hits, " << bytesPerKey
+                      << " bytes/key\n";
+        };
+        time("exact", DistinctTracker(rule),
+             (max + 1) * (sizeof(KeyInterner::Id) + sizeof(long)));
+        time("sketch", Sketch(rule), Sketch::bytesPerKey());
+    }
+}
+
+/**
+ * Check the top-K summaries against exact counts and time them. Keys
+ * are drawn from a Zipf-like distribution (as attack traffic is, with
+ * a few dominant IPs), offered to one summary and to four shards that
+ * are merged at the end, and the reported top 10 of each is compared
+ * with the exact top 10. The end-to-end cost is Sentry::checkLines
+ * with and without the report.
+ */
+void benchTopK(const size_t lineCount) {
+    const size_t keyCount = 100000, k = 10;
+    std::mt19937_64 random(11);
+    // Key i is drawn with weight 1 / (i + 1)
+    std::vector<double> weights(keyCount);
+    for (size_t i = 0; i < keyCount; i++) {
+        weights[i] = 1.0 / (i + 1);
+    }
+    std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < lineCount; i++) {
+        const size_t key = zipf(random);
+        keys.push_back("10." + std::to_string(key >> 16) + "." +
+                       std::to_string(key >> 8 & 255) + "." +
+                       std::to_string(key & 255));
+    }
+    std::unordered_map<std::string, size_t> exact;
+    for (const std::string& key : keys) {
+        exact[key]++;
+    }
+    std::vector<std::pair<size_t, std::string>> ranked;
+    for (const auto& [key, count] : exact) {
+        ranked.push_back({count, key});
+    }
+    std::sort(ranked.rbegin(), ranked.rend());
+    std::cout << "topk (" << keys.size() << " attempts, " << exact.size()
+              << " keys)\n";
+    const auto compare = [&](const std::string& name,
+                             const SpaceSaving& summary) {
+        size_t found = 0;
+        std::uint64_t worst = 0;
+        for (const SpaceSaving::Counter& counter : summary.top(k)) {
+            found += std::count_if(ranked.begin(), ranked.begin() + k,
+                [&](const auto& entry) { return entry.second ==
+                                                counter.key; });
+            worst = std::max<std::uint64_t>(worst, counter.count -
+                                            exact[counter.key]);
+        }
+        std::cout << "  " << name << ": " << found << " of the top " << k
+                  << " found, largest overcount " << worst << " (bound "
+                  << summary.size() / (k * 10) << ")\n";
+    };
+    SpaceSaving single(k * 10);
+    auto start = Clock::now();
+    for (const std::string& key : keys) {
+        single.offer(key);
+    }
+    std::cout << "  offer: " << std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / keys.size() << " ns/key\n";
+    compare("one summary", single);
+    std::vector<SpaceSaving> shards(4, SpaceSaving(k * 10));
+    for (size_t i = 0; i < keys.size(); i++) {
+        shards[std::hash<size_t>()(i * 2654435761u) % 4].offer(keys[i]);
+    }
+    for (size_t s = 1; s < shards.size(); s++) {
+        shards[0].merge(shards[s]);
+    }
+    compare("4 shards merged", shards[0]);
+
+    const std::string log = makeSyntheticLog(lineCount);
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    for (const bool report : {false, true}) {
+        AlertWriter nullOut(devNull);
+        if (report) {
+            nullOut.trackTop(k);
+        }
+        start = Clock::now();
+        Sentry sentry(bannedIPs, authorizedUsers, nullOut);
+        sentry.checkLines(log);
+        sentry.printSummary();
+        std::cout << "  checkLines" << (report ? " with top 10" : "")
+                  << ": " << std::chrono::duration<double>(
+                         Clock::now() - start).count() << " s\n";
+    }
+}
+
+/**
+ * Compare checking a buffer one line at a time (checkLine, as follow
+ * mode does) with the batched, columnar checkLines, for the default
+ * rule and for a rule set that also tracks every IP and /24.
+ */
+void benchBatch(const size_t lineCount) {
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    AlertWriter nullOut(devNull);
+    RuleSet withIPs = defaultRules();
+    withIPs.push_back({"ip_burst", RuleSpec::ATTEMPTS, RuleSpec::IP,
+                       {20, 300}});
+    withIPs.push_back(withIPs.back());
+    withIPs.back().name = "net_burst";
+    withIPs.back().v4Prefix = 24;
+    withIPs.back().v6Prefix = 64;
+    for (const int ipCount : {5000, 100000}) {
+        const std::string log = makeSyntheticLog(lineCount, 1000, ipCount);
+        std::cout << "batch (" << lineCount << " lines, " << ipCount
+                  << " IPs)\n";
+        for (const auto& [name, rules] : {std::make_pair("default rule",
+                                                         defaultRules()),
+                                          std::make_pair("user, IP and /24",
+                                                         withIPs)}) {
+            // The best of three runs of each
+            const auto run = [&](const bool batched) {
+                double best = 1e9;
+                for (int i = 0; i < 3; i++) {
+                    const auto start = Clock::now();
+                    Sentry sentry(bannedIPs, authorizedUsers, nullOut, rules);
+                    if (batched) {
+                        sentry.checkLines(log);
+                    } else {
+                        for (size_t pos = 0; pos < log.size();) {
+                            const size_t end = log.find('\n', pos);
+                            sentry.checkLine(std::string_view(log).substr(pos,
+                                end - pos));
+                            pos = end + 1;
+                        }
+                    }
+                    best = std::min(best, std::chrono::duration<double>(
+                        Clock::now() - start).count());
+                }
+                return best * 1e9 / lineCount;
+            };
+            const double perLine = run(false), batched = run(true);
+            std::cout << "  " << name << ": per line " << perLine
+                      << " ns/line, batched " << batched << " ns/line ("
+                      << (1 - batched / perLine) * 100 << "% less)\n";
+        }
+    }
+}
+
+/**
+ * Measure the cost of reordering logins with a lateness bound, and
+ * whether it restores the detections of a log whose lines were
+ * shuffled by up to about 16 seconds (e.g., merged from several hosts).
+ */
+void benchReorder(const size_t lineCount) {
+    const std::string sorted = makeSyntheticLog(lineCount, 50);
+    std::vector<std::pair<double, std::string_view>> keyed;
+    std::mt19937 rng(17);
+    std::uniform_real_distribution<double> jitter(0, 8);
+    for (size_t pos = 0; pos < sorted.size();) {
+        const size_t end = sorted.find('\n', pos) + 1;
+        keyed.push_back({keyed.size() + jitter(rng),
+                         std::string_view(sorted).substr(pos, end - pos)});
+        pos = end;
+    }
+    std::sort(keyed.begin(), keyed.end());
+    std::string shuffled;
+    shuffled.reserve(sorted.size());
+    for (const auto& entry : keyed) {
+        shuffled.append(entry.second);
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    std::cout << "reorder (" << lineCount << " lines, 50 users)\n";
+    struct Run {
+        const char* name;
+        const std::string* log;
+        long lateness;
+    };
+    const Run runs[] = {{"sorted", &sorted, 0}, {"sorted", &sorted, 20},
+                        {"shuffled", &shuffled, 0},
+                        {"shuffled", &shuffled, 20}};
+    for (const auto& [name, log, lateness] : runs) {
+        double seconds = 0;
+        const std::string out = captureAlerts([&](AlertWriter& alerts) {
+            alerts.trackLate(lateness);
+            const auto start = Clock::now();
+            Sentry sentry(bannedIPs, authorizedUsers, alerts,
+                          defaultRules(), lateness);
+            sentry.checkLines(*log);
+            sentry.finish();
+            seconds = std::chrono::duration<double>(Clock::now() -
+                                                    start).count();
+            sentry.printSummary();
+        });
+        std::cout << "  " << name << ", lateness " << lateness << ": "
+                  << seconds * 1e9 / lineCount << " ns/line\n";
+        // The late count and the summary are the last lines of the output
+        size_t from = out.rfind('\n', out.size() - 2);
+        if (lateness > 0) {
+            from = out.rfind('\n', from - 1);
+        }
+        std::istringstream last(out.substr(from + 1));
+        for (std::string line; std::getline(last, line);) {
+            std::cout << "    " << line << '\n';
+        }
+    }
+}
+
+/**
+ * Check the same logins written in each log format with the sentry
+ * compiled for that format, and report the cost per login of the
+ * scanner alone and of the whole sentry, with the number of hacking
+ * attempts found (which should agree). The journal formats carry the
+ * same instants as the syslog lines.
+ */
+void benchFormats(const size_t lineCount) {
+    const std::string syslog = makeSyntheticLog(lineCount);
+    std::string exported, json;
+    {
+        SshdFormat scanner;
+        TimestampParser timestamps;
+        LineSplitter<SshdFormat::WORDS> lines(syslog, 0);
+        std::string_view line;
+        LineWords words;
+        LogFields fields;
+        for (size_t n = 0; lines.next(line, words); n++) {
+            scanner.scan(line, words, fields);
+            const std::string micros = std::to_string(
+                scanner.time(timestamps, fields).seconds * 1000000 + n % 997);
+            const std::string_view message = line.substr(
+                line.find(": ") + 2);
+            exported.append("__CURSOR=s=0;i=").append(std::to_string(n))
+                .append("\n__REALTIME_TIMESTAMP=").append(micros)
+                .append("\n_HOSTNAME=ceclnx01\nSYSLOG_IDENTIFIER=sshd\n"
+                        "MESSAGE=").append(message).append("\n\n");
+            json.append("{\"__CURSOR\":\"s=0;i=").append(std::to_string(n))
+                .append("\",\"__REALTIME_TIMESTAMP\":\"").append(micros)
+                .append("\",\"_HOSTNAME\":\"ceclnx01\",\"SYSLOG_IDENTIFIER\":"
+                        "\"sshd\",\"MESSAGE\":\"").append(message)
+                .append("\"}\n");
+        }
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    std::cout << "formats (" << lineCount << " logins)\n";
+    const auto run = [&](auto scanner, const std::string& log) {
+        using Format = decltype(scanner);
+        const auto start = Clock::now();
+        TimestampParser timestamps;
+        LineSplitter<Format::WORDS> lines(log, 0);
+        std::string_view line;
+        LineWords words;
+        LogFields fields;
+        long total = 0;
+        while (lines.next(line, words)) {
+            if (scanner.scan(line, words, fields)) {
+                total += scanner.time(timestamps, fields).seconds;
+            }
+        }
+        sink = total;
+        const double scanSecs = std::chrono::duration<double>(Clock::now() -
+                                                              start).count();
+        double checkSecs = 0;
+        const std::string out = captureAlerts([&](AlertWriter& alerts) {
+            const auto start = Clock::now();
+            BasicSentry<Format> sentry(bannedIPs, authorizedUsers, alerts);
+            sentry.checkLines(log);
+            checkSecs = std::chrono::duration<double>(Clock::now() -
+                                                      start).count();
+            sentry.printSummary();
+        });
+        const size_t from = out.rfind('\n', out.size() - 2) + 1;
+        std::cout << "  " << Format::NAME << ": scan "
+                  << scanSecs * 1e9 / lineCount << " ns/login, check "
+                  << checkSecs * 1e9 / lineCount << " ns/login, "
+                  << log.size() / checkSecs / 1e6 << " MB/s\n    "
+                  << out.substr(from);
+    };
+    run(FieldsFormat(), syslog);
+    run(SshdFormat(), syslog);
+    run(JournalExportFormat(), exported);
+    run(JournalJsonFormat(), json);
+}
+
+/**
+ * A stream buffer over a string that sleeps before each block, like a
+ * download from a slow host.
+ */
+class ThrottledBuf : public std::streambuf {
+public:
+    ThrottledBuf(std::string_view data, const size_t blockSize,
+                 const std::chrono::microseconds delay)
+        : data(data), blockSize(blockSize), delay(delay) {}
+
+protected:
+    int_type underflow() override {
+        if (pos >= data.size()) {
+            return traits_type::eof();
+        }
+        std::this_thread::sleep_for(delay);
+        char* start = const_cast<char*>(data.data()) + pos;
+        pos = std::min(pos + blockSize, data.size());
+        setg(start, start, const_cast<char*>(data.data()) + pos);
+        return traits_type::to_int_type(*start);
+    }
+
+private:
+    std::string_view data;
+    const size_t blockSize;
+    const std::chrono::microseconds delay;
+    size_t pos = 0;
+};
+
+void benchPipeline(const size_t lineCount) {
+    const std::string log = makeSyntheticLog(lineCount);
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    std::cout << "pipeline (" << lineCount << " lines, "
+              << std::thread::hardware_concurrency() << " CPUs)\n";
+    // Inline: read, parse, check, and write on one thread
+    const auto inlineRun = [&](std::istream& is, AlertWriter& alerts) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts);
+        std::string chunk, remainder;
+        while (readChunk(is, PIPELINE_CHUNK_BYTES, remainder, chunk)) {
+            sentry.checkLines(chunk);
+        }
+        sentry.finish();
+        sentry.printSummary();
+    };
+    const std::string expected = captureAlerts([&](AlertWriter& alerts) {
+        std::istringstream is(log);
+        inlineRun(is, alerts);
+    });
+    const std::string piped = captureAlerts([&](AlertWriter& alerts) {
+        alerts.writeInBackground();
+        std::istringstream is(log);
+        processLogsPipelined(is, bannedIPs, authorizedUsers, defaultRules(),
+                             alerts);
+    });
+    std::cout << "  same alerts: " << (piped == expected ? "yes" : "NO")
+              << '\n';
+    // From memory, from a source that sleeps 1 ms per 256 KB, and to a
+    // pipe drained 64 KB per 2 ms
+    const char* labels[] = {"memory", "slow source", "slow sink"};
+    for (const int sources : {0, 1, 2}) {
+        int fds[2] = {devNull, devNull};
+        std::thread drain;
+        if (sources == 2) {
+            if (pipe(fds) != 0) {
+                return;
+            }
+        }
+        const auto startDrain = [&] {
+            if (sources == 2) {
+                drain = std::thread([&] {
+                    char buf[1 << 16];
+                    while (read(fds[0], buf, sizeof(buf)) > 0) {
+                        std::this_thread::sleep_for(
+                            std::chrono::milliseconds(2));
+                    }
+                });
+            }
+        };
+        const auto run = [&](const bool pipelined) {
+            ThrottledBuf slow(log, 1 << 18, std::chrono::milliseconds(1));
+            std::istream slowStream(&slow);
+            std::istringstream fast(log);
+            std::istream& is = (sources == 1 ? slowStream : fast);
+            PipelineStats stats;
+            timeIt(std::string(labels[sources]) + (pipelined ? ", pipelined" :
+                   ", inline"), lineCount, log.size(), [&] {
+                AlertWriter alerts(fds[1], AlertFormat::TEXT, 1 << 16,
+                                   std::chrono::milliseconds(0));
+                if (pipelined) {
+                    alerts.writeInBackground();
+                    stats = processLogsPipelined(is, bannedIPs,
+                        authorizedUsers, defaultRules(), alerts);
+                    alerts.stopBackground();
+                    stats.output = alerts.outputStats();
+                } else {
+                    inlineRun(is, alerts);
+                }
+            });
+            if (pipelined) {
+                std::ostringstream os;
+                stats.print(os);
+                std::istringstream lines(os.str());
+                for (std::string line; std::getline(lines, line);) {
+                    std::cout << "    " << line << '\n';
+                }
+            }
+        };
+        startDrain();
+        run(false);
+        run(true);
+        if (sources == 2) {
+            close(fds[1]);
+            drain.join();
+            close(fds[0]);
+        }
+    }
+}
+
+/**
+ * Run the benchmark named on the command line, or all of them.
+ */
+int main(int argc, char *argv[]) {
+    const std::map<std::string, std::function<void(size_t)>> benchmarks = {
+        {"tokenizer", benchTokenizer},
+        {"scan", benchScan},
+        {"timestamp", benchTimestamp},
+        {"window", benchWindow},
+        {"lookup", benchLookup},
+        {"ipset", benchIpSet},
+        {"scaling", benchScaling},
+        {"mapped", benchMapped},
+        {"decompress", benchDecompress},
+        {"alerts", benchAlerts},
+        {"follow", benchFollow},
+        {"fetch", benchFetch},
+        {"poll", benchPoll},
+        {"snapshot", benchSnapshot},
+        {"reload", benchReload},
+        {"rules", benchRules},
+        {"dimensions", benchDimensions},
+        {"sketch", benchSketch},
+        {"topk", benchTopK},
+        {"batch", benchBatch},
+        {"reorder", benchReorder},
+        {"formats", benchFormats},
+        {"pipeline", benchPipeline},
+    };
+    const std::string which = (argc > 1 ? argv[1] : "all");
+    const size_t lineCount = (argc > 2 ? std::stoul(argv[2]) : 2000000);
+    for (const auto& [name, bench] : benchmarks) {
+        if (which == "all" || which == name) {
+            bench(lineCount);
+        }
+    }
+    return 0;
+}
+
+// End of source code
@@ -0,0 +1,1700 @@
+// Copyright 2023 Evan Williams
+/**
+ * Tests for the helpers used by LoginSentry. Each test checks a helper
+ * against a simpler reference (such as the original istringstream
+ * parsing), or checks that bad input is rejected, and reports every
+ * check that fails. LoginSentryBench only times the same helpers.
+ *
+ * Usage: ./LoginSentryTest [test]
+ *
+ * With no test name, all tests are run. The exit code is 0 if every
+ * check passed and 1 otherwise.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Decompressor.h"
+#include "DetectorSnapshot.h"
+#include "DistinctSketch.h"
+#include "FileFollower.h"
+#include "FrequencyWindow.h"
+#include "HeavyHitters.h"
+#include "HttpFetch.h"
+#include "IpPrefixSet.h"
+#include "KeyInterner.h"
+#include "LineSplitter.h"
+#include "ListReloader.h"
+#include "LogTokenizer.h"
+#include "MappedFile.h"
+#include "MergedSentry.h"
+#include "ParallelSentry.h"
+#include "PipelinedSentry.h"
+#include "PollState.h"
+#include "RuleEngine.h"
+#include "Sentry.h"
+#include "SyntheticLog.h"
+#include "SyslogTime.h"
+#include "TestLogServer.h"
+
+/** The number of checks that failed so far */
+int failures = 0;
+
+/** A file descriptor for discarding output */
+const int devNull = open("/dev/null", O_WRONLY);
+
+/**
+ * Helper method to record the outcome of one check, printing it if it
+ * failed.
+ *
+ * @param ok True if the check passed.
+ *
+ * @param what A description of what was checked.
+ */
+void check(const bool ok, const std::string& what) {
+    if (!ok) {
+        std::cout << "  FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+/**
+ * Helper method to check that two values are equal, printing both if
+ * they are not.
+ */
+template <class T, class U>
+void checkEqual(const T& actual, const U& expected, const std::string& what) {
+    if (!(actual == expected)) {
+        std::ostringstream os;
+        os << what << ": got " << actual << ", expected " << expected;
+        check(false, os.str());
+    }
+}
+
+/**
+ * Helper method to check that an operation throws a given exception.
+ *
+ * @tparam Exception The type of exception expected.
+ */
+template <class Exception>
+void checkThrows(const std::function<void()>& op, const std::string& what) {
+    try {
+        op();
+    } catch (const Exception&) {
+        return;
+    }
+    check(false, what + ": no exception");
+}
+
+/**
+ * Check that tokenizeLine extracts the same fields as the original
+ * istringstream extraction, for a synthetic log and for lines with
+ * tabs, repeated spaces, and missing fields.
+ */
+void testTokenizer() {
+    std::string log = makeSyntheticLog(2000);
+    log += "Aug\t29  11:01:01 h sshd[1]: Failed password for bob from "
+           "1.2.3.4 port 1\n"
+           "  Aug 29 11:01:01 h sshd[1]: Failed password for bob\n"
+           "Aug 29\n\n";
+    std::istringstream is(log);
+    std::string line;
+    for (int lineNumber = 1; std::getline(is, line); lineNumber++) {
+        std::string month, day, time, user, ip, dummy;
+        std::istringstream(line) >> month >> day >> time >> dummy
+            >> dummy >> dummy >> dummy >> dummy >> user >> dummy >> ip;
+        LogFields fields;
+        tokenizeLine(line, fields);
+        const std::string where = "line " + std::to_string(lineNumber);
+        checkEqual(fields.month, month, where + " month");
+        checkEqual(fields.day, day, where + " day");
+        checkEqual(fields.time, time, where + " time");
+        checkEqual(fields.user, user, where + " user");
+        checkEqual(fields.ip, ip, where + " IP");
+    }
+}
+
+/**
+ * Check that FrequencyTracker reports the same logins as the original
+ * list of every login time per user, for the default rule and a wider
+ * one, on a log with few enough users that both rules fire.
+ */
+void testWindow() {
+    const std::string log = makeSyntheticLog(50000, 20);
+    for (const FrequencyRule rule : {FrequencyRule(), FrequencyRule{5, 60}}) {
+        std::unordered_map<std::string, std::vector<long>> loginTimes;
+        KeyInterner users;
+        FrequencyTracker tracker(rule);
+        TimestampParser timestamps;
+        LogFields fields;
+        size_t expected = 0, hits = 0;
+        for (size_t pos = 0, end; pos < log.size(); pos = end + 1) {
+            end = log.find('\n', pos);
+            tokenizeLine(std::string_view(log).substr(pos, end - pos),
+                         fields);
+            const long seconds = timestamps.toSeconds(fields.month,
+                fields.day, fields.time);
+            std::vector<long>& times = loginTimes[std::string(fields.user)];
+            times.push_back(seconds);
+            const size_t n = times.size();
+            expected += n > rule.maxAttempts &&
+                times[n - 1] - times[n - 1 - rule.maxAttempts] <= rule.window;
+            hits += tracker.record(users.intern(fields.user), seconds);
+        }
+        const std::string what = "hits for max " +
+            std::to_string(rule.maxAttempts);
+        check(expected > 0, what + " fire");
+        checkEqual(hits, expected, what);
+    }
+}
+
+/**
+ * Check the distinct-user sketches against exact counts: keys with up
+ * to EXACT_USERS users in the window must be counted exactly, and a
+ * threshold below that must alert exactly when DistinctTracker does.
+ * Each key draws its users from a pool of its own size, so some keys
+ * stay small and others outgrow the exact count.
+ */
+void testSketch() {
+    using Sketch = DistinctSketchTracker;
+    const FrequencyRule rule = {10, 600};
+    Sketch sketch(rule);
+    DistinctTracker exact(rule);
+    // The last login time of each user of each key
+    std::vector<std::unordered_map<KeyInterner::Id, long>> lastSeen(10);
+    std::mt19937 random(5);
+    size_t exactCounts = 0, hits = 0;
+    for (long i = 0, seconds = 0; i < 200000; i++) {
+        seconds += random() % 2;
+        const KeyInterner::Id key = random() % lastSeen.size();
+        const KeyInterner::Id user = random() % (key * 8 + 1);
+        lastSeen[key][user] = seconds;
+        size_t inWindow = 0;
+        for (const auto& [other, when] : lastSeen[key]) {
+            inWindow += (when >= seconds - rule.window);
+        }
+        const bool hit = sketch.record(key, user, seconds);
+        hits += hit;
+        if (hit != exact.record(key, user, seconds)) {
+            check(false, "alert at login " + std::to_string(i));
+            break;
+        }
+        if (inWindow <= Sketch::EXACT_USERS) {
+            exactCounts++;
+            if (sketch.estimate(key) != inWindow) {
+                checkEqual(sketch.estimate(key), inWindow,
+                           "count at login " + std::to_string(i));
+                break;
+            }
+        }
+    }
+    check(hits > 0 && exactCounts > 0 && exactCounts < 200000,
+          "both small and large keys alert and are counted");
+}
+
+/**
+ * Check Space-Saving summaries against exact counts: with c counters
+ * over n occurrences, every key with more than n / c must be tracked,
+ * and each tracked count must be at most its error above the true
+ * count. Summaries of parts of a stream (of different capacities, and
+ * with different heavy keys) merged together must keep both
+ * guarantees over the whole stream.
+ */
+void testHeavyHitters() {
+    using Exact = std::unordered_map<std::string, std::uint64_t>;
+    const auto checkSummary = [](const SpaceSaving& summary,
+                                 const size_t capacity, const Exact& exact,
+                                 const std::string& what) {
+        std::uint64_t n = 0;
+        for (const auto& [key, count] : exact) {
+            n += count;
+        }
+        checkEqual(summary.size(), n, what + " size");
+        const std::vector<SpaceSaving::Counter> top = summary.top(capacity);
+        std::set<std::string> tracked;
+        for (const SpaceSaving::Counter& counter : top) {
+            tracked.insert(counter.key);
+            const auto it = exact.find(counter.key);
+            const std::uint64_t count = it == exact.end() ? 0 : it->second;
+            if (counter.count - counter.error > count ||
+                count > counter.count) {
+                check(false, what + " bounds the count of " + counter.key);
+                return;
+            }
+        }
+        size_t heavy = 0;
+        for (const auto& [key, count] : exact) {
+            if (count > n / capacity) {
+                heavy++;
+                if (!tracked.count(key)) {
+                    check(false, what + " tracks " + key);
+                    return;
+                }
+            }
+        }
+        check(heavy > 0 && top.size() == capacity, what + " is full");
+        check(std::is_sorted(top.begin(), top.end(), [](const auto& a,
+                                                        const auto& b) {
+            return a.count > b.count;
+        }), what + " top is highest first");
+    };
+    // Each part draws from a skewed distribution over its own ranking
+    // of the keys, so that parts disagree on which keys are heavy
+    std::mt19937 random(19);
+    const std::vector<size_t> capacities = {50, 80, 50, 20};
+    SpaceSaving merged(50);
+    Exact all;
+    for (size_t part = 0; part < capacities.size(); part++) {
+        SpaceSaving summary(capacities[part]);
+        Exact exact;
+        std::vector<int> rank(2000);
+        for (size_t i = 0; i < rank.size(); i++) {
+            rank[i] = static_cast<int>(i);
+        }
+        std::shuffle(rank.begin(), rank.end(), random);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        for (int i = 0; i < 50000; i++) {
+            // Rank r is drawn with a probability falling off as 1/r^2
+            const double u = uniform(random);
+            const size_t r = static_cast<size_t>(1 / (1 - u * 0.9995)) - 1;
+            const std::string key = "10.0." +
+                std::to_string(rank[std::min(r, rank.size() - 1)]);
+            summary.offer(key);
+            exact[key]++;
+            all[key]++;
+        }
+        const std::string what = "part " + std::to_string(part);
+        checkSummary(summary, capacities[part], exact, what);
+        merged.merge(summary);
+        checkSummary(merged, 50, all, "merge of " + what);
+    }
+}
+
+/**
+ * Check KeyInterner against a std::unordered_map from a small table
+ * through many rehashes: new keys get the next ID, repeated keys keep
+ * theirs, every key still finds its ID and text after each rehash, and
+ * keys never interned are not found. The keys include the empty key,
+ * prefixes of one another, and an embedded NUL.
+ */
+void testInterner() {
+    KeyInterner interner(1);
+    std::unordered_map<std::string, KeyInterner::Id> exact;
+    const auto checkAll = [&](const std::string& what) {
+        checkEqual(interner.size(), exact.size(), what + " size");
+        for (const auto& [key, id] : exact) {
+            if (interner.find(key) != id || interner.key(id) != key) {
+                check(false, what + " finds " + key);
+                return;
+            }
+        }
+        for (const char* missing : {"10.0.0.x", "user", "10.0.0.-1"}) {
+            check(!interner.contains(missing), what + " lacks " + missing);
+        }
+    };
+    checkAll("empty");
+    std::mt19937 random(4);
+    const std::vector<std::string> shortKeys = {"", "1", "10", "1.0",
+        std::string("a\0b", 3), std::string("a\0c", 3)};
+    for (const std::string& key : shortKeys) {
+        exact.emplace(key, static_cast<KeyInterner::Id>(exact.size()));
+        checkEqual(interner.intern(key), exact[key], "ID of short key");
+    }
+    checkAll("short keys");
+    for (int i = 0; i < 50000; i++) {
+        // Draw both new and repeated keys
+        const std::string key = "10.0.0." + std::to_string(random() %
+                                                            (i + 1));
+        const auto [it, added] = exact.emplace(key,
+            static_cast<KeyInterner::Id>(exact.size()));
+        const KeyInterner::Id id = interner.intern(key);
+        if (id != it->second) {
+            checkEqual(id, it->second, "ID of " + key);
+            return;
+        }
+        // Check everything each time the keys double (past a rehash)
+        if (added && (exact.size() & (exact.size() - 1)) == 0) {
+            checkAll("at " + std::to_string(exact.size()) + " keys");
+        }
+    }
+    check(exact.size() > 20000, "most keys are new");
+    checkAll("at the end");
+}
+
+/**
+ * Check IpPrefixSet against a brute-force scan of its ranges: IPv4
+ * addresses and ranges of every length, some IPv6 ones, probes that
+ * are not addresses (never banned), and entries that must be rejected.
+ */
+void testIpSet() {
+    std::mt19937 random(381);
+    const auto dotted = [](const std::uint32_t a) {
+        return std::to_string(a >> 24) + '.' + std::to_string(a >> 16 & 255) +
+               '.' + std::to_string(a >> 8 & 255) + '.' +
+               std::to_string(a & 255);
+    };
+    // Ranges within 10.0.0.0/8, so that random probes hit some of them
+    std::vector<std::pair<std::uint32_t, int>> bans;
+    IpPrefixSet set;
+    for (int i = 0; i < 3000; i++) {
+        const int len = (i % 100 == 0 ? 12 + i / 100 % 12 : i % 5 == 0 ?
+                         24 + random() % 8 : 32);
+        const std::uint32_t addr = (10u << 24 | (random() & 0xffffff)) &
+                                   (~0u << (32 - len));
+        bans.emplace_back(addr, len);
+        set.insert(dotted(addr) + (len < 32 || i % 2 ? "/" +
+                   std::to_string(len) : ""));
+    }
+    size_t mismatches = 0, hits = 0;
+    for (int i = 0; i < 20000; i++) {
+        const std::uint32_t addr = 10u << 24 | (random() & 0xffffff);
+        bool banned = false;
+        for (const auto& [net, len] : bans) {
+            banned |= (addr & (~0u << (32 - len))) == net;
+        }
+        mismatches += (banned != set.contains(dotted(addr)));
+        hits += banned;
+    }
+    checkEqual(mismatches, size_t(0), "IPv4 mismatches");
+    check(hits > 0 && hits < 20000, "some probes are banned");
+    set.insert("2001:db8::/32");
+    set.insert("2001:db9::1");
+    check(set.contains("2001:db8:ffff::1"), "in an IPv6 range");
+    check(set.contains("2001:db9::1"), "an IPv6 address");
+    check(!set.contains("2001:db9::2"), "next to an IPv6 address");
+    check(!set.contains("2001:db7:ffff::1"), "outside an IPv6 range");
+    for (const char* probe : {"", "10.0.0", "10.0.0.1.2", "host",
+                              "10.0.0.256"}) {
+        check(!set.contains(probe), std::string("not an address: ") + probe);
+    }
+    for (const char* entry : {"", "host", "10.0.0.1/", "10.0.0.1/33",
+                              "10.0.0.1/x", "10.0.0/8", "::1/129"}) {
+        checkThrows<std::runtime_error>([&] { set.insert(entry); },
+            std::string("entry ") + entry);
+    }
+}
+
+/**
+ * Check that AlertWriter's text output is byte for byte what the
+ * original std::cout statements printed, whether it writes inline or
+ * on a writer thread, and that the JSON and TSV formats escape what
+ * their syntax needs.
+ */
+void testAlerts() {
+    const std::string log = makeSyntheticLog(100000);
+    std::string expected;
+    const auto report = [&](AlertWriter& alerts) {
+        size_t lines = 0;
+        for (size_t pos = 0; pos < log.size(); lines++) {
+            const size_t end = log.find('\n', pos);
+            const std::string_view line =
+                std::string_view(log).substr(pos, end - pos);
+            alerts.alert(lines % 2 ? FREQUENCY_ALERT : BANNED_IP_ALERT,
+                         "user", "ip", 0, line);
+            pos = end + 1;
+        }
+        alerts.summary(lines, lines);
+    };
+    size_t lines = 0;
+    for (size_t pos = 0; pos < log.size(); lines++) {
+        const size_t end = log.find('\n', pos);
+        expected.append(lines % 2 ? "Hacking due to frequency. Line: " :
+                        "Hacking due to banned IP. Line: ")
+                .append(log, pos, end - pos) += '\n';
+        pos = end + 1;
+    }
+    expected += "Processed " + std::to_string(lines) + " lines. Found " +
+                std::to_string(lines) + " possible hacking attempts.\n";
+    checkEqual(captureAlerts(report) == expected, true, "text output");
+    checkEqual(captureAlerts([&](AlertWriter& alerts) {
+        alerts.writeInBackground(2);
+        report(alerts);
+    }) == expected, true, "text output from a writer thread");
+    const auto one = [](AlertWriter& alerts) {
+        alerts.alert(FREQUENCY_ALERT, "a\"b\\c\td", "10.0.0.1", 42, "line");
+    };
+    checkEqual(captureAlerts(one, AlertFormat::JSON),
+        std::string("{\"rule\":\"frequency\",\"user\":\"a\\\"b\\\\c"
+                    "\\u0009d\",\"ip\":\"10.0.0.1\",\"time\":42}\n"),
+        "JSON escapes");
+    checkEqual(captureAlerts(one, AlertFormat::TSV),
+        std::string("frequency\ta\"b\\\\c\\td\t10.0.0.1\t42\n"),
+        "TSV escapes");
+}
+
+/**
+ * Check that the four log formats find the same logins in the same log
+ * written four ways (the syslog lines as they are, and as journal
+ * export records and JSON objects), so their TSV alerts (rule, user,
+ * IP, time) are the same. Then check that the sshd scanner finds the
+ * user and IP of the other sshd messages it accepts, and skips the
+ * messages that are not logins.
+ */
+void testFormats() {
+    const std::string syslog = makeSyntheticLog(30000, 50, 600);
+    std::string exported, json;
+    SshdFormat sshd;
+    TimestampParser timestamps;
+    LineSplitter<SshdFormat::WORDS> lines(syslog, 0);
+    std::string_view line;
+    LineWords words;
+    LogFields fields;
+    for (size_t n = 0; lines.next(line, words); n++) {
+        sshd.scan(line, words, fields);
+        const std::string micros = std::to_string(
+            sshd.time(timestamps, fields).seconds * 1000000 + n % 997);
+        const std::string_view message = line.substr(line.find(": ") + 2);
+        exported.append("__CURSOR=s=0;i=").append(std::to_string(n))
+            .append("\n__REALTIME_TIMESTAMP=").append(micros)
+            .append("\n_HOSTNAME=ceclnx01\nMESSAGE=").append(message)
+            .append("\n\n");
+        json.append("{\"__CURSOR\":\"s=0;i=").append(std::to_string(n))
+            .append("\",\"__REALTIME_TIMESTAMP\":\"").append(micros)
+            .append("\",\"MESSAGE\":\"").append(message).append("\"}\n");
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    // The alerts and the hack count, without the line count, which
+    // differs between the formats
+    const auto run = [&](auto scanner, const std::string& log) {
+        using Format = decltype(scanner);
+        const std::string out = captureAlerts([&](AlertWriter& alerts) {
+            BasicSentry<Format> sentry(bannedIPs, authorizedUsers, alerts);
+            sentry.checkLines(log);
+            sentry.printSummary();
+        }, AlertFormat::TSV);
+        const size_t summary = out.rfind("summary\t");
+        return out.substr(0, summary) +
+               out.substr(out.find('\t', summary + 8));
+    };
+    const std::string expected = run(FieldsFormat(), syslog);
+    check(expected.find("banned_ip\t") != std::string::npos &&
+          expected.find("frequency\t") != std::string::npos,
+          "both rules fire");
+    checkEqual(run(SshdFormat(), syslog) == expected, true, "sshd");
+    checkEqual(run(JournalExportFormat(), exported) == expected, true,
+               "export");
+    checkEqual(run(JournalJsonFormat(), json) == expected, true, "json");
+    const std::pair<const char*, const char*> messages[] = {
+        {"Failed password for invalid user bob from 10.1.1.1 port 22 ssh2",
+         "bob 10.1.1.1"},
+        {"Accepted publickey for root from 2001:db8::1 port 22 ssh2: RSA "
+         "SHA256:abc", "root 2001:db8::1"},
+        {"Failed keyboard-interactive/pam for eve from 10.1.1.2 port 22 "
+         "ssh2", "eve 10.1.1.2"},
+        {"message repeated 2 times: [ Failed password for sam from "
+         "10.1.1.3 port 22 ssh2]", "sam 10.1.1.3"},
+        {"Failed password for user name from 10.1.1.4 port 22 ssh2",
+         "user name 10.1.1.4"},
+        {"Invalid user bob from 10.1.1.1 port 22", ""},
+        {"Connection closed by 10.1.1.1 port 22 [preauth]", ""},
+        {"Failed password for", ""},
+    };
+    for (const auto& [message, expectedFields] : messages) {
+        const std::string text = std::string("Jun 10 03:32:36 ceclnx01 "
+                                             "sshd[1]: ") + message;
+        LineSplitter<SshdFormat::WORDS> one(text, 0);
+        one.next(line, words);
+        const std::string found = sshd.scan(line, words, fields) ?
+            std::string(fields.user) + " " + std::string(fields.ip) : "";
+        checkEqual(found, std::string(expectedFields), message);
+    }
+}
+
+/**
+ * Helper method to split text with a LineSplitter from a position and
+ * compare every line and its first Words words with a byte-by-byte
+ * split (lines at '\n', words between isLogSpace characters).
+ *
+ * @return The number of lines that differed.
+ */
+template <size_t Words>
+size_t splitMismatches(std::string_view text, const size_t pos) {
+    LineSplitter<Words> lines(text, pos);
+    std::string_view line;
+    LineWords words;
+    size_t mismatches = 0;
+    for (size_t start = pos; start < text.size();) {
+        size_t end = text.find('\n', start);
+        end = (end == std::string_view::npos ? text.size() : end);
+        const std::string_view expected = text.substr(start, end - start);
+        std::vector<std::uint32_t> bounds;
+        for (size_t i = 0; i < expected.size() &&
+                           bounds.size() < 2 * Words; i++) {
+            const bool space = isLogSpace(expected[i]),
+                before = (i == 0 || isLogSpace(expected[i - 1]));
+            if (space != before) {
+                bounds.push_back(static_cast<std::uint32_t>(i));
+            }
+        }
+        if (bounds.size() % 2 != 0) {
+            bounds.push_back(static_cast<std::uint32_t>(expected.size()));
+        }
+        if (!lines.next(line, words) || line != expected ||
+            words.boundCount != bounds.size() ||
+            !std::equal(bounds.begin(), bounds.end(), words.bounds)) {
+            mismatches++;
+        }
+        start = end + 1;
+    }
+    return mismatches + lines.next(line, words);
+}
+
+/**
+ * Check LineSplitter against a byte-by-byte split: random text of
+ * words, every kind of whitespace, empty and long lines, with and
+ * without a final newline, at sizes around the 64-byte blocks and from
+ * positions other than 0; for 0, 3, and the most words per line.
+ */
+void testSplitter() {
+    std::mt19937 random(24);
+    const char alphabet[] = "ab\xff  \t\r\v\f\n\n";
+    size_t mismatches = 0;
+    for (int round = 0; round < 3000; round++) {
+        std::string text;
+        const size_t size = (round < 300 ? round : random() % 2000);
+        // Some texts are mostly long words, so lines cross blocks
+        const bool longWords = (round % 3 == 0);
+        while (text.size() < size) {
+            text += (longWords && random() % 8 ? 'w' :
+                     alphabet[random() % (sizeof(alphabet) - 1)]);
+        }
+        const size_t newline = text.find('\n', random() % (size + 1));
+        const size_t pos = (round % 2 || newline == std::string::npos ?
+                            0 : newline + 1);
+        mismatches += splitMismatches<0>(text, pos) +
+                      splitMismatches<3>(text, pos) +
+                      splitMismatches<LineWords::MAX>(text, pos);
+    }
+    checkEqual(mismatches, size_t(0), "mismatched lines");
+}
+
+/**
+ * Helper method to check a log with a single-threaded Sentry and
+ * return its output, which the other ways of processing the log must
+ * reproduce exactly.
+ */
+std::string checkSingle(const std::string& log, const IpPrefixSet& bannedIPs,
+                        const LookupMap& authorizedUsers) {
+    return captureAlerts([&](AlertWriter& alerts) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts);
+        sentry.checkLines(log);
+        sentry.printSummary();
+    });
+}
+
+/**
+ * Helper method to obtain a rule set with one rule of each kind, for
+ * tests that need every tracker to hold some state.
+ */
+RuleSet everyKindOfRule() {
+    RuleSet rules(4);
+    rules[0].name = "frequency";
+    rules[0].measure = RuleSpec::ATTEMPTS;
+    rules[0].key = RuleSpec::USER;
+    rules[1].name = "ip_burst";
+    rules[1].measure = RuleSpec::ATTEMPTS;
+    rules[1].key = RuleSpec::IP;
+    rules[1].rule = {5, 60};
+    rules[2].name = "spray";
+    rules[2].measure = RuleSpec::USERS;
+    rules[2].key = RuleSpec::IP;
+    rules[2].rule = {3, 300};
+    rules[2].v4Prefix = 24;
+    rules[3].name = "wide_spray";
+    rules[3].measure = RuleSpec::ESTIMATED_USERS;
+    rules[3].key = RuleSpec::IP;
+    rules[3].rule = {10, 3600};
+    rules[3].v4Prefix = 16;
+    return rules;
+}
+
+/**
+ * Check that loadRules accepts valid rule files and rejects invalid
+ * ones, such as a negative max, with a runtime_error naming the line.
+ */
+void testRulesFile() {
+    const std::string path = "/tmp/LoginSentryTest.rules";
+    const auto load = [&](const std::string& text) {
+        std::ofstream(path) << text;
+        return loadRules(path);
+    };
+    const RuleSet rules = load("# name counts per max window\n\n"
+        "frequency attempts user 3 20\n"
+        "  net   attempts ip/24 50 300\n"
+        "spray users ip/16/48 100 3600\n"
+        "wide distinct ip 1000000000 3600\n");
+    checkEqual(rules.size(), 4u, "rules loaded");
+    if (rules.size() == 4) {
+        checkEqual(rules[1].v4Prefix, 24, "net IPv4 prefix");
+        checkEqual(rules[1].v6Prefix, 64, "net IPv6 prefix");
+        checkEqual(rules[2].v6Prefix, 48, "spray IPv6 prefix");
+        checkEqual(rules[3].rule.maxAttempts, 1000000000u, "wide max");
+    }
+    const std::vector<std::string> bad = {
+        "r attempts user -1 20", "r users ip -1 20", "r distinct ip -1 20",
+        "r attempts user 3 -1", "r attempts user 99999999999999999999 20",
+        "r attempts user 2000000 20", "r users ip 2000000 20",
+        "r attempts user x 20", "r attempts user 3", "r attempts user 3 20 x",
+        "r tries user 3 20", "r users user 3 20", "r attempts host 3 20",
+        "r attempts ip/33 3 20", "r attempts ip/24/129 3 20",
+        "r attempts ip/x 3 20", "# only a comment",
+    };
+    for (const std::string& rule : bad) {
+        checkThrows<std::runtime_error>([&] { load(rule + "\n"); }, rule);
+    }
+    checkThrows<std::runtime_error>([&] { loadRules("/nonexistent"); },
+                                    "missing file");
+    std::remove(path.c_str());
+}
+
+/**
+ * Check RuleEngine against a direct reading of the rules, which keeps
+ * every login of every key and counts those within each window, on a
+ * log where every rule fires. For each login, the first rule violated
+ * (if any) must be the same.
+ */
+void testRules() {
+    const std::string log = makeSyntheticLog(40000, 20, 600);
+    RuleSet rules = everyKindOfRule();
+    rules.pop_back();  // The sketch is only approximate
+    // An IP logs in about every 600 s, and two of the /24s every 2.3 s
+    rules[1].rule = {3, 600};
+    rules[2].rule = {2, 600};
+    rules[2].v4Prefix = 32;
+    rules.push_back(rules[1]);
+    rules.back().name = "net_burst";
+    rules.back().v4Prefix = 24;
+    rules.back().rule = {280, 600};
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    RuleEngine engine(authorizedUsers, rules);
+    // The logins of each key of each rule: (time, user)
+    std::vector<std::map<std::string, std::deque<std::pair<long,
+        std::string>>>> logins(rules.size());
+    std::vector<size_t> fired(rules.size());
+    size_t mismatches = 0;
+    TimestampParser timestamps;
+    LogFields fields;
+    size_t lineNumber = 0;
+    for (size_t pos = 0, end; pos < log.size(); pos = end + 1) {
+        end = log.find('\n', pos);
+        tokenizeLine(std::string_view(log).substr(pos, end - pos), fields);
+        lineNumber++;
+        const long seconds = timestamps.toSeconds(fields.month, fields.day,
+                                                  fields.time);
+        const std::string user(fields.user), ip(fields.ip);
+        size_t expected = rules.size();
+        for (size_t r = 0; r < rules.size() && !authorizedUsers.contains(
+                 user); r++) {
+            const RuleSpec& spec = rules[r];
+            // The key: the user, the IP, or the IPv4 prefix of the IP
+            std::string key = (spec.key == RuleSpec::USER ? user : ip);
+            for (int octets = 4; octets * 8 > spec.v4Prefix; octets--) {
+                key = key.substr(0, key.rfind('.'));
+            }
+            auto& seen = logins[r][key];
+            seen.emplace_back(seconds, user);
+            while (seen.front().first < seconds - spec.rule.window) {
+                seen.pop_front();
+            }
+            std::set<std::string> users;
+            size_t attempts = 0;
+            for (const auto& [time, who] : seen) {
+                if (time >= seconds - spec.rule.window) {
+                    attempts++;
+                    users.insert(who);
+                }
+            }
+            const size_t count = (spec.measure == RuleSpec::ATTEMPTS ?
+                                  attempts : users.size());
+            if (count > spec.rule.maxAttempts) {
+                fired[r]++;
+                expected = std::min(expected, r);
+            }
+        }
+        const RuleSpec* rule = engine.check(fields.user, fields.ip,
+                                            seconds);
+        const std::string name = (rule ? rule->name : "none");
+        const std::string want = (expected < rules.size() ?
+                                  rules[expected].name : "none");
+        if (name != want && mismatches++ == 0) {
+            checkEqual(name, want, "rule of line " +
+                       std::to_string(lineNumber));
+        }
+    }
+    checkEqual(mismatches, 0u, "lines with a different rule");
+    for (size_t r = 0; r < rules.size(); r++) {
+        check(fired[r] > 0, rules[r].name + " fires");
+    }
+}
+
+/**
+ * Check that a Sentry restored from a snapshot carries on exactly as
+ * if it had not stopped, and that truncated or corrupted snapshots
+ * either restore a usable state or are rejected with a runtime_error,
+ * which is what LoginSentry catches to start afresh.
+ */
+void testSnapshot() {
+    const std::string log = makeSyntheticLog(6000, 20, 200);
+    const size_t half = log.find('\n', log.size() / 2) + 1;
+    const std::string_view first = std::string_view(log).substr(0, half),
+                           second = std::string_view(log).substr(half);
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.0.0/28");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const RuleSet rules = everyKindOfRule();
+    const std::string expected = captureAlerts([&](AlertWriter& alerts) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts, rules, 10);
+        sentry.checkLines(log);
+        sentry.finish();
+        sentry.printSummary();
+    });
+    std::string data;
+    const std::string before = captureAlerts([&](AlertWriter& alerts) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts, rules, 10);
+        sentry.checkLines(first);
+        SnapshotWriter writer;
+        sentry.snapshot(writer);
+        data = writer.data();
+    });
+    // Restore the snapshot, or a damaged copy, and check some more
+    const auto resume = [&](std::string_view snapshot, AlertWriter& alerts,
+                            std::string_view text) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts, rules, 10);
+        SnapshotReader reader(snapshot);
+        sentry.snapshot(reader);
+        sentry.checkLines(text);
+        sentry.finish();
+        sentry.printSummary();
+    };
+    checkEqual(before + captureAlerts([&](AlertWriter& alerts) {
+        resume(data, alerts, second);
+    }) == expected, true, "restored output");
+    // A damaged state only has to survive a few hundred lines
+    AlertWriter discard(devNull);
+    const std::string_view some = second.substr(0, 30000);
+    size_t rejected = 0, damaged = 0;
+    const auto tryDamaged = [&](const std::string& snapshot,
+                                const std::string& what) {
+        damaged++;
+        try {
+            resume(snapshot, discard, some);
+        } catch (const std::runtime_error&) {
+            rejected++;
+        } catch (const std::exception& e) {
+            check(false, what + ": threw " + e.what());
+        }
+    };
+    for (size_t size = 0; size < data.size(); size += 8) {
+        tryDamaged(data.substr(0, size), "truncated to " +
+                   std::to_string(size));
+    }
+    checkEqual(rejected, damaged, "truncated snapshots rejected");
+    // Overwrite each 8-byte value in turn, which hits every count,
+    // table slot, ID, and offset
+    rejected = damaged = 0;
+    const std::int64_t values[] = {0, -1, 1L << 40, 0x7fffffff};
+    for (size_t pos = sizeof(SNAPSHOT_MAGIC); pos < data.size(); pos += 8) {
+        for (const std::int64_t value : values) {
+            std::string snapshot = data;
+            std::memcpy(&snapshot[pos], &value, sizeof(value));
+            tryDamaged(snapshot, "value " + std::to_string(value) +
+                       " at " + std::to_string(pos));
+        }
+    }
+    check(rejected > 0, "corrupt snapshots rejected");
+}
+
+/**
+ * Check that a gzip-compressed log streamed through LogInput gives the
+ * same output as the plain log, and that a truncated one is reported
+ * as an error rather than ending quietly.
+ */
+void testDecompress() {
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    const std::string log = makeSyntheticLog(20000, 50, 5000);
+    const std::string expected = checkSingle(log, bannedIPs,
+                                             authorizedUsers);
+    const std::string gz = gzipCompress(log);
+    checkEqual(captureAlerts([&](AlertWriter& alerts) {
+        std::istringstream is(gz);
+        LogInput input(is);
+        Sentry sentry(bannedIPs, authorizedUsers, alerts);
+        for (std::string line; std::getline(input.stream(), line);) {
+            sentry.checkLine(line);
+        }
+        sentry.printSummary();
+        checkEqual(input.error(), "", "gzip error");
+    }) == expected, true, "gzip output");
+    std::istringstream is(gz.substr(0, gz.size() / 2));
+    LogInput input(is);
+    std::ostringstream text;
+    text << input.stream().rdbuf();
+    check(!input.error().empty(), "truncated gzip is an error");
+}
+
+/**
+ * Helper method to feed a whole response to an HttpResponseParser, the
+ * way a download would, and return the body it passed on.
+ *
+ * @param ok Set to false if the parser rejected the response.
+ */
+std::string parseResponse(HttpResponseParser& parser,
+                          const std::string& response, bool& ok) {
+    std::string body;
+    ok = parser.feed(response, [&](std::string_view data) {
+        body.append(data);
+    }) && parser.finish();
+    return body;
+}
+
+/**
+ * Check that HttpResponseParser handles well-formed responses and
+ * rejects malformed lengths and ranges with an error, rather than by
+ * throwing out of the download loop.
+ */
+void testHttpHeaders() {
+    const std::vector<std::pair<std::string, std::string>> good = {
+        {"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", "hello"},
+        {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+         "3\r\nhel\r\n2;x=y\r\nlo\r\n0\r\n\r\n", "hello"},
+        {"HTTP/1.0 200 OK\nContent-Length:  5 \n\nhello", "hello"},
+    };
+    for (const auto& [response, body] : good) {
+        HttpResponseParser parser;
+        bool ok;
+        checkEqual(parseResponse(parser, response, ok), body, response);
+        check(ok && parser.error().empty(), response + ": " +
+              parser.error());
+    }
+    HttpResponseParser resumed(3);
+    bool ok;
+    checkEqual(parseResponse(resumed, "HTTP/1.1 206 Partial\r\n"
+        "Content-Range: bytes 3-4/5\r\nContent-Length: 2\r\n\r\nlo",
+        ok), "lo", "resumed body");
+    check(ok, "resumed response: " + resumed.error());
+    // A 416 means nothing new, unless the log is now below the offset
+    for (const auto& [size, restart] : {std::pair<std::string, bool>{"3",
+             false}, {"2", true}}) {
+        HttpResponseParser refused(3);
+        parseResponse(refused, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */" + size + "\r\n\r\n", ok);
+        check(ok && refused.complete(), "416 for size " + size + ": " +
+              refused.error());
+        checkEqual(refused.restart(), restart, "restart for size " + size);
+    }
+    const std::vector<std::string> bad = {
+        "HTTP/1.1 200 OK\r\nContent-Length: abc\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nContent-Length: -5\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nContent-Length: 5x\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nContent-Length:\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nContent-Length: 99999999999999999999\r\n\r\n",
+        "HTTP/1.1 206 Partial\r\nContent-Range: bytes x-4/5\r\n\r\nlo",
+        "HTTP/1.1 206 Partial\r\nContent-Range: bytes 3\r\n\r\nlo",
+        "HTTP/1.1 206 Partial\r\n"
+        "Content-Range: bytes 99999999999999999999-1/2\r\n\r\nlo",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+        "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */x\r\n\r\n",
+    };
+    for (const std::string& response : bad) {
+        HttpResponseParser parser(3);
+        try {
+            parseResponse(parser, response, ok);
+            check(!ok && !parser.error().empty(), response + ": accepted");
+        } catch (const std::exception& e) {
+            check(false, response + ": threw " + e.what());
+        }
+    }
+}
+
+/**
+ * Check that scanning a memory-mapped file with checkLines writes the
+ * same output as checking each line read with getline, with and without
+ * a newline at the end of the file.
+ */
+void testMapped() {
+    const std::string path = "/tmp/LoginSentryTest.log";
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    std::string log = makeSyntheticLog(20000, 50, 5000);
+    for (const bool newline : {true, false}) {
+        if (!newline) {
+            log.pop_back();
+        }
+        std::ofstream(path) << log;
+        const std::string expected = captureAlerts([&](AlertWriter& alerts) {
+            Sentry sentry(bannedIPs, authorizedUsers, alerts);
+            std::istringstream is(log);
+            for (std::string line; std::getline(is, line);) {
+                sentry.checkLine(line);
+            }
+            sentry.printSummary();
+        });
+        checkEqual(captureAlerts([&](AlertWriter& alerts) {
+            const MappedFile file(path);
+            Sentry sentry(bannedIPs, authorizedUsers, alerts);
+            sentry.checkLines(file.data());
+            sentry.printSummary();
+        }) == expected, true, std::string("mapped file output") +
+            (newline ? "" : " without a final newline"));
+    }
+    std::remove(path.c_str());
+}
+
+/**
+ * Check that the batched checkLines writes the same output as checking
+ * one line at a time with checkLine, for every kind of rule, with
+ * banned IPs and an authorized user, and with reordering.
+ */
+void testBatch() {
+    const std::string log = makeSyntheticLog(50000, 50, 600);
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const RuleSet rules = everyKindOfRule();
+    for (const long lateness : {0, 10}) {
+        const auto run = [&](const bool batched) {
+            return captureAlerts([&](AlertWriter& alerts) {
+                Sentry sentry(bannedIPs, authorizedUsers, alerts, rules,
+                              lateness);
+                if (batched) {
+                    sentry.checkLines(log);
+                } else {
+                    for (size_t pos = 0; pos < log.size();) {
+                        const size_t end = log.find('\n', pos);
+                        sentry.checkLine(std::string_view(log).substr(pos,
+                            end - pos));
+                        pos = end + 1;
+                    }
+                }
+                sentry.finish();
+                sentry.printSummary();
+            });
+        };
+        const std::string expected = run(false);
+        const std::string what = "lateness " + std::to_string(lateness);
+        check(expected.find("due to banned IP") != std::string::npos &&
+              expected.find("due to frequency") != std::string::npos,
+              what + ": the rules fire");
+        checkEqual(run(true) == expected, true, what + ": same output");
+    }
+}
+
+/**
+ * Helper method to sort the lines of an output, for outputs whose
+ * order may differ (such as banned-IP alerts, which are not held).
+ */
+std::string sortedLines(const std::string& text) {
+    std::vector<std::string> lines;
+    std::istringstream is(text);
+    for (std::string line; std::getline(is, line);) {
+        lines.push_back(line);
+    }
+    std::sort(lines.begin(), lines.end());
+    std::string sorted;
+    for (const std::string& line : lines) {
+        sorted.append(line) += '\n';
+    }
+    return sorted;
+}
+
+/**
+ * Check that a log whose lines are out of order by less than the
+ * lateness bound gets the same alerts as the sorted log. The lines of
+ * each second are moved together, keeping their order, so that which
+ * of several logins in one second alerts stays the same.
+ */
+void testReorder() {
+    const std::string sorted = makeSyntheticLog(50000, 20, 600);
+    std::vector<std::pair<double, std::string_view>> keyed;
+    std::mt19937 random(17);
+    std::uniform_real_distribution<double> jitter(0, 8);
+    TimestampParser timestamps;
+    LogFields fields;
+    long last = LONG_MIN;
+    double shift = 0;
+    for (size_t pos = 0; pos < sorted.size();) {
+        const size_t end = sorted.find('\n', pos) + 1;
+        const std::string_view line =
+            std::string_view(sorted).substr(pos, end - pos);
+        tokenizeLine(line.substr(0, line.size() - 1), fields);
+        const long seconds = timestamps.toSeconds(fields.month, fields.day,
+                                                  fields.time);
+        if (seconds != last) {
+            shift = jitter(random);
+            last = seconds;
+        }
+        keyed.push_back({seconds + shift, line});
+        pos = end;
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::string shuffled;
+    for (const auto& entry : keyed) {
+        shuffled.append(entry.second);
+    }
+    check(shuffled != sorted, "the log is shuffled");
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    const auto run = [&](const std::string& log, const long lateness) {
+        return sortedLines(captureAlerts([&](AlertWriter& alerts) {
+            Sentry sentry(bannedIPs, authorizedUsers, alerts,
+                          everyKindOfRule(), lateness);
+            sentry.checkLines(log);
+            sentry.finish();
+            sentry.printSummary();
+        }));
+    };
+    const std::string expected = run(sorted, 0);
+    check(expected.find("due to frequency") != std::string::npos,
+          "the frequency rule fires");
+    checkEqual(run(sorted, 10) == expected, true, "sorted, lateness 10");
+    checkEqual(run(shuffled, 10) == expected, true, "shuffled, lateness 10");
+    checkEqual(run(shuffled, 0) == expected, false, "shuffled, no lateness");
+}
+
+/**
+ * Check that processLogsParallel writes the same output as a single-
+ * threaded Sentry with any number of threads, from a stream or from
+ * memory, and with chunks small enough that each batch holds many.
+ */
+void testParallel() {
+    const std::string log = makeSyntheticLog(50000, 50, 5000);
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const std::string expected = checkSingle(log, bannedIPs,
+                                             authorizedUsers);
+    check(expected.find("due to frequency") != std::string::npos &&
+          expected.find("due to banned IP") != std::string::npos,
+          "both rules fire");
+    for (const size_t threads : {1, 2, 3, 4}) {
+        for (const size_t chunkSize : {1 << 20, 4096}) {
+            const std::string what = std::to_string(threads) +
+                " threads, " + std::to_string(chunkSize) + "-byte chunks";
+            checkEqual(captureAlerts([&](AlertWriter& alerts) {
+                std::istringstream is(log);
+                processLogsParallel(is, bannedIPs, authorizedUsers, threads,
+                                    alerts, 0, chunkSize);
+            }) == expected, true, what + " from a stream");
+            checkEqual(captureAlerts([&](AlertWriter& alerts) {
+                processLogsParallel(std::string_view(log), bannedIPs,
+                    authorizedUsers, threads, alerts, 0, chunkSize);
+            }) == expected, true, what + " from memory");
+        }
+    }
+}
+
+/**
+ * Check that a log that runs across New Year gets the same output with
+ * any number of threads as with one, and that its timestamps keep
+ * increasing over the new year. The rollover is about 1200 lines in,
+ * so workers whose first chunk is in January see no December line.
+ */
+void testNewYear() {
+    const std::string log = makeSyntheticLog(50000, 50, 5000,
+                                             LogGenerator::NEW_YEAR - 1200);
+    check(log.find("\nJan  1 ") != std::string::npos, "the log reaches Jan 1");
+    TimestampParser timestamps;
+    LogFields fields;
+    long last = 0;
+    bool increasing = true;
+    for (size_t pos = 0; pos < log.size() && increasing;) {
+        const size_t end = log.find('\n', pos);
+        tokenizeLine(std::string_view(log).substr(pos, end - pos), fields);
+        const long seconds = timestamps.toSeconds(fields.month, fields.day,
+                                                  fields.time);
+        increasing = (seconds >= last);
+        last = seconds;
+        pos = end + 1;
+    }
+    check(increasing, "timestamps increase across New Year");
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.3.0/24");
+    LookupMap authorizedUsers;
+    const std::string expected = checkSingle(log, bannedIPs,
+                                             authorizedUsers);
+    for (const size_t threads : {1, 2, 4}) {
+        for (const size_t chunkSize : {1 << 20, 1 << 16}) {
+            checkEqual(captureAlerts([&](AlertWriter& alerts) {
+                processLogsParallel(std::string_view(log), bannedIPs,
+                    authorizedUsers, threads, alerts, 0, chunkSize);
+            }) == expected, true, std::to_string(threads) + " threads, " +
+                std::to_string(chunkSize) + "-byte chunks");
+        }
+    }
+}
+
+/**
+ * Check the year inference of TimestampParser (see yearOf): a late
+ * December line just after New Year belongs to the year before and
+ * does not undo the rollover, and a gap of over half a year forward
+ * stays in the same year.
+ */
+void testYear() {
+    TimestampParser timestamps;
+    const auto at = [&](const char* month, const char* day) {
+        return timestamps.toSeconds(month, day, "12:00:00");
+    };
+    const long dec = at("Dec", "31"), jan = at("Jan", "1");
+    checkEqual(jan - dec, 86400, "Dec 31 to Jan 1");
+    checkEqual(at("Dec", "31"), dec, "a late Dec 31 line");
+    checkEqual(at("Jan", "2") - jan, 86400, "Jan 2 after the late line");
+    const long aug = at("Aug", "1");
+    check(aug > jan, "a jump from January to August keeps the year");
+    checkEqual(at("Sep", "1") - aug, 31 * 86400, "Sep 1 after Aug 1");
+    checkEqual(at("Feb", "1") - at("Jan", "1"), 31 * 86400,
+               "the next rollover");
+    // Full month names go through strptime, but infer the year the same
+    TimestampParser full;
+    const long fullDec = full.toSeconds("December", "31", "12:00:00");
+    checkEqual(full.toSeconds("January", "1", "12:00:00") - fullDec, 86400,
+               "December 31 to January 1");
+    TimestampParser clock(TimestampParser::CLOCK_YEAR),
+        abbreviated(TimestampParser::CLOCK_YEAR);
+    checkEqual(clock.toSeconds("June", "10", "03:32:36"),
+               abbreviated.toSeconds("Jun", "10", "03:32:36"),
+               "a first line with a full month name and the clock's year");
+}
+
+/**
+ * Helper method to run an operation with the TZ environment variable
+ * set to a timezone, and then restore it.
+ */
+void withTimezone(const char* zone, const std::function<void()>& op) {
+    const char* const before = getenv("TZ");
+    const std::string saved = (before ? before : "");
+    setenv("TZ", zone, 1);
+    tzset();
+    op();
+    if (before) {
+        setenv("TZ", saved.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
+
+/**
+ * Check that TimestampParser agrees with toSeconds for a timestamp
+ * every 7 minutes of the year, with the seconds varying, without DST
+ * (UTC) and across both DST changes of a US timezone.
+ */
+void testTimestamp() {
+    static const char *Months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    for (const char* zone : {"UTC", "America/New_York"}) {
+        withTimezone(zone, [&] {
+            TimestampParser parser;
+            size_t mismatches = 0;
+            char time[16];
+            for (int mon = 0; mon < 12; mon++) {
+                for (int day = 1; day <= 31; day++) {
+                    for (int min = 0; min < 24 * 60; min += 7) {
+                        snprintf(time, sizeof(time), "%02d:%02d:%02d",
+                                 min / 60, min % 60, min % 61);
+                        const std::string dayText = std::to_string(day);
+                        mismatches += parser.toSeconds(Months[mon], dayText,
+                            time) != toSeconds(std::string(Months[mon]) +
+                                " " + dayText + " " + time);
+                    }
+                }
+            }
+            checkEqual(mismatches, size_t(0), std::string(zone) +
+                       " mismatches");
+        });
+    }
+    // A year with a non-digit in it is not an RFC 3339 timestamp
+    TimestampParser parser;
+    const long invalid = parser.toSeconds("", "", "x");
+    for (size_t i = 0; i < 4; i++) {
+        std::string ts = "2021-06-10T03:32:36Z";
+        ts[i] = 'x';
+        checkEqual(parser.toSeconds("", "", ts), invalid, ts);
+    }
+}
+
+/**
+ * The original toSeconds, which left tm_isdst at 0 (standard time all
+ * year), to check the current one against.
+ */
+long originalToSeconds(const std::string& timestamp, const int year = 2021) {
+    struct tm tstamp = {};
+    tstamp.tm_year = year - 1900;
+    strptime(timestamp.c_str(), "%B %d %H:%M:%S", &tstamp);
+    return mktime(&tstamp);
+}
+
+/**
+ * Check toSeconds and TimestampParser against the original toSeconds:
+ * without DST (UTC) all three agree, and in a timezone with DST the
+ * original is an hour late exactly while DST is in effect, which is the
+ * one change in behavior.
+ */
+void testDst() {
+    for (const char* zone : {"UTC", "America/New_York"}) {
+        withTimezone(zone, [&] {
+            TimestampParser timestamps;
+            size_t mismatches = 0, summer = 0;
+            for (const char* month : {"Jan", "Mar", "May", "Jul", "Sep",
+                                      "Nov"}) {
+                for (const char* day : {"01", "15"}) {
+                    const std::string stamp = std::string(month) + " " + day +
+                                              " 12:00:00";
+                    const long original = originalToSeconds(stamp),
+                               current = toSeconds(stamp),
+                               parsed = timestamps.toSeconds(month, day,
+                                                             "12:00:00");
+                    const time_t at = current;
+                    struct tm local;
+                    localtime_r(&at, &local);
+                    summer += (local.tm_isdst > 0);
+                    mismatches += (parsed != current) ||
+                        (original - current != (local.tm_isdst > 0 ? 3600 :
+                                                0));
+                }
+            }
+            checkEqual(mismatches, size_t(0), std::string(zone) +
+                       " mismatches");
+            checkEqual(summer > 0, std::string(zone) != "UTC",
+                       std::string(zone) + " has DST");
+        });
+    }
+}
+
+/**
+ * Check that processLogsPipelined writes the same output as Sentry's
+ * checkLines over the whole log, for every kind of rule, with and
+ * without reordering, and with the alerts written inline or on a
+ * writer thread. The log is several pipeline chunks long, so the pool
+ * of chunks is reused.
+ */
+void testPipeline() {
+    const std::string log = makeSyntheticLog(40000, 50, 600);
+    check(log.size() > 2 * PIPELINE_CHUNK_BYTES, "several chunks");
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const RuleSet rules = everyKindOfRule();
+    for (const long lateness : {0, 10}) {
+        const std::string expected = captureAlerts([&](AlertWriter& alerts) {
+            Sentry sentry(bannedIPs, authorizedUsers, alerts, rules,
+                          lateness);
+            sentry.checkLines(log);
+            sentry.finish();
+            sentry.printSummary();
+        });
+        for (const bool background : {false, true}) {
+            const std::string what = "lateness " + std::to_string(lateness) +
+                (background ? ", writer thread" : "");
+            checkEqual(captureAlerts([&](AlertWriter& alerts) {
+                if (background) {
+                    alerts.writeInBackground();
+                }
+                std::istringstream is(log);
+                processLogsPipelined(is, bannedIPs, authorizedUsers, rules,
+                                     alerts, lateness);
+            }) == expected, true, what);
+        }
+    }
+}
+
+/**
+ * Check that several paths on one host are fetched over a single
+ * keep-alive connection, and that a body whose connection drops part
+ * way through is resumed with a Range request on a new connection, so
+ * that every body received is byte-identical to the log and no byte is
+ * sent twice.
+ */
+void testDownload() {
+    const std::string log = makeSyntheticLog(20000);
+    for (const size_t drops : {0, 1, 2}) {
+        TestLogServer server(log, std::chrono::milliseconds(0), 1000000000);
+        server.dropAfter(drops, log.size() / 3 + 7);
+        std::vector<std::string> urls;
+        for (const char* path : {"/a.log", "/b.log", "/c.log"}) {
+            urls.push_back("http://127.0.0.1:" +
+                           std::to_string(server.port()) + path);
+        }
+        std::vector<std::string> bodies(urls.size());
+        const std::vector<std::string> errors = fetchAll(urls,
+            [&](const size_t i, std::string_view body) {
+                bodies[i].append(body);
+            });
+        const std::string what = std::to_string(drops) + " drops";
+        for (size_t i = 0; i < urls.size(); i++) {
+            checkEqual(errors[i], "", what + ", error for " + urls[i]);
+            check(bodies[i] == log, what + ", body of " + urls[i]);
+        }
+        checkEqual(server.connections(), 1 + drops, what + ", connections");
+        checkEqual(server.bodyBytes(), urls.size() * log.size(),
+                   what + ", bytes sent");
+    }
+    // The same through the stream that LoginSentry reads a URL from
+    TestLogServer server(log, std::chrono::milliseconds(0), 1000000000);
+    server.dropAfter(2, 1000);
+    HttpStreamBuf buf("http://127.0.0.1:" + std::to_string(server.port()) +
+                      "/auth.log");
+    std::istream is(&buf);
+    std::ostringstream body;
+    body << is.rdbuf();
+    check(body.str() == log && buf.error().empty(),
+          "stream body after 2 drops: " + buf.error());
+    checkEqual(server.connections(), size_t(3), "stream connections");
+}
+
+/**
+ * Helper method to check a whole log with one Sentry, as LoginSentry
+ * does for a single file, and return its output.
+ */
+std::string checkAll(const std::string& log, const IpPrefixSet& bannedIPs,
+                     const LookupMap& authorizedUsers) {
+    return captureAlerts([&](AlertWriter& alerts) {
+        Sentry sentry(bannedIPs, authorizedUsers, alerts);
+        sentry.checkLines(log);
+        sentry.finish();
+        sentry.printSummary();
+    });
+}
+
+/**
+ * Check that pollUrls checks a log from where the previous run stopped,
+ * and that a log rotated to a shorter one without an ETag (which the
+ * server refuses to resume with a 416) is checked from its start, so
+ * the run after it checks only what was appended to the new log. Each
+ * log starts days after the previous one, so no window spans two and
+ * each run should print what checking its new lines alone prints.
+ */
+void testPoll() {
+    std::string log = makeSyntheticLog(20000, 50, 600);
+    const TestLogServer server(log, std::chrono::milliseconds(0),
+                               1000000000, "");
+    const std::vector<std::string> urls = {"http://127.0.0.1:" +
+        std::to_string(server.port()) + "/auth.log"};
+    const std::string stateFile = "/tmp/LoginSentryTest.state";
+    std::remove(stateFile.c_str());
+    std::remove((stateFile + ".snapshot").c_str());
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    const auto poll = [&] {
+        return captureAlerts([&](AlertWriter& alerts) {
+            pollUrls<SshdFormat>(urls, stateFile, bannedIPs,
+                                 authorizedUsers, defaultRules(), alerts);
+        });
+    };
+    const std::string rotated = makeSyntheticLog(5000, 50, 600, 5 * 86400);
+    const std::string appended = makeSyntheticLog(3000, 50, 600,
+                                                  10 * 86400);
+    const std::vector<std::pair<std::string, std::string>> runs = {
+        {"first run", log}, {"after rotation", rotated},
+        {"after appending", appended}};
+    for (const auto& [what, added] : runs) {
+        if (what == "after rotation") {
+            log = rotated;
+        } else if (what == "after appending") {
+            log += appended;
+        }
+        checkEqual(poll() == checkAll(added, bannedIPs, authorizedUsers),
+                   true, what);
+        checkEqual(loadPollState(stateFile)[urls[0]].offset, log.size(),
+                   "offset " + what);
+    }
+    std::remove(stateFile.c_str());
+    std::remove((stateFile + ".snapshot").c_str());
+}
+
+/**
+ * Check that processUrls, which fetches several logs at once and checks
+ * them merged in time order as they arrive, writes the same output as
+ * checking the log they were split from as a single file. Each line of
+ * the log goes to the host numbered by its rank among the lines with
+ * the same timestamp, so the merged order is the original order. The
+ * hosts are throttled, so their downloads interleave.
+ */
+void testFetch() {
+    const size_t hosts = 4;
+    const std::string log = makeSyntheticLog(30000, 50, 600);
+    std::vector<std::string> logs(hosts);
+    std::string_view previous;
+    size_t rank = 0;
+    for (size_t pos = 0; pos < log.size();) {
+        const size_t end = log.find('\n', pos) + 1;
+        const std::string_view line(log.data() + pos, end - pos);
+        // The timestamp is the first 15 characters
+        rank = (line.substr(0, 15) == previous.substr(0, 15) ? rank + 1 : 0);
+        logs[std::min(rank, hosts - 1)].append(line);
+        previous = line;
+        pos = end;
+    }
+    std::vector<std::unique_ptr<TestLogServer>> servers;
+    std::vector<std::string> urls;
+    for (const std::string& body : logs) {
+        servers.push_back(std::make_unique<TestLogServer>(body,
+            std::chrono::milliseconds(0), 10000000));
+        urls.push_back("http://127.0.0.1:" +
+                       std::to_string(servers.back()->port()) + "/auth.log");
+    }
+    IpPrefixSet bannedIPs;
+    bannedIPs.insert("10.0.1.0/24");
+    LookupMap authorizedUsers;
+    authorizedUsers.intern("user7");
+    const RuleSet rules = everyKindOfRule();
+    for (const long lateness : {0, 10}) {
+        const std::string expected = captureAlerts([&](AlertWriter& alerts) {
+            Sentry sentry(bannedIPs, authorizedUsers, alerts, rules,
+                          lateness);
+            sentry.checkLines(log);
+            sentry.finish();
+            sentry.printSummary();
+        });
+        checkEqual(captureAlerts([&](AlertWriter& alerts) {
+            processUrls(urls, bannedIPs, authorizedUsers, rules, alerts,
+                        lateness);
+        }) == expected, true, "lateness " + std::to_string(lateness));
+    }
+}
+
+/**
+ * Check that a FileFollower reports every line exactly once, in order,
+ * while the file is appended to (with a line written in two pieces),
+ * truncated in place and rewritten (as copytruncate does), and renamed
+ * away with more lines appended to the old file before a new one is
+ * created at the path (as logrotate does). The follower is held
+ * between reading and checking for rotation while the file is rotated,
+ * so that it finds the rotation with lines still unread.
+ */
+void testFollow() {
+    const std::string path = "/tmp/LoginSentryTest.follow";
+    std::remove(path.c_str());
+    std::remove((path + ".1").c_str());
+    std::vector<std::string> written, seen;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool pauseWanted = false, paused = false;
+    size_t next = 0;
+    // Append the next count lines to a file
+    const auto append = [&](const std::string& file, const size_t count) {
+        std::ofstream os(file, std::ios::app);
+        for (size_t i = 0; i < count; i++) {
+            written.push_back("line " + std::to_string(next++));
+            os << written.back() << '\n';
+        }
+    };
+    // Wait up to 2 seconds for every line written to be reported
+    const auto caughtUp = [&] {
+        for (int i = 0; i < 200; i++) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (seen.size() >= written.size()) {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    };
+    append(path, 100);
+    FileFollower follower(path);
+    std::atomic<bool> stop(false);
+    std::thread thread([&] {
+        follower.run([&](std::string_view line) {
+            std::lock_guard<std::mutex> lock(mutex);
+            seen.emplace_back(line);
+        }, [&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (pauseWanted) {
+                paused = true;
+                changed.notify_all();
+                changed.wait(lock, [&] { return !pauseWanted; });
+                paused = false;
+            }
+        }, stop, 20);
+    });
+    // Run an operation while the follower waits after a read
+    const auto whilePaused = [&](const std::function<void()>& op) {
+        std::unique_lock<std::mutex> lock(mutex);
+        pauseWanted = true;
+        changed.wait(lock, [&] { return paused; });
+        op();
+        pauseWanted = false;
+        changed.notify_all();
+    };
+    check(caughtUp(), "the lines already in the file");
+    append(path, 50);
+    {
+        std::ofstream os(path, std::ios::app);
+        written.push_back("line " + std::to_string(next++));
+        os << written.back().substr(0, 3) << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        os << written.back().substr(3) << '\n';
+    }
+    check(caughtUp(), "appended lines");
+    // The rewritten file is shorter than the offset reached, so the
+    // truncation shows even though the follower looks after the write
+    whilePaused([&] {
+        std::ofstream(path, std::ios::trunc).close();
+        append(path, 20);
+    });
+    check(caughtUp(), "lines after truncation");
+    whilePaused([&] {
+        std::rename(path.c_str(), (path + ".1").c_str());
+        append(path + ".1", 5);
+        append(path, 30);
+    });
+    check(caughtUp(), "lines after rename and create");
+    stop = true;
+    thread.join();
+    checkEqual(seen.size(), written.size(), "lines reported");
+    check(seen == written, "every line once, in order");
+    std::remove(path.c_str());
+    std::remove((path + ".1").c_str());
+}
+
+/** Helper method to count the open file descriptors of this process */
+size_t openFds() {
+    size_t count = 0;
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        while (readdir(dir)) {
+            count++;
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+/**
+ * Check that a ListReloader publishes a new generation of the lists,
+ * with the new entries, when a list file is rewritten in place and
+ * when one is replaced by renaming a new file over it. Also check that
+ * it refuses to start when a file cannot be loaded or its directory
+ * cannot be watched, without leaking its inotify descriptor.
+ */
+void testReload() {
+    const std::string dir = "/tmp/LoginSentryTest.lists";
+    mkdir(dir.c_str(), 0755);
+    const std::string banned = dir + "/banned_ips.txt",
+        authorized = dir + "/authorized_users.txt";
+    const auto write = [](const std::string& path, const char* text) {
+        std::ofstream(path) << text;
+    };
+    write(banned, "10.0.0.1\n");
+    write(authorized, "alice\n");
+    // The reloads are reported on cerr
+    std::ostringstream log;
+    std::streambuf* const cerr = std::cerr.rdbuf(log.rdbuf());
+    {
+        ListReloader lists(banned, authorized);
+        checkEqual(lists.generation(), 1u, "first generation");
+        const LookupLists* current = &lists.acquire();
+        check(current->bannedIPs.contains("10.0.0.1") &&
+              !current->bannedIPs.contains("10.0.0.2"), "first banned IPs");
+        // Wait up to 2 seconds for the watcher to publish a generation
+        const auto reached = [&](const uint64_t generation) {
+            for (int i = 0; i < 100 && lists.generation() < generation;
+                 i++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+            return lists.generation() == generation;
+        };
+        write(banned, "10.0.0.1\n10.0.0.2\n");
+        check(reached(2), "generation 2 after rewriting the banned IPs");
+        current = &lists.acquire();
+        check(current->bannedIPs.contains("10.0.0.2"), "new banned IP");
+        write(authorized + ".new", "alice\nbob\n");
+        std::rename((authorized + ".new").c_str(), authorized.c_str());
+        check(reached(3), "generation 3 after replacing the users");
+        current = &lists.acquire();
+        check(current->authorizedUsers.contains("bob") &&
+              current->bannedIPs.contains("10.0.0.2"), "new authorized user");
+    }
+    const size_t fds = openFds();
+    checkThrows<std::runtime_error>([&] {
+        ListReloader lists(dir + "/missing.txt", authorized);
+    }, "a missing list file");
+    checkThrows<std::runtime_error>([&] {
+        ListReloader lists(banned, dir + "/missing/users.txt");
+    }, "a missing directory");
+    checkEqual(openFds(), fds, "open descriptors after failing to start");
+    std::cerr.rdbuf(cerr);
+    std::remove(banned.c_str());
+    std::remove(authorized.c_str());
+    rmdir(dir.c_str());
+}
+
+int main(int argc, char *argv[]) {
+    const std::map<std::string, std::function<void()>> tests = {
+        {"alerts", testAlerts},
+        {"batch", testBatch},
+        {"decompress", testDecompress},
+        {"dst", testDst},
+        {"download", testDownload},
+        {"fetch", testFetch},
+        {"follow", testFollow},
+        {"formats", testFormats},
+        {"heavy-hitters", testHeavyHitters},
+        {"http", testHttpHeaders},
+        {"interner", testInterner},
+        {"ipset", testIpSet},
+        {"mapped", testMapped},
+        {"new-year", testNewYear},
+        {"parallel", testParallel},
+        {"pipeline", testPipeline},
+        {"poll", testPoll},
+        {"reload", testReload},
+        {"reorder", testReorder},
+        {"rules", testRules},
+        {"rules-file", testRulesFile},
+        {"sketch", testSketch},
+        {"snapshot", testSnapshot},
+        {"splitter", testSplitter},
+        {"timestamp", testTimestamp},
+        {"tokenizer", testTokenizer},
+        {"window", testWindow},
+        {"year", testYear},
+    };
+    const std::string which = (argc > 1 ? argv[1] : "all");
+    for (const auto& [name, test] : tests) {
+        if (which == "all" || which == name) {
+            const int before = failures;
+            test();
+            std::cout << name << ": "
+                      << (failures == before ? "ok" : "FAILED") << '\n';
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// End of source code
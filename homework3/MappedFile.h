@@ -0,0 +1,135 @@
+// Copyright 2023 Evan Williams
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+/**
+ * A read-only memory mapping of a whole file, so that archived logs
+ * can be scanned in place instead of being copied through a stream,
+ * and the matching helper for replacing a file atomically.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+class MappedFile {
+public:
+    /**
+     * Map a file into memory. The kernel is told that the mapping will
+     * be read sequentially, so it reads ahead aggressively and drops
+     * pages behind the scan.
+     *
+     * @param path The path of the file to be mapped.
+     *
+     * @exception std::runtime_error If the file cannot be opened or
+     * mapped.
+     */
+    explicit MappedFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) == -1) {
+            const std::string error = std::strerror(errno);
+            if (fd != -1) {
+                close(fd);
+            }
+            throw std::runtime_error("Error opening file " + path + ": " +
+                                     error);
+        }
+        size = info.st_size;
+        if (size > 0) {
+            addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Error mapping file " + path + ": " +
+                                     std::strerror(errno));
+        }
+        if (size > 0) {
+            madvise(addr, size, MADV_SEQUENTIAL);
+        }
+    }
+
+    /** Unmap the file */
+    ~MappedFile() {
+        if (size > 0) {
+            munmap(addr, size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * Obtain the contents of the file. The view is valid for the
+     * lifetime of this object.
+     */
+    std::string_view data() const {
+        return std::string_view(static_cast<const char*>(addr), size);
+    }
+
+private:
+    /** The start of the mapping (nullptr for an empty file) */
+    void* addr = nullptr;
+
+    /** The size of the file and the mapping */
+    size_t size = 0;
+};
+
+/**
+ * A read-only stream buffer over data already in memory (such as a
+ * MappedFile), so it can be read through an std::istream without
+ * being copied into the stream first.
+ */
+class ViewBuf : public std::streambuf {
+public:
+    /**
+     * Create a stream buffer over the given data.
+     *
+     * @param data The data, which must outlive this buffer.
+     */
+    explicit ViewBuf(std::string_view data) {
+        char* start = const_cast<char*>(data.data());
+        setg(start, start, start + data.size());
+    }
+};
+
+/**
+ * Helper method to replace a file with new contents atomically: the
+ * contents are written and synced to a temporary file that is then
+ * renamed over the old one, so a crash leaves either the old or the
+ * new file, never a mix.
+ *
+ * @param path The file to replace.
+ *
+ * @param contents The new contents.
+ *
+ * @exception std::runtime_error If the file cannot be written.
+ */
+inline void writeFileAtomically(const std::string& path,
+                                std::string_view contents) {
+    const std::string temp = path + ".tmp";
+    const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = (fd != -1);
+    while (ok && !contents.empty()) {
+        const ssize_t n = write(fd, contents.data(), contents.size());
+        ok = (n > 0 || (n < 0 && errno == EINTR));
+        contents.remove_prefix(n > 0 ? n : 0);
+    }
+    if (fd != -1) {
+        ok = (fsync(fd) == 0 && close(fd) == 0 && ok);
+    }
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        const std::string error = std::strerror(errno);
+        unlink(temp.c_str());
+        throw std::runtime_error("Error writing " + path + ": " + error);
+    }
+}
+
+#endif  // MAPPED_FILE_H
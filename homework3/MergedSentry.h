@@ -0,0 +1,402 @@
+// Copyright 2023 Evan Williams
+#ifndef MERGED_SENTRY_H
+#define MERGED_SENTRY_H
+
+/**
+ * Detection over the logs of many hosts at once. Each log is fed to
+ * its own SourceParser as it is downloaded, which splits, tokenizes,
+ * timestamps, and checks the banned-IP rule for each line. A
+ * MergedDetector walks the logins of all hosts in time order while the
+ * downloads are still running, so the frequency rule sees a user's
+ * attempts across every host (e.g., one attacker spraying the same
+ * account over a fleet). With a lateness bound, the merged logins also
+ * go through a ReorderBuffer, which puts back in order the lines of a
+ * log that is itself slightly out of order. The parsers are compiled
+ * for one log format (see LogFormat.h).
+ *
+ * A login is checked as soon as every log still downloading has a
+ * later one queued, so the memory held is each log's partial last line
+ * plus the logins that are waiting for the other logs (or for the
+ * lateness bound) to catch up. It grows with how far apart in log time
+ * the downloads are, not with the size of the logs.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "AlertWriter.h"
+#include "HttpFetch.h"
+#include "IpPrefixSet.h"
+#include "LineSplitter.h"
+#include "LogFormat.h"
+#include "ReorderBuffer.h"
+#include "RuleEngine.h"
+#include "SyslogTime.h"
+
+/**
+ * The parse pipeline of one log. Text is fed in arbitrary pieces, and
+ * the complete lines among them are parsed right away. The logins are
+ * queued, with a copy of their lines, until the MergedDetector takes
+ * them; the rest of the text is not kept.
+ *
+ * @tparam Format The scanner of the log format.
+ */
+template <class Format = SshdFormat>
+class BasicSourceParser {
+public:
+    /**
+     * A parsed login. The line is at an offset in the text of the
+     * queued logins (see slice), the user and IP at offsets in the
+     * line, and nanos is the fraction of a second of an RFC 3339
+     * timestamp.
+     */
+    struct Login {
+        size_t line;
+        uint32_t lineLen, user, userLen, ip, ipLen;
+        long seconds, nanos;
+        bool banned;
+    };
+
+    /**
+     * Create a parser.
+     *
+     * @param bannedIPs The banned IP addresses and ranges. The set must
+     * outlive the parser.
+     *
+     * @param year The year of the first line without one (see
+     * TimestampParser).
+     */
+    explicit BasicSourceParser(const IpPrefixSet& bannedIPs,
+                               const int year = 2021)
+        : bannedIPs(bannedIPs), timestamps(year) {}
+
+    /** Add the next piece of the log and parse any complete lines */
+    void feed(std::string_view data) {
+        size_t pos = 0;
+        if (!partial.empty()) {
+            // The rest of the line that the previous piece ended in
+            const size_t nl = data.find('\n');
+            if (nl == std::string_view::npos) {
+                partial.append(data);
+                return;
+            }
+            partial.append(data.substr(0, nl + 1));
+            parseLines(partial);
+            partial.clear();
+            pos = nl + 1;
+        }
+        const size_t last = data.rfind('\n');
+        if (last != std::string_view::npos && last >= pos) {
+            parseLines(data.substr(0, last + 1), pos);
+            pos = last + 1;
+        }
+        partial.append(data.substr(pos));
+    }
+
+    /**
+     * Mark the end of the log.
+     *
+     * @param partialLine Whether a final line without a newline is
+     * parsed. If not, it is left for a later run (see pending).
+     */
+    void finish(const bool partialLine = true) {
+        if (partialLine) {
+            parseLines(partial);
+            partial.clear();
+        }
+        done = true;
+    }
+
+    /** Determine whether the end of the log has been reached */
+    bool finished() const { return done; }
+
+    /** Determine whether no parsed login is waiting to be taken */
+    bool empty() const { return next == parsed.size(); }
+
+    /** Obtain the earliest parsed login not taken yet */
+    const Login& front() const { return parsed[next]; }
+
+    /**
+     * Take the earliest login. Its line stays valid until the next
+     * call to feed or pop.
+     */
+    void pop() {
+        if (++next == parsed.size()) {
+            keptBase += kept.size();
+            kept.clear();
+            parsed.clear();
+            next = 0;
+        } else if (next >= 1024 && 2 * next >= parsed.size()) {
+            // Drop the logins taken, which are most of the queue
+            const size_t drop = parsed[next].line - keptBase;
+            kept.erase(0, drop);
+            keptBase += drop;
+            parsed.erase(parsed.begin(), parsed.begin() + next);
+            next = 0;
+        }
+    }
+
+    /** Obtain the line of a queued login */
+    std::string_view slice(const size_t pos, const size_t len) const {
+        return std::string_view(kept).substr(pos - keptBase, len);
+    }
+
+    /** Obtain the number of lines seen, including unparsable ones */
+    size_t lineCount() const { return lines; }
+
+    /** Obtain the length of the final line that has no newline yet */
+    size_t pending() const { return partial.size(); }
+
+private:
+    /** Parse the lines of the text from pos on */
+    void parseLines(std::string_view text, const size_t pos = 0) {
+        LineSplitter<Format::WORDS> splitter(text, pos);
+        std::string_view line;
+        while (splitter.next(line, words)) {
+            parseLine(line);
+        }
+    }
+
+    /** Scan one line and queue it if it is a login */
+    void parseLine(std::string_view line) {
+        lines++;
+        if (!scanner.scan(line, words, fields)) {
+            return;
+        }
+        const auto offset = [&](std::string_view field) {
+            return static_cast<uint32_t>(field.data() - line.data());
+        };
+        const LogTime time = scanner.time(timestamps, fields);
+        parsed.push_back({keptBase + kept.size(),
+            static_cast<uint32_t>(line.size()),
+            offset(fields.user), static_cast<uint32_t>(fields.user.size()),
+            offset(fields.ip), static_cast<uint32_t>(fields.ip.size()),
+            time.seconds, time.nanos, bannedIPs.contains(fields.ip)});
+        kept.append(line);
+    }
+
+    const IpPrefixSet& bannedIPs;
+    TimestampParser timestamps;
+    Format scanner;
+    LineWords words;
+    LogFields fields;
+
+    /** The final line received so far, which has no newline yet */
+    std::string partial;
+
+    /**
+     * The lines of the queued logins, and the offset of its first byte
+     * from the start of all the lines queued so far
+     */
+    std::string kept;
+    size_t keptBase = 0;
+
+    /** The queued logins, of which the first next have been taken */
+    std::vector<Login> parsed;
+    size_t next = 0;
+
+    size_t lines = 0;
+    bool done = false;
+};
+
+/** The parser for sshd's syslog lines */
+using SourceParser = BasicSourceParser<>;
+
+/**
+ * The merged detection phase: check the logins of all sources in time
+ * order, to the nanosecond for RFC 3339 timestamps, as they are parsed.
+ * Each source's own order is kept, and logins with equal timestamps
+ * are taken from the lower-numbered source first, so with a single
+ * source the result matches processLogs exactly, and the result does
+ * not depend on how the downloads interleave.
+ *
+ * @tparam Format The scanner of the log format.
+ */
+template <class Format = SshdFormat>
+class MergedDetector {
+public:
+    /**
+     * Create a detector.
+     *
+     * @param sources The parsers of the logs. The vector must outlive
+     * the detector and not be resized.
+     *
+     * @param loginTimes The threshold rules' state, which may have been
+     * restored from an earlier run.
+     *
+     * @param alerts The writer to which detections are reported.
+     *
+     * @param lateness How many seconds a login may arrive out of order
+     * within its log and still be checked in order, or 0. Logins from a
+     * banned IP are reported as they are merged, the others as they are
+     * released.
+     */
+    MergedDetector(std::vector<BasicSourceParser<Format>>& sources,
+                   RuleEngine& loginTimes, AlertWriter& alerts,
+                   const long lateness = 0)
+        : sources(sources), loginTimes(loginTimes), alerts(alerts),
+          lateness(lateness), reorder(lateness),
+          queued(sources.size(), false) {}
+
+    /**
+     * Check the logins that can be put in order so far: each one that
+     * is earlier than the next login of every source not yet finished.
+     * Call after feeding or finishing sources.
+     */
+    void advance() {
+        size_t waiting = 0;
+        for (size_t s = 0; s < sources.size(); s++) {
+            if (!queued[s] && !sources[s].empty()) {
+                queue(s);
+            } else if (!queued[s] && !sources[s].finished()) {
+                waiting++;
+            }
+        }
+        // A source with nothing queued might still send an earlier login
+        while (waiting == 0 && !heads.empty()) {
+            const size_t s = std::get<2>(heads.top());
+            heads.pop();
+            BasicSourceParser<Format>& source = sources[s];
+            const Login& login = source.front();
+            const std::string_view line = source.slice(login.line,
+                                                       login.lineLen);
+            if (lateness > 0 && !login.banned) {
+                reorder.push(login.seconds, {std::string(line), login.user,
+                    login.userLen, login.ip, login.ipLen}, release());
+            } else {
+                check(line, login.user, login.userLen, login.ip,
+                      login.ipLen, login.seconds, login.banned);
+            }
+            source.pop();
+            queued[s] = false;
+            if (!source.empty()) {
+                queue(s);
+            } else if (!source.finished()) {
+                waiting++;
+            }
+        }
+    }
+
+    /**
+     * Check the remaining logins once every source has finished, and
+     * report the summary.
+     */
+    void finish() {
+        advance();
+        reorder.flush(release());
+        size_t lineCount = 0;
+        for (const auto& source : sources) {
+            lineCount += source.lineCount();
+        }
+        alerts.summary(lineCount, hackCount, reorder.lateCount());
+    }
+
+private:
+    using Login = typename BasicSourceParser<Format>::Login;
+
+    /** A login held for reordering, with a copy of its line */
+    struct Held {
+        std::string line;
+        uint32_t user, userLen, ip, ipLen;
+    };
+
+    /** Add the next login of a source to the heap of heads */
+    void queue(const size_t s) {
+        heads.push({sources[s].front().seconds, sources[s].front().nanos,
+                    s});
+        queued[s] = true;
+    }
+
+    /** Obtain the callback that checks a login released by reorder */
+    auto release() {
+        return [this](const long seconds, const Held& held) {
+            check(held.line, held.user, held.userLen, held.ip, held.ipLen,
+                  seconds, false);
+        };
+    }
+
+    /** Check one login against the rules and report it if it fails */
+    void check(std::string_view line, const uint32_t userPos,
+               const uint32_t userLen, const uint32_t ipPos,
+               const uint32_t ipLen, const long seconds, const bool banned) {
+        const std::string_view user = line.substr(userPos, userLen),
+            ip = line.substr(ipPos, ipLen);
+        if (banned) {
+            hackCount++;
+            alerts.alert(BANNED_IP_ALERT, user, ip, seconds, line);
+        } else if (const RuleSpec* rule = loginTimes.check(user, ip,
+                       seconds)) {
+            hackCount++;
+            alerts.alert(rule->alertKind(), user, ip, seconds, line);
+        }
+    }
+
+    std::vector<BasicSourceParser<Format>>& sources;
+    RuleEngine& loginTimes;
+    AlertWriter& alerts;
+    const long lateness;
+    ReorderBuffer<Held> reorder;
+
+    /**
+     * (seconds, nanos, source) of the next login of each source that
+     * has one queued, earliest first
+     */
+    using Head = std::tuple<long, long, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    /** Whether each source's next login is in heads */
+    std::vector<bool> queued;
+
+    size_t hackCount = 0;
+};
+
+/**
+ * Download the logs of several hosts concurrently and check them as
+ * one fleet. Each log is parsed as it arrives, and the threshold rules
+ * run over the logins of all hosts merged in time order as they come
+ * in (see MergedDetector). Hosts that cannot be fetched are reported
+ * on cerr and the rest are still checked. Logs on the same host are
+ * fetched one after another, so the logins of the earlier ones are
+ * held until the later ones start to arrive; give each log its own
+ * host (or port) to keep them all streaming.
+ *
+ * @param urls The URLs of the logs.
+ * @param bannedIPs The banned IP addresses and ranges.
+ * @param authorizedUsers The users exempt from the threshold rules.
+ * @param rules The threshold rules to be checked.
+ * @param alerts The writer to which detections are reported.
+ * @param lateness The lateness bound for reordering (see
+ * MergedDetector).
+ *
+ * @tparam Format The scanner of the log format.
+ */
+template <class Format = SshdFormat>
+void processUrls(const std::vector<std::string>& urls,
+    const IpPrefixSet& bannedIPs, const LookupMap& authorizedUsers,
+    const RuleSet& rules, AlertWriter& alerts, const long lateness = 0) {
+    std::vector<BasicSourceParser<Format>> sources(urls.size(),
+        BasicSourceParser<Format>(bannedIPs));
+    RuleEngine loginTimes(authorizedUsers, rules);
+    MergedDetector<Format> merged(sources, loginTimes, alerts, lateness);
+    const std::vector<std::string> errors = fetchAll(urls,
+        [&](const size_t i, std::string_view body) {
+            sources[i].feed(body);
+            merged.advance();
+        }, [&](const size_t i) {
+            sources[i].finish();
+            merged.advance();
+        });
+    for (size_t i = 0; i < urls.size(); i++) {
+        if (!errors[i].empty()) {
+            std::cerr << urls[i] << ": " << errors[i] << '\n';
+        }
+    }
+    merged.finish();
+}
+
+#endif  // MERGED_SENTRY_H
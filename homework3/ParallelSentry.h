@@ -0,0 +1,476 @@
+// Copyright 2023 Evan Williams
+#ifndef PARALLEL_SENTRY_H
+#define PARALLEL_SENTRY_H
+
+/**
+ * A multi-threaded version of LoginSentry's log processing. One reader
+ * thread, which runs for the whole log, splits the input into batches
+ * of chunks of whole lines and hands them over an SpscRing, filling the
+ * next batch while the current one is processed. Each batch is then
+ * handled by a pool of worker threads in two steps:
+ *
+ *   1. Parse: each chunk is tokenized by some worker, which also does
+ *      the banned-IP check. The remaining logins are bucketed by a hash
+ *      of the user ID into one list per shard. The timestamps are then
+ *      converted on the calling thread, in log order, since the year
+ *      of a syslog timestamp is inferred from the lines before it (see
+ *      TimestampParser) and a worker only sees some of the chunks.
+ *      This is one cached date lookup per login on the fast path, but
+ *      it is serial, so it bounds how far the threads can scale.
+ *
+ *   2. Detect: worker s owns the frequency state of shard s and walks
+ *      that shard's lists in chunk order, so each user's logins still
+ *      arrive in log order at exactly one detector.
+ *
+ * The hits of each chunk are then merged by line number and reported,
+ * so the output is identical to the single-threaded processLogs.
+ *
+ * With a lateness bound, each shard passes its logins through its own
+ * ReorderBuffer, with a watermark over the logins of that shard only,
+ * so each user's logins reach the detector in timestamp order even if
+ * the log is a few seconds out of order. Frequency hits are then
+ * reported as their logins are released (in line order among those
+ * released by the same batch), after the banned-IP hits of the batch.
+ *
+ * Like BasicSentry, the functions are compiled for one log format (see
+ * LogFormat.h). Each worker has its own scanner, so a format whose
+ * logins depend on earlier lines must be checked on one thread.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "AlertWriter.h"
+#include "FrequencyWindow.h"
+#include "IpPrefixSet.h"
+#include "LogFormat.h"
+#include "ReorderBuffer.h"
+#include "SpscRing.h"
+#include "SyslogTime.h"
+
+/**
+ * A fixed set of threads that repeatedly run the same task in lock
+ * step. The calling thread acts as worker 0, so a pool of size 1 runs
+ * everything inline.
+ */
+class WorkerPool {
+public:
+    /**
+     * Create a pool.
+     *
+     * @param size The total number of workers, including the caller.
+     */
+    explicit WorkerPool(const size_t size) : workerCount(size) {
+        for (size_t i = 1; i < size; i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    /** Stop and join all the worker threads */
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            generation++;
+        }
+        wakeup.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    /**
+     * Run task(i) on worker i for every worker, and wait for all of
+     * them to finish.
+     *
+     * @param task The task to run. It receives the worker number.
+     */
+    void run(const std::function<void(size_t)>& task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &task;
+            pending = workerCount - 1;
+            generation++;
+        }
+        wakeup.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return pending == 0; });
+    }
+
+    /** Obtain the number of workers, including the caller */
+    size_t size() const { return workerCount; }
+
+private:
+    /** The loop run by each worker thread until the pool is destroyed */
+    void workerLoop(const size_t index) {
+        size_t seen = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [&] { return generation != seen; });
+            seen = generation;
+            if (stopping) {
+                return;
+            }
+            const auto* task = current;
+            lock.unlock();
+            (*task)(index);
+            lock.lock();
+            if (--pending == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+    const size_t workerCount;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wakeup, finished;
+    const std::function<void(size_t)>* current = nullptr;
+    size_t generation = 0, pending = 0;
+    bool stopping = false;
+};
+
+/**
+ * Helper method to read the next chunk of whole lines from a stream.
+ * Any partial line at the end of the read is carried over to the next
+ * chunk in the remainder string.
+ *
+ * @param is The stream to read from.
+ *
+ * @param chunkSize The number of bytes to read per chunk.
+ *
+ * @param remainder The partial line left over from the previous call.
+ *
+ * @param chunk The chunk to be filled in.
+ *
+ * @return False if there was nothing left to read.
+ */
+inline bool readChunk(std::istream& is, const size_t chunkSize,
+                      std::string& remainder, std::string& chunk) {
+    chunk.swap(remainder);
+    remainder.clear();
+    const size_t start = chunk.size();
+    chunk.resize(start + chunkSize);
+    is.read(&chunk[start], chunkSize);
+    chunk.resize(start + is.gcount());
+    if (is) {
+        // Move the trailing partial line (if any) to the remainder
+        const size_t lastNewline = chunk.rfind('\n');
+        const size_t keep = (lastNewline == std::string::npos ? 0 :
+                             lastNewline + 1);
+        remainder.assign(chunk, keep);
+        chunk.resize(keep);
+    }
+    return !chunk.empty() || !remainder.empty();
+}
+
+/**
+ * A source of chunks of whole log lines. It is called with a string
+ * it may use as storage and sets the view to the next chunk (which
+ * need not point into the storage). It returns false at the end.
+ */
+using ChunkSource = std::function<bool(std::string&, std::string_view&)>;
+
+/**
+ * Process login logs just like processLogs, but using the given number
+ * of threads. The frequency state is split into one shard per thread.
+ *
+ * @param nextChunk The source of the chunks of log lines. It is
+ * called from a separate reader thread.
+ *
+ * @param bannedIPs The banned IP addresses and ranges.
+ *
+ * @param authorizedUsers The users exempt from the frequency rule.
+ *
+ * @param threadCount The number of worker threads (and shards) to use.
+ *
+ * @param alerts The writer to which results are reported.
+ *
+ * @param lateness How many seconds a login may arrive out of order and
+ * still be checked in order, or 0 to check logins as they come.
+ *
+ * @tparam Format The scanner of the log format.
+ */
+template <class Format = SshdFormat>
+void processChunksParallel(const ChunkSource& nextChunk,
+    const IpPrefixSet& bannedIPs, const LookupMap& authorizedUsers,
+    const size_t threadCount, AlertWriter& alerts, const long lateness = 0) {
+    // A login to be checked by the shard that owns the user
+    struct Login {
+        size_t lineNo;
+        std::string_view line, user, ip;
+        long seconds;
+    };
+    // A flagged line and the rule that flagged it
+    struct Hit {
+        const AlertKind* kind;
+        Login login;
+    };
+    // A login held for reordering, with its own copy of the line and
+    // its line number in the whole log
+    struct Held {
+        size_t lineNo;
+        std::string line;
+        uint32_t user, userLen, ip, ipLen;
+    };
+    // The timestamp of a login, to be converted in log order, and the
+    // login's place: a shard's list, or bannedHits if shard is shards
+    struct Stamp {
+        LogFields fields;
+        size_t shard, index;
+    };
+    // The per-chunk results of the parse and detect steps
+    struct Chunk {
+        std::string storage;
+        std::string_view text;
+        size_t firstLine, lineCount;
+        std::vector<Stamp> stamps;
+        std::vector<std::vector<Login>> logins;
+        std::vector<Hit> bannedHits;
+        std::vector<std::vector<Hit>> frequencyHits;
+    };
+    const size_t shards = std::max<size_t>(threadCount, 1);
+    const size_t batchSize = shards * 2;
+    WorkerPool pool(shards);
+    std::vector<FrequencyDetector> detectors(shards,
+        FrequencyDetector(authorizedUsers));
+    TimestampParser timestamps;
+    std::vector<Format> scanners(shards);
+    std::vector<ReorderBuffer<Held>> reorder(shards,
+        ReorderBuffer<Held>(lateness));
+    // The held logins each shard flagged since the last report
+    std::vector<std::deque<Held>> released(shards);
+    std::vector<std::vector<Hit>> releasedHits(shards);
+    const auto release = [&](const size_t shard, const long seconds,
+                             Held& held) {
+        const std::string_view line = held.line;
+        if (detectors[shard].check(line.substr(held.user, held.userLen),
+                                   seconds)) {
+            const Held& kept = released[shard].emplace_back(std::move(held));
+            const std::string_view text = kept.line;
+            releasedHits[shard].push_back({&FREQUENCY_ALERT, {kept.lineNo,
+                text, text.substr(kept.user, kept.userLen),
+                text.substr(kept.ip, kept.ipLen), seconds}});
+        }
+    };
+    size_t lineCount = 0, hackCount = 0;
+    const auto reportReleased = [&] {
+        std::vector<Hit> hits;
+        for (size_t shard = 0; shard < shards; shard++) {
+            hits.insert(hits.end(), releasedHits[shard].begin(),
+                        releasedHits[shard].end());
+        }
+        std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) {
+            return a.login.lineNo < b.login.lineNo;
+        });
+        for (const Hit& hit : hits) {
+            alerts.alert(*hit.kind, hit.login.user, hit.login.ip,
+                         hit.login.seconds, hit.login.line);
+        }
+        hackCount += hits.size();
+        for (size_t shard = 0; shard < shards; shard++) {
+            releasedHits[shard].clear();
+            released[shard].clear();
+        }
+    };
+    // The reader fills the next batch while the pool works on this one.
+    // The batches go to the pool through one ring and back through the
+    // other once processed.
+    std::vector<std::vector<Chunk>> batches(2);
+    SpscRing<std::vector<Chunk>*> toProcess(batches.size()),
+        toRead(batches.size());
+    for (auto& batch : batches) {
+        toRead.push(&batch);
+    }
+    std::thread reader([&] {
+        std::vector<Chunk>* batch;
+        while (toRead.pop(batch)) {
+            batch->resize(batchSize);
+            size_t used = 0;
+            while (used < batchSize && nextChunk((*batch)[used].storage,
+                                                 (*batch)[used].text)) {
+                used++;
+            }
+            batch->resize(used);
+            if (used == 0) {
+                break;
+            }
+            toProcess.push(batch);
+        }
+        toProcess.close();
+    });
+    std::vector<Chunk>* next;
+    while (toProcess.pop(next)) {
+        std::vector<Chunk>& batch = *next;
+        pool.run([&](const size_t worker) {
+            for (size_t c = worker; c < batch.size(); c += shards) {
+                Chunk& chunk = batch[c];
+                chunk.lineCount = 0;
+                chunk.stamps.clear();
+                chunk.bannedHits.clear();
+                chunk.logins.resize(shards);
+                chunk.frequencyHits.resize(shards);
+                for (size_t shard = 0; shard < shards; shard++) {
+                    chunk.logins[shard].clear();
+                    chunk.frequencyHits[shard].clear();
+                }
+                LineSplitter<Format::WORDS> lines(chunk.text, 0);
+                std::string_view line;
+                LineWords words;
+                LogFields fields;
+                while (lines.next(line, words)) {
+                    const size_t lineNo = chunk.lineCount++;
+                    if (!scanners[worker].scan(line, words, fields)) {
+                        continue;
+                    }
+                    const Login login = {lineNo, line, fields.user, fields.ip,
+                                         0};
+                    if (bannedIPs.contains(fields.ip)) {
+                        chunk.stamps.push_back({fields, shards,
+                                                chunk.bannedHits.size()});
+                        chunk.bannedHits.push_back({&BANNED_IP_ALERT, login});
+                        continue;
+                    }
+                    const size_t shard =
+                        std::hash<std::string_view>()(fields.user) % shards;
+                    chunk.stamps.push_back({fields, shard,
+                                            chunk.logins[shard].size()});
+                    chunk.logins[shard].push_back(login);
+                }
+            }
+        });
+        size_t firstLine = lineCount;
+        for (Chunk& chunk : batch) {
+            chunk.firstLine = firstLine;
+            firstLine += chunk.lineCount;
+            for (const Stamp& stamp : chunk.stamps) {
+                Login& login = (stamp.shard == shards ?
+                    chunk.bannedHits[stamp.index].login :
+                    chunk.logins[stamp.shard][stamp.index]);
+                login.seconds = scanners[0].time(timestamps,
+                                                 stamp.fields).seconds;
+            }
+        }
+        pool.run([&](const size_t shard) {
+            const auto held = [&](const long seconds, Held& login) {
+                release(shard, seconds, login);
+            };
+            for (Chunk& chunk : batch) {
+                for (const Login& login : chunk.logins[shard]) {
+                    if (lateness > 0) {
+                        const auto offset = [&](std::string_view field) {
+                            return static_cast<uint32_t>(field.data() -
+                                                         login.line.data());
+                        };
+                        reorder[shard].push(login.seconds, Held{
+                            chunk.firstLine + login.lineNo,
+                            std::string(login.line), offset(login.user),
+                            static_cast<uint32_t>(login.user.size()),
+                            offset(login.ip),
+                            static_cast<uint32_t>(login.ip.size())}, held);
+                    } else if (detectors[shard].check(login.user,
+                                                      login.seconds)) {
+                        chunk.frequencyHits[shard].push_back(
+                            {&FREQUENCY_ALERT, login});
+                    }
+                }
+            }
+        });
+        for (Chunk& chunk : batch) {
+            std::vector<Hit> hits = std::move(chunk.bannedHits);
+            for (auto& shardHits : chunk.frequencyHits) {
+                hits.insert(hits.end(), shardHits.begin(), shardHits.end());
+            }
+            std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) {
+                return a.login.lineNo < b.login.lineNo;
+            });
+            for (const Hit& hit : hits) {
+                alerts.alert(*hit.kind, hit.login.user, hit.login.ip,
+                             hit.login.seconds, hit.login.line);
+            }
+            lineCount += chunk.lineCount;
+            hackCount += hits.size();
+        }
+        reportReleased();
+        toRead.push(next);
+    }
+    reader.join();
+    pool.run([&](const size_t shard) {
+        reorder[shard].flush([&](const long seconds, Held& login) {
+            release(shard, seconds, login);
+        });
+    });
+    reportReleased();
+    size_t lateCount = 0;
+    for (const auto& buffer : reorder) {
+        lateCount += buffer.lateCount();
+    }
+    alerts.summary(lineCount, hackCount, lateCount);
+}
+
+/**
+ * Process login logs from a stream using the given number of threads.
+ * See processChunksParallel for details.
+ *
+ * @param is The stream with the log lines.
+ *
+ * @param lateness The lateness bound for reordering, or 0.
+ *
+ * @param chunkSize The number of bytes in each chunk read from is.
+ */
+template <class Format = SshdFormat>
+void processLogsParallel(std::istream& is,
+    const IpPrefixSet& bannedIPs, const LookupMap& authorizedUsers,
+    const size_t threadCount, AlertWriter& alerts, const long lateness = 0,
+    const size_t chunkSize = 1 << 20) {
+    std::string remainder;
+    processChunksParallel<Format>([&](std::string& storage,
+                                      std::string_view& text) {
+        if (!readChunk(is, chunkSize, remainder, storage)) {
+            return false;
+        }
+        text = storage;
+        return true;
+    }, bannedIPs, authorizedUsers, threadCount, alerts, lateness);
+}
+
+/**
+ * Process login logs that are already in memory (such as a memory-
+ * mapped file) using the given number of threads. The chunks are
+ * views into the data, so no log text is copied.
+ *
+ * @param data The log text.
+ *
+ * @param lateness The lateness bound for reordering, or 0.
+ *
+ * @param chunkSize The approximate number of bytes in each chunk.
+ */
+template <class Format = SshdFormat>
+void processLogsParallel(std::string_view data,
+    const IpPrefixSet& bannedIPs, const LookupMap& authorizedUsers,
+    const size_t threadCount, AlertWriter& alerts, const long lateness = 0,
+    const size_t chunkSize = 1 << 20) {
+    size_t pos = 0;
+    processChunksParallel<Format>([&](std::string&, std::string_view& text) {
+        if (pos >= data.size()) {
+            return false;
+        }
+        // Extend the chunk to the end of the line it stops in
+        size_t end = data.find('\n', std::min(pos + chunkSize, data.size()));
+        end = (end == std::string_view::npos ? data.size() : end + 1);
+        text = data.substr(pos, end - pos);
+        pos = end;
+        return true;
+    }, bannedIPs, authorizedUsers, threadCount, alerts, lateness);
+}
+
+#endif  // PARALLEL_SENTRY_H
@@ -0,0 +1,163 @@
+// Copyright 2023 Evan Williams
+#ifndef PIPELINED_SENTRY_H
+#define PIPELINED_SENTRY_H
+
+/**
+ * Single-detector processing of a log stream as a pipeline of stages
+ * on their own threads, so a slow network read (or decompression, or
+ * stdout) no longer stalls the other stages:
+ *
+ *   read    Reads chunks of whole lines from the stream, including
+ *           the socket reads and HTTP framing of a download.
+ *   parse   Splits each chunk into lines and fills the columns of its
+ *           batches (Sentry::parseBatch).
+ *   detect  Checks the batches against the rules in log order
+ *           (Sentry::checkBatch) on the calling thread.
+ *   write   Writes the alerts, if the AlertWriter writes in the
+ *           background (see AlertWriter::writeInBackground).
+ *
+ * The stages pass pointers to a fixed pool of large chunks through
+ * lock-free SPSC rings (see SpscRing.h), and the detector hands each
+ * chunk back to the reader once it is checked. So at most POOL_CHUNKS
+ * chunks are in flight: when detection falls behind, the reader waits
+ * for a free chunk (backpressure) instead of buffering the whole log.
+ *
+ * The counters of each ring (PipelineStats) tell which stage limits
+ * the throughput: the stages after it wait on an empty ring, and the
+ * reader waits for free chunks when a stage after it is the slow one.
+ * Since the detector is one thread in log order, the results are the
+ * same as Sentry::checkLines over the whole log.
+ */
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "AlertWriter.h"
+#include "IpPrefixSet.h"
+#include "LogFormat.h"
+#include "ParallelSentry.h"
+#include "RuleEngine.h"
+#include "Sentry.h"
+#include "SpscRing.h"
+
+/** The counters of the rings between the pipeline's stages */
+struct PipelineStats {
+    /** Chunks from the reader to the parser */
+    RingStats read;
+    /** Parsed chunks from the parser to the detector */
+    RingStats parsed;
+    /** Checked chunks from the detector back to the reader */
+    RingStats recycled;
+    /** Alert buffers from the detector to the writer */
+    RingStats output;
+
+    /** Print the rings that were used, one per line */
+    void print(std::ostream& os) const {
+        const std::pair<const char*, const RingStats*> rings[] = {
+            {"read->parse", &read}, {"parse->detect", &parsed},
+            {"detect->read (free chunks)", &recycled},
+            {"detect->write", &output}};
+        for (const auto& [name, stats] : rings) {
+            if (stats->capacity > 0) {
+                stats->print(os, name);
+            }
+        }
+    }
+};
+
+/** The number of chunks in flight between the stages */
+constexpr size_t POOL_CHUNKS = 8;
+
+/** The size of the chunks read from the stream */
+constexpr size_t PIPELINE_CHUNK_BYTES = 1 << 18;
+
+/**
+ * Process login logs from a stream with the read, parse, and detect
+ * stages on their own threads (see above), and report the results.
+ *
+ * @param is The stream to read from.
+ *
+ * @param bannedIPs The banned IP addresses and ranges.
+ *
+ * @param authorizedUsers The users exempt from the threshold rules.
+ *
+ * @param rules The threshold rules to be checked.
+ *
+ * @param alerts The writer to which detections are reported.
+ *
+ * @param lateness How many seconds a login may arrive out of order and
+ * still be checked in order, or 0.
+ *
+ * @return The counters of the read, parse, and detect rings.
+ *
+ * @tparam Format The scanner of the log format.
+ */
+template <class Format = SshdFormat>
+PipelineStats processLogsPipelined(std::istream& is,
+    const IpPrefixSet& bannedIPs, const LookupMap& authorizedUsers,
+    const RuleSet& rules, AlertWriter& alerts, const long lateness = 0) {
+    using Sentry = BasicSentry<Format>;
+    // A chunk of whole lines and the batches parsed from it
+    struct Chunk {
+        std::string text;
+        std::vector<std::unique_ptr<typename Sentry::Batch>> batches;
+        size_t batchCount = 0;
+    };
+    Sentry sentry(bannedIPs, authorizedUsers, alerts, rules, lateness);
+    std::vector<Chunk> pool(POOL_CHUNKS);
+    SpscRing<Chunk*> toParse(POOL_CHUNKS), toDetect(POOL_CHUNKS),
+        toRead(POOL_CHUNKS);
+    for (Chunk& chunk : pool) {
+        toRead.push(&chunk);
+    }
+    std::thread reader([&] {
+        std::string remainder;
+        Chunk* chunk;
+        while (toRead.pop(chunk)) {
+            if (!readChunk(is, PIPELINE_CHUNK_BYTES, remainder,
+                           chunk->text)) {
+                break;
+            }
+            toParse.push(chunk);
+        }
+        toParse.close();
+    });
+    std::thread parser([&] {
+        Chunk* chunk;
+        while (toParse.pop(chunk)) {
+            chunk->batchCount = 0;
+            for (size_t pos = 0; pos < chunk->text.size();) {
+                if (chunk->batchCount == chunk->batches.size()) {
+                    chunk->batches.push_back(
+                        std::make_unique<typename Sentry::Batch>());
+                }
+                pos = sentry.parseBatch(chunk->text, pos,
+                    *chunk->batches[chunk->batchCount++]);
+            }
+            toDetect.push(chunk);
+        }
+        toDetect.close();
+    });
+    Chunk* chunk;
+    while (toDetect.pop(chunk)) {
+        for (size_t b = 0; b < chunk->batchCount; b++) {
+            sentry.checkBatch(*chunk->batches[b]);
+        }
+        toRead.push(chunk);
+    }
+    reader.join();
+    parser.join();
+    sentry.finish();
+    sentry.printSummary();
+    PipelineStats stats;
+    stats.read = toParse.stats();
+    stats.parsed = toDetect.stats();
+    stats.recycled = toRead.stats();
+    return stats;
+}
+
+#endif  // PIPELINED_SENTRY_H
@@ -0,0 +1,131 @@
+// Copyright 2023 Evan Williams
+#ifndef POLL_STATE_H
+#define POLL_STATE_H
+
+/**
+ * The state kept between runs when remote logs are polled: for each
+ * URL, the byte offset up to which the log has been checked and the
+ * ETag of the log at that point. It is a small text file with one
+ * "url offset etag" line per URL, so it can be inspected or edited by
+ * hand (e.g., deleting a line rescans that log from the start).
+ * pollUrls keeps it to check only what each log gained since the
+ * previous run.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "AlertWriter.h"
+#include "DetectorSnapshot.h"
+#include "HttpFetch.h"
+#include "IpPrefixSet.h"
+#include "MappedFile.h"
+#include "MergedSentry.h"
+#include "RuleEngine.h"
+#include "SyslogTime.h"
+
+/**
+ * Helper method to load the poll state. A missing file is an empty
+ * state, so the first run scans every log from the start.
+ *
+ * @param path The state file.
+ *
+ * @return The offset and ETag of each URL in the file.
+ */
+inline std::map<std::string, FetchState> loadPollState(
+    const std::string& path) {
+    std::map<std::string, FetchState> states;
+    std::ifstream is(path);
+    for (std::string line; std::getline(is, line);) {
+        std::istringstream fields(line);
+        std::string url;
+        FetchState state;
+        if (fields >> url >> state.offset) {
+            fields >> state.etag;
+            states[url] = state;
+        }
+    }
+    return states;
+}
+
+/**
+ * Helper method to save the poll state atomically.
+ *
+ * @param path The state file.
+ *
+ * @param states The offset and ETag of each URL.
+ */
+inline void savePollState(const std::string& path,
+                          const std::map<std::string, FetchState>& states) {
+    std::ostringstream os;
+    for (const auto& [url, state] : states) {
+        os << url << ' ' << state.offset << ' ' << state.etag << '\n';
+    }
+    writeFileAtomically(path, os.str());
+}
+
+/**
+ * Check only what has been appended to remote logs since the previous
+ * run, e.g., from cron. The offset and ETag of each URL are kept in a
+ * state file and each log is fetched with a Range request from there.
+ * A log that was rotated (new ETag, or shorter than the offset) is
+ * checked from its start. The rules' windows are snapshotted next
+ * to the state file, so bursts that span two runs are still caught. A
+ * final line without a newline is left for the next run.
+ *
+ * @param urls The URLs of the logs.
+ * @param stateFile The state file, e.g., /var/lib/loginsentry/state.
+ * @param bannedIPs The banned IP addresses and ranges.
+ * @param authorizedUsers The users exempt from the threshold rules.
+ * @param rules The threshold rules to be checked.
+ * @param alerts The writer to which detections are reported.
+ * @param lateness The lateness bound for reordering (see MergedDetector).
+ * Logins still held at the end of a run are checked then.
+ */
+template <class Format>
+void pollUrls(const std::vector<std::string>& urls,
+    const std::string& stateFile, const IpPrefixSet& bannedIPs,
+    const LookupMap& authorizedUsers, const RuleSet& rules,
+    AlertWriter& alerts, const long lateness = 0) {
+    std::map<std::string, FetchState> saved = loadPollState(stateFile);
+    std::vector<FetchState> states;
+    for (const auto& url : urls) {
+        states.push_back(saved[url]);
+    }
+    auto loginTimes = std::make_unique<RuleEngine>(authorizedUsers, rules);
+    try {
+        loadSnapshot(stateFile + ".snapshot", *loginTimes);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Ignoring " << stateFile << ".snapshot: " << e.what()
+                  << '\n';
+        loginTimes = std::make_unique<RuleEngine>(authorizedUsers, rules);
+    }
+    std::vector<BasicSourceParser<Format>> sources(urls.size(),
+        BasicSourceParser<Format>(bannedIPs, TimestampParser::CLOCK_YEAR));
+    MergedDetector<Format> merged(sources, *loginTimes, alerts, lateness);
+    fetchAll(urls, states, [&](const size_t i, std::string_view body) {
+        sources[i].feed(body);
+        merged.advance();
+    }, [&](const size_t i) {
+        sources[i].finish(false);
+        merged.advance();
+    });
+    for (size_t i = 0; i < urls.size(); i++) {
+        if (!states[i].error.empty()) {
+            std::cerr << urls[i] << ": " << states[i].error << '\n';
+        }
+        states[i].offset -= sources[i].pending();
+        saved[urls[i]] = states[i];
+    }
+    merged.finish();
+    saveSnapshot(stateFile + ".snapshot", *loginTimes);
+    savePollState(stateFile, saved);
+}
+
+#endif  // POLL_STATE_H
@@ -0,0 +1,190 @@
+// Copyright 2023 Evan Williams
+#ifndef REORDER_BUFFER_H
+#define REORDER_BUFFER_H
+
+/**
+ * Bounded-lateness reordering of logins before the threshold rules,
+ * which assume each user's (and IP's) timestamps arrive in order. Logs
+ * merged from many hosts, or written by hosts whose clocks and buffers
+ * differ slightly, interleave logins a few seconds out of order, and a
+ * burst whose attempts arrive shuffled can slip past the window check.
+ *
+ * A buffer holds the logins it is given in a min-heap by timestamp and
+ * tracks a watermark: the newest timestamp seen minus the lateness
+ * bound. A login is released once it is at or below the watermark, so
+ * logins come out in timestamp order as long as none arrives more than
+ * the lateness bound behind the newest one. Logins with equal
+ * timestamps come out in arrival order, so input that is already in
+ * order passes through unchanged (just delayed). A login that arrives
+ * behind the watermark is counted as late and released right away;
+ * the rules then see it out of order, just as without a buffer.
+ *
+ * Memory is bounded by the logins within the lateness bound, and each
+ * login costs a heap push and pop. The heap only holds timestamps and
+ * slot numbers; the logins stay put in reused slots.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+template <class Event>
+class ReorderBuffer {
+public:
+    /**
+     * Create an empty buffer.
+     *
+     * @param lateness How many seconds a login may arrive behind the
+     * newest one and still be put in order.
+     */
+    explicit ReorderBuffer(const long lateness = 0)
+        : lateness(std::max(lateness, 0L)) {}
+
+    /**
+     * Add a login and release every login that is now at or below the
+     * watermark, earliest first.
+     *
+     * @param seconds The login's timestamp.
+     *
+     * @param event The login.
+     *
+     * @param release Called with the timestamp and login of each
+     * login released.
+     */
+    template <class Release>
+    void push(const long seconds, Event event, Release&& release) {
+        if (newest != LONG_MIN && seconds < newest - lateness) {
+            late++;
+            release(seconds, event);
+            return;
+        }
+        newest = std::max(newest, seconds);
+        std::uint32_t slot;
+        if (freeSlots.empty()) {
+            slot = static_cast<std::uint32_t>(events.size());
+            events.push_back(std::move(event));
+        } else {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            events[slot] = std::move(event);
+        }
+        heap.push_back({seconds, sequence++, slot});
+        std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+        while (heap.front().seconds <= newest - lateness) {
+            pop(release);
+            if (heap.empty()) {
+                break;
+            }
+        }
+    }
+
+    /**
+     * Release every login still held, earliest first, e.g., at the end
+     * of the input.
+     */
+    template <class Release>
+    void flush(Release&& release) {
+        while (!heap.empty()) {
+            pop(release);
+        }
+    }
+
+    /** Obtain the number of logins that arrived behind the watermark */
+    size_t lateCount() const { return late; }
+
+    /** Obtain the number of logins being held */
+    size_t size() const { return heap.size(); }
+
+    /** Call visit with each login being held, in no particular order */
+    template <class Visit>
+    void forEach(Visit&& visit) const {
+        for (const Entry& entry : heap) {
+            visit(events[entry.slot]);
+        }
+    }
+
+    /**
+     * Write or restore the held logins and the watermark with a
+     * snapshot archive (see DetectorSnapshot.h). Each login is saved
+     * with its own snapshot method.
+     *
+     * @exception std::runtime_error If the logins being restored are
+     * not in heap order.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        std::uint64_t count = heap.size();
+        ar.value(newest);
+        ar.value(sequence);
+        ar.value(late);
+        ar.value(count);
+        // A restored heap grows as its logins are read, so a corrupt
+        // count runs into the end of the snapshot, not out of memory
+        std::vector<Event> held;
+        for (size_t i = 0; i < count; i++) {
+            if (i == heap.size()) {
+                heap.push_back({0, 0, UINT32_MAX});
+            }
+            Entry& entry = heap[i];
+            held.push_back(entry.slot < events.size() ?
+                           std::move(events[entry.slot]) : Event());
+            ar.value(entry.seconds);
+            ar.value(entry.sequence);
+            held[i].snapshot(ar);
+            entry.slot = static_cast<std::uint32_t>(i);
+        }
+        // The held logins are now in slots 0 to count - 1, in heap order
+        heap.resize(count);
+        events = std::move(held);
+        freeSlots.clear();
+        ar.check(std::is_heap(heap.begin(), heap.end(),
+                              std::greater<Entry>()), "reorder heap");
+    }
+
+private:
+    /** A held login's slot, ordered by timestamp and then by arrival */
+    struct Entry {
+        long seconds;
+        std::uint64_t sequence;
+        std::uint32_t slot;
+
+        bool operator>(const Entry& other) const {
+            return seconds != other.seconds ? seconds > other.seconds :
+                   sequence > other.sequence;
+        }
+    };
+
+    /** Remove the earliest login and release it */
+    template <class Release>
+    void pop(Release& release) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+        const Entry entry = heap.back();
+        heap.pop_back();
+        freeSlots.push_back(entry.slot);
+        release(entry.seconds, events[entry.slot]);
+    }
+
+    /** The lateness bound in seconds */
+    const long lateness;
+
+    /** The slots of the held logins as a min-heap */
+    std::vector<Entry> heap;
+
+    /** The held logins, and the slots that are free */
+    std::vector<Event> events;
+    std::vector<std::uint32_t> freeSlots;
+
+    /** The newest timestamp seen (the watermark is lateness before it) */
+    long newest = LONG_MIN;
+
+    /** The arrival number of the next login */
+    std::uint64_t sequence = 0;
+
+    /** The number of logins that arrived behind the watermark */
+    std::uint64_t late = 0;
+};
+
+#endif  // REORDER_BUFFER_H
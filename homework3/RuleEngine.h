@@ -0,0 +1,605 @@
+// Copyright 2023 Evan Williams
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+/**
+ * A declarative set of threshold rules, loaded from a config file and
+ * compiled into specialized detectors. Each rule counts login attempts,
+ * distinct users (exactly), or distinct users estimated with a sketch
+ * (see DistinctSketch.h), per user, per IP address, or per subnet,
+ * and is violated when the count within its window exceeds its
+ * maximum, e.g.:
+ *
+ *     # name      counts    per    max  window (seconds)
+ *     frequency   attempts  user   3    20
+ *     ip_burst    attempts  ip     20   300
+ *     net_burst   attempts  ip/24  50   300
+ *     spray       users     ip     100  3600
+ *     wide_spray  distinct  ip/24  5000 3600
+ *
+ * A subnet is given as "ip/N" for IPv4 addresses grouped by their /N,
+ * with IPv6 addresses grouped by their /64, or as "ip/N/M" to group
+ * IPv6 addresses by their /M instead. An exact "users" rule keeps the
+ * last max + 1 users of each key and scans them for every login, so
+ * large thresholds should use "distinct", whose cost and memory per key
+ * are fixed.
+ *
+ * The rules of each kind are grouped into one array of trackers, so a
+ * line is checked against every rule in one pass over flat arrays with
+ * no virtual calls, and its user and IP are interned only once however
+ * many rules use them. IPs are interned in binary form, and the subnets
+ * of an IP are worked out when the IP is first seen, so later lines
+ * find them with one array lookup. As
+ * with the original frequency rule, logins by authorized users are
+ * exempt from every rule.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "AddressInterner.h"
+#include "AlertWriter.h"
+#include "DistinctSketch.h"
+#include "FrequencyWindow.h"
+#include "KeyInterner.h"
+
+/** One rule of a rule set */
+struct RuleSpec {
+    /** What is counted */
+    enum Measure { ATTEMPTS, USERS, ESTIMATED_USERS };
+    /** What the counts are kept per */
+    enum Key { USER, IP };
+
+    /** The rule's name, which is reported in its alerts */
+    std::string name;
+    Measure measure;
+    Key key;
+    /** The count may not exceed rule.maxAttempts within rule.window */
+    FrequencyRule rule;
+    /** For IP keys, the subnet prefix lengths (full length: per IP) */
+    int v4Prefix = 32, v6Prefix = 128;
+
+    /** Check if the rule is kept per IP address rather than per subnet */
+    bool perAddress() const { return v4Prefix == 32 && v6Prefix == 128; }
+
+    /** Obtain the kind of alert reported when the rule is violated */
+    AlertKind alertKind() const { return {name.c_str(), name.c_str()}; }
+};
+
+/** The rules checked together, in the order their alerts take priority */
+using RuleSet = std::vector<RuleSpec>;
+
+/**
+ * Helper method to obtain the original rule: more than 3 logins by a
+ * user within 20 seconds. Its alerts are the FREQUENCY_ALERT ones.
+ */
+inline RuleSet defaultRules() {
+    RuleSpec spec;
+    spec.name = FREQUENCY_ALERT.name;
+    spec.measure = RuleSpec::ATTEMPTS;
+    spec.key = RuleSpec::USER;
+    return {spec};
+}
+
+/**
+ * Helper method to parse the "per" field of a rule: "user", "ip",
+ * "ip/N", or "ip/N/M".
+ *
+ * @return False if the field is not valid.
+ */
+inline bool parseRuleKey(const std::string& text, RuleSpec& spec) {
+    spec.key = (text == "user" ? RuleSpec::USER : RuleSpec::IP);
+    if (text == "user" || text == "ip") {
+        return true;
+    }
+    char slash;
+    std::istringstream is(text.rfind("ip/", 0) == 0 ? text.substr(2) : "");
+    if (!(is >> slash >> spec.v4Prefix)) {
+        return false;
+    }
+    spec.v6Prefix = 64;
+    if (is >> slash && !(is >> spec.v6Prefix)) {
+        return false;
+    }
+    return is.eof() && !is.bad() && spec.v4Prefix >= 0 &&
+           spec.v4Prefix <= 32 && spec.v6Prefix >= 0 &&
+           spec.v6Prefix <= 128;
+}
+
+/**
+ * The largest max of an "attempts" or "users" rule, which keeps the
+ * last max + 1 logins or users of every key.
+ */
+constexpr long long MAX_EXACT_COUNT = 1 << 20;
+
+/**
+ * Helper method to load a rule set from a config file. Each line is
+ * "name attempts|users|distinct user|ip|ip/N|ip/N/M max window"; blank lines
+ * and lines starting with '#' are ignored. The max may not be negative,
+ * or larger than MAX_EXACT_COUNT unless the rule is "distinct".
+ *
+ * @param fileName The config file.
+ *
+ * @exception std::runtime_error If the file cannot be read or a line
+ * is not a valid rule.
+ */
+inline RuleSet loadRules(const std::string& fileName) {
+    std::ifstream is(fileName);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + fileName);
+    }
+    RuleSet rules;
+    int lineNumber = 0;
+    for (std::string line; std::getline(is, line);) {
+        lineNumber++;
+        std::istringstream fields(line);
+        std::string name, measure, key, extra;
+        long long max;
+        RuleSpec spec;
+        if (!(fields >> name) || name[0] == '#') {
+            continue;
+        }
+        if (!(fields >> measure >> key >> max >> spec.rule.window) ||
+            (fields >> extra) ||
+            (measure != "attempts" && measure != "users" &&
+             measure != "distinct") || !parseRuleKey(key, spec) ||
+            (measure != "attempts" && key == "user") ||
+            spec.rule.window < 0 || max < 0 ||
+            (measure != "distinct" && max > MAX_EXACT_COUNT) ||
+            max == LLONG_MAX) {
+            throw std::runtime_error(fileName + ":" +
+                std::to_string(lineNumber) + ": invalid rule: " + line);
+        }
+        spec.rule.maxAttempts = static_cast<size_t>(max);
+        spec.name = name;
+        spec.measure = (measure == "users" ? RuleSpec::USERS :
+                        measure == "distinct" ? RuleSpec::ESTIMATED_USERS :
+                        RuleSpec::ATTEMPTS);
+        rules.push_back(spec);
+    }
+    if (rules.empty()) {
+        throw std::runtime_error(fileName + ": no rules");
+    }
+    return rules;
+}
+
+/**
+ * The most recently seen distinct users of each key (IP address), for
+ * a rule of the form "more than maxAttempts distinct users within
+ * window seconds". Only the last maxAttempts + 1 distinct users of a
+ * key can decide the rule, so each key gets that many (user, time)
+ * slots back-to-back in flat arrays, and memory per key is fixed.
+ */
+class DistinctTracker {
+public:
+    /**
+     * Create a tracker for the given rule.
+     *
+     * @param rule The maximum number of distinct users and the window.
+     */
+    explicit DistinctTracker(const FrequencyRule& rule)
+        : rule(rule), slotCount(rule.maxAttempts + 1) {}
+
+    /**
+     * Record a login by a user for a key and report whether the key's
+     * distinct users now violate the rule. Timestamps are assumed to
+     * arrive in order for each key.
+     *
+     * @param keyID The interned ID of the key (e.g., the IP address).
+     *
+     * @param userID The interned ID of the user who attempted to login.
+     *
+     * @param seconds The time of the attempt in seconds since Epoch.
+     *
+     * @return True if more than maxAttempts distinct users logged in
+     * for this key within the rule's window.
+     */
+    bool record(const KeyInterner::Id keyID, const KeyInterner::Id userID,
+                const long seconds) {
+        if (keyID >= users.size() / slotCount) {
+            users.resize((keyID + 1) * slotCount, KeyInterner::NotFound);
+            times.resize(users.size(), LONG_MIN);
+        }
+        KeyInterner::Id *slotUsers = &users[keyID * slotCount];
+        long *slotTimes = &times[keyID * slotCount];
+        // One pass finds the user's slot (or else the least recent one,
+        // which empty slots always are) and counts the other users seen
+        // within the window
+        const long since = seconds - rule.window;
+        size_t slot = 0, inWindow = 1;
+        bool found = false;
+        for (size_t i = 0; i < slotCount; i++) {
+            if (slotUsers[i] == userID) {
+                slot = i;
+                found = true;
+            } else {
+                inWindow += (slotTimes[i] >= since);
+                if (!found && slotTimes[i] < slotTimes[slot]) {
+                    slot = i;
+                }
+            }
+        }
+        if (!found) {
+            inWindow -= (slotTimes[slot] >= since);
+        }
+        slotUsers[slot] = userID;
+        slotTimes[slot] = seconds;
+        return inWindow > rule.maxAttempts;
+    }
+
+    /** Start loading a key's slots (see FrequencyTracker::prefetch) */
+    void prefetch(const KeyInterner::Id keyID) const {
+        if (keyID < users.size() / slotCount) {
+            __builtin_prefetch(&users[keyID * slotCount], 1);
+            __builtin_prefetch(&times[keyID * slotCount], 1);
+        }
+    }
+
+    /**
+     * Write or restore the slots with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the snapshot being restored was
+     * taken with a different rule.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        size_t size = slotCount;
+        long window = rule.window;
+        ar.value(size);
+        ar.value(window);
+        if (size != slotCount || window != rule.window) {
+            throw std::runtime_error("Snapshot has a different distinct-"
+                                     "users rule");
+        }
+        ar.array(users);
+        ar.array(times);
+        ar.check(times.size() == users.size() &&
+                 users.size() % slotCount == 0, "distinct-users slots");
+    }
+
+private:
+    /** The rule being checked */
+    const FrequencyRule rule;
+
+    /** The number of slots kept per key (maxAttempts + 1) */
+    const size_t slotCount;
+
+    /** The user in each slot (NotFound if empty), slotCount per key */
+    std::vector<KeyInterner::Id> users;
+
+    /** The time each slot's user last logged in (LONG_MIN if empty) */
+    std::vector<long> times;
+};
+
+/**
+ * The state of a rule set: the dense IDs of the users, IP addresses,
+ * and subnets seen, and one tracker per rule. Like FrequencyDetector, it is fed
+ * the logins in time order.
+ */
+class RuleEngine {
+public:
+    /**
+     * Compile a rule set.
+     *
+     * @param authorizedUsers The users that are exempt from the rules.
+     * The set must outlive this engine.
+     *
+     * @param rules The rules to be checked.
+     */
+    explicit RuleEngine(const LookupMap& authorizedUsers,
+                        const RuleSet& rules = defaultRules())
+        : authorizedUsers(&authorizedUsers), rules(rules), ipKeys(1) {
+        for (size_t r = 0; r < rules.size(); r++) {
+            const RuleSpec& spec = rules[r];
+            if (spec.measure == RuleSpec::USERS) {
+                ipUsers.emplace_back(spec.rule);
+                ipUserRules.push_back(r);
+                ipUserKeys.push_back(keyIndex(spec));
+            } else if (spec.measure == RuleSpec::ESTIMATED_USERS) {
+                ipSketches.emplace_back(spec.rule);
+                ipSketchRules.push_back(r);
+                ipSketchKeys.push_back(keyIndex(spec));
+            } else if (spec.key == RuleSpec::IP) {
+                ipAttempts.emplace_back(spec.rule);
+                ipAttemptRules.push_back(r);
+                ipAttemptKeys.push_back(keyIndex(spec));
+            } else {
+                userAttempts.emplace_back(spec.rule);
+                userAttemptRules.push_back(r);
+            }
+        }
+    }
+
+    /**
+     * Record a login and check it against every rule.
+     *
+     * @param user The user ID from the log line.
+     *
+     * @param ip The IP address from the log line, in binary form (see
+     * AddressInterner::toKey).
+     *
+     * @param seconds The time of the login in seconds since Epoch.
+     *
+     * @return The first rule (in rule set order) that the login
+     * violates, or nullptr if there is none.
+     */
+    const RuleSpec* check(std::string_view user,
+                          const AddressInterner::Key ip, const long seconds) {
+        const KeyInterner::Id id = userID(user);
+        if (authorized[id]) {
+            return nullptr;
+        }
+        return check(id, usesIP() ? ipID(ip) : 0, seconds);
+    }
+
+    /**
+     * Obtain the dense ID of a user, adding the user if it is new. The
+     * IDs are for the check overload below, e.g., when a batch of lines
+     * is parsed before any of them is checked.
+     */
+    KeyInterner::Id userID(std::string_view user) {
+        const KeyInterner::Id id = users.intern(user);
+        if (id == authorized.size()) {
+            authorized.push_back(authorizedUsers->contains(user));
+        }
+        return id;
+    }
+
+    /** Start loading the table slot of an IP address (see ipID) */
+    void prefetchIP(const AddressInterner::Key ip) const { ips.prefetch(ip); }
+
+    /**
+     * Obtain the dense ID of an IP address (see userID), working out its
+     * subnets if it is new.
+     *
+     * @param ip The address in binary form (see AddressInterner::toKey).
+     */
+    KeyInterner::Id ipID(const AddressInterner::Key ip) {
+        const KeyInterner::Id id = ips.intern(ip);
+        if (!subnets.empty() && id == subnets[0].ofAddress.size()) {
+            addSubnets(ip);
+        }
+        return id;
+    }
+
+    /**
+     * Record a login and check it against every rule. See above.
+     *
+     * @param userID The ID of the user (see userID).
+     *
+     * @param ipID The ID of the IP address (see ipID). It is only used
+     * if usesIP().
+     */
+    const RuleSpec* check(const KeyInterner::Id userID,
+                          const KeyInterner::Id ipID, const long seconds) {
+        if (authorized[userID]) {
+            return nullptr;
+        }
+        size_t violated = rules.size();
+        for (size_t i = 0; i < userAttempts.size(); i++) {
+            if (userAttempts[i].record(userID, seconds)) {
+                violated = std::min(violated, userAttemptRules[i]);
+            }
+        }
+        if (usesIP()) {
+            // The ID of the IP itself, then of each of its subnets
+            ipKeys[0] = ipID;
+            for (size_t s = 0; s < subnets.size(); s++) {
+                ipKeys[s + 1] = subnets[s].ofAddress[ipID];
+            }
+            for (size_t i = 0; i < ipAttempts.size(); i++) {
+                if (ipAttempts[i].record(ipKeys[ipAttemptKeys[i]], seconds)) {
+                    violated = std::min(violated, ipAttemptRules[i]);
+                }
+            }
+            for (size_t i = 0; i < ipUsers.size(); i++) {
+                if (ipUsers[i].record(ipKeys[ipUserKeys[i]], userID,
+                                      seconds)) {
+                    violated = std::min(violated, ipUserRules[i]);
+                }
+            }
+            for (size_t i = 0; i < ipSketches.size(); i++) {
+                if (ipSketches[i].record(ipKeys[ipSketchKeys[i]], userID,
+                                         seconds)) {
+                    violated = std::min(violated, ipSketchRules[i]);
+                }
+            }
+        }
+        return violated < rules.size() ? &rules[violated] : nullptr;
+    }
+
+    /**
+     * Record a login and check it against every rule. See above; the IP
+     * address is only parsed if a rule needs it.
+     *
+     * @param ip The IP address from the log line, in text form.
+     */
+    const RuleSpec* check(std::string_view user, std::string_view ip,
+                          const long seconds) {
+        return check(user, usesIP() ? AddressInterner::toKey(ip) : 0,
+                     seconds);
+    }
+
+    /** Obtain the number of users and of IP addresses seen */
+    size_t userCount() const { return users.size(); }
+    size_t ipCount() const { return ips.size(); }
+
+    /** Check if any rule is kept per IP address or subnet */
+    bool usesIP() const {
+        return !ipAttempts.empty() || !ipUsers.empty() ||
+               !ipSketches.empty();
+    }
+
+    /**
+     * Start loading the state that checking a login will use: the
+     * trackers' entries for its user and IP (see check). Checking a
+     * batch of logins with each one prefetched a few logins ahead
+     * overlaps their cache misses.
+     */
+    void prefetch(const KeyInterner::Id userID, const KeyInterner::Id ipID) {
+        for (const FrequencyTracker& tracker : userAttempts) {
+            tracker.prefetch(userID);
+        }
+        if (usesIP()) {
+            for (size_t i = 0; i < ipAttempts.size(); i++) {
+                ipAttempts[i].prefetch(keyOf(ipAttemptKeys[i], ipID));
+            }
+            for (size_t i = 0; i < ipUsers.size(); i++) {
+                ipUsers[i].prefetch(keyOf(ipUserKeys[i], ipID));
+            }
+            for (size_t i = 0; i < ipSketches.size(); i++) {
+                ipSketches[i].prefetch(keyOf(ipSketchKeys[i], ipID));
+            }
+        }
+    }
+
+    /**
+     * Switch to a new set of authorized users, e.g., after the list was
+     * reloaded. The flags of every tracked user are recomputed, and
+     * the rules' state is kept.
+     *
+     * @param users The users that are now exempt from the rules. The
+     * set must outlive this engine or the next switch.
+     */
+    void setAuthorizedUsers(const LookupMap& users) {
+        authorizedUsers = &users;
+        for (KeyInterner::Id id = 0; id < authorized.size(); id++) {
+            authorized[id] = users.contains(this->users.key(id));
+        }
+    }
+
+    /**
+     * Write or restore the engine with a snapshot archive (see
+     * DetectorSnapshot.h).
+     *
+     * @exception std::runtime_error If the snapshot being restored was
+     * taken with different rules or fails a check of its invariants.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        size_t count = rules.size();
+        ar.value(count);
+        if (count != rules.size()) {
+            throw std::runtime_error("Snapshot has a different rule set");
+        }
+        users.snapshot(ar);
+        ar.array(authorized);
+        ar.check(authorized.size() == users.size(), "user flags");
+        ips.snapshot(ar);
+        for (SubnetKeys& group : subnets) {
+            int v4Prefix = group.v4Prefix, v6Prefix = group.v6Prefix;
+            ar.value(v4Prefix);
+            ar.value(v6Prefix);
+            if (v4Prefix != group.v4Prefix || v6Prefix != group.v6Prefix) {
+                throw std::runtime_error("Snapshot has a different subnet "
+                                         "rule");
+            }
+            group.ids.snapshot(ar);
+            ar.array(group.ofAddress);
+            bool valid = group.ofAddress.size() == ips.size();
+            for (const KeyInterner::Id id : group.ofAddress) {
+                valid = valid && id < group.ids.size();
+            }
+            ar.check(valid, "subnet IDs");
+        }
+        for (FrequencyTracker& tracker : userAttempts) {
+            tracker.snapshot(ar);
+        }
+        for (FrequencyTracker& tracker : ipAttempts) {
+            tracker.snapshot(ar);
+        }
+        for (DistinctTracker& tracker : ipUsers) {
+            tracker.snapshot(ar);
+        }
+        for (DistinctSketchTracker& tracker : ipSketches) {
+            tracker.snapshot(ar);
+        }
+    }
+
+private:
+    /** The subnets of every IP address seen, for one pair of prefixes */
+    struct SubnetKeys {
+        int v4Prefix, v6Prefix;
+        /** The dense IDs of the subnets */
+        AddressInterner ids;
+        /** The ID of the subnet of each IP (indexed by IP ID) */
+        std::vector<KeyInterner::Id> ofAddress;
+    };
+
+    /**
+     * Obtain the index in ipKeys of the key a rule is kept per (0 for
+     * the IP itself), adding a subnet grouping if it is a new one.
+     */
+    size_t keyIndex(const RuleSpec& spec) {
+        if (spec.perAddress()) {
+            return 0;
+        }
+        for (size_t s = 0; s < subnets.size(); s++) {
+            if (subnets[s].v4Prefix == spec.v4Prefix &&
+                subnets[s].v6Prefix == spec.v6Prefix) {
+                return s + 1;
+            }
+        }
+        subnets.push_back({spec.v4Prefix, spec.v6Prefix, {}, {}});
+        ipKeys.push_back(0);
+        return subnets.size();
+    }
+
+    /** Obtain the ID of an IP's key (see keyIndex) */
+    KeyInterner::Id keyOf(const size_t index, const KeyInterner::Id ipID)
+        const {
+        return index == 0 ? ipID : subnets[index - 1].ofAddress[ipID];
+    }
+
+    /** Work out the subnets of an IP address that was just interned */
+    void addSubnets(const AddressInterner::Key key) {
+        const bool v4 = (key >> 32 == 0xffff);
+        for (SubnetKeys& group : subnets) {
+            const int len = (v4 ? 96 + group.v4Prefix : group.v6Prefix);
+            // Something that is not an address is its own subnet
+            const AddressInterner::Key prefix =
+                AddressInterner::isTextKey(key) || len == 128 ? key :
+                key & ~(~AddressInterner::Key(0) >> len);
+            group.ofAddress.push_back(group.ids.intern(prefix));
+        }
+    }
+
+    /** The users that are exempt from the rules */
+    const LookupMap* authorizedUsers;
+
+    /** The rules being checked */
+    RuleSet rules;
+
+    /** The dense IDs of every user and IP address seen so far */
+    KeyInterner users;
+    AddressInterner ips;
+
+    /** The subnet groupings used by the rules */
+    std::vector<SubnetKeys> subnets;
+
+    /** The keys of the line being checked (see keyIndex) */
+    std::vector<KeyInterner::Id> ipKeys;
+
+    /** Whether each user (indexed by ID) is an authorized user */
+    std::vector<bool> authorized;
+
+    /**
+     * The trackers of each kind of rule, the index in rules of the rule
+     * each one checks, and the index in ipKeys of the key it is kept per.
+     */
+    std::vector<FrequencyTracker> userAttempts, ipAttempts;
+    std::vector<DistinctTracker> ipUsers;
+    std::vector<DistinctSketchTracker> ipSketches;
+    std::vector<size_t> userAttemptRules, ipAttemptRules, ipUserRules,
+                        ipSketchRules;
+    std::vector<size_t> ipAttemptKeys, ipUserKeys, ipSketchKeys;
+};
+
+#endif  // RULE_ENGINE_H
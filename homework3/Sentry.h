@@ -0,0 +1,453 @@
+// Copyright 2023 Evan Williams
+#ifndef SENTRY_H
+#define SENTRY_H
+
+/**
+ * The single-threaded detection state of LoginSentry: the rules are
+ * applied one line at a time by checkLine, and the state persists
+ * between calls, so lines can come from a stream, a memory-mapped
+ * file, or several reads of a growing file.
+ *
+ * Larger buffers are checked by checkLines in batches, one stage at a
+ * time: a parse stage fills columns (structure of arrays) with the
+ * timestamp, user, IP, and text of each login, and then the
+ * banned-IP check, the interning, the threshold rules, and the
+ * reporting each run as a tight loop over those columns. Since a
+ * stage knows which IPs and users the next logins have, it prefetches
+ * their table slots and tracker entries a few logins ahead, so the
+ * cache misses of per-IP state (which rarely fits in cache) overlap
+ * instead of stalling every line in turn. The parse stage and the rest
+ * are separate calls (parseBatch and checkBatch), so they can also run
+ * on different threads (see PipelinedSentry.h).
+ *
+ * With a lateness bound, logins that are not from a banned IP go
+ * through a ReorderBuffer before the rules, so logs whose lines are a
+ * few seconds out of order are still checked in timestamp order.
+ * Held logins keep a copy of their line, since the text they came
+ * from may be reused, and are saved with the rules' state.
+ *
+ * The sentry is compiled for one log format (see LogFormat.h); Sentry
+ * is the one for sshd's syslog lines.
+ */
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "AlertWriter.h"
+#include "IpPrefixSet.h"
+#include "LogFormat.h"
+#include "ReorderBuffer.h"
+#include "RuleEngine.h"
+#include "SyslogTime.h"
+
+template <class Format = SshdFormat>
+class BasicSentry {
+public:
+    /**
+     * Create a sentry.
+     *
+     * @param bannedIPs The banned IP addresses and ranges. The set must
+     * outlive the sentry.
+     *
+     * @param authorizedUsers The users exempt from the frequency rule.
+     * The set must outlive the sentry.
+     *
+     * @param alerts The writer to which detections are reported.
+     *
+     * @param rules The threshold rules checked for logins that are not
+     * from a banned IP.
+     *
+     * @param lateness How many seconds a login may arrive out of order
+     * and still be checked in order, or 0 to check logins as they come
+     * (see ReorderBuffer.h). Call finish at the end of the input.
+     *
+     * @param year The year of the first line without one, or
+     * TimestampParser::CLOCK_YEAR (see SyslogTime.h).
+     */
+    BasicSentry(const IpPrefixSet& bannedIPs,
+                const LookupMap& authorizedUsers, AlertWriter& alerts,
+                const RuleSet& rules = defaultRules(),
+                const long lateness = 0, const int year = 2021)
+        : bannedIPs(&bannedIPs), loginTimes(authorizedUsers, rules),
+          timestamps(year), reordering(lateness > 0), reorder(lateness),
+          alerts(alerts) {}
+
+    /**
+     * Check one log line for a login by a banned IP address or one
+     * that violates a threshold rule (by default, excessive login
+     * frequency from a single unauthorized user), and report the line
+     * if it is a possible hacking attempt. Lines that are not logins
+     * in the sentry's format are counted but not checked.
+     *
+     * @param line The log line, without its newline.
+     */
+    void checkLine(std::string_view line) {
+        lineCount++;
+        splitWords<Format::WORDS>(line, words);
+        if (!scanner.scan(line, words, fields)) {
+            return;
+        }
+        const long seconds = scanner.time(timestamps, fields).seconds;
+        // The IP is parsed once for both the banned list and the rules
+        AddressInterner::Key ip;
+        int maxLen;
+        const bool isAddress = IpPrefixSet::parse(fields.ip, ip, maxLen);
+        if (isAddress && bannedIPs->contains(ip)) {
+            hackCount++;
+            alerts.alert(BANNED_IP_ALERT, fields.user, fields.ip, seconds,
+                         line);
+        } else if (reordering) {
+            hold(line, fields, seconds, loginTimes.userID(fields.user),
+                 loginTimes.usesIP() ? loginTimes.ipID(isAddress ? ip :
+                     AddressInterner::toKey(fields.ip)) : 0);
+        } else if (const RuleSpec* rule = loginTimes.check(fields.user,
+                       isAddress ? ip : AddressInterner::toKey(fields.ip),
+                       seconds)) {
+            hackCount++;
+            alerts.alert(rule->alertKind(), fields.user, fields.ip, seconds,
+                         line);
+        }
+    }
+
+    /**
+     * Check every line in a buffer of log text, such as a memory-mapped
+     * file, in batches of BATCH_LINES lines (see above). Lines and their
+     * words are found in one pass by a LineSplitter, in place, so the
+     * text is never copied. The results are the same
+     * as calling checkLine for each line, but the alerts of a batch are
+     * reported once the whole batch has been checked.
+     *
+     * @param text The log text. A final line without a newline is
+     * checked too.
+     */
+    void checkLines(std::string_view text) {
+        for (size_t pos = 0; pos < text.size();) {
+            pos = parseBatch(text, pos, batch);
+            checkBatch(batch);
+        }
+    }
+
+    /**
+     * The columns of a batch of lines, one entry per login. The views
+     * point into the text the batch was parsed from, which must be kept
+     * until the batch is checked.
+     */
+    struct Batch {
+        /** The number of lines parsed, and of logins among them */
+        size_t lineCount = 0, count = 0;
+        std::vector<std::string_view> lines =
+            std::vector<std::string_view>(BATCH_LINES);
+        std::vector<LogFields> fields = std::vector<LogFields>(BATCH_LINES);
+        std::vector<long> seconds = std::vector<long>(BATCH_LINES);
+        std::vector<KeyInterner::Id> users =
+            std::vector<KeyInterner::Id>(BATCH_LINES),
+            ips = std::vector<KeyInterner::Id>(BATCH_LINES);
+        std::vector<AddressInterner::Key> addresses =
+            std::vector<AddressInterner::Key>(BATCH_LINES);
+        std::vector<char> isAddress = std::vector<char>(BATCH_LINES),
+            banned = std::vector<char>(BATCH_LINES);
+        std::vector<const RuleSpec*> violated =
+            std::vector<const RuleSpec*>(BATCH_LINES);
+        /** The words of the line being parsed */
+        LineWords words;
+    };
+
+    /**
+     * The parse stage: split the next BATCH_LINES lines of the text and
+     * fill the columns of a batch with the logins among them. It uses
+     * only the scanner and the timestamp converter, so it may run on
+     * another thread than checkBatch (see PipelinedSentry.h), as long as
+     * each batch is checked after it is parsed.
+     *
+     * @param text The log text.
+     *
+     * @param pos The start of the first line to parse.
+     *
+     * @param batch The batch to fill.
+     *
+     * @return The position after the last line parsed.
+     */
+    size_t parseBatch(std::string_view text, const size_t pos,
+                      Batch& batch) {
+        size_t count = 0, n = 0;
+        LineSplitter<Format::WORDS> lines(text, pos);
+        std::string_view line;
+        for (; n < BATCH_LINES && lines.next(line, batch.words); n++) {
+            LogFields& f = batch.fields[count];
+            if (!scanner.scan(line, batch.words, f)) {
+                continue;
+            }
+            int maxLen;
+            batch.lines[count] = line;
+            batch.seconds[count] = scanner.time(timestamps, f).seconds;
+            batch.isAddress[count] = IpPrefixSet::parse(f.ip,
+                batch.addresses[count], maxLen);
+            if (!batch.isAddress[count]) {
+                batch.addresses[count] = AddressInterner::toKey(f.ip);
+            }
+            count++;
+        }
+        batch.lineCount = n;
+        batch.count = count;
+        return lines.position();
+    }
+
+    /**
+     * The check stage: flag the logins of a parsed batch that are from
+     * a banned IP, intern the users and IPs of the others, and then
+     * either check them against the rules and report the batch, or hold
+     * them for reordering.
+     */
+    void checkBatch(Batch& batch) {
+        lineCount += batch.lineCount;
+        checkBanned(batch);
+        internBatch(batch);
+        if (reordering) {
+            holdBatch(batch);
+            return;
+        }
+        checkRules(batch);
+        reportBatch(batch);
+    }
+
+    /**
+     * Check the logins still held for reordering, e.g., at the end of
+     * the input.
+     */
+    void finish() {
+        reorder.flush([this](const long seconds, HeldLogin& login) {
+            checkHeld(seconds, login);
+        });
+    }
+
+    /** The number of lines parsed before the rules run over them */
+    static constexpr size_t BATCH_LINES = 1024;
+
+    /** How many logins ahead the state of a login is prefetched */
+    static constexpr size_t PREFETCH_DISTANCE = 8;
+
+    /**
+     * Switch to new lists, e.g., after they were reloaded. Lines checked
+     * from now on use the new lists; the rules' state is kept.
+     *
+     * @param banned The banned IP addresses and ranges.
+     *
+     * @param authorizedUsers The users exempt from the frequency rule.
+     * Both sets must outlive the sentry or the next switch.
+     */
+    void useLists(const IpPrefixSet& banned,
+                  const LookupMap& authorizedUsers) {
+        bannedIPs = &banned;
+        loginTimes.setAuthorizedUsers(authorizedUsers);
+    }
+
+    /**
+     * Write or restore the rules' state, the held logins, the year
+     * being assumed, and the counters with a snapshot archive (see
+     * DetectorSnapshot.h).
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        loginTimes.snapshot(ar);
+        reorder.snapshot(ar);
+        bool valid = true;
+        reorder.forEach([&](const HeldLogin& login) {
+            valid = valid && login.userID < loginTimes.userCount() &&
+                    (!loginTimes.usesIP() ||
+                     login.ipID < loginTimes.ipCount());
+        });
+        ar.check(valid, "held login IDs");
+        timestamps.snapshot(ar);
+        scanner.snapshot(ar);
+        ar.value(lineCount);
+        ar.value(hackCount);
+    }
+
+    /** Report the number of lines processed and hacking attempts found */
+    void printSummary() const {
+        alerts.summary(lineCount, hackCount, reorder.lateCount());
+    }
+
+private:
+    /** A login held for reordering, with its own copy of the line */
+    struct HeldLogin {
+        std::string line;
+        /** The positions of the user and IP in the line */
+        std::uint32_t user, userLen, ip, ipLen;
+        /** The interned user and IP (see RuleEngine::check) */
+        KeyInterner::Id userID, ipID;
+
+        /** Write or restore the login with a snapshot archive */
+        template <class Archive>
+        void snapshot(Archive& ar) {
+            ar.array(line);
+            ar.value(user);
+            ar.value(userLen);
+            ar.value(ip);
+            ar.value(ipLen);
+            ar.value(userID);
+            ar.value(ipID);
+            ar.check(user <= line.size() && userLen <= line.size() - user &&
+                     ip <= line.size() && ipLen <= line.size() - ip,
+                     "held login");
+        }
+    };
+
+    /**
+     * Hold a login that is not from a banned IP until the reorder
+     * buffer releases it (and maybe others) to the rules. The copy of
+     * the line reuses the storage of a released one.
+     */
+    void hold(std::string_view line, const LogFields& f, const long seconds,
+              const KeyInterner::Id userID, const KeyInterner::Id ipID) {
+        const auto offset = [&](std::string_view field) {
+            return static_cast<std::uint32_t>(field.data() - line.data());
+        };
+        std::string copy;
+        if (!spareLines.empty()) {
+            copy = std::move(spareLines.back());
+            spareLines.pop_back();
+        }
+        copy.assign(line);
+        reorder.push(seconds, HeldLogin{std::move(copy), offset(f.user),
+            static_cast<std::uint32_t>(f.user.size()), offset(f.ip),
+            static_cast<std::uint32_t>(f.ip.size()), userID, ipID},
+            [this](const long released, HeldLogin& login) {
+                checkHeld(released, login);
+            });
+    }
+
+    /** Check a login released by the reorder buffer against the rules */
+    void checkHeld(const long seconds, HeldLogin& login) {
+        if (const RuleSpec* rule = loginTimes.check(login.userID,
+                                                    login.ipID, seconds)) {
+            const std::string_view line = login.line;
+            hackCount++;
+            alerts.alert(rule->alertKind(),
+                         line.substr(login.user, login.userLen),
+                         line.substr(login.ip, login.ipLen), seconds, line);
+        }
+        spareLines.push_back(std::move(login.line));
+    }
+
+    /**
+     * Intern the users of the batch, and its IPs if a rule needs them,
+     * prefetching the IPs' table slots ahead. Logins from a banned IP
+     * are skipped, as checkLine skips them, since the rules never see
+     * them.
+     */
+    void internBatch(Batch& batch) {
+        const size_t count = batch.count;
+        for (size_t i = 0; i < count; i++) {
+            if (!batch.banned[i]) {
+                batch.users[i] = loginTimes.userID(batch.fields[i].user);
+            }
+        }
+        if (loginTimes.usesIP()) {
+            for (size_t i = 0; i < count; i++) {
+                if (i + PREFETCH_DISTANCE < count) {
+                    loginTimes.prefetchIP(
+                        batch.addresses[i + PREFETCH_DISTANCE]);
+                }
+                if (!batch.banned[i]) {
+                    batch.ips[i] = loginTimes.ipID(batch.addresses[i]);
+                }
+            }
+        }
+    }
+
+    /** Flag the logins of the batch that are from a banned IP */
+    void checkBanned(Batch& batch) {
+        const size_t count = batch.count;
+        for (size_t i = 0; i < count; i++) {
+            batch.banned[i] = batch.isAddress[i] &&
+                              bannedIPs->contains(batch.addresses[i]);
+        }
+    }
+
+    /** Check the other logins of the batch against the rules, in order */
+    void checkRules(Batch& batch) {
+        const size_t count = batch.count;
+        for (size_t i = 0; i < count; i++) {
+            // A banned login has no IDs to prefetch (see internBatch)
+            if (i + PREFETCH_DISTANCE < count &&
+                !batch.banned[i + PREFETCH_DISTANCE]) {
+                loginTimes.prefetch(batch.users[i + PREFETCH_DISTANCE],
+                                    batch.ips[i + PREFETCH_DISTANCE]);
+            }
+            batch.violated[i] = (batch.banned[i] ? nullptr :
+                loginTimes.check(batch.users[i], batch.ips[i],
+                                 batch.seconds[i]));
+        }
+    }
+
+    /**
+     * Report the logins of the batch that are from a banned IP, and
+     * hold the others for reordering.
+     */
+    void holdBatch(Batch& batch) {
+        for (size_t i = 0; i < batch.count; i++) {
+            if (batch.banned[i]) {
+                hackCount++;
+                alerts.alert(BANNED_IP_ALERT, batch.fields[i].user,
+                             batch.fields[i].ip, batch.seconds[i],
+                             batch.lines[i]);
+            } else {
+                hold(batch.lines[i], batch.fields[i], batch.seconds[i],
+                     batch.users[i], loginTimes.usesIP() ? batch.ips[i] : 0);
+            }
+        }
+    }
+
+    /** Report the flagged logins of the batch, in order */
+    void reportBatch(Batch& batch) {
+        for (size_t i = 0; i < batch.count; i++) {
+            if (!batch.banned[i] && !batch.violated[i]) {
+                continue;
+            }
+            hackCount++;
+            alerts.alert(batch.banned[i] ? BANNED_IP_ALERT :
+                         batch.violated[i]->alertKind(),
+                         batch.fields[i].user, batch.fields[i].ip,
+                         batch.seconds[i], batch.lines[i]);
+        }
+    }
+
+    /** The banned IP addresses and ranges */
+    const IpPrefixSet* bannedIPs;
+
+    /** The threshold rules' per-user and per-IP state */
+    RuleEngine loginTimes;
+
+    /** The converter for the timestamps of the lines */
+    TimestampParser timestamps;
+
+    /** The scanner of the log format */
+    Format scanner;
+
+    /** The words and fields of the line being checked */
+    LineWords words;
+    LogFields fields;
+
+    /** Whether logins are reordered before the rules */
+    const bool reordering;
+
+    /** The logins held for reordering, and line storage to reuse */
+    ReorderBuffer<HeldLogin> reorder;
+    std::vector<std::string> spareLines;
+
+    /** The batch being checked by checkLines */
+    Batch batch;
+
+    /** The writer to which detections are reported */
+    AlertWriter& alerts;
+
+    /** The number of lines checked and hacking attempts found */
+    size_t lineCount = 0, hackCount = 0;
+};
+
+/** The sentry for sshd's syslog lines */
+using Sentry = BasicSentry<>;
+
+#endif  // SENTRY_H
@@ -0,0 +1,255 @@
+// Copyright 2023 Evan Williams
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+/**
+ * A bounded lock-free ring buffer between one producer thread and one
+ * consumer thread, which connects the stages of LoginSentry's
+ * pipelines (see PipelinedSentry.h). Each side owns one index and
+ * keeps a cached copy of the other's, so a push or pop touches the
+ * other side's cache line only when the ring looks full or empty.
+ *
+ * A full ring holds the producer back (backpressure) and an empty one
+ * holds the consumer. Either wait spins briefly, then yields, then
+ * sleeps in growing steps, so a waiting stage costs little CPU when
+ * the other stage is much slower (or shares the CPU). Each side
+ * counts its waits and the time spent in them, and the producer
+ * samples the ring's depth, so the stage that limits throughput shows
+ * as the one the others wait for.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/** The counters of a ring (see SpscRing::stats) */
+struct RingStats {
+    /** The number of items pushed */
+    std::uint64_t pushes = 0;
+    /** The number of pushes that waited for a full ring, and how long */
+    std::uint64_t fullWaits = 0;
+    double fullSeconds = 0;
+    /** The number of pops that waited for an empty ring, and how long */
+    std::uint64_t emptyWaits = 0;
+    double emptySeconds = 0;
+    /** The sum and maximum of the depth after each push */
+    std::uint64_t depthSum = 0, maxDepth = 0;
+    /** The capacity of the ring */
+    std::uint64_t capacity = 0;
+
+    /**
+     * Print the counters on one line, e.g., to cerr at the end of a
+     * run.
+     *
+     * @param os The stream to print to.
+     *
+     * @param name The name of the ring, such as "read->parse".
+     */
+    void print(std::ostream& os, const char* name) const {
+        os << name << ": " << pushes << " items, depth avg "
+           << (pushes ? double(depthSum) / pushes : 0) << " max "
+           << maxDepth << "/" << capacity << ", producer waited "
+           << fullWaits << " times (" << fullSeconds << " s), consumer "
+           << "waited " << emptyWaits << " times (" << emptySeconds
+           << " s)\n";
+    }
+};
+
+/**
+ * Waiting in a loop with growing pauses: spins, then yields, then
+ * sleeps of up to MAX_SLEEP.
+ */
+class Backoff {
+public:
+    static constexpr std::chrono::microseconds MAX_SLEEP{256};
+
+    /** Wait a little longer than last time */
+    void pause() {
+        if (rounds < SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else if (rounds < SPINS + YIELDS) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(sleep);
+            sleep = std::min(sleep * 2, MAX_SLEEP);
+        }
+        rounds++;
+    }
+
+private:
+    static constexpr int SPINS = 64, YIELDS = 16;
+    int rounds = 0;
+    std::chrono::microseconds sleep{16};
+};
+
+template <class T>
+class SpscRing {
+public:
+    /**
+     * Create an empty ring.
+     *
+     * @param capacity The most items the ring holds, rounded up to a
+     * power of two.
+     */
+    explicit SpscRing(const size_t capacity)
+        : slots(roundUp(capacity)), mask(slots.size() - 1) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /**
+     * Add an item unless the ring is full. Only the producer may call
+     * this.
+     *
+     * @param item The item, moved from if it was added.
+     *
+     * @return False if the ring was full.
+     */
+    bool tryPush(T& item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - producer.head == slots.size()) {
+            producer.head = head.load(std::memory_order_acquire);
+            if (t - producer.head == slots.size()) {
+                return false;
+            }
+        }
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        const std::uint64_t depth = t + 1 - producer.head;
+        producer.pushes++;
+        producer.depthSum += depth;
+        producer.maxDepth = std::max(producer.maxDepth, depth);
+        return true;
+    }
+
+    /**
+     * Add an item, waiting while the ring is full. Only the producer
+     * may call this.
+     */
+    void push(T item) {
+        if (tryPush(item)) {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        Backoff backoff;
+        while (!tryPush(item)) {
+            backoff.pause();
+        }
+        producer.waits++;
+        producer.seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * Tell the consumer that no more items will be pushed. Only the
+     * producer may call this.
+     */
+    void close() { closed.store(true, std::memory_order_release); }
+
+    /**
+     * Remove the oldest item unless the ring is empty. Only the
+     * consumer may call this.
+     *
+     * @return False if the ring was empty.
+     */
+    bool tryPop(T& item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == consumer.tail) {
+            consumer.tail = tail.load(std::memory_order_acquire);
+            if (h == consumer.tail) {
+                return false;
+            }
+        }
+        item = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove the oldest item, waiting while the ring is empty. Only the
+     * consumer may call this.
+     *
+     * @return False once the ring is closed and empty.
+     */
+    bool pop(T& item) {
+        if (tryPop(item)) {
+            return true;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        Backoff backoff;
+        bool popped;
+        for (;;) {
+            if (tryPop(item)) {
+                popped = true;
+                break;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // Anything pushed before close is visible now
+                popped = tryPop(item);
+                break;
+            }
+            backoff.pause();
+        }
+        consumer.waits++;
+        consumer.seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        return popped;
+    }
+
+    /**
+     * Obtain the counters of both sides. They are exact once both
+     * threads are done with the ring, and approximate before.
+     */
+    RingStats stats() const {
+        RingStats stats;
+        stats.pushes = producer.pushes;
+        stats.fullWaits = producer.waits;
+        stats.fullSeconds = producer.seconds;
+        stats.emptyWaits = consumer.waits;
+        stats.emptySeconds = consumer.seconds;
+        stats.depthSum = producer.depthSum;
+        stats.maxDepth = producer.maxDepth;
+        stats.capacity = slots.size();
+        return stats;
+    }
+
+private:
+    static size_t roundUp(const size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    std::vector<T> slots;
+    const size_t mask;
+
+    /** The next slot to pop and to push, each on its own cache line */
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+
+    /** The producer's copy of head, and its counters */
+    struct alignas(64) {
+        size_t head = 0;
+        std::uint64_t pushes = 0, waits = 0, depthSum = 0, maxDepth = 0;
+        double seconds = 0;
+    } producer;
+
+    /** The consumer's copy of tail, and its counters */
+    struct alignas(64) {
+        size_t tail = 0;
+        std::uint64_t waits = 0;
+        double seconds = 0;
+    } consumer;
+};
+
+#endif  // SPSC_RING_H
@@ -0,0 +1,138 @@
+// Copyright 2023 Evan Williams
+#ifndef SYNTHETIC_LOG_H
+#define SYNTHETIC_LOG_H
+
+/**
+ * Synthetic sshd logs and output capture shared by LoginSentryBench
+ * and LoginSentryTest, so that the benchmarks and the tests run over
+ * the same inputs.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <zlib.h>
+#include "AlertWriter.h"
+
+/**
+ * A generator of synthetic sshd "Failed password" log lines from a pool
+ * of users and IP addresses, with timestamps that move forward by 0-2
+ * seconds per line. The same seed always yields the same lines. Lines
+ * are produced one at a time so that very long replays need no memory.
+ */
+class LogGenerator {
+public:
+    /**
+     * Create a generator.
+     *
+     * @param userCount The number of distinct users in the log.
+     *
+     * @param ipCount The number of distinct IP addresses in the log.
+     *
+     * @param start The time of the first line, in seconds from Jan 1
+     * 00:00:00. Months are 28 days long, so the log wraps to January
+     * at NEW_YEAR.
+     */
+    explicit LogGenerator(const int userCount = 1000,
+                          const int ipCount = 5000, const long start = 0)
+        : userCount(userCount), ipCount(ipCount), rng(381), secs(start) {}
+
+    /** The time at which the log wraps from December to January */
+    static constexpr long NEW_YEAR = 12 * 28 * 86400L;
+
+    /**
+     * Append the next line (including its newline) to the given string.
+     */
+    void next(std::string& out) {
+        static const char *Months[] = {"Jan", "Feb", "Mar", "Apr", "May",
+            "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        secs += rng() % 3;
+        const long day = secs / 86400, sod = secs % 86400;
+        const unsigned ip = rng() % ipCount;
+        char buf[160];
+        const int len = snprintf(buf, sizeof(buf), "%s %2ld %02ld:%02ld:%02ld "
+            "ceclnx01 sshd[%u]: Failed password for user%u from "
+            "10.%u.%u.%u port %u ssh2\n", Months[(day / 28) % 12],
+            day % 28 + 1, sod / 3600, sod / 60 % 60, sod % 60,
+            unsigned(1000 + rng() % 30000), unsigned(rng() % userCount),
+            ip >> 16 & 255, ip >> 8 & 255, ip & 255,
+            unsigned(1024 + rng() % 60000));
+        out.append(buf, len);
+    }
+
+private:
+    const int userCount, ipCount;
+    std::mt19937 rng;
+    long secs;
+};
+
+/**
+ * Generate a synthetic sshd log with the given number of lines.
+ *
+ * @param lineCount The number of lines to generate.
+ *
+ * @param userCount The number of distinct users in the log.
+ *
+ * @param ipCount The number of distinct IP addresses in the log.
+ *
+ * @param start The time of the first line (see LogGenerator).
+ *
+ * @return The generated log, one entry per line.
+ */
+inline std::string makeSyntheticLog(const size_t lineCount,
+                                    const int userCount = 1000,
+                                    const int ipCount = 5000,
+                                    const long start = 0) {
+    LogGenerator gen(userCount, ipCount, start);
+    std::string log;
+    log.reserve(lineCount * 90);
+    for (size_t i = 0; i < lineCount; i++) {
+        gen.next(log);
+    }
+    return log;
+}
+
+/**
+ * Helper method to run an operation that reports to an AlertWriter and
+ * return everything the writer wrote.
+ *
+ * @param format The format of the writer's output.
+ */
+inline std::string captureAlerts(const std::function<void(AlertWriter&)>& op,
+                                 const AlertFormat format = AlertFormat::TEXT) {
+    FILE* tmp = std::tmpfile();
+    {
+        AlertWriter alerts(fileno(tmp), format, 1 << 16,
+                           std::chrono::milliseconds(0));
+        op(alerts);
+    }
+    std::string out;
+    char buf[65536];
+    std::rewind(tmp);
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), tmp)) > 0;) {
+        out.append(buf, n);
+    }
+    std::fclose(tmp);
+    return out;
+}
+
+/**
+ * Helper method to gzip-compress data in memory with zlib.
+ */
+inline std::string gzipCompress(const std::string& data) {
+    z_stream zs = {};
+    deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+#endif  // SYNTHETIC_LOG_H
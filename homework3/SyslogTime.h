@@ -0,0 +1,435 @@
+// Copyright 2023 Evan Williams
+#ifndef SYSLOG_TIME_H
+#define SYSLOG_TIME_H
+
+/**
+ * Conversion of syslog timestamps into seconds since Epoch. Two forms
+ * are understood:
+ *
+ *   - The traditional "Jun 10 03:32:36" in local time, without a year.
+ *     The TimestampParser class handles the fixed format arithmetically
+ *     and only calls mktime once per distinct date, which is when the
+ *     local timezone rules actually need consulting. The year is
+ *     inferred: it starts at a given year and moves on when the dates
+ *     wrap from December to January, so a sentry that runs across New
+ *     Year keeps its timestamps increasing (see yearOf). Since the
+ *     year depends on the lines before, a log must be converted in
+ *     order by one parser. Dates on which the clocks change for DST
+ *     are converted with the UTC offset in effect at each time of day,
+ *     and the hour that repeats when the clocks go back is told apart
+ *     by the wall clock going backwards.
+ *
+ *   - RFC 3339, e.g., "2021-06-10T03:32:36.123456+02:00" as written by
+ *     rsyslog's high-precision format. These carry their year and UTC
+ *     offset, so they are converted exactly with integer arithmetic,
+ *     and keep their fraction of a second.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <string>
+#include <string_view>
+
+/**
+ * This method is used to convert a timestamp of the form "Jun 10
+ * 03:32:36" to seconds since Epoch (i.e., 1970-01-01 00:00:00). This
+ * method assumes by default, the year is 2021.
+ *
+ * \param[in] timestamp The timestamp to be converted to seconds.  The
+ * timestamp must be in the format "Month day Hour:Minutes:Seconds",
+ * e.g. "Jun 10 03:32:36".
+ *
+ * \param[in] year An optional year associated with the date. By
+ * default this value is assumed to be 2021.
+ *
+ * \return This method returns the seconds elapsed since Epoch. Times
+ * are in local time, with DST as the timezone rules have it on that
+ * date. (The original version left tm_isdst at 0, so it took every
+ * time as standard time, and times during DST came out an hour late;
+ * in a timezone without DST, such as UTC, nothing changed.)
+ */
+inline long toSeconds(const std::string& timestamp, const int year = 2021) {
+    // Initialize the time structure with specified year.
+    struct tm tstamp = {};
+    tstamp.tm_year = year - 1900;
+    // Now parse out the values from the supplied timestamp
+    strptime(timestamp.c_str(), "%B %d %H:%M:%S", &tstamp);
+    // Let mktime work out whether DST is in effect
+    tstamp.tm_isdst = -1;
+    // Use helper method to return seconds since Epoch
+    return mktime(&tstamp);
+}
+
+/** A point in time: seconds since Epoch and nanoseconds after that */
+struct LogTime {
+    long seconds;
+    long nanos;
+};
+
+/**
+ * A parser for log timestamps (see above). For traditional timestamps
+ * in the year being assumed, it returns exactly what toSeconds returns
+ * for the same text, except in the repeated hour after the clocks go
+ * back, which toSeconds always takes to be the first one. Anything
+ * that does not match either fixed format is handed to toSeconds.
+ */
+class TimestampParser {
+public:
+    /** The year to pass for the current year from the system clock */
+    static constexpr int CLOCK_YEAR = 0;
+
+    /**
+     * Create a parser.
+     *
+     * @param year The year of the first traditional timestamp. With
+     * CLOCK_YEAR, it is the current year, or the year before if the
+     * first timestamp is in a later month than today (e.g., a December
+     * line read in January).
+     */
+    explicit TimestampParser(const int year = 2021) : year(year) {}
+
+    /**
+     * Convert the three timestamp fields of a log line to seconds
+     * since Epoch. No memory is allocated on the fast path.
+     *
+     * @param month The month name, e.g. "Jun", or empty if time is an
+     * RFC 3339 timestamp.
+     *
+     * @param day The day of the month, e.g. "10".
+     *
+     * @param time The time of day, e.g. "03:32:36", or an RFC 3339
+     * timestamp.
+     *
+     * @return The seconds elapsed since Epoch.
+     */
+    long toSeconds(std::string_view month, std::string_view day,
+                   std::string_view time) {
+        return toTime(month, day, time).seconds;
+    }
+
+    /**
+     * Convert the timestamp fields of a log line like toSeconds, and
+     * keep the fraction of a second of an RFC 3339 timestamp.
+     */
+    LogTime toTime(std::string_view month, std::string_view day,
+                   std::string_view time) {
+        if (month.empty()) {
+            return fromRfc3339(time);
+        }
+        const int mon = monthIndex(month);
+        const int mday = (day.size() == 1 ? digit(day[0]) :
+                          day.size() == 2 ? twoDigits(day[0], day[1]) : -1);
+        if (mon < 0 || mday < 1 || mday > 31 || time.size() != 8 ||
+            time[2] != ':' || time[5] != ':') {
+            return {slowPath(month, day, time), 0};
+        }
+        const int hour = twoDigits(time[0], time[1]);
+        const int min  = twoDigits(time[3], time[4]);
+        const int sec  = twoDigits(time[6], time[7]);
+        if (hour < 0 || hour > 23 || min < 0 || min > 59 ||
+            sec < 0 || sec > 61) {
+            return {slowPath(month, day, time), 0};
+        }
+        const int older = yearOf(mon);
+        Day& date = days[older][mon][mday];
+        if (date.start == Unknown) {
+            startDay(date, year - older, mon, mday);
+        }
+        const int tod = hour * 3600 + min * 60 + sec;
+        long seconds = date.start + tod;
+        if (tod >= date.foldFrom) {
+            seconds += dstShift(date, tod);
+        }
+        return {seconds, 0};
+    }
+
+    /**
+     * Write or restore the year being assumed with a snapshot archive
+     * (see DetectorSnapshot.h), so that a restart keeps the year.
+     */
+    template <class Archive>
+    void snapshot(Archive& ar) {
+        const int before = year;
+        ar.value(year);
+        ar.value(lastMonth);
+        ar.check(lastMonth >= -1 && lastMonth < 12, "month");
+        if (year != before) {
+            clearDays(0);
+            clearDays(1);
+        }
+    }
+
+private:
+    /** Marker for a date whose start has not been computed yet */
+    static constexpr long Unknown = std::numeric_limits<long>::min();
+
+    /**
+     * How far the wall clock must go back within the repeated hour for
+     * the times after to be taken as the second pass through it. Lines
+     * that are merely a little out of order go back less than this.
+     */
+    static constexpr int FOLD_GAP = 600;
+
+    /** The conversion of one local date */
+    struct Day {
+        /** The seconds since Epoch at 00:00:00 */
+        long start = Unknown;
+        /** Times of day from foldFrom on may be after a DST change */
+        int foldFrom = INT_MAX;
+        /** From shiftAt on, shift seconds are added to start + time */
+        int shiftAt = INT_MAX, shift = 0;
+        /** The latest time seen in the repeated hour, and whether the
+         * clock has gone back to its start since */
+        int latest = -1;
+        bool folded = false;
+    };
+
+    /**
+     * Return 0 to use the date of the year being assumed, or 1 for the
+     * year before, and move on to the next year when the months wrap
+     * around (e.g., from December to January).
+     *
+     * The heuristic: a month more than half a year before the latest
+     * one starts a new year. A December line while the latest month is
+     * January is a late line from the year before (e.g., from a host
+     * whose clock had not reached midnight yet), and leaves the latest
+     * month alone. Any other later month, however far ahead, moves the
+     * latest month on within the same year, so a log with a gap of
+     * several months keeps its year. A log that jumps from January to
+     * December of the same year is the one case this gets wrong.
+     */
+    int yearOf(const int mon) {
+        if (lastMonth < 0) {
+            if (year == CLOCK_YEAR) {
+                year = clockYear(mon);
+            }
+            lastMonth = mon;
+        } else if (mon + 6 < lastMonth) {
+            // Half a year back is a new year rather than an old line
+            year++;
+            std::memcpy(days[1], days[0], sizeof(days[0]));
+            clearDays(0);
+            lastMonth = mon;
+        } else if (mon == 11 && lastMonth == 0) {
+            // A line from the end of the year before
+            return 1;
+        } else if (mon > lastMonth) {
+            lastMonth = mon;
+        }
+        return 0;
+    }
+
+    /**
+     * Return the current year, or the year before if the month is later
+     * in the year than today.
+     */
+    static int clockYear(const int mon) {
+        const time_t now = time(nullptr);
+        struct tm local;
+        localtime_r(&now, &local);
+        return local.tm_year + 1900 - (mon > local.tm_mon);
+    }
+
+    /** Forget the dates of the year being assumed (0) or the one before */
+    void clearDays(const int older) {
+        for (auto& month : days[older]) {
+            for (Day& date : month) {
+                date = Day();
+            }
+        }
+    }
+
+    /**
+     * Work out the start of a date with mktime and, if the UTC offset
+     * changes during it, when and by how much.
+     */
+    static void startDay(Day& date, const int yr, const int mon,
+                         const int mday) {
+        struct tm day = {};
+        day.tm_mday = mday;
+        day.tm_mon = mon;
+        day.tm_year = yr - 1900;
+        day.tm_isdst = -1;
+        struct tm next = day;
+        next.tm_mday++;
+        date.start = mktime(&day);
+        const long end = mktime(&next);
+        const long shift = end - date.start - 86400;
+        if (shift == 0) {
+            return;
+        }
+        // Find the instant of the change by bisection on the UTC offset
+        long before = date.start, after = end;
+        const long offset = utcOffset(before);
+        while (after - before > 1) {
+            const long mid = before + (after - before) / 2;
+            (utcOffset(mid) == offset ? before : after) = mid;
+        }
+        // The wall time of the change, on the clock before it
+        const int change = static_cast<int>(after - date.start);
+        date.shift = static_cast<int>(shift);
+        date.shiftAt = change + (shift < 0 ? -date.shift : 0);
+        date.foldFrom = (shift > 0 ? change - date.shift : date.shiftAt);
+    }
+
+    /** Return the UTC offset of local time at an instant */
+    static long utcOffset(const time_t t) {
+        struct tm local;
+        localtime_r(&t, &local);
+        return local.tm_gmtoff;
+    }
+
+    /**
+     * Return the seconds to add to start + time of day for a time at
+     * or after the date's foldFrom.
+     */
+    static int dstShift(Day& date, const int tod) {
+        if (tod >= date.shiftAt) {
+            // Past the change, so any repeated time later is the second
+            date.folded = true;
+            return date.shift;
+        }
+        if (!date.folded && tod + FOLD_GAP < date.latest) {
+            date.folded = true;
+        }
+        if (date.folded) {
+            return date.shift;
+        }
+        date.latest = std::max(date.latest, tod);
+        return 0;
+    }
+
+    /**
+     * Convert an RFC 3339 timestamp, such as "2021-06-10T03:32:36Z" or
+     * "2021-06-10T03:32:36.123456+02:00", with integer arithmetic.
+     */
+    LogTime fromRfc3339(std::string_view ts) {
+        if (ts.size() < 20 || ts[4] != '-' || ts[7] != '-' ||
+            (ts[10] | 0x20) != 't' || ts[13] != ':' || ts[16] != ':') {
+            return {slowPath("", "", ts), 0};
+        }
+        // Each pair is negative if either of its characters is no digit
+        const int century = twoDigits(ts[0], ts[1]),
+                  yy = twoDigits(ts[2], ts[3]);
+        const int yr = century * 100 + yy;
+        const int mon = twoDigits(ts[5], ts[6]), mday = twoDigits(ts[8],
+                                                                  ts[9]);
+        const int hour = twoDigits(ts[11], ts[12]);
+        const int min  = twoDigits(ts[14], ts[15]);
+        const int sec  = twoDigits(ts[17], ts[18]);
+        // The fraction (to nanoseconds; any further digits are dropped)
+        size_t pos = 19;
+        long nanos = 0;
+        bool valid = true;
+        if (ts[pos] == '.') {
+            int digits = 0;
+            for (pos++; pos < ts.size() && digit(ts[pos]) >= 0; pos++) {
+                if (digits < 9) {
+                    nanos = nanos * 10 + digit(ts[pos]);
+                    digits++;
+                }
+            }
+            valid = (digits > 0);
+            for (; digits < 9; digits++) {
+                nanos *= 10;
+            }
+        }
+        // The UTC offset, "Z" or "+HH:MM" / "-HH:MM"
+        int offset = 0;
+        if (pos + 6 == ts.size() && ts[pos + 3] == ':' &&
+            (ts[pos] == '+' || ts[pos] == '-')) {
+            const int hours = twoDigits(ts[pos + 1], ts[pos + 2]),
+                      mins = twoDigits(ts[pos + 4], ts[pos + 5]);
+            valid = valid && hours >= 0 && mins >= 0;
+            offset = (hours * 3600 + mins * 60) * (ts[pos] == '-' ? -1 : 1);
+        } else if (pos + 1 != ts.size() || (ts[pos] | 0x20) != 'z') {
+            valid = false;
+        }
+        if (!valid || century < 0 || yy < 0 || mon < 1 || mon > 12 ||
+            mday < 1 || mday > 31 || hour < 0 || hour > 23 || min < 0 ||
+            min > 59 || sec < 0 || sec > 60) {
+            return {slowPath("", "", ts), 0};
+        }
+        return {daysFromCivil(yr, mon, mday) * 86400 + hour * 3600L +
+                min * 60L + sec - offset, nanos};
+    }
+
+    /**
+     * Return the number of days from 1970-01-01 to a date in the
+     * proleptic Gregorian calendar.
+     */
+    static long daysFromCivil(long yr, const int mon, const int mday) {
+        yr -= (mon <= 2);
+        const long era = (yr >= 0 ? yr : yr - 399) / 400;
+        const long yoe = yr - era * 400;
+        const long doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 +
+                         mday - 1;
+        const long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + doe - 719468;
+    }
+
+    /**
+     * Return the 0-based month for a 3-letter month name (matched
+     * case-insensitively, as strptime does), or -1.
+     */
+    static int monthIndex(std::string_view month) {
+        static const char Names[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+        if (month.size() != 3) {
+            return -1;
+        }
+        const char c0 = month[0] | 0x20, c1 = month[1] | 0x20,
+                   c2 = month[2] | 0x20;
+        for (int i = 0; i < 12; i++) {
+            if (Names[i * 3] == c0 && Names[i * 3 + 1] == c1 &&
+                Names[i * 3 + 2] == c2) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /** Return the value of a decimal digit, or a large negative value */
+    static int digit(const char c) {
+        return (c >= '0' && c <= '9') ? c - '0' : -100;
+    }
+
+    /** Return the value of two decimal digits, or a negative value */
+    static int twoDigits(const char c1, const char c2) {
+        return digit(c1) * 10 + digit(c2);
+    }
+
+    /**
+     * Fall back to the strptime/mktime based conversion for timestamps
+     * outside the fixed formats (e.g., full month names). The year is
+     * inferred from the month as on the fast path, so with CLOCK_YEAR
+     * a first line in such a format still gets the current year.
+     */
+    long slowPath(std::string_view month, std::string_view day,
+                  std::string_view time) {
+        std::string timestamp(month);
+        timestamp.append(" ").append(day).append(" ").append(time);
+        struct tm parsed = {};
+        if (strptime(timestamp.c_str(), "%B %d %H:%M:%S", &parsed)) {
+            const int older = yearOf(parsed.tm_mon);
+            return ::toSeconds(timestamp, year - older);
+        }
+        // Not a date at all, so it says nothing about the year
+        return ::toSeconds(timestamp, year == CLOCK_YEAR ? clockYear(-1) :
+                                                           year);
+    }
+
+    /** The year of the latest traditional timestamps */
+    int year;
+
+    /** The latest month seen in that year, or -1 before the first */
+    int lastMonth = -1;
+
+    /** Cached conversions of each month/day of that year and the one
+     * before */
+    Day days[2][12][32];
+};
+
+#endif  // SYSLOG_TIME_H
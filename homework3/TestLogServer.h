@@ -0,0 +1,211 @@
+// Copyright 2023 Evan Williams
+#ifndef TEST_LOG_SERVER_H
+#define TEST_LOG_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+/**
+ * A local HTTP server for the download benchmarks and tests. It serves
+ * the same log for every path (honouring "Range: bytes=N-" requests),
+ * after a configurable delay and at a configurable bandwidth per
+ * connection, so that fetching from many distant hosts can be
+ * simulated without network access. It runs on its own thread.
+ *
+ * The log is held by reference, so the caller can append to it or
+ * replace it (as a rotation would) between downloads. A connection is
+ * kept open for further requests if the client asks for keep-alive,
+ * and the server can be told to drop connections part way through a
+ * body, so that resuming a download can be tested.
+ */
+class TestLogServer {
+public:
+    /**
+     * Start the server on an ephemeral port of 127.0.0.1.
+     *
+     * @param body The log served for every request.
+     *
+     * @param latency The delay before each response is sent.
+     *
+     * @param bytesPerSec The bandwidth of each connection.
+     *
+     * @param etag The ETag sent with the log, or "" for none.
+     */
+    TestLogServer(const std::string& body,
+                  const std::chrono::milliseconds latency,
+                  const size_t bytesPerSec,
+                  const std::string& etag = "\"bench\"")
+        : body(body), latency(latency), sliceSize(bytesPerSec / 100),
+          etag(etag),
+          acceptor(io, {boost::asio::ip::make_address("127.0.0.1"), 0}) {
+        accept();
+        thread = std::thread([this] { io.run(); });
+    }
+
+    /** Stop the server */
+    ~TestLogServer() {
+        io.stop();
+        thread.join();
+    }
+
+    /** Obtain the port the server listens on */
+    unsigned short port() const { return acceptor.local_endpoint().port(); }
+
+    /** Obtain the number of connections accepted so far */
+    size_t connections() const { return accepted; }
+
+    /** Obtain the number of body bytes sent so far */
+    size_t bodyBytes() const { return sentBytes; }
+
+    /**
+     * Close the connection of each of the next responses after part of
+     * its body has been sent.
+     *
+     * @param count The number of responses to cut short.
+     *
+     * @param bytes The number of body bytes sent before closing.
+     */
+    void dropAfter(const size_t count, const size_t bytes) {
+        dropBytes = bytes;
+        drops = count;
+    }
+
+private:
+    /** The state of one connection */
+    struct Connection {
+        explicit Connection(boost::asio::io_context& io)
+            : socket(io), timer(io) {}
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::steady_timer timer;
+        boost::asio::streambuf request;
+        std::string header;
+        /** The body offset sent up to, and where to stop sending */
+        size_t sent = 0, stop = 0;
+        /** Whether to wait for another request after this response */
+        bool keepAlive = false;
+    };
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    /** Accept connections until the server stops */
+    void accept() {
+        auto conn = std::make_shared<Connection>(io);
+        acceptor.async_accept(conn->socket, [this, conn](const auto& ec) {
+            if (!ec) {
+                accepted++;
+                readRequest(conn);
+            }
+            accept();
+        });
+    }
+
+    /** Wait for the next request on a connection, then answer it */
+    void readRequest(const ConnectionPtr& conn) {
+        boost::asio::async_read_until(conn->socket, conn->request,
+            "\r\n\r\n", [this, conn](const auto& ec, const size_t n) {
+                if (ec) {
+                    return;
+                }
+                const auto data = conn->request.data();
+                std::string request(boost::asio::buffers_begin(data),
+                                    boost::asio::buffers_begin(data) + n);
+                conn->request.consume(n);
+                conn->timer.expires_after(latency);
+                conn->timer.async_wait([this, conn, request](const auto&) {
+                    sendHeader(conn, request);
+                });
+            });
+    }
+
+    /**
+     * Send the response header, then the body in throttled slices. A
+     * "Range: bytes=N-" request gets the body from N onwards.
+     */
+    void sendHeader(const ConnectionPtr& conn, const std::string& request) {
+        const size_t range = request.find("Range: bytes=");
+        conn->sent = (range == std::string::npos ? 0 :
+                      std::stoul(request.substr(range + 13)));
+        conn->keepAlive = (request.find("Connection: keep-alive") !=
+                           std::string::npos);
+        conn->stop = body.size();
+        if (drops > 0) {
+            drops--;
+            conn->stop = std::min(conn->stop, conn->sent + dropBytes);
+        }
+        if (conn->sent >= body.size() && conn->sent > 0) {
+            conn->keepAlive = false;
+            conn->header = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                "Content-Range: bytes */" + std::to_string(body.size()) +
+                "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        } else {
+            conn->header = (range == std::string::npos ?
+                "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Range: bytes " + std::to_string(conn->sent) + "-" +
+                std::to_string(body.size() - 1) + "/" +
+                std::to_string(body.size()) + "\r\n") +
+                (etag.empty() ? "" : "ETag: " + etag + "\r\n") +
+                "Content-Length: " +
+                std::to_string(body.size() - conn->sent) +
+                (conn->keepAlive ? "\r\nConnection: keep-alive\r\n\r\n" :
+                                   "\r\nConnection: close\r\n\r\n");
+        }
+        boost::asio::async_write(conn->socket,
+            boost::asio::buffer(conn->header),
+            [this, conn](const auto& ec, size_t) {
+                if (!ec) {
+                    sendSlice(conn);
+                }
+            });
+    }
+
+    /**
+     * Send the next slice of the body, and pace the following one. At
+     * the end of the body, wait for the next request or close the
+     * connection; part way through, close it if it is to be dropped.
+     */
+    void sendSlice(const ConnectionPtr& conn) {
+        if (conn->sent >= body.size() && conn->keepAlive) {
+            return readRequest(conn);
+        }
+        boost::system::error_code ignored;
+        if (conn->sent >= body.size()) {
+            conn->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send,
+                                  ignored);
+            return;
+        }
+        if (conn->sent >= conn->stop) {
+            conn->socket.close(ignored);
+            return;
+        }
+        const size_t len = std::min(sliceSize, conn->stop - conn->sent);
+        conn->timer.expires_after(std::chrono::milliseconds(10));
+        boost::asio::async_write(conn->socket,
+            boost::asio::buffer(body.data() + conn->sent, len),
+            [this, conn, len](const auto& ec, size_t) {
+                if (!ec) {
+                    conn->sent += len;
+                    sentBytes += len;
+                    conn->timer.async_wait([this, conn](const auto&) {
+                        sendSlice(conn);
+                    });
+                }
+            });
+    }
+
+    const std::string& body;
+    const std::chrono::milliseconds latency;
+    const size_t sliceSize;
+    const std::string etag;
+    /** The responses still to be cut short, and after how many bytes */
+    std::atomic<size_t> drops{0}, dropBytes{0};
+    std::atomic<size_t> accepted{0}, sentBytes{0};
+    boost::asio::io_context io;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::thread thread;
+};
+
+#endif  // TEST_LOG_SERVER_H